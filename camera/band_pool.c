@@ -0,0 +1,235 @@
+/*
+ * Filename   : band_pool.c
+ *
+ * Description: Persistent thread pool that splits one frame into row bands
+ *            : 1) Helpers are created once and pinned round robin over the
+ *            :    online CPUs, starting at first_cpu
+ *            : 2) band_pool_run() bumps a generation number under the lock
+ *            :    and broadcasts; each helper runs its band for that
+ *            :    generation and counts itself out
+ *            : 3) The caller runs band 0, then waits for the count to reach
+ *            :    zero, which is the barrier before output
+ *            : One caller per pool; runs on a pool don't overlap.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : man 3 pthread_setaffinity_np
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#define _GNU_SOURCE             /* pthread_setaffinity_np() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include "band_pool.h"
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct band_helper
+{
+        struct band_pool   *pool;
+        pthread_t           thread;
+        unsigned int        band;
+};
+
+struct band_pool
+{
+        unsigned int        bands;
+        struct band_helper *helpers;            // bands - 1 of them
+        unsigned int        started;            // helpers successfully created
+
+        pthread_mutex_t     lock;
+        pthread_cond_t      start;              // new generation or stopping
+        pthread_cond_t      done;               // pending reached 0
+
+        // under lock
+        unsigned long       generation;
+        unsigned int        pending;            // helpers still working on this generation
+        band_fn             fn;
+        void               *ctx;
+        int                 stopping;
+};
+
+/*************************************************************************
+ *                         Helper Thread                                 *
+ *************************************************************************/
+
+static void *band_thread(void *arg)
+{
+    struct band_helper *h = arg;
+    struct band_pool *p = h->pool;
+    unsigned long seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;)
+    {
+        while (p->generation == seen && !p->stopping)
+            pthread_cond_wait(&p->start, &p->lock);
+        if (p->stopping)
+            break;
+        seen = p->generation;
+
+        pthread_mutex_unlock(&p->lock);
+        p->fn(p->ctx, h->band, p->bands);
+        pthread_mutex_lock(&p->lock);
+
+        if (--p->pending == 0)
+            pthread_cond_signal(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    return NULL;
+}
+
+/*************************************************************************
+ *                         Pool Functions                                *
+ *************************************************************************/
+
+/**
+ * @name   band_pool_create
+ * @brief  Starts the helper threads for a banded pool
+ * @param  bands     - bands per frame, 1 runs everything on the caller
+ *         first_cpu - CPU the first helper is pinned to
+ *
+ * @descr  A helper that cannot be pinned still runs, unpinned
+ *
+ * @return pool, NULL with errno set on failure
+ */
+
+struct band_pool *band_pool_create(unsigned int bands, unsigned int first_cpu)
+{
+    struct band_pool *p;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int i;
+
+    if (bands == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    p = calloc(1, sizeof(*p));
+    if (!p)
+        return NULL;
+
+    p->bands = bands;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    if (bands > 1)
+    {
+        p->helpers = calloc(bands - 1, sizeof(*p->helpers));
+        if (!p->helpers)
+        {
+            band_pool_destroy(p);
+            errno = ENOMEM;
+            return NULL;
+        }
+    }
+
+    if (cpus < 1)
+        cpus = 1;
+
+    for (i = 0; i + 1 < bands; i++)
+    {
+        struct band_helper *h = &p->helpers[i];
+        cpu_set_t set;
+
+        h->pool = p;
+        h->band = i + 1;
+        errno = pthread_create(&h->thread, NULL, band_thread, h);
+        if (errno)
+        {
+            int err = errno;
+
+            band_pool_destroy(p);
+            errno = err;
+            return NULL;
+        }
+        p->started++;
+
+        CPU_ZERO(&set);
+        CPU_SET((first_cpu + i) % cpus, &set);
+        if (pthread_setaffinity_np(h->thread, sizeof(set), &set) != 0)
+            fprintf(stderr, "band_pool: could not pin band %u to CPU %lu\n", h->band, (first_cpu + i) % cpus);
+    }
+
+    return p;
+}
+
+void band_pool_destroy(struct band_pool *p)
+{
+    unsigned int i;
+
+    if (!p)
+        return;
+
+    pthread_mutex_lock(&p->lock);
+    p->stopping = 1;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < p->started; i++)
+        pthread_join(p->helpers[i].thread, NULL);
+
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->start);
+    pthread_cond_destroy(&p->done);
+    free(p->helpers);
+    free(p);
+}
+
+unsigned int band_pool_bands(const struct band_pool *p)
+{
+    return p->bands;
+}
+
+/**
+ * @name   band_pool_run
+ * @brief  Runs fn on every band of a frame and waits for all of them
+ * @param  p   - pool
+ *         fn  - band function, called once per band
+ *         ctx - passed to fn
+ *
+ * @descr  Band 0 runs on the calling thread while the helpers run theirs
+ *
+ * @return none
+ */
+
+void band_pool_run(struct band_pool *p, band_fn fn, void *ctx)
+{
+    if (p->bands == 1)
+    {
+        fn(ctx, 0, 1);
+        return;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    p->fn      = fn;
+    p->ctx     = ctx;
+    p->pending = p->bands - 1;
+    p->generation++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    fn(ctx, 0, p->bands);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->pending)
+        pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
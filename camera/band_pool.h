@@ -0,0 +1,36 @@
+/*
+ * Filename   : band_pool.h
+ *
+ * Description: Persistent thread pool that splits one frame into row bands
+ *            : A pool for N bands owns N - 1 helper threads, each pinned to
+ *            : its own CPU and parked between frames. band_pool_run() hands
+ *            : bands 1..N-1 to the helpers, runs band 0 on the caller and
+ *            : returns once every band is done, so the caller can pass the
+ *            : whole frame on to output.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef BAND_POOL_H
+#define BAND_POOL_H
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+// Processes band of bands, e.g. rows [band * rows / bands, (band + 1) * rows / bands)
+typedef void (*band_fn)(void *ctx, unsigned int band, unsigned int bands);
+
+struct band_pool;
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct band_pool *band_pool_create(unsigned int bands, unsigned int first_cpu);
+void band_pool_destroy(struct band_pool *p);
+
+unsigned int band_pool_bands(const struct band_pool *p);
+void band_pool_run(struct band_pool *p, band_fn fn, void *ctx);
+
+#endif /* BAND_POOL_H */
@@ -0,0 +1,570 @@
+/*
+ * Filename   : bench.c
+ *
+ * Description: Benchmark for the conversion and write paths, no camera needed
+ *            : Code Flow:
+ *            : 1) Build synthetic YUYV frames per resolution, or load
+ *            :    recorded ones (raw YUYV, as captured) with -i
+ *            : 2) Convert every frame with each supported kernel, timing
+ *            :    each conversion
+ *            : 3) With -o, also send converted frames through the frame
+ *            :    writer as PPMs (PGMs with -g), as the capture workers do
+ *            : 4) Report frames/s, ns/pixel, bytes/s and latency percentiles
+ *            : With -m each kernel is run once per memory variant: cached
+ *            : stores, source prefetch, non-temporal stores, both, and a copy
+ *            : of each frame out of a capture-like buffer first, by memcpy or
+ *            : by streaming loads, as capture does without --in-place
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "yuv_convert.h"
+#include "frame_writer.h"
+#include "frame_stats.h"
+#include "band_pool.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define MAX_RESOLUTIONS 16
+#define SRC_FRAMES      4       // distinct input frames cycled, so a run isn't served from cache
+#define OUT_FRAMES      8       // converted frames in flight to the writer
+#define OUT_NAMES       (2 * OUT_FRAMES)    // file names reused, bounds disk use
+#define NAME_MAX_LEN    32
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct resolution
+{
+        unsigned int    width;
+        unsigned int    height;
+};
+
+struct out_pool;
+
+// Converted frame, owned by the writer from submit until bench_done
+struct out_slot
+{
+        struct out_pool *pool;
+        unsigned char   *data;
+        int              busy;
+        uint64_t         submit_ns;
+};
+
+// One frame's conversion split into row bands, as capture does with --bands
+struct band_job
+{
+        yuyv_convert_fn         convert;
+        const unsigned char    *src;
+        unsigned char          *dst;
+        unsigned int            width, height;
+        size_t                  out_bpp;
+};
+
+// How a run gets frames through memory, see -m
+enum bench_variant
+{
+        VARIANT_CACHED = 0,
+        VARIANT_PREFETCH,
+        VARIANT_NT,
+        VARIANT_NT_PREFETCH,
+        VARIANT_COPY,           // memcpy out of the capture buffer, then convert
+        VARIANT_STREAM_COPY,    // the same with yuv_stream_copy()
+        VARIANTS
+};
+
+struct out_pool
+{
+        struct out_slot     slots[OUT_FRAMES];
+        pthread_mutex_t     lock;
+        pthread_cond_t      cond;
+        struct frame_stats *stats;
+};
+
+/*************************************************************************
+ *                  Global Variables                                     *
+ *************************************************************************/
+
+static struct resolution resolutions[MAX_RESOLUTIONS];
+static unsigned int     n_resolutions;
+static unsigned int     n_frames = 200;
+static enum yuv_kernel  only_kernel = YUV_KERNEL_AUTO;  // AUTO = every supported kernel
+static char            *input_path;
+static int              gray;                   // time the luma-only kernels instead
+static unsigned int     n_bands = 1;            // threads each frame's conversion is split over
+static char            *output_dir;
+static enum writer_backend writer_backend = WRITER_AUTO;
+static int              memory_variants;        // -m, every bench_variant instead of cached only
+static size_t           prefetch_bytes = 512;   // distance for the prefetch variants
+
+static const char      *variant_names[VARIANTS] =
+        { "cached", "prefetch", "nt", "nt+pf", "copy", "stream-copy" };
+
+static const struct resolution default_resolutions[] =
+{
+        { 320, 240 }, { 640, 480 }, { 1280, 720 }, { 1920, 1080 },
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+static void errno_exit(const char *s)
+{
+        fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+}
+
+/**
+ * @name   synth_frames
+ * @brief  Fills frames with a moving colour gradient plus noise
+ * @param  frames - SRC_FRAMES buffers of width * height * 2 bytes
+ *
+ * @descr  Covers the full U/V range and mid-range luma so clipping paths
+ *         get exercised; noise keeps branchy code honest
+ *
+ * @return none
+ */
+
+static void synth_frames(unsigned char **frames, unsigned int width, unsigned int height)
+{
+    unsigned int f, x, y, seed = 12345;
+
+    for (f = 0; f < SRC_FRAMES; f++)
+    {
+        for (y = 0; y < height; y++)
+        {
+            unsigned char *row = frames[f] + (size_t)y * width * 2;
+
+            for (x = 0; x < width; x += 2)
+            {
+                seed = seed * 1103515245 + 12345;
+                row[2 * x + 0] = (x + y + f * 16 + (seed >> 28)) & 0xff;  // Y0
+                row[2 * x + 1] = (x * 255 / width) & 0xff;                  // U
+                row[2 * x + 2] = (x + y + f * 16 + (seed >> 24)) & 0xff;  // Y1
+                row[2 * x + 3] = (y * 255 / height) & 0xff;                 // V
+            }
+        }
+    }
+}
+
+/**
+ * @name   load_frames
+ * @brief  Reads up to SRC_FRAMES recorded YUYV frames from input_path
+ * @param  frames     - SRC_FRAMES buffers of frame_size bytes
+ *         frame_size - width * height * 2
+ *
+ * @descr  Frames beyond those in the file repeat the earlier ones
+ *
+ * @return none, exits if the file has less than one frame
+ */
+
+static void load_frames(unsigned char **frames, size_t frame_size)
+{
+    FILE *fp = fopen(input_path, "rb");
+    unsigned int f, loaded = 0;
+
+    if (!fp)
+        errno_exit(input_path);
+
+    while (loaded < SRC_FRAMES && fread(frames[loaded], 1, frame_size, fp) == frame_size)
+        loaded++;
+    fclose(fp);
+
+    if (loaded == 0)
+    {
+        fprintf(stderr, "%s: less than one %zu byte frame\n", input_path, frame_size);
+        exit(EXIT_FAILURE);
+    }
+
+    for (f = loaded; f < SRC_FRAMES; f++)
+        memcpy(frames[f], frames[f % loaded], frame_size);
+}
+
+// Writer completion callback, runs on a writer thread
+static void bench_done(void *ctx, int error)
+{
+    struct out_slot *slot = ctx;
+    struct out_pool *pool = slot->pool;
+
+    if (error)
+        fprintf(stderr, "write error %d, %s\n", error, strerror(error));
+    else
+        frame_stats_record(pool->stats, STAT_WRITE, stats_now_ns() - slot->submit_ns);
+
+    pthread_mutex_lock(&pool->lock);
+    slot->busy = 0;
+    pthread_cond_signal(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+// Waits for an idle output frame, the same back-pressure the capture workers see
+static struct out_slot *get_out_slot(struct out_pool *pool)
+{
+    struct out_slot *slot = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&pool->lock);
+    while (!slot)
+    {
+        for (i = 0; i < OUT_FRAMES && !slot; i++)
+            if (!pool->slots[i].busy)
+                slot = &pool->slots[i];
+
+        if (!slot)
+            pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    slot->busy = 1;
+    pthread_mutex_unlock(&pool->lock);
+
+    return slot;
+}
+
+/**
+ * @name   run
+ * @brief  Benchmarks one kernel at one resolution and prints a result line
+ * @param  kernel  - conversion kernel
+ *         variant - memory variant, VARIANT_CACHED without -m
+ *         res     - resolution
+ *         src     - SRC_FRAMES YUYV frames
+ *         bands   - pool the conversion is split over, NULL for one thread
+ *
+ * @descr  Without -o only conversion is timed; with -o the wall time covers
+ *         conversion plus writing every frame, as the capture pipeline does
+ *         The copy variants time the copy into a bounce frame as part of
+ *         the conversion, which then reads the copy
+ *
+ * @return none
+ */
+
+// Band of a frame in a band_job, whole rows each
+static void bench_band(void *arg, unsigned int band, unsigned int bands)
+{
+    const struct band_job *job = arg;
+    unsigned int r0 = (uint64_t)job->height * band / bands;
+    unsigned int r1 = (uint64_t)job->height * (band + 1) / bands;
+
+    job->convert(job->src + (size_t)r0 * job->width * 2, job->dst + (size_t)r0 * job->width * job->out_bpp,
+                 (size_t)(r1 - r0) * job->width * 2);
+}
+
+static void run(enum yuv_kernel kernel, enum bench_variant variant, const struct resolution *res,
+                unsigned char **src, struct band_pool *bands)
+{
+    size_t in_size = (size_t)res->width * res->height * 2;
+    size_t out_size = gray ? in_size / 2 : (in_size / 2) * 3;
+    size_t pixels = (size_t)res->width * res->height;
+    int nt = variant == VARIANT_NT || variant == VARIANT_NT_PREFETCH;
+    yuyv_convert_fn convert;
+    struct frame_stats *stats;
+    struct frame_writer *writer = NULL;
+    unsigned char *bounce = NULL;
+    char name[NAME_MAX_LEN];
+    struct out_pool pool;
+    struct out_slot *slot;
+    char header[WRITER_HEADER_MAX];
+    int header_len = snprintf(header, sizeof(header), gray ? "P5\n%u %u\n255\n" : "P6\n%u %u\n255\n",
+                              res->width, res->height);
+    uint64_t start, elapsed;
+    unsigned int f, i;
+    double secs;
+
+    if (nt)
+        convert = gray ? yuv_kernel_luma_stream_fn(kernel) : yuv_kernel_stream_fn(kernel, YUV_OUTPUT_RGB24);
+    else
+        convert = gray ? yuv_kernel_luma_fn(kernel) : yuv_kernel_fn(kernel);
+    yuv_set_prefetch(variant == VARIANT_PREFETCH || variant == VARIANT_NT_PREFETCH ? prefetch_bytes : 0);
+
+    if (memory_variants)
+        snprintf(name, sizeof(name), "%s/%s", yuv_kernel_name(kernel), variant_names[variant]);
+    else
+        snprintf(name, sizeof(name), "%s", yuv_kernel_name(kernel));
+
+    stats = frame_stats_create(name);
+    if (!stats)
+        errno_exit("frame_stats_create");
+
+    if (variant == VARIANT_COPY || variant == VARIANT_STREAM_COPY)
+    {
+        bounce = malloc(in_size);
+        if (!bounce)
+            errno_exit("malloc");
+        memset(bounce, 0, in_size);
+    }
+
+    memset(&pool, 0, sizeof(pool));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.stats = stats;
+    for (i = 0; i < OUT_FRAMES; i++)
+    {
+        pool.slots[i].pool = &pool;
+        pool.slots[i].data = malloc(out_size);
+        if (!pool.slots[i].data)
+            errno_exit("malloc");
+        memset(pool.slots[i].data, 0, out_size); // fault pages in before timing
+    }
+
+    if (output_dir)
+    {
+        // File names repeat every OUT_NAMES frames, so pre-opening is off
+        writer = frame_writer_create(writer_backend, output_dir, gray ? "bench%02u.pgm" : "bench%02u.ppm",
+                                     2, OUT_FRAMES, 0);
+        if (!writer)
+            errno_exit("frame_writer_create");
+    }
+
+    start = stats_now_ns();
+    for (f = 0; f < n_frames; f++)
+    {
+        const unsigned char *in = src[f % SRC_FRAMES];
+        uint64_t t0;
+
+        slot = writer ? get_out_slot(&pool) : &pool.slots[f % OUT_FRAMES];
+
+        t0 = stats_now_ns();
+        if (variant == VARIANT_COPY)
+            memcpy(bounce, in, in_size);
+        else if (variant == VARIANT_STREAM_COPY)
+            yuv_stream_copy(bounce, in, in_size);
+        if (bounce)
+            in = bounce;
+
+        if (bands)
+        {
+            struct band_job job = { convert, in, slot->data, res->width, res->height, gray ? 1 : 3 };
+
+            band_pool_run(bands, bench_band, &job);
+        }
+        else
+            convert(in, slot->data, in_size);
+        frame_stats_record(stats, STAT_CONVERT, stats_now_ns() - t0);
+
+        if (writer)
+        {
+            slot->submit_ns = stats_now_ns();
+            if (frame_writer_submit(writer, f % OUT_NAMES, header, header_len, slot->data, out_size,
+                                    bench_done, slot) == -1)
+                errno_exit("frame_writer_submit");
+        }
+    }
+    if (writer)
+        frame_writer_flush(writer);
+    elapsed = stats_now_ns() - start;
+    secs = elapsed / 1e9;
+
+    printf("%-*s %5ux%-5u %8.1f fps %7.2f ns/px %8.1f MB/s in %8.1f MB/s out   convert p50 %7.1f p99 %7.1f us",
+           memory_variants ? 18 : 6, name, res->width, res->height,
+           n_frames / secs, (double)elapsed / ((double)n_frames * pixels),
+           n_frames * in_size / secs / 1e6, n_frames * out_size / secs / 1e6,
+           latency_hist_percentile(&stats->hist[STAT_CONVERT], 50) / 1e3,
+           latency_hist_percentile(&stats->hist[STAT_CONVERT], 99) / 1e3);
+    if (writer)
+        printf("   write p50 %7.1f p99 %7.1f us (%s)",
+               latency_hist_percentile(&stats->hist[STAT_WRITE], 50) / 1e3,
+               latency_hist_percentile(&stats->hist[STAT_WRITE], 99) / 1e3,
+               writer_backend_name(frame_writer_backend(writer)));
+    printf("\n");
+
+    frame_writer_destroy(writer);
+    free(bounce);
+    for (i = 0; i < OUT_FRAMES; i++)
+        free(pool.slots[i].data);
+    pthread_mutex_destroy(&pool.lock);
+    pthread_cond_destroy(&pool.cond);
+    frame_stats_destroy(stats);
+}
+
+static void usage(FILE *fp, char **argv)
+{
+        fprintf(fp,
+                 "Usage: %s [options]\n\n"
+                 "Options:\n"
+                 "-r | --resolution WxH  Frame size, repeat for more [320x240 640x480 1280x720 1920x1080]\n"
+                 "-n | --frames N        Frames per run [%u]\n"
+                 "-k | --kernel name     Only this kernel: scalar, sse2, avx2, neon, lut [all supported]\n"
+                 "-i | --input file      Recorded raw YUYV frames instead of synthetic ones (one -r)\n"
+                 "-o | --output dir      Also write PPMs to dir through the frame writer\n"
+                 "-g | --gray            Time the Y-only PGM kernels instead of RGB24 conversion\n"
+                 "-t | --bands N         Split each frame's conversion over N pinned threads [%u]\n"
+                 "-b | --writer name     Frame writer backend: auto, uring, threads [auto]\n"
+                 "-m | --memory          Run each kernel cached, with prefetch, nt stores, both, and after a copy\n"
+                 "-p | --prefetch N      Prefetch distance in bytes for the prefetch variants [%zu]\n"
+                 "-h | --help            Print this message\n"
+                 "",
+                 argv[0], n_frames, n_bands, prefetch_bytes);
+}
+
+static const char short_options[] = "r:n:k:i:o:gt:b:mp:h";
+
+static const struct option
+long_options[] = {
+        { "resolution", required_argument, NULL, 'r' },
+        { "frames",     required_argument, NULL, 'n' },
+        { "kernel",     required_argument, NULL, 'k' },
+        { "input",      required_argument, NULL, 'i' },
+        { "output",     required_argument, NULL, 'o' },
+        { "gray",       no_argument,       NULL, 'g' },
+        { "bands",      required_argument, NULL, 't' },
+        { "writer",     required_argument, NULL, 'b' },
+        { "memory",     no_argument,       NULL, 'm' },
+        { "prefetch",   required_argument, NULL, 'p' },
+        { "help",       no_argument,       NULL, 'h' },
+        { 0, 0, 0, 0 }
+};
+
+int main(int argc, char **argv)
+{
+    unsigned char *src[SRC_FRAMES];
+    struct band_pool *bands = NULL;
+    unsigned int r, f;
+    int k, v;
+
+    for (;;)
+    {
+        int idx;
+        int c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 'r':
+                if (n_resolutions == MAX_RESOLUTIONS ||
+                    sscanf(optarg, "%ux%u", &resolutions[n_resolutions].width, &resolutions[n_resolutions].height) != 2 ||
+                    resolutions[n_resolutions].width < 2 || resolutions[n_resolutions].height < 1)
+                {
+                    fprintf(stderr, "Bad resolution '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                resolutions[n_resolutions].width &= ~1u; // whole YUYV macropixels
+                n_resolutions++;
+                break;
+
+            case 'n':
+                n_frames = strtoul(optarg, NULL, 0);
+                if (n_frames < 1)
+                    n_frames = 1;
+                break;
+
+            case 'k':
+                if (yuv_kernel_parse(optarg, &only_kernel) == -1 || !yuv_kernel_supported(only_kernel))
+                {
+                    fprintf(stderr, "Unknown or unsupported kernel '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'i':
+                input_path = optarg;
+                break;
+
+            case 'o':
+                output_dir = optarg;
+                break;
+
+            case 'g':
+                gray = 1;
+                break;
+
+            case 't':
+                n_bands = strtoul(optarg, NULL, 0);
+                if (n_bands == 0 || n_bands > 64)
+                {
+                    fprintf(stderr, "Bands must be 1 to 64\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'b':
+                if (writer_backend_parse(optarg, &writer_backend) == -1)
+                {
+                    fprintf(stderr, "Unknown writer backend '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'm':
+                memory_variants = 1;
+                break;
+
+            case 'p':
+                prefetch_bytes = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'h':
+                usage(stdout, argv);
+                exit(EXIT_SUCCESS);
+
+            default:
+                usage(stderr, argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (n_resolutions == 0)
+    {
+        if (input_path)
+        {
+            fprintf(stderr, "-i needs the frame size given with -r\n");
+            exit(EXIT_FAILURE);
+        }
+        n_resolutions = sizeof(default_resolutions) / sizeof(default_resolutions[0]);
+        memcpy(resolutions, default_resolutions, sizeof(default_resolutions));
+    }
+
+    if (n_bands > 1)
+    {
+        bands = band_pool_create(n_bands, 1);
+        if (!bands)
+            errno_exit("band_pool_create");
+    }
+
+    for (r = 0; r < n_resolutions; r++)
+    {
+        size_t frame_size = (size_t)resolutions[r].width * resolutions[r].height * 2;
+
+        for (f = 0; f < SRC_FRAMES; f++)
+        {
+            src[f] = malloc(frame_size);
+            if (!src[f])
+                errno_exit("malloc");
+        }
+
+        if (input_path)
+            load_frames(src, frame_size);
+        else
+            synth_frames(src, resolutions[r].width, resolutions[r].height);
+
+        for (k = YUV_KERNEL_SCALAR; k < YUV_KERNELS; k++)
+        {
+            if (!yuv_kernel_supported(k) || (only_kernel != YUV_KERNEL_AUTO && only_kernel != (enum yuv_kernel)k))
+                continue;
+            for (v = 0; v < (memory_variants ? VARIANTS : 1); v++)
+                run(k, v, &resolutions[r], src, bands);
+        }
+
+        for (f = 0; f < SRC_FRAMES; f++)
+            free(src[f]);
+    }
+
+    band_pool_destroy(bands);
+    return EXIT_SUCCESS;
+}
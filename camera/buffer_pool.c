@@ -0,0 +1,212 @@
+/*
+ * Filename   : buffer_pool.c
+ *
+ * Description: Application-owned capture buffer pool
+ *            : 1) memfd sized for count page-aligned buffers, huge pages
+ *            :    first if requested, falling back to normal pages
+ *            : 2) One shared mapping of the whole memfd, prefaulted
+ *            : 3) Per-buffer DMABUF on demand via UDMABUF_CREATE
+ *            : The memfd is sealed against shrinking, which udmabuf requires.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : https://www.kernel.org/doc/html/latest/userspace-api/media/v4l/userp.html
+ *            : https://www.kernel.org/doc/html/latest/userspace-api/media/v4l/dmabuf.html
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#define _GNU_SOURCE             /* memfd_create() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+
+#include <linux/udmabuf.h>
+
+#include "buffer_pool.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+static size_t round_up(size_t n, size_t align)
+{
+    return (n + align - 1) / align * align;
+}
+
+/**
+ * @name   pool_map
+ * @brief  Creates, sizes and maps the memfd backing the pool
+ * @param  pool    - pool, memfd/base are filled in
+ *         size    - bytes, already rounded to the page size in use
+ *         hugetlb - back with huge pages
+ *
+ * @descr  hugetlbfs memfds accept ftruncate without reserved pages, so the
+ *         shortage only shows up when MAP_POPULATE faults them in
+ *
+ * @return 0, -1 with errno set on failure
+ */
+
+static int pool_map(struct buffer_pool *pool, size_t size, int hugetlb)
+{
+    unsigned int flags = MFD_CLOEXEC | MFD_ALLOW_SEALING;
+    int err;
+
+    if (hugetlb)
+        flags |= MFD_HUGETLB;
+
+    pool->memfd = memfd_create("capture-buffers", flags);
+    if (pool->memfd == -1)
+        return -1;
+
+    if (ftruncate(pool->memfd, size) == -1)
+        goto fail;
+
+    // udmabuf refuses memfds that could shrink under the device
+    fcntl(pool->memfd, F_ADD_SEALS, F_SEAL_SHRINK);
+
+    // MAP_POPULATE so the driver and the first frames don't take page faults
+    pool->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pool->memfd, 0);
+    if (pool->base == MAP_FAILED)
+        goto fail;
+
+    pool->map_size = size;
+    pool->hugetlb  = hugetlb;
+    return 0;
+
+fail:
+    err = errno;
+    close(pool->memfd);
+    pool->memfd = -1;
+    errno = err;
+    return -1;
+}
+
+/**
+ * @name   buffer_pool_create
+ * @brief  Allocates count page-aligned buffers of at least buf_size bytes
+ * @param  count    - number of buffers
+ *         buf_size - bytes per buffer, normally fmt.fmt.pix.sizeimage
+ *         hugetlb  - try to back the pool with 2 MB huge pages
+ *
+ * @descr  Buffers are packed at page granularity; with huge pages only the
+ *         total is rounded up to 2 MB so small frames don't each take one
+ *         Falls back to normal pages with a warning if no huge pages are
+ *         reserved (see /proc/sys/vm/nr_hugepages)
+ *
+ * @return pool, NULL with errno set on failure
+ */
+
+struct buffer_pool *buffer_pool_create(unsigned int count, size_t buf_size, int hugetlb)
+{
+    struct buffer_pool *pool;
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    pool = calloc(1, sizeof(*pool));
+    if (!pool)
+        return NULL;
+
+    pool->count    = count;
+    pool->buf_size = buf_size;
+    pool->stride   = round_up(buf_size, page);
+
+    if (hugetlb && pool_map(pool, round_up(pool->stride * count, HUGE_PAGE_SIZE), 1) == -1)
+    {
+        fprintf(stderr, "Huge pages unavailable (%s), using normal pages\n", strerror(errno));
+        hugetlb = 0;
+    }
+
+    if (!hugetlb && pool_map(pool, pool->stride * count, 0) == -1)
+    {
+        int err = errno;
+
+        free(pool);
+        errno = err;
+        return NULL;
+    }
+
+    return pool;
+}
+
+/**
+ * @name   buffer_pool_destroy
+ * @brief  Unmaps and frees the pool
+ * @param  pool - pool to free, no longer queued to the driver
+ *
+ * @descr  DMABUFs from buffer_pool_dmabuf hold their own memfd reference
+ *         and must be closed by their owners
+ *
+ * @return none
+ */
+
+void buffer_pool_destroy(struct buffer_pool *pool)
+{
+    if (!pool)
+        return;
+
+    munmap(pool->base, pool->map_size);
+    close(pool->memfd);
+    free(pool);
+}
+
+void *buffer_pool_addr(const struct buffer_pool *pool, unsigned int i)
+{
+    return pool->base + (size_t)i * pool->stride;
+}
+
+/**
+ * @name   buffer_pool_dmabuf
+ * @brief  Wraps buffer i as a DMABUF
+ * @param  pool - pool
+ *         i    - buffer index
+ *
+ * @descr  The DMABUF aliases the pool mapping, so frames the driver writes
+ *         through it are directly visible at buffer_pool_addr(pool, i)
+ *
+ * @return DMABUF fd, -1 with errno set on failure
+ */
+
+int buffer_pool_dmabuf(const struct buffer_pool *pool, unsigned int i)
+{
+    struct udmabuf_create create;
+    int dev, dmabuf;
+
+    dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (dev == -1)
+        return -1;
+
+    memset(&create, 0, sizeof(create));
+    create.memfd  = pool->memfd;
+    create.flags  = UDMABUF_FLAGS_CLOEXEC;
+    create.offset = (size_t)i * pool->stride;
+    create.size   = pool->stride;
+
+    dmabuf = ioctl(dev, UDMABUF_CREATE, &create);
+    if (dmabuf == -1)
+    {
+        int err = errno;
+
+        close(dev);
+        errno = err;
+        return -1;
+    }
+
+    close(dev);
+    return dmabuf;
+}
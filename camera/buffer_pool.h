@@ -0,0 +1,43 @@
+/*
+ * Filename   : buffer_pool.h
+ *
+ * Description: Application-owned capture buffer pool
+ *            : A single memfd-backed mapping (optionally hugetlb) carved
+ *            : into page-aligned frame buffers. Buffers can be handed to the
+ *            : driver directly (V4L2_MEMORY_USERPTR) or wrapped as DMABUFs
+ *            : through /dev/udmabuf (V4L2_MEMORY_DMABUF import).
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct buffer_pool
+{
+        int             memfd;
+        unsigned char  *base;
+        size_t          map_size;
+        size_t          stride;         // bytes between buffers, page multiple
+        size_t          buf_size;       // usable bytes per buffer
+        unsigned int    count;
+        int             hugetlb;        // 1 if backed by huge pages
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct buffer_pool *buffer_pool_create(unsigned int count, size_t buf_size, int hugetlb);
+void buffer_pool_destroy(struct buffer_pool *pool);
+
+void *buffer_pool_addr(const struct buffer_pool *pool, unsigned int i);
+int buffer_pool_dmabuf(const struct buffer_pool *pool, unsigned int i);
+
+#endif /* BUFFER_POOL_H */
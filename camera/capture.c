@@ -6,7 +6,7 @@
  *            : 1) Open device
  *            : 2) Initialize device
  *            : 3) Start capturing
- *            : 4) Main Loop
+ *            : 4) Main Loop (one epoll loop for every camera, feeding processing workers)
  *            : 5) Stop Capturing
  *            : 6) Unitialize device
  *            : 7) Close Device
@@ -23,6 +23,8 @@
  *                            Header Files                               *
  *************************************************************************/
  
+#define _GNU_SOURCE             /* pthread_setaffinity_np(), CPU_SET() */
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,46 +40,281 @@
 #include <sys/time.h>
 #include <sys/mman.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>        // device nodes coming back
+#include <signal.h>
+#include <stdint.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include <linux/videodev2.h>
 
 #include <time.h>
 
+#include "yuv_convert.h"
+#include "frame_ring.h"
+#include "frame_writer.h"
+#include "dmabuf_export.h"
+#include "buffer_pool.h"
+#include "frame_stats.h"
+#include "mjpeg_decode.h"
+#include "frame_stream.h"
+#include "frame_recorder.h"
+#include "frame_motion.h"
+#include "band_pool.h"
+#include "frame_shm.h"
+#include "frame_net.h"
+#include "frame_pipeline.h"
+#include "frame_log.h"
+#include "device_cache.h"
+#include "frame_encoder.h"
+
 /*************************************************************************
  *                            Macros                                     *
  *************************************************************************/
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 #define COLOR_CONVERT
-#define HRES 320
-#define VRES 240
-#define HRES_STR "320"
-#define VRES_STR "240"
+#define OUT_BUFFERS 4   // converted frames a worker may have queued on the writer
+#define MAX_CAMERAS 16
+#define MAX_IN_PLACE_BUFFERS 64 // one bit each in camera.returned
+#define STALL_TIMEOUT_MS 2000   // a camera with no frame for this long is restarted
+#define RECOVER_RETRY_MS 250    // between attempts to reopen a failed camera
+#define RECOVER_TICK_MS 20      // main loop wakeup while a camera is recovering
+#define FPS_MAX ((unsigned int)-1)     // req_fps: fastest interval the driver lists
+#define MAX_CPU_LIST 64                 // entries of --worker-cpus
+#define PREFAULT_STACK (256 * 1024)     // capture thread stack touched before real-time start
+#define SHM_SLOTS 8                     // frames kept in the --shm ring, at least two per worker
 
 /*************************************************************************
  *                        Structures                                     *
  *************************************************************************/
  
- // Format is used by a number of functions, so made as a file global
-static struct v4l2_format fmt;
+// Where capture buffers come from
+enum io_method
+{
+        IO_METHOD_MMAP,         // driver allocates, we mmap
+        IO_METHOD_USERPTR,      // our buffer_pool memory, passed by address
+        IO_METHOD_DMABUF,       // our buffer_pool memory, imported as udmabuf fds
+};
 
 struct buffer 
 {
         void   *start;
         size_t  length;
+        int     dmabuf_fd;      // VIDIOC_EXPBUF or udmabuf fd, -1 if none
+        atomic_uint refs;       // capture thread, workers, DMABUF consumers; re-queued at 0
+        int     queued;         // with the driver, capture thread only
+};
+
+// What startup time goes on, per camera, in order
+enum startup_phase
+{
+        STARTUP_OPEN,
+        STARTUP_FORMAT,         // VIDIOC_QUERYCAP, crop and VIDIOC_S_FMT
+        STARTUP_RATE,
+        STARTUP_BUFFERS,        // VIDIOC_REQBUFS and mapping, or the pool
+        STARTUP_WORKERS,        // workers, exporter and recorder
+        STARTUP_STREAMON,
+        STARTUP_FIRST_FRAME,    // stream on to the first dequeue
+        STARTUP_PHASES
+};
+
+// Where a camera is between a failure and streaming again
+enum camera_state
+{
+        CAMERA_STREAMING,
+        CAMERA_DRAINING,        // stream off, waiting for consumers to release its buffers
+        CAMERA_REOPENING,       // buffers unmapped and device closed, reopened every RECOVER_RETRY_MS
+};
+
+struct worker;
+struct camera;
+
+// Output buffer of a copying pipeline stage, idle again once its last reference is put
+struct out_buffer
+{
+        struct pipe_buf     buf;                // first, the pipeline hands out &buf
+        struct worker      *w;
+        int                 busy;               // under the worker's out_lock
+};
+
+// Ring frame as the pipeline's source buffer, back to the ring on its last reference
+struct ring_source
+{
+        struct pipe_buf     buf;                // first
+        struct worker      *w;
+        struct frame       *f;
+};
+
+// An access unit on its way to the container, its encoder buffer back once written
+struct coded_write
+{
+        struct camera      *cam;
+        unsigned int        index;              // encoder CAPTURE buffer
+        unsigned int        tag;
+        size_t              size;
+        uint64_t            capture_ns;
+};
+
+// Processing thread fed by the capture thread through its own frame ring
+struct worker
+{
+        struct camera      *cam;
+        pthread_t           thread;
+        struct frame_ring  *ring;
+        struct ring_source *src;                // one per ring frame, same index
+        unsigned int        sources_out;        // ring frames not yet released, under out_lock
+        struct pipeline    *pipe;
+        struct out_buffer   out[OUT_BUFFERS];   // converted output, private to this worker
+        pthread_mutex_t     out_lock;
+        pthread_cond_t      out_cond;
+        struct mjpeg_decoder *decoder;          // MJPEG with --decode only
+        unsigned char      *row;                // one decimated YUYV row per band, with --decimate only
+        struct band_pool   *bands;              // helpers converting row bands, with --bands only
+        unsigned long       processed;
+};
+
+// Everything that belongs to one capture device
+struct camera
+{
+        const char         *dev_name;
+        unsigned int        index;              // position on the command line
+        int                 fd;
+        struct v4l2_format  fmt;
+        struct v4l2_fract   timeperframe;       // what VIDIOC_S_PARM settled on, 0/0 if unset
+        struct buffer      *buffers;
+        unsigned int        n_buffers;
+        struct buffer_pool *pool;               // USERPTR / DMABUF import memory
+        struct worker      *workers;
+        struct frame_writer *writer;
+        struct frame_stream *stream;            // container output, NULL for a file per frame
+        struct frame_recorder *recorder;        // ring of the last frames, replaces per-frame output
+        struct frame_motion *motion;            // skips unchanged frames, NULL to keep all
+        struct frame_shm   *shm;                // local consumers, NULL if not published
+        struct frame_net   *net;                // TCP/UDP consumers, NULL if not sent
+        struct frame_encoder *encoder;          // --encode, its access units replace the frames
+        struct coded_write  coded[ENC_CODED_BUFFERS];   // one per encoder CAPTURE buffer
+        int                 exported;           // capture buffers exported for the encoder, again after a reopen
+        char                dumpname[32];       // frame_writer name format
+        int                 ppm_header_len;     // every frame's header is this long, 0 for MJPEG pass-through
+        int                 gray;               // YUYV written as Y-only PGM
+        enum yuv_output     output;             // layout YUYV is converted to, RGB24 unless it is
+        yuyv_convert_fn     convert;            // packed layout or luma kernel, NULL when planar
+        yuyv_planar_fn      planar;             // NV12 / I420 kernel, two lines at a time
+        struct v4l2_rect    roi;                // part of the captured frame that is processed
+        int                 hw_crop;            // the driver crops to roi, nothing left to do in software
+        unsigned int        decimate;           // keep every Nth pixel and row of roi
+        unsigned int        out_width, out_height;  // image written per frame
+        char                export_path[108];
+        struct dmabuf_export *exporter;
+        struct frame_stats *stats;
+        unsigned int        framecnt;
+        int                 remaining;          // frames still to capture, 0 once stopped
+        struct timespec     last_frame;         // CLOCK_MONOTONIC, for stall detection
+        uint64_t            period_ns;          // frame period, the dequeue deadline; 0 if unknown
+        uint64_t            last_capture_ns;    // previous frame, for STAT_JITTER
+        uint64_t            last_dequeue_ns;
+        unsigned int        queued;             // buffers the driver holds, capture thread only
+        unsigned int        held_peak;          // most buffers out with us and consumers at once
+        unsigned long       starved;            // dequeues that left the driver no buffer to fill
+        int                 parked;             // fd out of epoll until a buffer is queued again
+        int                 return_fd;          // eventfd: buffers released off the capture thread
+        _Atomic uint64_t    returned;           // their indices, one bit each
+        enum camera_state   state;
+        const char         *fail_what;          // what failed while streaming, NULL if nothing
+        int                 fail_errno;
+        struct timespec     outage_start;       // CLOCK_MONOTONIC, last frame before the current outage
+        struct timespec     next_reopen;
+        unsigned int        reopens;            // attempts in the current outage
+        unsigned int        outages, recovered;
+        uint64_t            outage_ns, outage_max_ns;   // last frame to the next, or to giving up
+        uint64_t            startup_mark;       // stats_now_ns() when the current phase began
+        uint64_t            startup_ns[STARTUP_PHASES];
+        int                 cached_format;      // the device still had the format --cache remembered
+        int                 cached_rate;        // and the frame interval
+};
+
+// What an epoll event is for, in the top half of its data word
+enum event_kind
+{
+        EVENT_STOP,
+        EVENT_CAMERA,
+        EVENT_EXPORT,
+        EVENT_STATS,
+        EVENT_SNAPSHOT,
+        EVENT_RETURN,
+        EVENT_HOTPLUG,
 };
 
 /*************************************************************************
  *                  Global Variables                                     *
  *************************************************************************/
 
-static char            *dev_name;
-static int              fd = -1;
-struct buffer          *buffers;
-static unsigned int     n_buffers;
+static struct camera    cameras[MAX_CAMERAS];
+static unsigned int     n_cameras;
+static int              stop_fd = -1;   // eventfd, written to end the main loop
+static int              snapshot_fd = -1;       // eventfd, written to snapshot the recorders
 static int              out_buf;
 static int              force_format=1;
+static unsigned int     req_width = 320;        // requested, the driver may adjust
+static unsigned int     req_height = 240;
+static unsigned int     req_pixelformat = V4L2_PIX_FMT_YUYV;
+static int              decode_mjpeg;           // write MJPEG decoded to PPM instead of as-is
+static int              gray_output;            // write YUYV luma as PGM, no color conversion
+static enum yuv_output  output_layout = YUV_OUTPUT_RGB24;   // what YUYV is converted to otherwise
+static struct v4l2_rect req_roi;                // in requested frame pixels, width 0 = whole frame
+static unsigned int     decimate = 1;           // 1, 2, 4 or 8
+static unsigned int     motion_threshold;       // mean |dY| per pixel of a changed block, 0 = keep every frame
+static unsigned int     motion_blocks = 1;      // changed blocks that make a frame worth keeping
+static unsigned int     n_bands = 1;            // row bands each frame's conversion is split into
+static int              rt_priority;            // SCHED_FIFO priority of the capture thread, 0 = SCHED_OTHER
+static int              capture_cpu = -1;       // CPU the capture thread is pinned to, -1 = any
+static int              worker_cpus[MAX_CPU_LIST];      // workers are pinned round robin over these
+static unsigned int     n_worker_cpus;
+static int              lock_memory;            // mlockall() and prefault the frame buffers
+static unsigned int     req_fps;                // 0 = driver default, FPS_MAX = fastest listed
+static int              list_only;              // print the supported modes and exit
+static enum io_method   io = IO_METHOD_MMAP;
+static const char      *io_names[] = { "mmap", "userptr", "dmabuf" };
+static unsigned int     req_buffers = 6;
+static int              use_hugepages;
 static int              frame_count = 30;
+static enum yuv_kernel  kernel = YUV_KERNEL_AUTO;
+static int              selftest;
+static unsigned int     n_workers = 1;
+static unsigned int     ring_depth = 4;
+static enum ring_policy ring_policy = RING_BLOCK;
+static enum writer_backend writer_backend = WRITER_AUTO;
+static unsigned int     writer_threads = 2;
+static char            *export_path;
+static unsigned int     stats_interval;         // seconds between reports, 0 for final only
+static char            *stats_path;
+static char            *stream_prefix;          // container segments instead of a file per frame
+static unsigned int     segment_frames = 1800;  // records per container segment
+static unsigned int     record_seconds;         // ring recorder length, 0 = off
+static char            *shm_name;               // publish frames to this POSIX shm ring
+static char            *net_spec;               // tcp:[HOST:]PORT or udp:HOST:PORT
+static char            *encode_device;          // V4L2 memory-to-memory encoder, NULL to write frames as they are
+static unsigned int     encode_codec = V4L2_PIX_FMT_H264;
+static unsigned int     encode_bitrate;         // bits per second, 0 = driver default
+static int              no_disk;                // frames only go to the shm and network sinks
+static int              in_place;               // workers read capture buffers, no copy into the ring
+static int              stream_copy;            // copy capture buffers into the ring with streaming loads
+static int              nt_stores;              // converted frames bypass the cache on their way to the sinks
+static size_t           prefetch_bytes;         // source prefetch distance of the conversion kernels, 0 = off
+static int              verbose;                // a log line per frame
+static unsigned int     log_rate = 10;          // log records per second per call site, 0 = unlimited
+static unsigned int     recover_seconds = 30;   // a failed camera is reopened for this long, 0 = stop it
+static char            *cache_path;             // negotiated settings remembered here between runs
+static struct device_cache *device_cache;
+static uint64_t         start_ns;               // stats_now_ns() as main() began
+static const char      *startup_names[STARTUP_PHASES] =
+        { "open", "format", "frame rate", "buffers", "workers", "stream on", "first frame" };
+static FILE            *stats_file;
 
 /*************************************************************************
  *                         Functions                                     *
@@ -142,6 +379,52 @@ static int xioctl(int fh, int request, void *arg)
         return r;
 }
 
+// V4L2 memory type for the selected io method
+static enum v4l2_memory io_memory()
+{
+        switch (io)
+        {
+            case IO_METHOD_USERPTR: return V4L2_MEMORY_USERPTR;
+            case IO_METHOD_DMABUF:  return V4L2_MEMORY_DMABUF;
+            default:                return V4L2_MEMORY_MMAP;
+        }
+}
+
+// Pixel formats process_image handles
+struct pixel_format
+{
+        const char     *name;
+        unsigned int    fourcc;
+        unsigned int    bytes_per_pixel;        // 0 for compressed formats
+};
+
+static const struct pixel_format pixel_formats[] =
+{
+        { "yuyv",  V4L2_PIX_FMT_YUYV,  2 },
+        { "rgb24", V4L2_PIX_FMT_RGB24, 3 },
+        { "mjpeg", V4L2_PIX_FMT_MJPEG, 0 },
+};
+
+#define N_PIXEL_FORMATS (sizeof(pixel_formats) / sizeof(pixel_formats[0]))
+
+// Table entry for fourcc, NULL if process_image can't handle it
+static const struct pixel_format *find_format(unsigned int fourcc)
+{
+        unsigned int i;
+
+        for (i = 0; i < N_PIXEL_FORMATS; i++)
+            if (pixel_formats[i].fourcc == fourcc)
+                return &pixel_formats[i];
+        return NULL;
+}
+
+static const char *format_name(unsigned int fourcc)
+{
+        const struct pixel_format *pf = find_format(fourcc);
+
+        return pf ? pf->name : "?";
+}
+
 /*************************************************************************
  *                          Open Device Function                         *
  *************************************************************************/
@@ -149,7 +432,7 @@ static int xioctl(int fh, int request, void *arg)
 /**
  * @name   open_device
  * @brief  Open camera device named dev_name
- * @param  none
+ * @param  cam - camera
  * 
  * @descr  Checks if file exists using stat
  *         Checks if it's a device file by accessing st_mode and S_ISCHR
@@ -159,33 +442,33 @@ static int xioctl(int fh, int request, void *arg)
  * @return none
  */
  
-static void open_device()
+static void open_device(struct camera *cam)
 {
         struct stat st; // To store file information; st variable of type struct stat
 				
         // return val -1 on error
-        if (stat(dev_name, &st) == -1) //stat function retrieves info about file pointed to by dev_name and stores it in st structure
+        if (stat(cam->dev_name, &st) == -1) //stat function retrieves info about file pointed to by dev_name and stores it in st structure
 		{
-                fprintf(stderr, "Cannot identify '%s': %d, %s\n", dev_name, errno, strerror(errno));
+                fprintf(stderr, "Cannot identify '%s': %d, %s\n", cam->dev_name, errno, strerror(errno));
                 exit(EXIT_FAILURE);
         }
 
 		// st_mode is member of struct stat which contains info about file type and permissions.
         if (!S_ISCHR(st.st_mode)) //checks if mode is a char device; error if not char special file
 		{
-                fprintf(stderr, "%s is no device\n", dev_name);
+                fprintf(stderr, "%s is no device\n", cam->dev_name);
                 exit(EXIT_FAILURE);
         }
 		
         // open system call to open device name with reading and writing in non-blocking mode
-        fd = open(dev_name, O_RDWR | O_NONBLOCK, 0); //file name, flags, mode
+        cam->fd = open(cam->dev_name, O_RDWR | O_NONBLOCK, 0); //file name, flags, mode
 		// Access modes: O_NONBLOCK - file is opened in nonblocking mode (Doesn't wait for resource to be available)
 		// O_RDWR - file opened for both reading and writing
 		// mode = 0; no special permissions for file opened, use default, do not modify
 
-        if (fd == -1) // exit on opening failure 
+        if (cam->fd == -1) // exit on opening failure 
 		{
-                fprintf(stderr, "Cannot open '%s': %d, %s\n", dev_name, errno, strerror(errno));
+                fprintf(stderr, "Cannot open '%s': %d, %s\n", cam->dev_name, errno, strerror(errno));
                 exit(EXIT_FAILURE);
         }
 }
@@ -197,7 +480,7 @@ static void open_device()
 /**
  * @name   init_mmap
  * @brief  Initializes mem mapping for video capture buffers
- * @param  none
+ * @param  cam - camera
  * 
  * @descr  Requests buffers from the device driver and checks sufficiency
  *         Queries buffer info
@@ -207,21 +490,21 @@ static void open_device()
  * @return none
  */
 
-static void init_mmap()
+static void init_mmap(struct camera *cam)
 {
         struct v4l2_requestbuffers req; //struct to request memory buffers from device driver
 
         CLEAR(req); //clears memory associated with req struct
 
-        req.count = 6; // buffers requested from device
+        req.count = req_buffers; // buffers requested from device
         req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // type requested video capture buffers
         req.memory = V4L2_MEMORY_MMAP; // memory mapping used for buffers
 
-        if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1) //request memory buffers from the device drive check
+        if (xioctl(cam->fd, VIDIOC_REQBUFS, &req) == -1) //request memory buffers from the device drive check
         {
                 if (EINVAL == errno) 
                 {
-                        fprintf(stderr, "%s does not support memory mapping\n", dev_name);
+                        fprintf(stderr, "%s does not support memory mapping\n", cam->dev_name);
                         exit(EXIT_FAILURE);
                 } else 
                 {
@@ -231,19 +514,19 @@ static void init_mmap()
 
         if (req.count < 2) //checks if requested number of buffers is sufficient
         {
-                fprintf(stderr, "Insufficient buffer memory on %s\n", dev_name);
+                fprintf(stderr, "Insufficient buffer memory on %s\n", cam->dev_name);
                 exit(EXIT_FAILURE);
         }
 
-        buffers = calloc(req.count, sizeof(*buffers)); //dynamically allocates memory for arr of buffer structs (each memory-mapped buffer)
+        cam->buffers = calloc(req.count, sizeof(*cam->buffers)); //dynamically allocates memory for arr of buffer structs (each memory-mapped buffer)
 
-        if (!buffers) 
+        if (!cam->buffers) 
         {
                 fprintf(stderr, "Out of memory\n");
                 exit(EXIT_FAILURE);
         }
 
-        for (n_buffers = 0; n_buffers < req.count; ++n_buffers) //iterates over each buffer requested and obtained from device driver
+        for (cam->n_buffers = 0; cam->n_buffers < req.count; ++cam->n_buffers) //iterates over each buffer requested and obtained from device driver
 		{ // for each buffer
                 struct v4l2_buffer buf; //initializes a v4l2_buffer structure buf 
 
@@ -252,566 +535,3864 @@ static void init_mmap()
 				// set buffer type, memory and index
                 buf.type        = V4L2_BUF_TYPE_VIDEO_CAPTURE;
                 buf.memory      = V4L2_MEMORY_MMAP;
-                buf.index       = n_buffers;
+                buf.index       = cam->n_buffers;
 
-                if (xioctl(fd, VIDIOC_QUERYBUF, &buf) == -1) //request to query buffer info from device driver
+                if (xioctl(cam->fd, VIDIOC_QUERYBUF, &buf) == -1) //request to query buffer info from device driver
                         errno_exit("VIDIOC_QUERYBUF");
 
-                buffers[n_buffers].length = buf.length; //Stores buffer length obtained from driver in corresponding buffer struct in buffers arr
+                cam->buffers[cam->n_buffers].length = buf.length; //Stores buffer length obtained from driver in corresponding buffer struct in buffers arr
 				//Uses mmap to map the buffer's memory into process's address space; mapped memory stored in start member of corresponding buffer struct
-                buffers[n_buffers].start =
+                cam->buffers[cam->n_buffers].start =
                         mmap(NULL /* start anywhere */,
                               buf.length,
                               PROT_READ | PROT_WRITE /* required */,
                               MAP_SHARED /* recommended */,
-                              fd, buf.m.offset);
+                              cam->fd, buf.m.offset);
 
-                if (MAP_FAILED == buffers[n_buffers].start) // checks mmap failure
+                if (MAP_FAILED == cam->buffers[cam->n_buffers].start) // checks mmap failure
                         errno_exit("mmap");
+
+                cam->buffers[cam->n_buffers].dmabuf_fd = -1;
         }
 }
 
 /*************************************************************************
- *                          Init Device Function                         *
+ *      Export Buffers Function called in init_device                    *
  *************************************************************************/
 
 /**
- * @name   init_device
- * @brief  Initializes video capture device
- * @param  none
- * 
- * @descr  Queries device's capabilties
- *         Checks if device supports video capture and streaming I/O
- *         Queries and sets cropping parameters
- *         Configures video format
- *         Ensures proper buffer size
- *         Initializes memory mapping
+ * @name   export_buffers
+ * @brief  Exports each mmap capture buffer as a DMABUF fd
+ * @param  cam - camera
  *
- * @return none
+ * @descr  VIDIOC_EXPBUF gives an fd for the same memory the driver fills,
+ *         which consumers can mmap or import into a GPU or encoder without
+ *         any CPU copy; fds are read-only for consumers
+ *
+ * @return 0, -1 with errno set and no buffer exported
  */
 
-static void init_device()
+static int export_buffers(struct camera *cam)
 {
-    struct v4l2_capability cap; // struct holds device capabilities
-    struct v4l2_cropcap cropcap; // struct holds cropping capabilities
-    struct v4l2_crop crop; // struct holds cropping settings
-    unsigned int min; // min buffer size
+        unsigned int i;
 
-    if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) // queries the device's capabilities 
-    {
-        if (errno == EINVAL) 
-		{
-            fprintf(stderr, "%s is no V4L2 device\n", dev_name);
-            exit(EXIT_FAILURE);
-        }
-        else
+        for (i = 0; i < cam->n_buffers; ++i)
         {
-            errno_exit("VIDIOC_QUERYCAP");
-        }
-    }
-	
-	// checks if device supports video capture and streaming I/O by examining capabilities returned by query
-    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
-    {
-        fprintf(stderr, "%s is no video capture device\n", dev_name);
-        exit(EXIT_FAILURE);
-    }
-    if (!(cap.capabilities & V4L2_CAP_STREAMING))
-    {
-        fprintf(stderr, "%s does not support streaming i/o\n", dev_name);
-        exit(EXIT_FAILURE);
-    }
-  
+                struct v4l2_exportbuffer expbuf;
 
-    // Select video input, video standard and tune here.
-
-    CLEAR(cropcap); // clears memory associated with cropcap struct
+                CLEAR(expbuf);
+                expbuf.type  = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+                expbuf.index = i;
+                expbuf.flags = O_RDONLY | O_CLOEXEC;
 
-    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; //set type of cropping operation for video capture
+                if (xioctl(cam->fd, VIDIOC_EXPBUF, &expbuf) == -1)
+                {
+                        int err = errno;
 
-    if (xioctl(fd, VIDIOC_CROPCAP, &cropcap) == 0) //Queries cropping capabilities of device and stores them in cropcap
-    {   // on success enters
-        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        crop.c = cropcap.defrect; /* reset to default */
+                        while (i--)
+                        {
+                                close(cam->buffers[i].dmabuf_fd);
+                                cam->buffers[i].dmabuf_fd = -1;
+                        }
+                        errno = err;
+                        return -1;
+                }
 
-        if (xioctl(fd, VIDIOC_S_CROP, &crop) == -1)
-        {
-			if(errno == EINVAL)
-				fprintf(stderr, "Cropping not supported\n");
+                cam->buffers[i].dmabuf_fd = expbuf.fd;
         }
-    }
-
-    CLEAR(fmt); //clears v4l2 format struct var
-
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; //set type of video capture
-
-    if (force_format)
-    {
-        fmt.fmt.pix.width       = HRES;
-        fmt.fmt.pix.height      = VRES;
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_YUYV; // This one work for Logitech C200
-        fmt.fmt.pix.field       = V4L2_FIELD_NONE;
-
-        if (xioctl(fd, VIDIOC_S_FMT, &fmt) == -1)
-            errno_exit("VIDIOC_S_FMT");
-
-        /* Note VIDIOC_S_FMT may change width and height. */
-    }
-    else
-    {
-        printf("ASSUMING FORMAT\n");
-        /* Preserve original settings as set by v4l2-ctl for example */
-        if (xioctl(fd, VIDIOC_G_FMT, &fmt) == -1)
-            errno_exit("VIDIOC_G_FMT");
-    }
-
-    // Buggy driver paranoia.
-	//precautionary measure for buggy drivers
-	//ensures buffer size (sizeimage) is large enough to hold the captured image data
-	// calculates min req buffer size based on the width, height, and bytes per line, and adjusts bytesperline and sizeimage if necessary.
-    min = fmt.fmt.pix.width * 2;
-    if (fmt.fmt.pix.bytesperline < min)
-            fmt.fmt.pix.bytesperline = min;
-		
-    min = fmt.fmt.pix.bytesperline * fmt.fmt.pix.height;
-    if (fmt.fmt.pix.sizeimage < min)
-            fmt.fmt.pix.sizeimage = min;
 
-    init_mmap(); //initialize memory mapping for video capture (efficient data transfer between user space and device)
+        return 0;
 }
 
 /*************************************************************************
- *                      Start capturing Function                         *
+ *    Init User Buffer Pool Function called in init_device               *
  *************************************************************************/
 
 /**
- * @name   start_capturing
- * @brief  Prepares device for video capture bu queueing buffers for capturing and starting video stream
- * @param  none
- * 
- * @descr  Queues buffers
- *         Starts video stream
+ * @name   init_pool
+ * @brief  Sets up capture into our own buffer pool (USERPTR or DMABUF import)
+ * @param  buffer_size - bytes per buffer, from the negotiated format
+ *
+ * @descr  Requests buffer slots without driver memory
+ *         Allocates page-aligned buffers from a buffer_pool, hugetlb backed
+ *         if requested, so frames land in memory the processing stages own
+ *         For DMABUF, wraps each pool buffer as a udmabuf fd to queue
  *
  * @return none
  */
 
-static void start_capturing()
+static void init_pool(struct camera *cam, unsigned int buffer_size)
 {
-        unsigned int i;
-        enum v4l2_buf_type type; // buffer type for streaming
+        struct v4l2_requestbuffers req;
+
+        CLEAR(req);
+
+        req.count  = req_buffers;
+        req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        req.memory = io_memory();
+
+        if (xioctl(cam->fd, VIDIOC_REQBUFS, &req) == -1)
+        {
+                if (EINVAL == errno)
+                {
+                        fprintf(stderr, "%s does not support %s i/o\n", cam->dev_name, io_names[io]);
+                        exit(EXIT_FAILURE);
+                } else
+                {
+                        errno_exit("VIDIOC_REQBUFS");
+                }
+        }
 
-        for (i = 0; i < n_buffers; ++i) //iterates over each buffer allocated during initialization
+        if (req.count < 2)
         {
-            //printf("allocated buffer %d\n", i);
-            struct v4l2_buffer buf; //init struct
+                fprintf(stderr, "Insufficient buffer memory on %s\n", cam->dev_name);
+                exit(EXIT_FAILURE);
+        }
 
-            CLEAR(buf); //clear it
-			//sets buffer type, memory type, and buffer index
-            buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-            buf.memory = V4L2_MEMORY_MMAP;
-            buf.index = i;
+        cam->buffers = calloc(req.count, sizeof(*cam->buffers));
+        cam->pool = buffer_pool_create(req.count, buffer_size, use_hugepages);
 
-            if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) //request to enqueue the buffer for video capture
-                errno_exit("VIDIOC_QBUF");
+        if (!cam->buffers || !cam->pool)
+        {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
         }
-		
-		//After queuing all buffers, sets the type variable to V4L2_BUF_TYPE_VIDEO_CAPTURE to specify the buffer type for streaming
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        if (xioctl(fd, VIDIOC_STREAMON, &type) == -1) //request to start streaming video
-            errno_exit("VIDIOC_STREAMON");
+
+        for (cam->n_buffers = 0; cam->n_buffers < req.count; ++cam->n_buffers)
+        {
+                cam->buffers[cam->n_buffers].start     = buffer_pool_addr(cam->pool, cam->n_buffers);
+                cam->buffers[cam->n_buffers].length    = cam->pool->stride;
+                cam->buffers[cam->n_buffers].dmabuf_fd = -1;
+
+                if (io == IO_METHOD_DMABUF)
+                {
+                        cam->buffers[cam->n_buffers].dmabuf_fd = buffer_pool_dmabuf(cam->pool, cam->n_buffers);
+                        if (cam->buffers[cam->n_buffers].dmabuf_fd == -1)
+                                errno_exit("UDMABUF_CREATE");
+                }
+        }
+
+        printf("%u %s buffers of %zu bytes%s\n", cam->n_buffers, io_names[io], cam->pool->stride,
+               cam->pool->hugetlb ? " on huge pages" : "");
 }
 
 /*************************************************************************
- *         Dump PPM Function called in Image Processing Function         *
+ *           List Modes Function called in Main Function                 *
  *************************************************************************/
- 
- /**
- * @name   start_capturing
- * @brief  Prepares device for video capture bu queueing buffers for capturing and starting video stream
- * @param  none
- * 
- * @descr  Queues buffers
- *         Starts video stream
+
+/**
+ * @name   list_modes
+ * @brief  Prints every pixel format, frame size and frame interval the driver offers
+ * @param  cam - camera
+ *
+ * @descr  VIDIOC_ENUM_FMT, then VIDIOC_ENUM_FRAMESIZES per format and
+ *         VIDIOC_ENUM_FRAMEINTERVALS per discrete size
+ *         Stepwise and continuous ranges are printed as ranges
  *
  * @return none
  */
- 
-char ppm_header[]="P6\n#9999999999 sec 9999999999 msec \n"HRES_STR" "VRES_STR"\n255\n";
-char ppm_dumpname[]="frames/test00000000.ppm";
 
-static void dump_ppm(const void *p, int size, unsigned int tag, struct timespec *time)
+static void list_modes(struct camera *cam)
 {
-    int written, i, total, dumpfd;
-   
-    snprintf(&ppm_dumpname[4], 9, "%08d", tag);
-    strncat(&ppm_dumpname[12], ".ppm", 5);
-    dumpfd = open(ppm_dumpname, O_WRONLY | O_NONBLOCK | O_CREAT, 00666);
+        struct v4l2_fmtdesc fmtdesc;
+        struct v4l2_frmsizeenum size;
+        struct v4l2_frmivalenum ival;
 
-    // subtract 1 because sizeof for string includes null terminator
-    written=write(dumpfd, ppm_header, sizeof(ppm_header)-1);
+        printf("%s:\n", cam->dev_name);
 
-    total=0;
+        CLEAR(fmtdesc);
+        fmtdesc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        for (; xioctl(cam->fd, VIDIOC_ENUM_FMT, &fmtdesc) == 0; fmtdesc.index++)
+        {
+                printf("  %.4s  %s%s\n", (char *)&fmtdesc.pixelformat, fmtdesc.description,
+                       find_format(fmtdesc.pixelformat) ? "" : " (not supported here)");
 
-    do
-    {
-        written=write(dumpfd, p, size);
-        total+=written;
-    } while(total < size);
+                CLEAR(size);
+                size.pixel_format = fmtdesc.pixelformat;
+                for (; xioctl(cam->fd, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++)
+                {
+                        if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+                        {
+                                printf("    %ux%u to %ux%u, step %ux%u\n",
+                                       size.stepwise.min_width, size.stepwise.min_height,
+                                       size.stepwise.max_width, size.stepwise.max_height,
+                                       size.stepwise.step_width, size.stepwise.step_height);
+                                break;
+                        }
 
-    printf("wrote %d bytes\n", total);
+                        printf("    %ux%u:", size.discrete.width, size.discrete.height);
 
-    close(dumpfd);
-    
+                        CLEAR(ival);
+                        ival.pixel_format = fmtdesc.pixelformat;
+                        ival.width        = size.discrete.width;
+                        ival.height       = size.discrete.height;
+                        for (; xioctl(cam->fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++)
+                        {
+                                if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+                                {
+                                        printf(" %.2f to %.2f fps",
+                                               (double)ival.stepwise.max.denominator / ival.stepwise.max.numerator,
+                                               (double)ival.stepwise.min.denominator / ival.stepwise.min.numerator);
+                                        break;
+                                }
+                                printf(" %.2f", (double)ival.discrete.denominator / ival.discrete.numerator);
+                        }
+                        printf("\n");
+                }
+        }
 }
 
 /*************************************************************************
- * YUV to RGB Conversion Function called in Image Processing Function    *
+ *      Set Frame Rate Function called in init_device                    *
  *************************************************************************/
- 
- /**
- * @name   start_capturing
- * @brief  Prepares device for video capture bu queueing buffers for capturing and starting video stream
- * @param  none
- * 
- * @descr  Queues buffers
- *         Starts video stream
+
+// Frames per second of a frame interval, 0 for an invalid one
+static double fract_fps(const struct v4l2_fract *t)
+{
+        return t->numerator && t->denominator ? (double)t->denominator / t->numerator : 0;
+}
+
+/**
+ * @name   choose_interval
+ * @brief  Picks the supported frame interval closest to req_fps
+ * @param  cam  - camera, format already negotiated
+ *         best - filled with the chosen interval
  *
- * @return none
+ * @descr  Enumerates VIDIOC_ENUM_FRAMEINTERVALS for the negotiated size and
+ *         format; FPS_MAX picks the shortest interval offered
+ *         Stepwise and continuous ranges are clamped to their limits
+ *
+ * @return 0 on success, -1 if the driver doesn't enumerate intervals
  */
 
-// This is probably the most acceptable conversion from camera YUYV to RGB
-//
-// Wikipedia has a good discussion on the details of various conversions and cites good references:
-// http://en.wikipedia.org/wiki/YUV
-//
-// Also http://www.fourcc.org/yuv.php
-//
-// What's not clear without knowing more about the camera in question is how often U & V are sampled compared
-// to Y.
-//
-// E.g. YUV444, which is equivalent to RGB, where both require 3 bytes for each pixel
-//      YUV422, which we assume here, where there are 2 bytes for each pixel, with two Y samples for one U & V,
-//              or as the name implies, 4Y and 2 UV pairs
-//      YUV420, where for every 4 Ys, there is a single UV pair, 1.5 bytes for each pixel or 36 bytes for 24 pixels
-
-void yuv2rgb(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b)
+static int choose_interval(struct camera *cam, struct v4l2_fract *best)
 {
-   int r1, g1, b1;
+        struct v4l2_frmivalenum ival;
+        double want = req_fps == FPS_MAX ? 1e9 : req_fps;
+        double best_diff = -1;
+
+        CLEAR(ival);
+        ival.pixel_format = cam->fmt.fmt.pix.pixelformat;
+        ival.width        = cam->fmt.fmt.pix.width;
+        ival.height       = cam->fmt.fmt.pix.height;
+
+        for (; xioctl(cam->fd, VIDIOC_ENUM_FRAMEINTERVALS, &ival) == 0; ival.index++)
+        {
+                struct v4l2_fract t;
+                double diff;
 
-   // replaces floating point coefficients
-   int c = y-16, d = u - 128, e = v - 128;       
+                if (ival.type == V4L2_FRMIVAL_TYPE_DISCRETE)
+                {
+                        t = ival.discrete;
+                }
+                else
+                {
+                        // ranges hold intervals: min is the fastest rate
+                        if (want >= fract_fps(&ival.stepwise.min))
+                            t = ival.stepwise.min;
+                        else if (want <= fract_fps(&ival.stepwise.max))
+                            t = ival.stepwise.max;
+                        else
+                        {
+                            t.numerator   = 1;
+                            t.denominator = req_fps;
+                        }
+                }
 
-   // Conversion that avoids floating point
-   r1 = (298 * c           + 409 * e + 128) >> 8;
-   g1 = (298 * c - 100 * d - 208 * e + 128) >> 8;
-   b1 = (298 * c + 516 * d           + 128) >> 8;
+                if (fract_fps(&t) == 0)
+                        continue;
 
-   // Computed values may need clipping.
-   if (r1 > 255) r1 = 255;
-   if (g1 > 255) g1 = 255;
-   if (b1 > 255) b1 = 255;
+                diff = fract_fps(&t) > want ? fract_fps(&t) - want : want - fract_fps(&t);
+                if (best_diff < 0 || diff < best_diff)
+                {
+                        *best = t;
+                        best_diff = diff;
+                }
 
-   if (r1 < 0) r1 = 0;
-   if (g1 < 0) g1 = 0;
-   if (b1 < 0) b1 = 0;
+                if (ival.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+                        break;
+        }
 
-   *r = r1 ;
-   *g = g1 ;
-   *b = b1 ;
+        return best_diff < 0 ? -1 : 0;
 }
 
-/*************************************************************************
- *          Image Processing Function called in Read_frame               *
- *************************************************************************/
- 
- /**
- * @name   start_capturing
- * @brief  Prepares device for video capture bu queueing buffers for capturing and starting video stream
- * @param  none
- * 
- * @descr  Queues buffers
- *         Starts video stream
+/**
+ * @name   set_frame_rate
+ * @brief  Asks the driver for the supported rate closest to req_fps
+ * @param  cam  - camera
+ *         last - what --cache has from the last run, NULL if nothing
+ *
+ * @descr  The interval comes from choose_interval; drivers that don't
+ *         enumerate intervals get 1/req_fps and round it themselves
+ *         A remembered interval is used as it is, and not set again if
+ *         the driver is still running at it
+ *         The rate the driver settled on is kept in cam->timeperframe
+ *         and printed, with a warning when it isn't the one requested
+ *         Drivers without V4L2_CAP_TIMEPERFRAME keep their default rate
  *
  * @return none
  */
 
-unsigned int framecnt=0;
-unsigned char bigbuffer[(1280*960)];
-
-static void process_image(const void *p, int size)
+static void set_frame_rate(struct camera *cam, const struct device_cache_entry *last)
 {
-    int i, newi, newsize=0;
-    struct timespec frame_time;
-    int y_temp, y2_temp, u_temp, v_temp;
-    unsigned char *pptr = (unsigned char *)p;
-
-    // record when process was called
-    clock_gettime(CLOCK_REALTIME, &frame_time);    
-
-    framecnt++;
-    printf("frame %d: ", framecnt);
+        struct v4l2_streamparm parm;
+        struct v4l2_fract want;
 
-    // This just dumps the frame to a file now, but you could replace with whatever image
-    // processing you wish.
-    //
+        CLEAR(parm);
+        parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-    if(fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV)
-    {
+        if (xioctl(cam->fd, VIDIOC_G_PARM, &parm) == -1 ||
+            !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+        {
+                fprintf(stderr, "%s: frame rate is not settable\n", cam->dev_name);
+                return;
+        }
 
-#if defined(COLOR_CONVERT)
-        //printf("Dump YUYV converted to RGB size %d\n", size);
-       
-        // Pixels are YU and YV alternating, so YUYV which is 4 bytes
-        // We want RGB, so RGBRGB which is 6 bytes
-        //
-        for(i=0, newi=0; i<size; i=i+4, newi=newi+6)
+        if (last && last->timeperframe.denominator)
+        {
+                want = last->timeperframe;
+                if (parm.parm.capture.timeperframe.numerator == want.numerator &&
+                    parm.parm.capture.timeperframe.denominator == want.denominator)
+                {
+                        cam->cached_rate  = 1;
+                        cam->timeperframe = want;
+                        printf("%s: %.2f fps\n", cam->dev_name, fract_fps(&cam->timeperframe));
+                        return;
+                }
+        }
+        else if (choose_interval(cam, &want) == -1)
         {
-            y_temp=(int)pptr[i]; u_temp=(int)pptr[i+1]; y2_temp=(int)pptr[i+2]; v_temp=(int)pptr[i+3];
-            yuv2rgb(y_temp, u_temp, v_temp, &bigbuffer[newi], &bigbuffer[newi+1], &bigbuffer[newi+2]);
-            yuv2rgb(y2_temp, u_temp, v_temp, &bigbuffer[newi+3], &bigbuffer[newi+4], &bigbuffer[newi+5]);
+                if (req_fps == FPS_MAX)
+                {
+                        fprintf(stderr, "%s: driver doesn't list frame intervals, keeping its rate\n", cam->dev_name);
+                        cam->timeperframe = parm.parm.capture.timeperframe;
+                        return;
+                }
+                want.numerator   = 1;
+                want.denominator = req_fps;
         }
 
-        dump_ppm(bigbuffer, ((size*6)/4), framecnt, &frame_time);
-#endif
+        parm.parm.capture.timeperframe = want;
 
-    }
+        if (xioctl(cam->fd, VIDIOC_S_PARM, &parm) == -1)
+                errno_exit("VIDIOC_S_PARM");
 
-    else if(fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_RGB24)
-    {
-        printf("Dump RGB as-is size %d\n", size);
-        dump_ppm(p, size, framecnt, &frame_time);
-    }
+        cam->timeperframe = parm.parm.capture.timeperframe;
 
-    fflush(stderr);
-    //fprintf(stderr, ".");
-    fflush(stdout);
+        printf("%s: %.2f fps\n", cam->dev_name, fract_fps(&cam->timeperframe));
+        if (req_fps != FPS_MAX && fract_fps(&cam->timeperframe) != req_fps)
+                fprintf(stderr, "%s: %u fps requested, driver runs at %.2f\n", cam->dev_name,
+                        req_fps, fract_fps(&cam->timeperframe));
 }
 
-/*************************************************************************
- *                 Read frame Function called in Main loop               *
- *************************************************************************/
- 
- /**
- * @name   start_capturing
- * @brief  Prepares device for video capture bu queueing buffers for capturing and starting video stream
- * @param  none
- * 
- * @descr  Queues buffers
- *         Starts video stream
+// Frame rate the camera runs at: the one set, else what the driver reports, 0 if neither
+static double camera_fps(struct camera *cam)
+{
+        struct v4l2_streamparm parm;
+
+        if (fract_fps(&cam->timeperframe) > 0)
+                return fract_fps(&cam->timeperframe);
+
+        CLEAR(parm);
+        parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (xioctl(cam->fd, VIDIOC_G_PARM, &parm) == 0)
+                return fract_fps(&parm.parm.capture.timeperframe);
+
+        return 0;
+}
+
+/**
+ * @name   set_hw_crop
+ * @brief  Asks the driver to crop the sensor to the requested region of interest
+ * @param  cam     - camera
+ *         cropcap - from VIDIOC_CROPCAP
  *
- * @return none
+ * @descr  req_roi is in requested frame pixels; it is scaled onto defrect
+ *         Tries VIDIOC_S_SELECTION, then the older VIDIOC_S_CROP, and only
+ *         counts a readback that matches exactly, as a rounded crop would
+ *         shift the region
+ *
+ * @return 0 if the driver crops, -1 to crop in software
  */
- 
-static int read_frame()
+
+static int set_hw_crop(struct camera *cam, const struct v4l2_cropcap *cropcap)
 {
-    struct v4l2_buffer buf;
-    unsigned int i;
+        const struct v4l2_rect *d = &cropcap->defrect;
+        struct v4l2_selection sel;
+        struct v4l2_crop crop;
+        struct v4l2_rect want;
 
-    CLEAR(buf);
+        want.left   = d->left + (int)((uint64_t)req_roi.left * d->width / req_width);
+        want.top    = d->top  + (int)((uint64_t)req_roi.top * d->height / req_height);
+        want.width  = (uint64_t)req_roi.width * d->width / req_width;
+        want.height = (uint64_t)req_roi.height * d->height / req_height;
 
-    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    buf.memory = V4L2_MEMORY_MMAP;
+        CLEAR(sel);
+        sel.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        sel.target = V4L2_SEL_TGT_CROP;
+        sel.r      = want;
+        if (xioctl(cam->fd, VIDIOC_S_SELECTION, &sel) == 0 && xioctl(cam->fd, VIDIOC_G_SELECTION, &sel) == 0)
+                return memcmp(&sel.r, &want, sizeof(want)) == 0 ? 0 : -1;
 
-    if (-1 == xioctl(fd, VIDIOC_DQBUF, &buf))
-    {
-        switch (errno)
-        {
-            case EAGAIN:
-                return 0;
+        CLEAR(crop);
+        crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        crop.c    = want;
+        if (xioctl(cam->fd, VIDIOC_S_CROP, &crop) == 0 && xioctl(cam->fd, VIDIOC_G_CROP, &crop) == 0)
+                return memcmp(&crop.c, &want, sizeof(want)) == 0 ? 0 : -1;
 
-            case EIO:
-                /* Could ignore EIO, but drivers should only set for serious errors, although some set for non-fatal errors too.*/
-                return 0;
+        return -1;
+}
+
+/**
+ * @name   set_roi
+ * @brief  Works out which part of the negotiated frame is processed and the output size
+ * @param  cam - camera, fmt negotiated
+ *
+ * @descr  With a hardware crop the whole frame is the region; otherwise
+ *         req_roi is clamped to the frame and cropped in software from the
+ *         capture buffer. YUYV regions start and end on a macropixel
+ *         Compressed frames are passed on or decoded whole
+ *
+ * @return none
+ */
+
+static void set_roi(struct camera *cam)
+{
+        unsigned int width = cam->fmt.fmt.pix.width, height = cam->fmt.fmt.pix.height;
+        struct v4l2_rect *roi = &cam->roi;
+
+        roi->left = roi->top = 0;
+        roi->width  = width;
+        roi->height = height;
+        cam->decimate = decimate;
 
+        if (cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG)
+        {
+                if (req_roi.width || decimate > 1)
+                        fprintf(stderr, "%s: region of interest and decimation need uncompressed frames, ignored\n",
+                                cam->dev_name);
+                cam->decimate = 1;
+        }
+        else if (req_roi.width && !cam->hw_crop)
+        {
+                roi->left   = (unsigned int)req_roi.left < width ? (unsigned int)req_roi.left : width;
+                roi->top    = (unsigned int)req_roi.top < height ? (unsigned int)req_roi.top : height;
+                roi->width  = req_roi.width < width - roi->left ? req_roi.width : width - roi->left;
+                roi->height = req_roi.height < height - roi->top ? req_roi.height : height - roi->top;
+        }
 
-             default:
-                printf("mmap failure\n");
-                errno_exit("VIDIOC_DQBUF");
+        if (cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV)
+        {
+                roi->left  &= ~1;
+                roi->width &= ~1;
         }
-    }
 
-    assert(buf.index < n_buffers);
+        cam->out_width  = roi->width / cam->decimate;
+        cam->out_height = roi->height / cam->decimate;
+        if (cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV)
+                cam->out_width &= ~1;
+        if (cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV && yuv_output_planar(output_layout))
+                cam->out_height &= ~1;  // 4:2:0 chroma lines cover two rows
 
-    process_image(buffers[buf.index].start, buf.bytesused);
+        if (cam->out_width == 0 || cam->out_height == 0)
+        {
+                fprintf(stderr, "%s: region of interest is empty in a %ux%u frame\n", cam->dev_name, width, height);
+                exit(EXIT_FAILURE);
+        }
 
-    if (-1 == xioctl(fd, VIDIOC_QBUF, &buf))
-        errno_exit("VIDIOC_QBUF");
-    return 1;
+        if (req_roi.width || cam->decimate > 1)
+                printf("%s: processing %ux%u+%u+%u (%s crop), 1/%u decimation, %ux%u out\n", cam->dev_name,
+                       roi->width, roi->height, roi->left, roi->top, cam->hw_crop ? "hardware" : "software",
+                       cam->decimate, cam->out_width, cam->out_height);
 }
 
 /*************************************************************************
- *                           Main loop function                          *
+ *                 Startup Timing and the Device Cache                   *
  *************************************************************************/
- 
- /**
- * @name   mainloop
- * @brief  Prepares device for video capture bu queueing buffers for capturing and starting video stream
- * @param  none
- * 
- * @descr  Queues buffers
- *         Starts video stream
+
+// Ends the camera's current startup phase, timed from the end of the one before
+static void startup_phase(struct camera *cam, enum startup_phase phase)
+{
+    uint64_t now = stats_now_ns();
+
+    cam->startup_ns[phase] = now - cam->startup_mark;
+    cam->startup_mark      = now;
+}
+
+// e.g. "/dev/video0: startup open 3.1 ms, format 0.4 ms (cached), ..."; the first frame comes later
+static void report_startup(const struct camera *cam)
+{
+    unsigned int p;
+
+    printf("%s: startup", cam->dev_name);
+    for (p = 0; p < STARTUP_FIRST_FRAME; p++)
+        printf("%s %s %.1f ms%s", p ? "," : "", startup_names[p], cam->startup_ns[p] / 1e6,
+               (p == STARTUP_FORMAT && cam->cached_format) || (p == STARTUP_RATE && cam->cached_rate) ? " (cached)" : "");
+    printf("\n");
+}
+
+/**
+ * @name   cache_key
+ * @brief  Names a device and what is asked of it, for --cache
+ * @param  cap - VIDIOC_QUERYCAP answer
+ *         key - filled in
+ *         len - bytes at key
+ *
+ * @descr  bus_info tells two cameras of the same model apart, driver and
+ *         card a different camera on the same port; the node name is left
+ *         out since it changes with enumeration order
  *
  * @return none
  */
 
-static void mainloop()
+static void cache_key(const struct v4l2_capability *cap, char *key, size_t len)
+{
+    char *p;
+
+    snprintf(key, len, "%.32s|%.32s|%.32s|%ux%u|%.4s|%u|%ux%u+%d+%d",
+             (const char *)cap->driver, (const char *)cap->bus_info, (const char *)cap->card,
+             req_width, req_height, (const char *)&req_pixelformat, req_fps,
+             req_roi.width, req_roi.height, req_roi.left, req_roi.top);
+
+    // Tabs and newlines are the file's separators
+    for (p = key; *p; p++)
+        if (*p == '\t' || *p == '\n')
+            *p = ' ';
+}
+
+// The fields a remembered format has to match for the device to count as unchanged
+static int pix_matches(const struct v4l2_pix_format *a, const struct v4l2_pix_format *b)
 {
-    unsigned int count;
-    struct timespec read_delay;
-    struct timespec time_error;
+    return a->width == b->width && a->height == b->height && a->pixelformat == b->pixelformat &&
+           a->bytesperline == b->bytesperline && a->sizeimage == b->sizeimage && a->field == b->field;
+}
+
+/*************************************************************************
+ *                          Init Device Function                         *
+ *************************************************************************/
 
-    read_delay.tv_sec=0;
-    read_delay.tv_nsec=30000;
+/**
+ * @name   init_device
+ * @brief  Initializes video capture device
+ * @param  cam - camera
+ * 
+ * @descr  Queries device's capabilties
+ *         Checks if device supports video capture and streaming I/O
+ *         Queries and sets cropping parameters, cropping in the driver
+ *         to the region of interest when it can
+ *         Configures video format from req_width/req_height/req_pixelformat
+ *         Ensures proper buffer size
+ *         Sets the frame rate if one was requested
+ *         Initializes memory mapping
+ *
+ * @return none
+ */
 
-    count = frame_count;
+static void init_device(struct camera *cam)
+{
+    struct v4l2_capability cap; // struct holds device capabilities
+    struct v4l2_cropcap cropcap; // struct holds cropping capabilities
+    struct v4l2_crop crop; // struct holds cropping settings
+    struct v4l2_format cur; // format the device has before we set one
+    struct device_cache_entry entry, last; // what this run settles on, what the last one did
+    int have_last = 0;
+    unsigned int min; // min buffer size
+    const struct pixel_format *pf; // negotiated format
 
-    while (count > 0)
+    if (xioctl(cam->fd, VIDIOC_QUERYCAP, &cap) == -1) // queries the device's capabilities 
     {
-        for (;;)
+        if (errno == EINVAL) 
+		{
+            fprintf(stderr, "%s is no V4L2 device\n", cam->dev_name);
+            exit(EXIT_FAILURE);
+        }
+        else
         {
-            fd_set fds;
-            struct timeval tv;
-            int r;
+            errno_exit("VIDIOC_QUERYCAP");
+        }
+    }
+	
+	// checks if device supports video capture and streaming I/O by examining capabilities returned by query
+    if (!(cap.capabilities & V4L2_CAP_VIDEO_CAPTURE))
+    {
+        fprintf(stderr, "%s is no video capture device\n", cam->dev_name);
+        exit(EXIT_FAILURE);
+    }
+    if (!(cap.capabilities & V4L2_CAP_STREAMING))
+    {
+        fprintf(stderr, "%s does not support streaming i/o\n", cam->dev_name);
+        exit(EXIT_FAILURE);
+    }
 
-            FD_ZERO(&fds);
-            FD_SET(fd, &fds);
+    CLEAR(entry);
+    if (device_cache && force_format)
+    {
+        cache_key(&cap, entry.key, sizeof(entry.key));
+        have_last = device_cache_find(device_cache, entry.key, &last) == 0;
+    }
 
-            /* Timeout. */
-            tv.tv_sec = 2;
-            tv.tv_usec = 0;
+    // Select video input, video standard and tune here.
 
-            r = select(fd + 1, &fds, NULL, NULL, &tv);
+    CLEAR(cropcap); // clears memory associated with cropcap struct
 
-            if (-1 == r)
-            {
-                if (EINTR == errno)
-                    continue;
-                errno_exit("select");
-            }
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; //set type of cropping operation for video capture
+
+    if (xioctl(cam->fd, VIDIOC_CROPCAP, &cropcap) == 0) //Queries cropping capabilities of device and stores them in cropcap
+    {   // on success enters
+        if (req_roi.width && req_pixelformat != V4L2_PIX_FMT_MJPEG && force_format && set_hw_crop(cam, &cropcap) == 0)
+            cam->hw_crop = 1;
+        else
+        {
+            crop.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+            crop.c = cropcap.defrect; /* reset to default */
 
-            if (0 == r)
+            if (xioctl(cam->fd, VIDIOC_S_CROP, &crop) == -1)
             {
-                fprintf(stderr, "select timeout\n");
-                exit(EXIT_FAILURE);
+                if(errno == EINVAL)
+                    fprintf(stderr, "Cropping not supported\n");
             }
+        }
+    }
+
+    CLEAR(cam->fmt); //clears v4l2 format struct var
+
+    cam->fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE; //set type of video capture
+
+    // Still set up as the last run left it: G_FMT is answered from driver state, S_FMT may go out to the camera
+    CLEAR(cur);
+    cur.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (have_last && xioctl(cam->fd, VIDIOC_G_FMT, &cur) == 0 && pix_matches(&cur.fmt.pix, &last.pix))
+    {
+        cam->fmt = cur;
+        cam->cached_format = 1;
+    }
+    else if (force_format)
+    {
+        // A driver crop is delivered unscaled, the frame is the region of interest
+        cam->fmt.fmt.pix.width       = cam->hw_crop ? req_roi.width : req_width;
+        cam->fmt.fmt.pix.height      = cam->hw_crop ? req_roi.height : req_height;
+        cam->fmt.fmt.pix.pixelformat = req_pixelformat; // YUYV works for Logitech C200/C270
+        cam->fmt.fmt.pix.field       = V4L2_FIELD_NONE;
+
+        if (xioctl(cam->fd, VIDIOC_S_FMT, &cam->fmt) == -1)
+            errno_exit("VIDIOC_S_FMT");
+
+        /* Note VIDIOC_S_FMT may change width and height. */
+    }
+    else
+    {
+        printf("ASSUMING FORMAT\n");
+        /* Preserve original settings as set by v4l2-ctl for example */
+        if (xioctl(cam->fd, VIDIOC_G_FMT, &cam->fmt) == -1)
+            errno_exit("VIDIOC_G_FMT");
+    }
+    entry.pix = cam->fmt.fmt.pix;   // as the driver gave it, before the paranoia below
+
+    pf = find_format(cam->fmt.fmt.pix.pixelformat);
+    if (!pf)
+    {
+        fprintf(stderr, "%s: driver picked unsupported format %.4s\n", cam->dev_name, (char *)&cam->fmt.fmt.pix.pixelformat);
+        exit(EXIT_FAILURE);
+    }
+
+    // Buggy driver paranoia.
+	//precautionary measure for buggy drivers
+	//ensures buffer size (sizeimage) is large enough to hold the captured image data
+	// calculates min req buffer size based on the width, height, and bytes per line, and adjusts bytesperline and sizeimage if necessary.
+	// compressed formats have no lines, sizeimage is the driver's worst case frame
+    if (pf->bytes_per_pixel)
+    {
+        min = cam->fmt.fmt.pix.width * pf->bytes_per_pixel;
+        if (cam->fmt.fmt.pix.bytesperline < min)
+                cam->fmt.fmt.pix.bytesperline = min;
+
+        min = cam->fmt.fmt.pix.bytesperline * cam->fmt.fmt.pix.height;
+        if (cam->fmt.fmt.pix.sizeimage < min)
+                cam->fmt.fmt.pix.sizeimage = min;
+    }
+    else if (cam->fmt.fmt.pix.sizeimage == 0)
+    {
+        fprintf(stderr, "%s: driver reports no frame size for %.4s\n", cam->dev_name, (char *)&cam->fmt.fmt.pix.pixelformat);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s: %ux%u %.4s, %u bytes per line, %u bytes per frame\n", cam->dev_name,
+           cam->fmt.fmt.pix.width, cam->fmt.fmt.pix.height, (char *)&cam->fmt.fmt.pix.pixelformat,
+           cam->fmt.fmt.pix.bytesperline, cam->fmt.fmt.pix.sizeimage);
+
+    set_roi(cam);
+    startup_phase(cam, STARTUP_FORMAT);
+
+    if (req_fps)
+        set_frame_rate(cam, have_last ? &last : NULL);
+    if (camera_fps(cam) > 0)
+        cam->period_ns = (uint64_t)(1e9 / camera_fps(cam));
+    startup_phase(cam, STARTUP_RATE);
 
-            if (read_frame())
+    entry.timeperframe = cam->timeperframe;
+    if (device_cache && force_format && device_cache_put(device_cache, &entry) == -1)
+        fprintf(stderr, "%s: out of memory for the device cache\n", cam->dev_name);
+
+    if (io == IO_METHOD_MMAP)
+    {
+        init_mmap(cam); //initialize memory mapping for video capture (efficient data transfer between user space and device)
+
+        if (export_path && export_buffers(cam) == -1) // zero-copy DMABUF handles for downstream consumers
+        {
+            if (errno == EINVAL || errno == ENOTTY)
             {
-                if(nanosleep(&read_delay, &time_error) != 0)
-                    perror("nanosleep");
-                count--;
-                break;
+                fprintf(stderr, "%s does not support DMABUF export\n", cam->dev_name);
+                exit(EXIT_FAILURE);
             }
-
-            /* EAGAIN - continue select loop unless count done. */
-            if(count <= 0) break;
+            errno_exit("VIDIOC_EXPBUF");
         }
 
-        if(count <= 0) break;
+        // The encoder reads buffers workers hold in place straight from their DMABUF
+        if (encode_device && in_place && !export_path)
+        {
+            cam->exported = export_buffers(cam) == 0;
+            if (!cam->exported)
+                fprintf(stderr, "%s: no DMABUF export, the encoder gets copies\n", cam->dev_name);
+        }
+    }
+    else
+    {
+        init_pool(cam, cam->fmt.fmt.pix.sizeimage); // DMABUF import buffers are exportable as they are
     }
+    startup_phase(cam, STARTUP_BUFFERS);
 }
 
-
 /*************************************************************************
- *                       Stop capturing Function                         *
+ *                      Start capturing Function                         *
  *************************************************************************/
 
+// Queues buffer index to the driver, filling in the memory specific fields; 0 or -1 with errno
+static int queue_buffer(struct camera *cam, unsigned int index)
+{
+        struct v4l2_buffer buf;
+
+        CLEAR(buf);
+        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = io_memory();
+        buf.index  = index;
+
+        if (io == IO_METHOD_USERPTR)
+        {
+            buf.m.userptr = (unsigned long)cam->buffers[index].start;
+            buf.length    = cam->buffers[index].length;
+        }
+        else if (io == IO_METHOD_DMABUF)
+        {
+            buf.m.fd   = cam->buffers[index].dmabuf_fd;
+            buf.length = cam->buffers[index].length;
+        }
+
+        if (xioctl(cam->fd, VIDIOC_QBUF, &buf) == -1) //request to enqueue the buffer for video capture
+            return -1;
+        cam->buffers[index].queued = 1;
+        cam->queued++;
+        return 0;
+}
+
 /**
- * @name   stop_capturing
- * @brief  Initializes video capture device
- * @param  none
- * 
- * @descr  Stops video stream
+ * @name   camera_failed
+ * @brief  Notes that an ioctl on a streaming camera failed, the main loop then recovers it
+ * @param  cam  - camera
+ *         what - what failed, a string literal; errno says why
  *
  * @return none
  */
- 
-static void stop_capturing()
+
+static void camera_failed(struct camera *cam, const char *what)
 {
-        enum v4l2_buf_type type; // buffer type for streaming
+        if (cam->fail_what)
+            return;     // the first failure is the one that counts
+        cam->fail_what  = what;
+        cam->fail_errno = errno;
+}
 
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // sets type as video capture
-        if (xioctl(fd, VIDIOC_STREAMOFF, &type) == -1) // request to stop video stream
-            errno_exit("VIDIOC_STREAMOFF");
+// Hands a released buffer back to the driver; while recovering it waits for the restart
+static void requeue(struct camera *cam, unsigned int index)
+{
+        if (cam->state != CAMERA_STREAMING || cam->fail_what || cam->buffers[index].queued)
+            return;
+        if (queue_buffer(cam, index) == -1)
+            camera_failed(cam, "VIDIOC_QBUF");
 }
 
-/*************************************************************************
- *                        UnInit Device Function                         *
- *************************************************************************/
+/**
+ * @name   put_buffer
+ * @brief  Drops a reference to a dequeued capture buffer, the last one re-queues it
+ * @param  cam   - camera
+ *         index - buffer
+ *
+ * @descr  Capture thread only, it owns the queue; other threads use return_buffer
+ *
+ * @return none
+ */
+
+static void put_buffer(struct camera *cam, unsigned int index)
+{
+        if (atomic_fetch_sub_explicit(&cam->buffers[index].refs, 1, memory_order_acq_rel) == 1)
+            requeue(cam, index);
+}
 
 /**
- * @name   uninit_device
- * @brief  Uninitializes video capture device
- * @param  none
- * 
- * @descr  Avoids mem leak by releasing allocated memory
+ * @name   return_buffer
+ * @brief  put_buffer() for any thread, e.g. a sink done with a frame it read in place
+ * @param  cam   - camera
+ *         index - buffer
+ *
+ * @descr  The last reference marks the buffer in cam->returned and wakes the
+ *         main loop through return_fd, which queues everything marked
  *
  * @return none
  */
- 
-static void uninit_device()
+
+static void return_buffer(struct camera *cam, unsigned int index)
 {
-        unsigned int i;
-		//munmap function deallocates memory region mapped by mmap, which was used for memory mapping the device buffers
+        uint64_t one = 1;
 
-        for (i = 0; i < n_buffers; ++i) // iterates over each buffer allocated during init phase
-            if (munmap(buffers[i].start, buffers[i].length) == -1) // munmap function to unmap the memory associated with each buffer
-                errno_exit("munmap");
-			
-        free(buffers); //After unmapping all buffers, frees memory allocated for array of buffer structs
+        if (atomic_fetch_sub_explicit(&cam->buffers[index].refs, 1, memory_order_acq_rel) != 1)
+            return;
+
+        atomic_fetch_or_explicit(&cam->returned, 1ULL << index, memory_order_release);
+        if (write(cam->return_fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            log_error("%s: return_fd write failed, %s", cam->dev_name, strerror(errno));
 }
 
-/*************************************************************************
- *                          Close Device Function                         *
- *************************************************************************/
+// Main loop side of return_buffer
+static void requeue_returned(struct camera *cam)
+{
+        uint64_t returned, count;
+        unsigned int i;
+
+        if (read(cam->return_fd, &count, sizeof(count)) == -1)
+            return;
+
+        returned = atomic_exchange_explicit(&cam->returned, 0, memory_order_acquire);
+        for (i = 0; returned; i++, returned >>= 1)
+            if (returned & 1)
+                requeue(cam, i);
+}
 
 /**
- * @name   close_device
- * @brief  Closes camera device named dev_name
- * @param  none
+ * @name   start_capturing
+ * @brief  Prepares device for video capture bu queueing buffers for capturing and starting video stream
+ * @param  cam - camera
  * 
- * @descr  Close camera device pointed to by fd
- *         Set fd as -1 to not accidentally use file after closure
+ * @descr  Queues buffers
+ *         Starts video stream
  *
  * @return none
  */
- 
-static void close_device()
+
+static void start_capturing(struct camera *cam)
 {
-        if (close(fd) == -1) // check status of closing fd = camera device
-		{
-            errno_exit("close");
-		}
-        fd = -1; //set fd to -1, so fd is not accidentally used after closure
-}
+        unsigned int i;
+        enum v4l2_buf_type type; // buffer type for streaming
+
+        for (i = 0; i < cam->n_buffers; ++i) //iterates over each buffer allocated during initialization
+            if (queue_buffer(cam, i) == -1)
+                errno_exit("VIDIOC_QBUF");
+		
+		//After queuing all buffers, sets the type variable to V4L2_BUF_TYPE_VIDEO_CAPTURE to specify the buffer type for streaming
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        if (xioctl(cam->fd, VIDIOC_STREAMON, &type) == -1) //request to start streaming video
+            errno_exit("VIDIOC_STREAMON");
 
+        cam->remaining = frame_count > 0 ? frame_count : INT_MAX; // 0: until stopped
+        clock_gettime(CLOCK_MONOTONIC, &cam->last_frame); // stall clock starts with the stream
+}
 
 /*************************************************************************
- *                                 Main Function                         *
+ *         Frame Sinks fed by the Image Processing Pipeline              *
  *************************************************************************/
  
-int main(int argc, char **argv)
+ /**
+ * @name   disk_sink
+ * @brief  Queues a processed frame to be written as a PPM (or PGM) file
+ * @param  ctx - camera
+ *         b   - frame, with the header the ppm-header stage built
+ *
+ * @descr  Header and payload go to the asynchronous frame writer as one
+ *         vectored write, so neither the capture thread nor the worker
+ *         waits on open/write/close
+ *         The sink holds a reference to b until dump_done, so the writer
+ *         reads the buffer in place, even a capture frame nothing copied
+ *
+ * @return none
+ */
+ 
+static const char ppm_header_fmt[]="P6\n#%010lu sec %010lu msec \n%u %u\n255\n";
+static const char pgm_header_fmt[]="P5\n#%010lu sec %010lu msec \n%u %u\n255\n";
+// Same names the old snprintf over "frames/test00000000.ppm" at offset 4 produced
+static const char ppm_dumpname[]="fram%08u.ppm";
+static const char pgm_dumpname[]="fram%08u.pgm";
+static const char jpg_dumpname[]="fram%08u.jpg";
+static const char raw_dumpname[]="fram%%08u.%s";    // other --output layouts, headerless, named after the layout
+
+// V4L2 fourcc and convert stage name of each enum yuv_output
+static const unsigned int output_fourcc[YUV_OUTPUTS] = {
+        V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_BGR24, V4L2_PIX_FMT_RGBA32, V4L2_PIX_FMT_ABGR32,
+        V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_YUV420,
+};
+static const char *output_stage_names[YUV_OUTPUTS] = {
+        "yuyv-rgb24", "yuyv-bgr24", "yuyv-rgba", "yuyv-bgra", "yuyv-nv12", "yuyv-i420",
+};
+
+// Writer completion callback, runs on a writer thread
+static void dump_done(void *ctx, int error)
 {
-	//argv[0] = name of program itself
-    if(argc > 1)
-        dev_name = argv[1]; // video device name provided in CLI
+    struct pipe_buf *b = ctx;
+    struct worker *w = b->owner;
+    struct frame_stats *stats = w->cam->stats;
+    uint64_t now = stats_now_ns();
+
+    if (error)
+        log_error("%s frame %u: write failed, %s", w->cam->dev_name, b->tag, strerror(error));
     else
-        dev_name = "/dev/video0";
-	
-	printf("Starting camera driver...\n");
-    open_device();
-	printf("Camera device opened...\n");
-    init_device();
-	printf("Initialized device...\n");
-	
-    start_capturing();
-    mainloop();
-    stop_capturing();
-	
-    uninit_device();
-	printf("Uninitialized device...\n");
-    close_device();
-	printf("Closed device...\n");
+    {
+        log_frame("%s frame %u: wrote %zu bytes", w->cam->dev_name, b->tag, b->size);
+        frame_stats_record(stats, STAT_WRITE, now - b->sink_ns);
+        frame_stats_record(stats, STAT_TOTAL, now - b->capture_ns);
+        frame_stats_written(stats, b->size);
+    }
+
+    pipe_buf_put(b);
+}
+
+static void disk_sink(void *ctx, struct pipe_buf *b)
+{
+    struct camera *cam = ctx;
+
+    pipe_buf_get(b);
+    if (cam->stream)
+    {
+        if (frame_stream_submit(cam->stream, b->tag, b->sequence, b->capture_ns,
+                                b->header, b->header_len, b->data, b->size, dump_done, b) == -1)
+        {
+            log_error("%s frame %u: frame_stream_submit failed, %s", cam->dev_name, b->tag, strerror(errno));
+            pipe_buf_put(b);
+        }
+    }
+    else if (frame_writer_submit(cam->writer, b->tag, b->header, b->header_len, b->data, b->size, dump_done, b) == -1)
+    {
+        log_error("%s frame %u: frame_writer_submit failed, %s", cam->dev_name, b->tag, strerror(errno));
+        pipe_buf_put(b);
+    }
+}
+
+// Copies the frame into the --shm ring, nothing is held
+static void shm_sink(void *ctx, struct pipe_buf *b)
+{
+    struct camera *cam = ctx;
+
+    frame_shm_publish(cam->shm, b->tag, b->sequence, b->capture_ns, b->header, b->header_len, b->data, b->size);
+}
+
+// Network sender callback, runs on its thread once no client needs b
+static void net_done(void *ctx, int error)
+{
+    pipe_buf_put(ctx);
+}
+
+// The sender reads b in place; not taken when nobody is connected or every send slot is in flight
+static void net_sink(void *ctx, struct pipe_buf *b)
+{
+    struct camera *cam = ctx;
+
+    pipe_buf_get(b);
+    if (frame_net_submit(cam->net, b->tag, b->sequence, b->capture_ns,
+                         b->header, b->header_len, b->data, b->size, net_done, b) == -1)
+        pipe_buf_put(b);
+}
+
+// Encoder callback once it has read b: before submit returns if it copied it, on its thread if it imported it
+static void encoder_done(void *ctx, int error)
+{
+    pipe_buf_put(ctx);
+}
+
+// Hands the frame, or its DMABUF with --in-place, to the encoder; a frame it has no room for is lost
+static void encoder_sink(void *ctx, struct pipe_buf *b)
+{
+    struct camera *cam = ctx;
+
+    pipe_buf_get(b);
+    if (frame_encoder_submit(cam->encoder, b->tag, b->sequence, b->capture_ns,
+                             b->data, b->size, b->dmabuf_fd, encoder_done, b) == -1)
+    {
+        log_warn("%s frame %u: not encoded, %s", cam->dev_name, b->tag, strerror(errno));
+        pipe_buf_put(b);
+    }
+}
+
+// Writer completion callback for an access unit, runs on a writer thread
+static void coded_done(void *ctx, int error)
+{
+    struct coded_write *c = ctx;
+    struct camera *cam = c->cam;
+
+    if (error)
+        log_error("%s frame %u: write failed, %s", cam->dev_name, c->tag, strerror(error));
+    else
+    {
+        log_frame("%s frame %u: wrote %zu bytes encoded", cam->dev_name, c->tag, c->size);
+        frame_stats_record(cam->stats, STAT_TOTAL, stats_now_ns() - c->capture_ns);
+        frame_stats_written(cam->stats, c->size);
+    }
+
+    frame_encoder_release(cam->encoder, c->index);
+}
+
+// Encoder thread: every access unit becomes one container record, under the tag of its frame
+static void encoded_out(void *ctx, const struct encoded_frame *f)
+{
+    struct camera *cam = ctx;
+    struct coded_write *c = &cam->coded[f->index];
+
+    c->cam        = cam;
+    c->index      = f->index;
+    c->tag        = f->tag;
+    c->size       = f->size;
+    c->capture_ns = f->capture_ns;
+    if (frame_stream_submit(cam->stream, f->tag, f->sequence, f->capture_ns,
+                            NULL, 0, f->data, f->size, coded_done, c) == -1)
+    {
+        log_error("%s frame %u: frame_stream_submit failed, %s", cam->dev_name, f->tag, strerror(errno));
+        frame_encoder_release(cam->encoder, f->index);
+    }
+}
+
+/**
+ * @name   start_encoder
+ * @brief  Opens the --encode device for the camera's negotiated format
+ * @param  cam - camera, capture buffers set up
+ *
+ * @descr  Only whole yuyv frames are encoded. With --in-place and
+ *         capture buffers that have a DMABUF fd the encoder imports them;
+ *         otherwise it copies each frame into its own buffers. Key frames
+ *         come about once a second
+ *
+ * @return none
+ */
+
+static void start_encoder(struct camera *cam)
+{
+    struct frame_encoder_config cfg;
+    double fps = camera_fps(cam);
+
+    if (cam->fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV ||
+        cam->out_width != cam->fmt.fmt.pix.width || cam->out_height != cam->fmt.fmt.pix.height)
+    {
+        fprintf(stderr, "%s: --encode needs whole yuyv frames, got %s %ux%u\n", cam->dev_name,
+                format_name(cam->fmt.fmt.pix.pixelformat), cam->out_width, cam->out_height);
+        exit(EXIT_FAILURE);
+    }
+
+    CLEAR(cfg);
+    cfg.device      = encode_device;
+    cfg.codec       = encode_codec;
+    cfg.width       = cam->fmt.fmt.pix.width;
+    cfg.height      = cam->fmt.fmt.pix.height;
+    cfg.stride      = cam->fmt.fmt.pix.bytesperline;
+    cfg.fps_num     = cam->timeperframe.numerator;
+    cfg.fps_den     = cam->timeperframe.denominator;
+    cfg.bitrate     = encode_bitrate;
+    cfg.gop         = fps > 0 ? (unsigned int)(fps + 0.5) : 30;
+    cfg.import      = in_place && cam->buffers[0].dmabuf_fd != -1;
+    cfg.import_size = cam->buffers[0].length;
+
+    cam->encoder = frame_encoder_create(&cfg, encoded_out, cam);
+    if (!cam->encoder)
+        errno_exit(encode_device);
+    printf("%s: ", cam->dev_name);
+    frame_encoder_describe(cam->encoder, stdout);
+}
+
+// With --no-disk a frame is out once the sinks before this one have it
+static void published_sink(void *ctx, struct pipe_buf *b)
+{
+    struct camera *cam = ctx;
+
+    log_frame("%s frame %u: published %zu bytes", cam->dev_name, b->tag, b->size);
+    frame_stats_record(cam->stats, STAT_TOTAL, b->sink_ns - b->capture_ns);
+    frame_stats_written(cam->stats, b->size);
+}
+
+/*************************************************************************
+ *                   Pipeline Buffers and Stages                         *
+ *************************************************************************/
+
+// Last reference to an output buffer gone, on whichever thread dropped it
+static void release_out_buffer(struct pipe_buf *b)
+{
+    struct out_buffer *ob = (struct out_buffer *)b;
+    struct worker *w = ob->w;
+
+    pthread_mutex_lock(&w->out_lock);
+    ob->busy = 0;
+    pthread_cond_signal(&w->out_cond);
+    pthread_mutex_unlock(&w->out_lock);
+}
+
+// Last reference to a source frame gone: back to the ring, its capture buffer back to the driver
+static void release_source(struct pipe_buf *b)
+{
+    struct ring_source *src = (struct ring_source *)b;
+    struct worker *w = src->w;
+    int buffer = src->f->buffer;
+
+    src->f->buffer = -1;
+    frame_ring_release(w->ring, src->f);
+    if (buffer >= 0)
+        return_buffer(w->cam, buffer);
+
+    pthread_mutex_lock(&w->out_lock);
+    w->sources_out--;
+    pthread_cond_signal(&w->out_cond);
+    pthread_mutex_unlock(&w->out_lock);
+}
+
+/**
+ * @name   get_out_buffer
+ * @brief  Pipeline allocator: takes an idle output buffer from the worker, waiting if all are queued
+ * @param  ctx - worker
+ *
+ * @descr  Waiting here is the back-pressure from a slow disk; it stalls this
+ *         worker only, the capture thread applies the ring policy
+ *
+ * @return output buffer holding one reference
+ */
+
+static struct pipe_buf *get_out_buffer(void *ctx)
+{
+    struct worker *w = ctx;
+    struct out_buffer *ob = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&w->out_lock);
+    while (!ob)
+    {
+        for (i = 0; i < OUT_BUFFERS && !ob; i++)
+            if (!w->out[i].busy)
+                ob = &w->out[i];
+
+        if (!ob)
+            pthread_cond_wait(&w->out_cond, &w->out_lock);
+    }
+    ob->busy = 1;
+    pthread_mutex_unlock(&w->out_lock);
+
+    atomic_store_explicit(&ob->buf.refs, 1, memory_order_relaxed);
+    return &ob->buf;
+}
+
+/*************************************************************************
+ *          Image Processing Function called in Read_frame               *
+ *************************************************************************/
+ 
+ /**
+ * @name   start_capturing
+ * @brief  Prepares device for video capture bu queueing buffers for capturing and starting video stream
+ * @param  none
+ * 
+ * @descr  Queues buffers
+ *         Starts video stream
+ *
+ * @return none
+ */
+
+// Output row r of the region of interest as YUYV, decimated into scratch if need be
+static const unsigned char *yuyv_roi_row(const struct camera *cam, const unsigned char *roi, unsigned int bpl,
+                                         unsigned int r, unsigned char *scratch)
+{
+    const unsigned char *src = roi + (size_t)r * cam->decimate * bpl;
+
+    if (cam->decimate == 1)
+        return src;
+
+    yuyv_decimate_row(src, scratch, cam->out_width, cam->decimate);
+    return scratch;
+}
+
+// One YUYV frame's conversion, shared by the bands it is split into
+struct convert_job
+{
+        struct worker          *w;
+        const unsigned char    *roi;            // first pixel of the region in the frame
+        unsigned int            bpl;
+        unsigned int            rows;           // output rows with source lines in the frame
+        unsigned char          *dst;
+        int                     contiguous;     // region is one span, no padding or decimation
+};
+
+/**
+ * @name   convert_planar_band
+ * @brief  Converts one row band of a YUYV frame to NV12 or I420
+ * @param  job        - frame being converted
+ *         band/bands - this band, out of
+ *
+ * @descr  Bands start on even rows so each owns whole chroma lines; the
+ *         kernel reads a line pair once and writes both Y lines and their
+ *         chroma line. A frame cut short on an odd row pairs its last line
+ *         with itself
+ *
+ * @return none
+ */
+
+static void convert_planar_band(const struct convert_job *job, unsigned int band, unsigned int bands)
+{
+    const struct camera *cam = job->w->cam;
+    unsigned int width = cam->out_width;
+    unsigned int r0 = ((uint64_t)job->rows * band / bands) & ~1u;
+    unsigned int r1 = band + 1 == bands ? job->rows : ((uint64_t)job->rows * (band + 1) / bands) & ~1u;
+    size_t luma = (size_t)width * cam->out_height;
+    unsigned char *u = job->dst + luma;
+    unsigned char *v = u + luma / 4;            // I420 only
+    size_t chroma_bpl = cam->output == YUV_OUTPUT_NV12 ? width : width / 2;
+    unsigned char *scratch = job->w->row ? job->w->row + (size_t)band * width * 4 : NULL;
+    unsigned int r;
+
+    for (r = r0; r < r1; r += 2)
+    {
+        const unsigned char *a = yuyv_roi_row(cam, job->roi, job->bpl, r, scratch);
+        const unsigned char *b = a;
+        unsigned char *ya = job->dst + (size_t)r * width;
+
+        if (r + 1 < r1)
+            b = yuyv_roi_row(cam, job->roi, job->bpl, r + 1, scratch ? scratch + width * 2 : NULL);
+
+        cam->planar(a, b, ya, r + 1 < r1 ? ya + width : ya, u + (size_t)(r / 2) * chroma_bpl,
+                    v + (size_t)(r / 2) * chroma_bpl, width);
+    }
+}
+
+/**
+ * @name   convert_band
+ * @brief  Converts one row band of a YUYV frame to the output layout, or luma with --gray
+ * @param  arg        - struct convert_job
+ *         band/bands - this band, out of
+ *
+ * @descr  Band b covers output rows [b * rows / bands, (b + 1) * rows / bands)
+ *         and has its own decimation rows, so bands share nothing but the job
+ *
+ * @return none
+ */
+
+static void convert_band(void *arg, unsigned int band, unsigned int bands)
+{
+    const struct convert_job *job = arg;
+    const struct camera *cam = job->w->cam;
+    unsigned int width = cam->out_width;
+    unsigned int r0 = (uint64_t)job->rows * band / bands;
+    unsigned int r1 = (uint64_t)job->rows * (band + 1) / bands;
+    size_t out_bpl = cam->gray ? width : yuv_output_bytes(cam->output, width, 1);
+    unsigned char *scratch = job->w->row ? job->w->row + (size_t)band * width * 4 : NULL;
+    unsigned int r;
+
+    if (cam->planar)
+    {
+        convert_planar_band(job, band, bands);
+        return;
+    }
+
+    if (job->contiguous)
+    {
+        cam->convert(job->roi + (size_t)r0 * job->bpl, job->dst + r0 * out_bpl, (size_t)(r1 - r0) * job->bpl);
+        return;
+    }
+
+    // skip the driver's line padding and anything outside the region
+    for (r = r0; r < r1; r++)
+        cam->convert(yuyv_roi_row(cam, job->roi, job->bpl, r, scratch), job->dst + r * out_bpl, width * 2);
+}
+
+// Converts a YUYV frame into dst, split over the worker's bands when it has them
+static void convert_yuyv(struct worker *w, const unsigned char *frame, unsigned int rows, unsigned char *dst)
+{
+    struct camera *cam = w->cam;
+    struct convert_job job;
+
+    job.w    = w;
+    job.bpl  = cam->fmt.fmt.pix.bytesperline;
+    job.roi  = frame + (size_t)cam->roi.top * job.bpl + (size_t)cam->roi.left * 2;
+    job.rows = rows;
+    job.dst  = dst;
+    job.contiguous = cam->decimate == 1 && cam->roi.width == cam->fmt.fmt.pix.width &&
+                     job.bpl == cam->out_width * 2;
+
+    if (w->bands)
+        band_pool_run(w->bands, convert_band, &job);   // returns once every band is done
+    else
+        convert_band(&job, 0, 1);
+}
+
+// Output rows with source lines in a frame of size bytes, only the region's lines are read
+static unsigned int roi_rows(const struct camera *cam, size_t size)
+{
+    unsigned int bpl = cam->fmt.fmt.pix.bytesperline;
+    unsigned int rows = bpl ? size / bpl : 0;
+    unsigned int step = cam->decimate;
+
+    rows = rows > (unsigned int)cam->roi.top ? (rows - cam->roi.top + step - 1) / step : 0;
+    return rows > cam->out_height ? cam->out_height : rows;
+}
+
+// YUYV region of interest to the output layout, or to luma only with --gray
+static int convert_stage(void *ctx, struct pipe_buf *in, struct pipe_buf *out)
+{
+    struct worker *w = ctx;
+    struct camera *cam = w->cam;
+    uint64_t start = stats_now_ns();
+
+    // Grayscale only needs the Y bytes: a strided gather, no YUV->RGB math
+    // and a third of the RGB24 output to write
+    // Only the region of interest is converted, decimated rows while still in L1,
+    // in parallel row bands with --bands; vectorized kernel picked at startup, see yuv_convert.c
+    convert_yuyv(w, in->data, roi_rows(cam, in->size), out->data);
+    frame_stats_record(cam->stats, STAT_CONVERT, stats_now_ns() - start);
+
+    out->width  = cam->out_width;
+    out->height = cam->out_height;
+    out->size   = cam->gray ? (size_t)cam->out_width * cam->out_height
+                            : yuv_output_bytes(cam->output, cam->out_width, cam->out_height);
+    return 0;
+}
+
+// RGB24 region of interest copied out of the frame, decimated or with the line padding dropped
+static int rgb24_roi_stage(void *ctx, struct pipe_buf *in, struct pipe_buf *out)
+{
+    struct worker *w = ctx;
+    struct camera *cam = w->cam;
+    unsigned int width = cam->out_width;
+    unsigned int bpl = cam->fmt.fmt.pix.bytesperline;
+    unsigned int step = cam->decimate;
+    unsigned int rows = roi_rows(cam, in->size), r, x;
+    const unsigned char *pptr = in->data + (size_t)cam->roi.top * bpl + (size_t)cam->roi.left * 3;
+    uint64_t start = stats_now_ns();
+
+    if (step == 1)
+        for (r = 0; r < rows; r++)
+            memcpy(out->data + (size_t)r * width * 3, pptr + (size_t)r * bpl, width * 3);
+    else
+        for (r = 0; r < rows; r++)
+            for (x = 0; x < width; x++)
+                memcpy(out->data + ((size_t)r * width + x) * 3, pptr + (size_t)r * step * bpl + (size_t)x * step * 3, 3);
+    frame_stats_record(cam->stats, STAT_CONVERT, stats_now_ns() - start);
+
+    out->width  = width;
+    out->height = cam->out_height;
+    out->size   = (size_t)width * cam->out_height * 3;
+    return 0;
+}
+
+// RGB24 region of whole, unpadded lines: the sinks read it where it lies in the frame
+static int rgb24_view_stage(void *ctx, struct pipe_buf *in, struct pipe_buf *out)
+{
+    struct worker *w = ctx;
+    struct camera *cam = w->cam;
+
+    in->data  += (size_t)cam->roi.top * cam->fmt.fmt.pix.bytesperline;
+    in->width  = cam->out_width;
+    in->height = cam->out_height;
+    in->size   = (size_t)cam->out_width * cam->out_height * 3;
+    in->dmabuf_fd = -1;         // data no longer starts the buffer
+    return 0;
+}
+
+// Only when pixels are wanted: libjpeg-turbo decodes straight into the PPM payload
+static int mjpeg_decode_stage(void *ctx, struct pipe_buf *in, struct pipe_buf *out)
+{
+    struct worker *w = ctx;
+    struct camera *cam = w->cam;
+    uint64_t start = stats_now_ns();
+
+    if (mjpeg_decode_rgb24(w->decoder, in->data, in->size, out->data, cam->out_width, cam->out_height) == -1)
+    {
+        log_warn("%s frame %u: corrupt MJPEG frame, %zu bytes", cam->dev_name, in->tag, in->size);
+        return -1;
+    }
+    frame_stats_record(cam->stats, STAT_CONVERT, stats_now_ns() - start);
+
+    out->width  = cam->out_width;
+    out->height = cam->out_height;
+    out->size   = (size_t)cam->out_width * cam->out_height * 3;
+    return 0;
+}
+
+// Compressed frame goes out as a .jpg, no header and no conversion
+static int mjpeg_stage(void *ctx, struct pipe_buf *in, struct pipe_buf *out)
+{
+    return 0;
+}
+
+/**
+ * @name   header_stage
+ * @brief  Builds the PPM (or PGM) header of a frame ahead of its pixels
+ * @param  ctx - worker
+ *         b   - frame, in place
+ *
+ * @descr  Carries the frame's timestamp and size; fixed-width fields keep
+ *         it ppm_header_len long
+ *
+ * @return 0
+ */
+
+static int header_stage(void *ctx, struct pipe_buf *b, struct pipe_buf *out)
+{
+    b->header_len = snprintf(b->header, sizeof(b->header),
+                             b->pixelformat == V4L2_PIX_FMT_GREY ? pgm_header_fmt : ppm_header_fmt,
+                             (unsigned long)b->time.tv_sec, (unsigned long)(b->time.tv_nsec / 1000000),
+                             b->width, b->height);
+    return 0;
+}
+
+/**
+ * @name   build_pipeline
+ * @brief  Puts together a worker's stages for the camera's format and its sinks for the options given
+ * @param  w - worker
+ *
+ * @descr  yuyv:  convert -> header, no header for --output other than rgb24
+ *         rgb24: roi copy or view -> header
+ *         mjpeg: decode -> header with --decode, else nothing at all
+ *         Sinks: disk unless --no-disk, then shm and net when asked for
+ *         --encode: no stage, the encoder is the only sink
+ *         A pipeline that never copies leaves the ring frame itself with
+ *         the sinks, which is why the ring is sized after this
+ *
+ * @return none
+ */
+
+static void build_pipeline(struct worker *w)
+{
+    struct camera *cam = w->cam;
+    unsigned int format = cam->fmt.fmt.pix.pixelformat;
+    struct pipe_stage stage = { .ctx = w };
+    struct pipe_sink sink = { .ctx = cam };
+    int ok = 1;
+
+    w->pipe = pipeline_create(format, get_out_buffer, w);
+    if (!w->pipe)
+        errno_exit("pipeline_create");
+
+    if (cam->encoder)
+    {
+        sink.name    = "encoder";
+        sink.consume = encoder_sink;
+        if (pipeline_add_sink(w->pipe, &sink) == -1)
+            errno_exit("build_pipeline");
+        return;
+    }
+
+    stage.in_format = format;
+    if (format == V4L2_PIX_FMT_YUYV)
+    {
+        stage.name       = cam->gray ? "yuyv-luma" : output_stage_names[cam->output];
+        stage.out_format = cam->gray ? V4L2_PIX_FMT_GREY : output_fourcc[cam->output];
+        stage.run        = convert_stage;
+    }
+    else if (format == V4L2_PIX_FMT_RGB24 && cam->decimate == 1 &&
+             cam->roi.width == cam->fmt.fmt.pix.width &&
+             cam->fmt.fmt.pix.bytesperline == cam->out_width * 3)
+    {
+        stage.name       = "rgb24-view";
+        stage.in_place   = 1;
+        stage.run        = rgb24_view_stage;
+    }
+    else if (format == V4L2_PIX_FMT_RGB24)
+    {
+        stage.name       = "rgb24-roi";
+        stage.run        = rgb24_roi_stage;
+    }
+    else if (w->decoder)
+    {
+        stage.name       = "mjpeg-rgb24";
+        stage.out_format = V4L2_PIX_FMT_RGB24;
+        stage.run        = mjpeg_decode_stage;
+    }
+    else
+    {
+        stage.name       = "mjpeg";
+        stage.in_place   = 1;
+        stage.run        = mjpeg_stage;
+    }
+    ok = pipeline_add_stage(w->pipe, &stage) == 0;
+
+    if (ok && cam->ppm_header_len)
+    {
+        memset(&stage, 0, sizeof(stage));
+        stage.name     = "ppm-header";
+        stage.in_place = 1;
+        stage.run      = header_stage;
+        stage.ctx      = w;
+        ok = pipeline_add_stage(w->pipe, &stage) == 0;
+    }
+
+    if (ok && !no_disk)
+    {
+        sink.name    = cam->stream ? "stream" : "disk";
+        sink.consume = disk_sink;
+        ok = pipeline_add_sink(w->pipe, &sink) == 0;
+    }
+    if (ok && cam->shm)
+    {
+        sink.name    = "shm";
+        sink.consume = shm_sink;
+        ok = pipeline_add_sink(w->pipe, &sink) == 0;
+    }
+    if (ok && cam->net)
+    {
+        sink.name    = "net";
+        sink.consume = net_sink;
+        ok = pipeline_add_sink(w->pipe, &sink) == 0;
+    }
+    if (ok && no_disk)
+    {
+        sink.name    = "published";
+        sink.consume = published_sink;
+        ok = pipeline_add_sink(w->pipe, &sink) == 0;
+    }
+    if (!ok)
+        errno_exit("build_pipeline");
+}
+
+/**
+ * @name   process_image
+ * @brief  Runs one consumed ring frame through the worker's pipeline
+ * @param  w - worker
+ *         f - frame, back to the ring once the pipeline and every sink holding it let go
+ *
+ * @descr  At most OUT_BUFFERS frames are out with the sinks at a time, the
+ *         extra frames the ring was given for that; beyond, the worker waits
+ *         here as it does for an output buffer
+ *
+ * @return none
+ */
+
+static void process_image(struct worker *w, struct frame *f)
+{
+    struct camera *cam = w->cam;
+    struct ring_source *src = &w->src[f - w->ring->frames];
+    struct pipe_buf *b = &src->buf;
+
+    pthread_mutex_lock(&w->out_lock);
+    while (w->sources_out >= OUT_BUFFERS)
+        pthread_cond_wait(&w->out_cond, &w->out_lock);
+    w->sources_out++;
+    pthread_mutex_unlock(&w->out_lock);
+
+    src->f         = f;
+    b->data        = f->buffer >= 0 ? cam->buffers[f->buffer].start : f->data;
+    b->capacity    = f->buffer >= 0 ? cam->buffers[f->buffer].length : w->ring->capacity;
+    b->size        = f->size;
+    b->pixelformat = cam->fmt.fmt.pix.pixelformat;
+    b->width       = cam->fmt.fmt.pix.width;
+    b->height      = cam->fmt.fmt.pix.height;
+    b->tag         = f->tag;
+    b->sequence    = f->sequence;
+    b->capture_ns  = f->capture_ns;
+    b->time        = f->time;
+    b->header_len  = 0;
+    b->dmabuf_fd   = f->buffer >= 0 ? cam->buffers[f->buffer].dmabuf_fd : -1;
+    atomic_store_explicit(&b->refs, 1, memory_order_relaxed);
+
+    // This just dumps the frame to a file now, but you could add
+    // whatever image processing you wish as a stage, see build_pipeline()
+    // Nothing is printed here; sinks log a line per frame with --verbose
+    pipeline_run(w->pipe, b);
+}
+
+/*************************************************************************
+ *                      Real-Time Setup Functions                        *
+ *************************************************************************/
+
+/**
+ * @name   parse_cpu_list
+ * @brief  Parses a CPU list such as "2,3" or "1-3,6"
+ * @param  list - text
+ *         cpus - parsed CPUs, in order
+ *         max  - room in cpus
+ *
+ * @return number of CPUs, -1 if malformed
+ */
+
+static int parse_cpu_list(const char *list, int *cpus, unsigned int max)
+{
+        unsigned int n = 0;
+        long first, last;
+        char *end;
+
+        do
+        {
+                first = strtol(list, &end, 10);
+                if (end == list || first < 0)
+                        return -1;
+                last = first;
+                if (*end == '-')
+                {
+                        list = end + 1;
+                        last = strtol(list, &end, 10);
+                        if (end == list || last < first)
+                                return -1;
+                }
+                for (; first <= last; first++)
+                {
+                        if (n == max)
+                                return -1;
+                        cpus[n++] = first;
+                }
+                list = end + 1;
+        } while (*end == ',');
+
+        return *end ? -1 : (int)n;
+}
+
+// Pins thread to cpu, a warning is all a failure costs
+static void pin_thread(pthread_t thread, int cpu, const char *what)
+{
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        errno = pthread_setaffinity_np(thread, sizeof(set), &set);
+        if (errno)
+                fprintf(stderr, "Could not pin %s to CPU %d: %s\n", what, cpu, strerror(errno));
+}
+
+// Touches every page of len bytes at p, writing if the contents don't matter yet
+static void prefault(void *p, size_t len, int write)
+{
+        volatile unsigned char *c = p;
+        size_t page = sysconf(_SC_PAGESIZE), i;
+
+        for (i = 0; i < len; i += page)
+        {
+                if (write)
+                        c[i] = 0;
+                else
+                        (void)c[i];
+        }
+}
+
+// Faults in the capture thread's stack before it has to meet deadlines
+static void prefault_stack(void)
+{
+        volatile unsigned char stack[PREFAULT_STACK];
+        size_t page = sysconf(_SC_PAGESIZE), i;
+
+        for (i = 0; i < sizeof(stack); i += page)
+                stack[i] = 0;
+}
+
+/**
+ * @name   start_realtime
+ * @brief  Makes the calling thread the real-time capture thread
+ * @param  none
+ *
+ * @descr  Called once every other thread exists, as threads inherit the
+ *         creator's policy and CPU mask: workers, writers and helpers keep
+ *         SCHED_OTHER and the full mask unless pinned themselves
+ *         With --mlock, memory was locked at startup (future faults too);
+ *         this faults in the capture buffers and the stack so the first
+ *         frames don't take page faults
+ *         Failure to get SCHED_FIFO (no CAP_SYS_NICE / RLIMIT_RTPRIO) is fatal,
+ *         the deadline report would be meaningless otherwise
+ *
+ * @return none
+ */
+
+static void start_realtime(void)
+{
+        struct sched_param param;
+        unsigned int i, j;
+
+        if (lock_memory)
+        {
+                for (i = 0; i < n_cameras; i++)
+                        for (j = 0; j < cameras[i].n_buffers; j++)
+                                prefault(cameras[i].buffers[j].start, cameras[i].buffers[j].length, 0);
+                prefault_stack();
+        }
+
+        if (capture_cpu >= 0)
+                pin_thread(pthread_self(), capture_cpu, "capture thread");
+
+        if (rt_priority)
+        {
+                CLEAR(param);
+                param.sched_priority = rt_priority;
+                errno = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+                if (errno)
+                        errno_exit("SCHED_FIFO");
+        }
+
+        if (rt_priority)
+                printf("Capture thread: SCHED_FIFO priority %d\n", rt_priority);
+        if (capture_cpu >= 0)
+                printf("Capture thread: pinned to CPU %d\n", capture_cpu);
+}
+
+/*************************************************************************
+ *                     Processing Worker Functions                       *
+ *************************************************************************/
+
+/**
+ * @name   process_thread
+ * @brief  Worker thread body, processes frames handed over by read_frame
+ * @param  arg - ptr to this thread's struct worker
+ *
+ * @descr  Consumes frames from the worker's ring until it is shut down and
+ *         drained, runs process_image on each and releases it to the pool
+ *
+ * @return NULL
+ */
+
+static void *process_thread(void *arg)
+{
+    struct worker *w = arg;
+    struct frame *f;
+
+    while ((f = frame_ring_consume(w->ring)) != NULL)
+    {
+        frame_stats_record(w->cam->stats, STAT_QUEUE, stats_now_ns() - f->dequeue_ns);
+        process_image(w, f);    // the frame's last reference releases it to the ring
+        w->processed++;
+    }
+
+    return NULL;
+}
+
+// V4L2 fourcc a reader of the stream info sees: the camera's, unless no header says what records hold
+static unsigned int record_format(const struct camera *cam)
+{
+    if (cam->encoder)
+        return encode_codec;
+    if (cam->output != YUV_OUTPUT_RGB24)
+        return output_fourcc[cam->output];
+
+    return cam->fmt.fmt.pix.pixelformat;
+}
+
+/**
+ * @name   start_workers
+ * @brief  Creates the camera's frame writer, processing workers and their frame rings
+ * @param  cam - camera
+ *
+ * @descr  Called after init_device so frames, output buffers and the PPM
+ *         header are sized from the negotiated format
+ *         With several cameras, file names get a camN_ prefix, shm names
+ *         a _camN suffix and network ports the camera number added
+ *
+ * @return none
+ */
+
+static void start_workers(struct camera *cam)
+{
+    unsigned int i, j;
+    size_t out_size = (size_t)cam->out_width * cam->out_height * 3; // RGB24 PPM payload
+    int passthrough = cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG && !decode_mjpeg;
+    const char *dumpname = ppm_dumpname;
+    char raw_name[24];
+    unsigned int writer_depth = encode_device ? ENC_CODED_BUFFERS : n_workers * OUT_BUFFERS;
+
+    if (gray_output && cam->fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV)
+        fprintf(stderr, "%s: grayscale output needs yuyv, writing %s as usual\n",
+                cam->dev_name, format_name(cam->fmt.fmt.pix.pixelformat));
+    cam->gray = gray_output && cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV;
+
+    if (output_layout != YUV_OUTPUT_RGB24 && cam->fmt.fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV)
+        fprintf(stderr, "%s: %s output needs yuyv, writing %s as usual\n",
+                cam->dev_name, yuv_output_name(output_layout), format_name(cam->fmt.fmt.pix.pixelformat));
+    cam->output = cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV ? output_layout : YUV_OUTPUT_RGB24;
+
+    // Kernels resolved once, the convert stage calls them per line or per frame
+    cam->planar  = yuv_kernel_planar_fn(yuv_kernel_active(), cam->output);
+    if (nt_stores)
+        cam->convert = cam->gray ? yuv_kernel_luma_stream_fn(yuv_kernel_active())
+                                 : yuv_kernel_stream_fn(yuv_kernel_active(), cam->output);
+    else
+        cam->convert = cam->gray ? yuyv_to_luma : yuv_kernel_output_fn(yuv_kernel_active(), cam->output);
+
+    if (passthrough)
+    {
+        out_size = cam->fmt.fmt.pix.sizeimage;
+        dumpname = jpg_dumpname;
+        cam->ppm_header_len = 0;
+    }
+    else if (cam->gray)
+    {
+        out_size = (size_t)cam->out_width * cam->out_height; // 8-bit PGM payload
+        dumpname = pgm_dumpname;
+        cam->ppm_header_len = snprintf(NULL, 0, pgm_header_fmt, 0UL, 0UL,
+                                       cam->out_width, cam->out_height);
+    }
+    else if (cam->output != YUV_OUTPUT_RGB24)
+    {
+        // No header describes these, the layout's fourcc in the stream info does
+        out_size = yuv_output_bytes(cam->output, cam->out_width, cam->out_height);
+        snprintf(raw_name, sizeof(raw_name), raw_dumpname, yuv_output_name(cam->output));
+        dumpname = raw_name;
+        cam->ppm_header_len = 0;
+    }
+    else
+        cam->ppm_header_len = snprintf(NULL, 0, ppm_header_fmt, 0UL, 0UL,
+                                       cam->out_width, cam->out_height);
+
+    // Records hold access units, nothing ahead of them
+    if (encode_device)
+    {
+        start_encoder(cam);
+        cam->ppm_header_len = 0;
+    }
+
+    if (n_cameras > 1)
+        snprintf(cam->dumpname, sizeof(cam->dumpname), "cam%u_%s", cam->index, dumpname);
+    else
+        snprintf(cam->dumpname, sizeof(cam->dumpname), "%s", dumpname);
+
+    // No per-frame files to pre-open when writing container segments, or nothing at all
+    cam->writer = frame_writer_create(writer_backend, ".", cam->dumpname, writer_threads, writer_depth,
+                                      stream_prefix || no_disk ? 0 : 2 * OUT_BUFFERS);
+    if (!cam->writer)
+        errno_exit("frame_writer_create");
+    printf("%s: frame writer using %s backend\n", cam->dev_name, writer_backend_name(frame_writer_backend(cam->writer)));
+
+    if (stream_prefix)
+    {
+        struct frame_stream_info info;
+        char prefix[256];
+
+        if (n_cameras > 1)
+            snprintf(prefix, sizeof(prefix), "cam%u_%s", cam->index, stream_prefix);
+        else
+            snprintf(prefix, sizeof(prefix), "%s", stream_prefix);
+
+        info.width       = cam->out_width;     // records hold the processed image
+        info.height      = cam->out_height;
+        info.pixelformat = record_format(cam);
+        info.max_record  = cam->encoder ? frame_encoder_max_size(cam->encoder) : cam->ppm_header_len + out_size;
+        info.capacity    = segment_frames;
+        cam->stream = frame_stream_create(cam->writer, ".", prefix, &info, writer_depth);
+        if (!cam->stream)
+            errno_exit("frame_stream_create");
+    }
+
+    if (shm_name || net_spec)
+    {
+        struct frame_stream_info info;
+
+        info.width       = cam->out_width;
+        info.height      = cam->out_height;
+        info.pixelformat = record_format(cam);
+        info.max_record  = cam->ppm_header_len + out_size;
+
+        if (shm_name)
+        {
+            char name[256];
+
+            if (n_cameras > 1)
+                snprintf(name, sizeof(name), "%s_cam%u", shm_name, cam->index);
+            else
+                snprintf(name, sizeof(name), "%s", shm_name);
+
+            info.capacity = SHM_SLOTS > 2 * n_workers ? SHM_SLOTS : 2 * n_workers;
+            cam->shm = frame_shm_create(name, &info);
+            if (!cam->shm)
+                errno_exit(name);
+            printf("%s: publishing frames to shm %s, %u slots\n", cam->dev_name, name, info.capacity);
+        }
+
+        if (net_spec)
+        {
+            // At most half the output buffers in flight, so slow clients cannot starve the workers
+            info.capacity = n_workers * OUT_BUFFERS / 2;
+            cam->net = frame_net_create(net_spec, cam->index, &info);
+            if (!cam->net)
+                errno_exit(net_spec);
+            printf("%s: sending frames over %s, port +%u\n", cam->dev_name, net_spec, cam->index);
+        }
+    }
+
+    cam->stats = frame_stats_create(cam->dev_name);
+
+    if (in_place)
+    {
+        if (cam->n_buffers > MAX_IN_PLACE_BUFFERS)
+        {
+            fprintf(stderr, "%s: at most %d capture buffers with --in-place\n", cam->dev_name, MAX_IN_PLACE_BUFFERS);
+            exit(EXIT_FAILURE);
+        }
+        cam->return_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (cam->return_fd == -1)
+            errno_exit("eventfd");
+        printf("%s: workers read the %u capture buffers in place\n", cam->dev_name, cam->n_buffers);
+    }
+
+    if (motion_threshold)
+    {
+        if (cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV)
+        {
+            cam->motion = frame_motion_create(cam->roi.width, cam->roi.height, motion_threshold, motion_blocks);
+            if (!cam->motion)
+                errno_exit("frame_motion_create");
+        }
+        else
+            fprintf(stderr, "%s: motion detection needs yuyv, keeping every frame\n", cam->dev_name);
+    }
+    cam->workers = calloc(n_workers, sizeof(*cam->workers));
+    if (!cam->stats || !cam->workers)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < n_workers; i++)
+    {
+        struct worker *w = &cam->workers[i];
+
+        w->cam  = cam;
+        if (cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG && decode_mjpeg)
+        {
+            w->decoder = mjpeg_decoder_create();
+            if (!w->decoder)
+                errno_exit("mjpeg_decoder_create");
+        }
+
+        build_pipeline(w);
+        if (i == 0)
+        {
+            printf("%s: pipeline ", cam->dev_name);
+            pipeline_describe(w->pipe, stdout);
+        }
+
+        // Sinks reading ring frames in place hold up to OUT_BUFFERS of them;
+        // with --in-place frames are only references to capture buffers
+        w->ring = frame_ring_create(ring_depth, in_place ? 0 : cam->fmt.fmt.pix.sizeimage, ring_policy,
+                                    pipeline_copies(w->pipe) ? 0 : OUT_BUFFERS);
+        w->src  = w->ring ? calloc(w->ring->n_frames, sizeof(*w->src)) : NULL;
+        if (!w->src)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(EXIT_FAILURE);
+        }
+        for (j = 0; j < w->ring->n_frames; j++)
+        {
+            pipe_buf_init(&w->src[j].buf, w->ring->frames[j].data, w->ring->capacity, release_source);
+            w->src[j].buf.owner = w;
+            w->src[j].w = w;
+        }
+
+        if (cam->decimate > 1)
+        {
+            w->row = malloc((size_t)cam->out_width * 4 * n_bands);   // a line pair per band for nv12 / i420
+            if (!w->row)
+            {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Helpers of worker i go on the CPUs after the i * n_bands-th, away from other workers'
+        if (n_bands > 1 && cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV)
+        {
+            w->bands = band_pool_create(n_bands, (cam->index * n_workers + i) * n_bands + 1);
+            if (!w->bands)
+                errno_exit("band_pool_create");
+        }
+
+        pthread_mutex_init(&w->out_lock, NULL);
+        pthread_cond_init(&w->out_cond, NULL);
+        for (j = 0; j < OUT_BUFFERS; j++)
+        {
+            unsigned char *data = pipeline_copies(w->pipe) ? malloc(out_size) : NULL;
+
+            if (pipeline_copies(w->pipe) && !data)
+            {
+                fprintf(stderr, "Out of memory\n");
+                exit(EXIT_FAILURE);
+            }
+            pipe_buf_init(&w->out[j].buf, data, out_size, release_out_buffer);
+            w->out[j].buf.owner = w;
+            w->out[j].w = w;
+            if (lock_memory && data)
+                prefault(data, out_size, 1);
+        }
+
+        if (lock_memory && w->ring->capacity)
+            for (j = 0; j < w->ring->n_frames; j++)
+                prefault(w->ring->frames[j].data, w->ring->capacity, 1);
+
+        errno = pthread_create(&w->thread, NULL, process_thread, w);
+        if (errno)
+            errno_exit("pthread_create");
+        if (n_worker_cpus)
+            pin_thread(w->thread, worker_cpus[(cam->index * n_workers + i) % n_worker_cpus], "worker");
+    }
+}
+
+/**
+ * @name   stop_workers
+ * @brief  Drains and joins processing workers, reports drops
+ * @param  cam - camera
+ *
+ * @return none
+ */
+
+static void stop_workers(struct camera *cam)
+{
+    unsigned int i, j;
+
+    for (i = 0; i < n_workers; i++)
+        frame_ring_shutdown(cam->workers[i].ring);
+
+    for (i = 0; i < n_workers; i++)
+    {
+        struct worker *w = &cam->workers[i];
+
+        pthread_join(w->thread, NULL);
+        printf("%s worker %u: %lu frames processed, %lu dropped\n",
+               cam->dev_name, i, w->processed, atomic_load(&w->ring->dropped));
+        printf("%s worker %u: ", cam->dev_name, i);
+        pipeline_report(w->pipe, stdout);
+    }
+
+    // The last access units go to the container, frames it still held back to their owners
+    if (cam->encoder)
+        frame_encoder_stop(cam->encoder);
+
+    // Hands back every output buffer the network still holds
+    if (cam->net)
+    {
+        frame_net_stop(cam->net);
+        frame_net_report(cam->net, stdout);
+        frame_net_destroy(cam->net);
+        cam->net = NULL;
+    }
+
+    // Waits for every queued frame, after which all output buffers are idle
+    frame_writer_flush(cam->writer);
+    frame_log_flush();
+    if (cam->encoder)
+    {
+        frame_encoder_report(cam->encoder, stdout);
+        frame_encoder_destroy(cam->encoder);
+        cam->encoder = NULL;
+    }
+    if (cam->stream)
+    {
+        frame_stream_report(cam->stream, stdout);
+        frame_stream_destroy(cam->stream);
+        cam->stream = NULL;
+    }
+    frame_writer_report(cam->writer, stdout);
+    frame_writer_destroy(cam->writer);
+    cam->writer = NULL;
+
+    if (cam->shm)
+    {
+        frame_shm_report(cam->shm, stdout);
+        frame_shm_destroy(cam->shm);
+        cam->shm = NULL;
+    }
+
+    if (cam->motion)
+    {
+        frame_motion_report(cam->motion, stdout);
+        frame_motion_destroy(cam->motion);
+        cam->motion = NULL;
+    }
+
+    frame_stats_report(cam->stats, stdout, stats_file);
+    frame_stats_destroy(cam->stats);
+    cam->stats = NULL;
+
+    for (i = 0; i < n_workers; i++)
+    {
+        struct worker *w = &cam->workers[i];
+
+        frame_ring_destroy(w->ring);
+        mjpeg_decoder_destroy(w->decoder);
+        band_pool_destroy(w->bands);
+        free(w->row);
+        free(w->src);
+        pipeline_destroy(w->pipe);
+        for (j = 0; j < OUT_BUFFERS; j++)
+            free(w->out[j].buf.data);
+        pthread_mutex_destroy(&w->out_lock);
+        pthread_cond_destroy(&w->out_cond);
+    }
+
+    free(cam->workers);
+    cam->workers = NULL;
+
+    if (cam->return_fd != -1)
+    {
+        close(cam->return_fd);
+        cam->return_fd = -1;
+    }
+}
+
+/*************************************************************************
+ *                       DMABUF Export Functions                         *
+ *************************************************************************/
+
+// Export callback on the main loop: last consumer released the buffer
+static void requeue_buffer(void *ctx, unsigned int index)
+{
+    put_buffer(ctx, index);
+}
+
+/**
+ * @name   start_export
+ * @brief  Starts the camera's DMABUF export server
+ * @param  cam - camera
+ *
+ * @descr  Consumers get the negotiated format and the fds from export_buffers
+ *         With several cameras, camera N listens on export_path.N
+ *
+ * @return none
+ */
+
+static void start_export(struct camera *cam)
+{
+    struct dmabuf_export_hello hello;
+    int fds[DMABUF_EXPORT_MAX_BUFFERS];
+    unsigned int i;
+
+    if (cam->n_buffers > DMABUF_EXPORT_MAX_BUFFERS)
+    {
+        fprintf(stderr, "Too many buffers to export: %u\n", cam->n_buffers);
+        exit(EXIT_FAILURE);
+    }
+
+    CLEAR(hello);
+    hello.width        = cam->fmt.fmt.pix.width;
+    hello.height       = cam->fmt.fmt.pix.height;
+    hello.pixelformat  = cam->fmt.fmt.pix.pixelformat;
+    hello.bytesperline = cam->fmt.fmt.pix.bytesperline;
+    hello.sizeimage    = cam->fmt.fmt.pix.sizeimage;
+    for (i = 0; i < cam->n_buffers; i++)
+    {
+        fds[i] = cam->buffers[i].dmabuf_fd;
+        hello.length[i] = cam->buffers[i].length;
+    }
+
+    if (n_cameras > 1)
+        snprintf(cam->export_path, sizeof(cam->export_path), "%s.%u", export_path, cam->index);
+    else
+        snprintf(cam->export_path, sizeof(cam->export_path), "%s", export_path);
+
+    cam->exporter = dmabuf_export_create(cam->export_path, fds, cam->n_buffers, &hello, requeue_buffer, cam);
+    if (!cam->exporter)
+        errno_exit(cam->export_path);
+    printf("Exporting %u DMABUF buffers on %s\n", cam->n_buffers, cam->export_path);
+}
+
+static void stop_export(struct camera *cam)
+{
+    dmabuf_export_destroy(cam->exporter);
+    cam->exporter = NULL;
+}
+
+/*************************************************************************
+ *                       Ring Recorder Functions                         *
+ *************************************************************************/
+
+/**
+ * @name   start_recorder
+ * @brief  Creates the camera's ring of the last record_seconds of frames
+ * @param  cam - camera, format and frame rate negotiated
+ *
+ * @descr  Frames kept = record_seconds at the rate the driver settled on,
+ *         read back with G_PARM if none was requested (30 fps if unknown)
+ *         The ring is ring.frm / camN_ring.frm with several cameras, and
+ *         holds raw frames as captured, each slot sized by sizeimage
+ *
+ * @return none
+ */
+
+static void start_recorder(struct camera *cam)
+{
+    struct frame_stream_info info;
+    char name[32];
+    double fps = camera_fps(cam);
+
+    if (fps == 0)
+        fps = 30;
+
+    if (n_cameras > 1)
+        snprintf(name, sizeof(name), "cam%u_ring", cam->index);
+    else
+        snprintf(name, sizeof(name), "ring");
+
+    info.width       = cam->fmt.fmt.pix.width;
+    info.height      = cam->fmt.fmt.pix.height;
+    info.pixelformat = cam->fmt.fmt.pix.pixelformat;
+    info.max_record  = cam->fmt.fmt.pix.sizeimage;
+    info.capacity    = (unsigned int)(record_seconds * fps + 0.5);
+    if (info.capacity < 1)
+        info.capacity = 1;
+
+    cam->recorder = frame_recorder_create(".", name, &info, 1000);
+    if (!cam->recorder)
+        errno_exit("frame_recorder_create");
+    printf("%s: recording the last %u frames (%u s at %.2f fps) to %s.frm, SIGUSR1 snapshots\n",
+           cam->dev_name, info.capacity, record_seconds, fps, name);
+}
+
+static void stop_recorder(struct camera *cam)
+{
+    if (!cam->recorder)
+        return;
+
+    frame_recorder_report(cam->recorder, stdout);
+    frame_recorder_destroy(cam->recorder);
+    cam->recorder = NULL;
+}
+
+/*************************************************************************
+ *                 Read frame Function called in Main loop               *
+ *************************************************************************/
+
+/**
+ * @name   frame_damaged
+ * @brief  Checks a dequeued buffer for data not worth processing
+ * @param  cam - camera
+ *         buf - buffer from VIDIOC_DQBUF
+ *
+ * @descr  V4L2_BUF_FLAG_ERROR marks data the driver knows is corrupt (a
+ *         USB transfer lost part of it, say). Uncompressed frames shorter
+ *         than the format's image size are missing lines; a compressed one
+ *         only needs to hold something. Each is counted in the stats
+ *
+ * @return 1 if the frame should be dropped, 0 if it is whole
+ */
+
+static int frame_damaged(struct camera *cam, const struct v4l2_buffer *buf)
+{
+    int compressed = cam->fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG;
+
+    if (buf->flags & V4L2_BUF_FLAG_ERROR)
+    {
+        frame_stats_error(cam->stats);
+        log_warn("%s: frame %u flagged corrupt by the driver, dropped", cam->dev_name, buf->sequence);
+        return 1;
+    }
+
+    if (compressed ? buf->bytesused == 0 : buf->bytesused < cam->fmt.fmt.pix.sizeimage)
+    {
+        frame_stats_truncated(cam->stats);
+        log_warn("%s: frame %u has %u of %u bytes, dropped", cam->dev_name, buf->sequence, buf->bytesused,
+                 cam->fmt.fmt.pix.sizeimage);
+        return 1;
+    }
+
+    return 0;
+}
+ 
+ /**
+ * @name   start_capturing
+ * @brief  Prepares device for video capture bu queueing buffers for capturing and starting video stream
+ * @param  cam - camera
+ * 
+ * @descr  Queues buffers
+ *         Starts video stream
+ *
+ * @return none
+ */
+ 
+static int read_frame(struct camera *cam)
+{
+    struct v4l2_buffer buf;
+    struct timespec frame_time;
+    uint64_t dequeue_ns, capture_ns;
+    struct worker *w;
+    struct frame *f;
+
+    CLEAR(buf);
+
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = io_memory();
+
+    if (-1 == xioctl(cam->fd, VIDIOC_DQBUF, &buf))
+    {
+        switch (errno)
+        {
+            case EAGAIN:
+                return 0;
+
+            // EIO from a device gone wrong, ENODEV from one unplugged: the main loop restarts it
+            default:
+                camera_failed(cam, "VIDIOC_DQBUF");
+                return 0;
+        }
+    }
+
+    assert(buf.index < cam->n_buffers);
+    cam->buffers[buf.index].queued = 0;
+    frame_stats_dequeued(cam->stats);
+
+    // Ours until the end of read_frame; consumers reading it in place take their own
+    atomic_store_explicit(&cam->buffers[buf.index].refs, 1, memory_order_relaxed);
+    if (--cam->queued == 0)
+        cam->starved++;     // the next frame has nowhere to go until a buffer comes back
+    if (cam->n_buffers - cam->queued > cam->held_peak)
+        cam->held_peak = cam->n_buffers - cam->queued;
+
+    // record when frame was dequeued
+    dequeue_ns = stats_now_ns();
+    clock_gettime(CLOCK_REALTIME, &frame_time);
+
+    // Driver timestamps are only comparable with ours when they are monotonic
+    if ((buf.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+    {
+        capture_ns = (uint64_t)buf.timestamp.tv_sec * 1000000000ULL + buf.timestamp.tv_usec * 1000ULL;
+        frame_stats_timestamp(cam->stats, capture_ns, cam->period_ns);
+        frame_stats_record(cam->stats, STAT_DRIVER, dequeue_ns - capture_ns);
+        if (cam->period_ns && dequeue_ns - capture_ns > cam->period_ns)
+            frame_stats_late(cam->stats);   // next frame was due before we got this one
+
+        // How much later or earlier than the camera's own spacing we dequeued
+        if (cam->last_capture_ns)
+        {
+            int64_t jitter = (int64_t)(dequeue_ns - cam->last_dequeue_ns) - (int64_t)(capture_ns - cam->last_capture_ns);
+
+            frame_stats_record(cam->stats, STAT_JITTER, jitter < 0 ? -jitter : jitter);
+        }
+        cam->last_capture_ns = capture_ns;
+        cam->last_dequeue_ns = dequeue_ns;
+
+        // Wall clock time of the capture itself rather than of the dequeue
+        if (dequeue_ns > capture_ns)
+        {
+            uint64_t lag = dequeue_ns - capture_ns;
+
+            frame_time.tv_sec  -= lag / 1000000000ULL;
+            frame_time.tv_nsec -= lag % 1000000000ULL;
+            if (frame_time.tv_nsec < 0)
+            {
+                frame_time.tv_sec--;
+                frame_time.tv_nsec += 1000000000L;
+            }
+        }
+    }
+    else
+        capture_ns = dequeue_ns;
+    frame_stats_sequence(cam->stats, buf.sequence);
+
+    // Straight back to the driver: no frame number, conversion, write or export
+    if (frame_damaged(cam, &buf))
+    {
+        put_buffer(cam, buf.index);
+        return -1;
+    }
+
+    cam->framecnt++;
+    if (cam->framecnt == 1)
+    {
+        startup_phase(cam, STARTUP_FIRST_FRAME);
+        log_info("%s: first frame %.1f ms after start, %.1f ms after stream on", cam->dev_name,
+                 (dequeue_ns - start_ns) / 1e6, cam->startup_ns[STARTUP_FIRST_FRAME] / 1e6);
+    }
+
+    // Static scene: one luma SAD pass over the region in the capture buffer, no copy,
+    // conversion or write
+    if (cam->motion &&
+        buf.bytesused >= (size_t)(cam->roi.top + cam->roi.height) * cam->fmt.fmt.pix.bytesperline &&
+        !frame_motion_changed(cam->motion, (unsigned char *)cam->buffers[buf.index].start +
+                              (size_t)cam->roi.top * cam->fmt.fmt.pix.bytesperline + (size_t)cam->roi.left * 2,
+                              cam->fmt.fmt.pix.bytesperline))
+    {
+        frame_stats_skipped(cam->stats);
+    }
+    else if (cam->recorder)
+    {
+        // The one copy this frame gets, straight into the mapped ring
+        if (frame_recorder_put(cam->recorder, cam->buffers[buf.index].start, buf.bytesused,
+                               cam->framecnt, buf.sequence, capture_ns) == 0)
+        {
+            frame_stats_record(cam->stats, STAT_TOTAL, stats_now_ns() - capture_ns);
+            frame_stats_written(cam->stats, buf.bytesused);
+        }
+    }
+    else
+    {
+        // Producer side only: copy out to the next worker and give the buffer straight back
+        // to the driver, or with --in-place hand the worker the buffer itself
+        w = &cam->workers[cam->framecnt % n_workers];
+        f = frame_ring_acquire(w->ring);
+        if (f && f->buffer >= 0)
+        {
+            put_buffer(cam, f->buffer);     // dropped as the oldest before its worker got to it
+            f->buffer = -1;
+        }
+        if (f && in_place)
+        {
+            atomic_fetch_add_explicit(&cam->buffers[buf.index].refs, 1, memory_order_relaxed);
+            f->buffer = buf.index;
+            f->size   = buf.bytesused;
+            if (f->size > cam->buffers[buf.index].length)
+                f->size = cam->buffers[buf.index].length;
+        }
+        else if (f)
+        {
+            f->size = buf.bytesused;
+            if (f->size > w->ring->capacity)
+                f->size = w->ring->capacity;
+            if (stream_copy)
+                yuv_stream_copy(f->data, cam->buffers[buf.index].start, f->size);
+            else
+                memcpy(f->data, cam->buffers[buf.index].start, f->size);
+        }
+        if (f)
+        {
+            f->tag  = cam->framecnt;
+            f->time = frame_time;
+            f->sequence   = buf.sequence;
+            f->capture_ns = capture_ns;
+            f->dequeue_ns = dequeue_ns;
+            frame_ring_publish(w->ring, f);
+        }
+    }
+
+    if (cam->exporter)
+    {
+        struct dmabuf_export_frame xf;
+
+        xf.index        = buf.index;
+        xf.sequence     = buf.sequence;
+        xf.bytesused    = buf.bytesused;
+        xf.flags        = buf.flags;
+        xf.timestamp_ns = (int64_t)buf.timestamp.tv_sec * 1000000000LL + buf.timestamp.tv_usec * 1000LL;
+
+        // Held by consumers: one reference for all of them, requeue_buffer drops it
+        if (dmabuf_export_frame(cam->exporter, &xf))
+            atomic_fetch_add_explicit(&cam->buffers[buf.index].refs, 1, memory_order_relaxed);
+    }
+
+    put_buffer(cam, buf.index);
+    return 1;
+}
+
+/*************************************************************************
+ *                           Main loop function                          *
+ *************************************************************************/
+ 
+ /**
+ * @name   watch
+ * @brief  Adds fd to the epoll set, tagged with what it is for
+ * @param  epfd  - epoll instance
+ *         fdesc - fd to watch for input
+ *         kind  - event_kind
+ *         index - camera index
+ *
+ * @return none
+ */
+
+static void watch(int epfd, int fdesc, enum event_kind kind, unsigned int index)
+{
+    struct epoll_event ev;
+
+    CLEAR(ev);
+    ev.events   = EPOLLIN;
+    ev.data.u64 = ((uint64_t)kind << 32) | index;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fdesc, &ev) == -1)
+        errno_exit("EPOLL_CTL_ADD");
+}
+
+// Takes a camera out of the loop; its stream stays on until stop_capturing
+static void retire_camera(int epfd, struct camera *cam)
+{
+    cam->remaining = 0;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, cam->fd, NULL);
+}
+
+static void park_camera(int epfd, struct camera *cam, int park)
+{
+    struct epoll_event ev;
+
+    CLEAR(ev);
+    ev.events   = park ? 0 : EPOLLIN;
+    ev.data.u64 = ((uint64_t)EVENT_CAMERA << 32) | cam->index;
+
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, cam->fd, &ev) == -1)
+        errno_exit("EPOLL_CTL_MOD");
+    cam->parked = park;
+}
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000 + (to->tv_nsec - from->tv_nsec) / 1000000;
+}
+
+/*************************************************************************
+ *             Recovery of a failed or unplugged camera                  *
+ *************************************************************************/
+
+// Whether the driver came back with the format workers and sinks were set up for
+static int same_format(const struct camera *cam, const struct v4l2_format *fmt)
+{
+    const struct v4l2_pix_format *was = &cam->fmt.fmt.pix, *now = &fmt->fmt.pix;
+    const struct pixel_format *pf = find_format(now->pixelformat);
+    unsigned int bpl = now->bytesperline;
+
+    if (now->width != was->width || now->height != was->height || now->pixelformat != was->pixelformat)
+        return 0;
+
+    // init_device raised a short bytesperline the first time round
+    if (pf && pf->bytes_per_pixel && bpl < now->width * pf->bytes_per_pixel)
+        bpl = now->width * pf->bytes_per_pixel;
+    if (pf && pf->bytes_per_pixel && bpl != was->bytesperline)
+        return 0;
+
+    // Pool memory was sized for the first sizeimage, mmap buffers are the driver's own
+    return io == IO_METHOD_MMAP || now->sizeimage <= cam->buffers[0].length;
+}
+
+/**
+ * @name   restore_stream
+ * @brief  Reopens a closed camera and brings back the stream it had
+ * @param  cam  - camera
+ *         step - set to what failed
+ *
+ * @descr  Nothing is negotiated again: the crop, format and frame interval
+ *         init_device settled on are set as they were and the format must
+ *         come back unchanged. The same number of buffers is requested;
+ *         mmap buffers are mapped afresh, USERPTR and DMABUF ones are the
+ *         pool memory used before
+ *
+ * @return 0, -1 with errno set and the camera closed again
+ */
+
+static int restore_stream(struct camera *cam, const char **step)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    struct v4l2_requestbuffers req;
+    struct v4l2_cropcap cropcap;
+    struct v4l2_format fmt;
+    unsigned int i, mapped = 0;
+    int err;
+
+    *step = "open";
+    cam->fd = open(cam->dev_name, O_RDWR | O_NONBLOCK, 0);
+    if (cam->fd == -1)
+        return -1;
+
+    *step = "crop";
+    errno = EINVAL;     // set_hw_crop fails without one when the driver rounds the crop
+    CLEAR(cropcap);
+    cropcap.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (cam->hw_crop && (xioctl(cam->fd, VIDIOC_CROPCAP, &cropcap) == -1 || set_hw_crop(cam, &cropcap) == -1))
+        goto fail;
+
+    *step = force_format ? "VIDIOC_S_FMT" : "VIDIOC_G_FMT";
+    fmt = cam->fmt;
+    if (xioctl(cam->fd, force_format ? VIDIOC_S_FMT : VIDIOC_G_FMT, &fmt) == -1)
+        goto fail;
+    *step = "format changed";
+    errno = EINVAL;
+    if (!same_format(cam, &fmt))
+        goto fail;
+
+    // Best effort, nothing downstream depends on the rate
+    if (cam->timeperframe.denominator)
+    {
+        struct v4l2_streamparm parm;
+
+        CLEAR(parm);
+        parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        parm.parm.capture.timeperframe = cam->timeperframe;
+        xioctl(cam->fd, VIDIOC_S_PARM, &parm);
+    }
+
+    *step = "VIDIOC_REQBUFS";
+    CLEAR(req);
+    req.count  = cam->n_buffers;
+    req.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = io_memory();
+    if (xioctl(cam->fd, VIDIOC_REQBUFS, &req) == -1)
+        goto fail;
+    errno = ENOMEM;
+    if (req.count < cam->n_buffers)
+        goto fail;
+
+    for (; io == IO_METHOD_MMAP && mapped < cam->n_buffers; mapped++)
+    {
+        struct v4l2_buffer buf;
+        void *start;
+
+        CLEAR(buf);
+        buf.type   = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_MMAP;
+        buf.index  = mapped;
+
+        *step = "VIDIOC_QUERYBUF";
+        if (xioctl(cam->fd, VIDIOC_QUERYBUF, &buf) == -1)
+            goto fail;
+
+        *step = "mmap";
+        start = mmap(NULL, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, cam->fd, buf.m.offset);
+        if (start == MAP_FAILED)
+            goto fail;
+        cam->buffers[mapped].start  = start;
+        cam->buffers[mapped].length = buf.length;
+    }
+
+    *step = "VIDIOC_EXPBUF";
+    if (cam->exported && export_buffers(cam) == -1)
+        goto fail;
+
+    *step = "VIDIOC_QBUF";
+    for (i = 0; i < cam->n_buffers; i++)
+        if (queue_buffer(cam, i) == -1)
+            goto fail;
+
+    *step = "VIDIOC_STREAMON";
+    if (xioctl(cam->fd, VIDIOC_STREAMON, &type) == -1)
+        goto fail;
+
+    return 0;
+
+fail:
+    err = errno;
+    for (i = 0; i < mapped; i++)
+    {
+        munmap(cam->buffers[i].start, cam->buffers[i].length);
+        cam->buffers[i].start = NULL;
+        if (cam->exported && cam->buffers[i].dmabuf_fd != -1)
+        {
+            close(cam->buffers[i].dmabuf_fd);
+            cam->buffers[i].dmabuf_fd = -1;
+        }
+    }
+    for (i = 0; i < cam->n_buffers; i++)
+        cam->buffers[i].queued = 0;
+    cam->queued = 0;
+    close(cam->fd);
+    cam->fd = -1;
+    errno = err;
+    return -1;
+}
+
+/**
+ * @name   begin_recovery
+ * @brief  Turns off the stream of a camera that failed or stalled, the first step back
+ * @param  epfd - main loop epoll set
+ *         cam  - camera, cam->fail_what says why
+ *
+ * @descr  The fd leaves the epoll set and the stream goes off, errors
+ *         ignored as the device may be gone. Buffers held by workers and
+ *         sinks stay mapped until advance_recovery sees them released
+ *         Without --recover the camera is stopped instead, as it is with
+ *         DMABUF consumers, who hold fds of buffers a reopen would replace
+ *
+ * @return 0, -1 if the camera was retired
+ */
+
+static int begin_recovery(int epfd, struct camera *cam)
+{
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    unsigned int i;
+
+    if (!recover_seconds || cam->exporter)
+    {
+        log_warn("%s: %s: %s, stopping it", cam->dev_name, cam->fail_what, strerror(cam->fail_errno));
+        retire_camera(epfd, cam);
+        return -1;
+    }
+    log_warn("%s: %s: %s, restarting the stream", cam->dev_name, cam->fail_what, strerror(cam->fail_errno));
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, cam->fd, NULL);
+    cam->parked = 0;
+    xioctl(cam->fd, VIDIOC_STREAMOFF, &type);   // gives every queued buffer back
+    for (i = 0; i < cam->n_buffers; i++)
+        cam->buffers[i].queued = 0;
+    cam->queued = 0;
+
+    cam->state        = CAMERA_DRAINING;
+    cam->outage_start = cam->last_frame;    // a stall was an outage before it was noticed
+    cam->reopens      = 0;
+    cam->outages++;
+    return 0;
+}
+
+// Adds the time since the camera's last frame to its outage totals
+static uint64_t end_outage(struct camera *cam, const struct timespec *now)
+{
+    uint64_t out_ns = (uint64_t)(now->tv_sec - cam->outage_start.tv_sec) * 1000000000ULL +
+                      now->tv_nsec - cam->outage_start.tv_nsec;
+
+    cam->outage_ns += out_ns;
+    if (out_ns > cam->outage_max_ns)
+        cam->outage_max_ns = out_ns;
+    return out_ns;
+}
+
+/**
+ * @name   advance_recovery
+ * @brief  Takes a recovering camera a step further, every main loop pass
+ * @param  epfd - main loop epoll set
+ *         cam  - camera, draining or reopening
+ *         now  - CLOCK_MONOTONIC
+ *
+ * @descr  Draining: once consumers hold none of its buffers the mmap ones
+ *         are unmapped and the device closed. Reopening: restore_stream is
+ *         tried every RECOVER_RETRY_MS, or as soon as hotplug() sees the
+ *         device node come back; on success the fd rejoins the epoll set
+ *         and the outage is timed from the last frame. A camera not back
+ *         recover_seconds after its last frame is stopped
+ *
+ * @return 0, -1 if the camera was retired
+ */
+
+static int advance_recovery(int epfd, struct camera *cam, const struct timespec *now)
+{
+    const char *step;
+    unsigned int i;
+    uint64_t out_ns;
+
+    if (elapsed_ms(&cam->outage_start, now) >= (long)recover_seconds * 1000)
+    {
+        log_error("%s: not back %u s after its last frame, stopping it", cam->dev_name, recover_seconds);
+        end_outage(cam, now);
+        retire_camera(epfd, cam);
+        return -1;
+    }
+
+    if (cam->state == CAMERA_DRAINING)
+    {
+        for (i = 0; i < cam->n_buffers; i++)
+            if (atomic_load_explicit(&cam->buffers[i].refs, memory_order_acquire))
+                return 0;
+
+        // Exports for the encoder would keep the old buffers alive, restore_stream makes new ones
+        for (i = 0; io == IO_METHOD_MMAP && i < cam->n_buffers; i++)
+        {
+            munmap(cam->buffers[i].start, cam->buffers[i].length);
+            cam->buffers[i].start = NULL;
+            if (cam->exported)
+            {
+                close(cam->buffers[i].dmabuf_fd);
+                cam->buffers[i].dmabuf_fd = -1;
+            }
+        }
+        close(cam->fd);
+        cam->fd          = -1;
+        cam->state       = CAMERA_REOPENING;
+        cam->next_reopen = *now;
+    }
+
+    if (elapsed_ms(&cam->next_reopen, now) < 0)
+        return 0;
+
+    if (restore_stream(cam, &step) == -1)
+    {
+        if (cam->reopens++ == 0)
+            log_info("%s: %s: %s, retrying every %d ms", cam->dev_name, step, strerror(errno), RECOVER_RETRY_MS);
+
+        cam->next_reopen.tv_sec  = now->tv_sec + RECOVER_RETRY_MS / 1000;
+        cam->next_reopen.tv_nsec = now->tv_nsec + (RECOVER_RETRY_MS % 1000) * 1000000L;
+        if (cam->next_reopen.tv_nsec >= 1000000000L)
+        {
+            cam->next_reopen.tv_sec++;
+            cam->next_reopen.tv_nsec -= 1000000000L;
+        }
+        return 0;
+    }
+
+    watch(epfd, cam->fd, EVENT_CAMERA, cam->index);
+    cam->state           = CAMERA_STREAMING;
+    cam->fail_what       = NULL;
+    cam->last_frame      = *now;
+    cam->last_capture_ns = 0;   // no jitter sample across the gap
+    frame_stats_restart(cam->stats);
+
+    out_ns = end_outage(cam, now);
+    cam->recovered++;
+
+    log_info("%s: streaming again after %.1f ms without frames, reopened on attempt %u", cam->dev_name,
+             out_ns / 1e6, cam->reopens + 1);
+    return 0;
+}
+
+/**
+ * @name   watch_device_nodes
+ * @brief  Watches the directories of the device nodes for udev recreating them
+ * @param  none
+ *
+ * @descr  A camera plugged back in gets its node, and then its permissions,
+ *         from udev; either is the moment to try reopening rather than
+ *         waiting for the next retry
+ *
+ * @return inotify fd, -1 if none could be set up
+ */
+
+static int watch_device_nodes(void)
+{
+    char dir[PATH_MAX];
+    unsigned int i, watched = 0;
+    const char *slash;
+    int fd;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1)
+    {
+        log_warn("inotify_init1 failed, %s; reconnects are only polled", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < n_cameras; i++)
+    {
+        slash = strrchr(cameras[i].dev_name, '/');
+        snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - cameras[i].dev_name) + 1 : 1,
+                 slash ? cameras[i].dev_name : ".");
+
+        // The same directory twice gives the same watch
+        if (inotify_add_watch(fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO) == -1)
+            log_warn("%s: can't watch %s, %s; reconnects are only polled", cameras[i].dev_name, dir, strerror(errno));
+        else
+            watched++;
+    }
+
+    if (!watched)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// A node was created or its permissions changed: reopen any camera waiting for that name
+static void hotplug(int fd, const struct timespec *now)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *ev;
+    const char *name;
+    unsigned int i;
+    ssize_t len;
+    char *p;
+
+    while ((len = read(fd, events, sizeof(events))) > 0)
+    {
+        for (p = events; p < events + len; p += sizeof(*ev) + ev->len)
+        {
+            ev = (const struct inotify_event *)p;
+            if (!ev->len)
+                continue;
+
+            for (i = 0; i < n_cameras; i++)
+            {
+                name = strrchr(cameras[i].dev_name, '/');
+                name = name ? name + 1 : cameras[i].dev_name;
+                if (cameras[i].state == CAMERA_REOPENING && strcmp(name, ev->name) == 0)
+                    cameras[i].next_reopen = *now;
+            }
+        }
+    }
+}
+
+ /**
+ * @name   mainloop
+ * @brief  Captures from every camera until each has frame_count frames
+ * @param  none
+ * 
+ * @descr  One epoll set holds every camera, every DMABUF exporter and stop_fd
+ *         A readable camera is drained of all ready buffers per wakeup
+ *         Stats are reported every stats_interval seconds from a timerfd
+ *         Writing snapshot_fd (SIGUSR1) snapshots every ring recorder
+ *         A camera that fails, or has no frame for STALL_TIMEOUT_MS, is
+ *         restarted, or stopped without --recover, on its own while the
+ *         others keep going; writing stop_fd (SIGINT/SIGTERM) ends the loop
+ *
+ * @return none
+ */
+
+static void mainloop()
+{
+    struct epoll_event events[3 * MAX_CAMERAS + 3];
+    struct timespec now;
+    unsigned int i, active = 0;
+    int epfd, stats_fd = -1, hotplug_fd = -1, recovering = 0, n, k;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1)
+        errno_exit("epoll_create1");
+
+    watch(epfd, stop_fd, EVENT_STOP, 0);
+    watch(epfd, snapshot_fd, EVENT_SNAPSHOT, 0);
+    if (stats_interval)
+    {
+        struct itimerspec it;
+
+        stats_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (stats_fd == -1)
+            errno_exit("timerfd_create");
+
+        CLEAR(it);
+        it.it_interval.tv_sec = stats_interval;
+        it.it_value = it.it_interval;
+        timerfd_settime(stats_fd, 0, &it, NULL);
+        watch(epfd, stats_fd, EVENT_STATS, 0);
+    }
+    if (recover_seconds)
+    {
+        hotplug_fd = watch_device_nodes();
+        if (hotplug_fd != -1)
+            watch(epfd, hotplug_fd, EVENT_HOTPLUG, 0);
+    }
+    for (i = 0; i < n_cameras; i++)
+    {
+        struct camera *cam = &cameras[i];
+
+        if (cam->exporter)
+            watch(epfd, dmabuf_export_fd(cam->exporter), EVENT_EXPORT, i);
+        if (cam->return_fd != -1)
+            watch(epfd, cam->return_fd, EVENT_RETURN, i);
+        if (cam->remaining > 0)
+        {
+            watch(epfd, cam->fd, EVENT_CAMERA, i);
+            active++;
+        }
+    }
+
+    while (active > 0)
+    {
+        // Recovering cameras are stepped on every pass
+        n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]),
+                       recovering ? RECOVER_TICK_MS : STALL_TIMEOUT_MS / 2);
+        if (n == -1)
+        {
+            if (EINTR == errno)
+                continue;
+            errno_exit("epoll_wait");
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        recovering = 0;
+
+        for (k = 0; k < n; k++)
+        {
+            enum event_kind kind = events[k].data.u64 >> 32;
+            struct camera *cam = &cameras[(uint32_t)events[k].data.u64];
+            int got;
+
+            switch (kind)
+            {
+                case EVENT_STOP:
+                    log_info("Stop requested");
+                    for (i = 0; i < n_cameras; i++)
+                        if (cameras[i].remaining > 0)
+                            retire_camera(epfd, &cameras[i]);
+                    active = 0;
+                    break;
+
+                case EVENT_EXPORT:
+                    dmabuf_export_handle(cam->exporter);
+                    break;
+
+                case EVENT_RETURN:
+                    requeue_returned(cam);
+                    break;
+
+                case EVENT_STATS:
+                {
+                    uint64_t expirations;
+
+                    if (read(stats_fd, &expirations, sizeof(expirations)) > 0)
+                        for (i = 0; i < n_cameras; i++)
+                            frame_stats_report(cameras[i].stats, stdout, stats_file);
+                    break;
+                }
+
+                case EVENT_SNAPSHOT:
+                {
+                    uint64_t requests;
+
+                    if (read(snapshot_fd, &requests, sizeof(requests)) > 0)
+                        for (i = 0; i < n_cameras; i++)
+                            if (cameras[i].recorder)
+                                frame_recorder_trigger(cameras[i].recorder);
+                    break;
+                }
+
+                case EVENT_HOTPLUG:
+                    hotplug(hotplug_fd, &now);
+                    break;
+
+                case EVENT_CAMERA:
+                    if (cam->remaining == 0 || cam->state != CAMERA_STREAMING || cam->fail_what) // retired or failed earlier in this batch
+                        break;
+                    // Damaged frames don't count towards -c, nor as signs of life for the stall check
+                    while (cam->remaining > 0 && (got = read_frame(cam)) != 0)
+                    {
+                        if (got < 0)
+                            continue;
+                        cam->remaining--;
+                        cam->last_frame = now;
+                    }
+                    if (cam->remaining == 0)
+                    {
+                        retire_camera(epfd, cam);
+                        active--;
+                    }
+                    break;
+            }
+        }
+
+        for (i = 0; i < n_cameras; i++)
+        {
+            struct camera *cam = &cameras[i];
+
+            if (cam->remaining == 0)
+                continue;
+
+            if (cam->state == CAMERA_STREAMING && !cam->fail_what &&
+                elapsed_ms(&cam->last_frame, &now) >= STALL_TIMEOUT_MS)
+            {
+                errno = ETIMEDOUT;
+                camera_failed(cam, "waiting for a frame");
+            }
+
+            if (cam->state == CAMERA_STREAMING && cam->fail_what && begin_recovery(epfd, cam) == -1)
+            {
+                active--;
+                continue;
+            }
+            if (cam->state != CAMERA_STREAMING)
+            {
+                if (advance_recovery(epfd, cam, &now) == -1)
+                    active--;
+                else
+                    recovering = 1;
+                continue;
+            }
+
+            // With every buffer out with consumers the fd polls as an error, keep it quiet until one is back
+            if (cam->parked != !cam->queued)
+                park_camera(epfd, cam, !cam->queued);
+        }
+    }
+
+    if (stats_fd != -1)
+        close(stats_fd);
+    if (hotplug_fd != -1)
+        close(hotplug_fd);
+    close(epfd);
+}
+
+
+/*************************************************************************
+ *                       Stop capturing Function                         *
+ *************************************************************************/
+
+/**
+ * @name   stop_capturing
+ * @brief  Initializes video capture device
+ * @param  cam - camera
+ * 
+ * @descr  Stops video stream
+ *         Reports the outages recovered from
+ *         Reports how far consumers holding buffers ran the driver's queue down
+ *
+ * @return none
+ */
+ 
+static void stop_capturing(struct camera *cam)
+{
+        enum v4l2_buf_type type; // buffer type for streaming
+
+        type = V4L2_BUF_TYPE_VIDEO_CAPTURE; // sets type as video capture
+        // A recovering camera's stream is already off; a failed one may be gone
+        if (cam->state == CAMERA_STREAMING && xioctl(cam->fd, VIDIOC_STREAMOFF, &type) == -1 && !cam->fail_what)
+            errno_exit("VIDIOC_STREAMOFF");
+
+        // Back-pressure from consumers holding buffers instead of a copy
+        if (in_place || cam->exporter)
+            printf("%s: %u capture buffers, at most %u out at once, driver left with none queued %lu times\n",
+                   cam->dev_name, cam->n_buffers, cam->held_peak, cam->starved);
+
+        if (cam->outages)
+            printf("%s: %u outages, %u recovered, %.1f ms without frames in total, the longest %.1f ms\n",
+                   cam->dev_name, cam->outages, cam->recovered, cam->outage_ns / 1e6, cam->outage_max_ns / 1e6);
+}
+
+/*************************************************************************
+ *                        UnInit Device Function                         *
+ *************************************************************************/
+
+/**
+ * @name   uninit_device
+ * @brief  Uninitializes video capture device
+ * @param  cam - camera
+ * 
+ * @descr  Avoids mem leak by releasing allocated memory
+ *
+ * @return none
+ */
+ 
+static void uninit_device(struct camera *cam)
+{
+        unsigned int i;
+		//munmap function deallocates memory region mapped by mmap, which was used for memory mapping the device buffers
+
+        for (i = 0; i < cam->n_buffers; ++i) // iterates over each buffer allocated during init phase
+        {
+            // unmapped already if it stopped while recovering
+            if (io == IO_METHOD_MMAP && cam->buffers[i].start && munmap(cam->buffers[i].start, cam->buffers[i].length) == -1) // munmap function to unmap the memory associated with each buffer
+                errno_exit("munmap");
+            if (cam->buffers[i].dmabuf_fd != -1)
+                close(cam->buffers[i].dmabuf_fd); // consumers keep their own references
+        }
+
+        buffer_pool_destroy(cam->pool); // USERPTR / DMABUF import memory
+        cam->pool = NULL;
+			
+        free(cam->buffers); //After unmapping all buffers, frees memory allocated for array of buffer structs
+}
+
+/*************************************************************************
+ *                          Close Device Function                         *
+ *************************************************************************/
+
+/**
+ * @name   close_device
+ * @brief  Closes camera device named dev_name
+ * @param  cam - camera
+ * 
+ * @descr  Close camera device pointed to by fd
+ *         Set fd as -1 to not accidentally use file after closure
+ *
+ * @return none
+ */
+ 
+static void close_device(struct camera *cam)
+{
+        if (cam->fd == -1) // stopped while recovering, closed already
+            return;
+        if (close(cam->fd) == -1) // check status of closing fd = camera device
+		{
+            errno_exit("close");
+		}
+        cam->fd = -1; //set fd to -1, so fd is not accidentally used after closure
+}
+
+
+/*************************************************************************
+ *                      Parallel Device Initialization                   *
+ *************************************************************************/
+
+// Opens and initializes one camera; the slow ioctls of several overlap this way
+static void *init_thread(void *arg)
+{
+    struct camera *cam = arg;
+
+    cam->startup_mark = stats_now_ns();
+    open_device(cam);
+    startup_phase(cam, STARTUP_OPEN);
+    printf("Camera device %s opened...\n", cam->dev_name);
+
+    init_device(cam);
+    printf("Initialized device %s...\n", cam->dev_name);
+    return NULL;
+}
+
+/**
+ * @name   init_cameras
+ * @brief  Opens and initializes every camera, each on a thread of its own
+ * @param  none
+ *
+ * @descr  Negotiation with USB cameras is mostly waiting on control
+ *         transfers, so N cameras take about as long as the slowest
+ *         rather than the sum. A camera whose thread can't be created is
+ *         initialized on this one. A failure still exits, as it did
+ *
+ * @return none
+ */
+
+static void init_cameras(void)
+{
+    pthread_t threads[MAX_CAMERAS];
+    int started[MAX_CAMERAS];
+    uint64_t begin = stats_now_ns();
+    unsigned int i;
+
+    for (i = 0; i < n_cameras; i++)
+    {
+        started[i] = n_cameras > 1 && pthread_create(&threads[i], NULL, init_thread, &cameras[i]) == 0;
+        if (!started[i])
+            init_thread(&cameras[i]);
+    }
+    for (i = 0; i < n_cameras; i++)
+        if (started[i])
+            pthread_join(threads[i], NULL);
+
+    printf("Initialized %u device%s in %.1f ms\n", n_cameras, n_cameras > 1 ? "s in parallel" : "",
+           (stats_now_ns() - begin) / 1e6);
+}
+
+/*************************************************************************
+ *                      Command Line Usage Function                      *
+ *************************************************************************/
+
+/**
+ * @name   usage
+ * @brief  Prints command line options
+ * @param  fp   - stream to print to
+ *         argc - argument count
+ *         argv - argument vector, argv[0] is program name
+ *
+ * @return none
+ */
+
+static void usage(FILE *fp, int argc, char **argv)
+{
+        fprintf(fp,
+                 "Usage: %s [options] [device...]\n\n"
+                 "Options:\n"
+                 "-d | --device name   Video device name, repeat for more cameras [/dev/video0]\n"
+                 "-c | --count N       Number of frames to grab per camera, 0 = until stopped [%i]\n"
+                 "-r | --resolution WxH  Requested frame size [%ux%u]\n"
+                 "-f | --format name   Pixel format: yuyv, rgb24, mjpeg [%s]\n"
+                 "-j | --decode        Decode mjpeg frames to PPM instead of writing them as .jpg\n"
+                 "-g | --gray          Write yuyv frames as grayscale PGM from the Y plane, no color conversion\n"
+                 "-O | --output name   Convert yuyv frames to: rgb24 (PPM), or raw bgr24, rgba, bgra, nv12, i420 [%s]\n"
+                 "-a | --roi WxH+X+Y   Only process this region of the frame, cropped by the driver if it can\n"
+                 "-z | --decimate N    Keep every Nth pixel and line of the region: 1, 2, 4, 8 [%u]\n"
+                 "-t | --bands N       Split each yuyv frame's conversion over N pinned threads per worker [%u]\n"
+                 "-P | --priority N    Run the capture thread SCHED_FIFO at priority N, 0 = SCHED_OTHER [%d]\n"
+                 "-u | --capture-cpu N Pin the capture thread to CPU N\n"
+                 "-U | --worker-cpus L Pin workers round robin to the CPUs in L, e.g. 2,3 or 2-5\n"
+                 "-L | --mlock         Lock all memory and prefault frame buffers before capture\n"
+                 "-M | --motion T      Skip yuyv frames unless a 16x16 block's mean luma change exceeds T, 0 = off [%u]\n"
+                 "-B | --motion-blocks N  Changed blocks needed to keep a frame with --motion [%u]\n"
+                 "-F | --fps N|max     Requested frame rate, 0 = driver default [%u]\n"
+                 "-l | --list          Print the formats, sizes and frame rates each device offers\n"
+                 "-k | --kernel name   YUYV conversion kernel: auto, scalar, sse2, avx2, neon, lut [%s]\n"
+                 "-S | --selftest      Check conversion kernels against scalar path and exit\n"
+                 "-w | --workers N     Processing threads fed by the capture thread [%u]\n"
+                 "-q | --queue N       Frames buffered per worker [%u]\n"
+                 "-p | --policy name   When workers fall behind: block, drop-oldest, drop-newest [%s]\n"
+                 "-b | --writer name   Frame writer backend: auto, uring, threads [%s]\n"
+                 "-W | --writer-threads N  Threads for the threads writer backend [%u]\n"
+                 "-x | --export path   Export capture buffers as DMABUF fds on Unix socket path\n"
+                 "-m | --io method     Capture buffers: mmap, userptr, dmabuf [%s]\n"
+                 "-n | --buffers N     Capture buffers requested from the driver [%u]\n"
+                 "-i | --in-place      Workers and sinks read capture buffers, re-queued once all release them; raise -n\n"
+                 "-G | --stream-copy   Copy capture buffers with SSE4.1 streaming loads, for drivers that map them uncached\n"
+                 "-Z | --nt-stores     Write packed and gray frames past the cache, only sinks read them (x86 kernels)\n"
+                 "-I | --prefetch N    Prefetch yuyv source N bytes ahead of the conversion kernels, 0 = off [%zu]\n"
+                 "-v | --verbose       Log a line for every frame written or published\n"
+                 "-E | --log-rate N    Log lines per second allowed from each place that logs, 0 = unlimited [%u]\n"
+                 "-A | --recover S     Reopen a camera that fails, stalls or is unplugged, until S seconds after its last frame, 0 = stop it [%u]\n"
+                 "-H | --hugepages     Back userptr/dmabuf buffers with huge pages\n"
+                 "-s | --stats N       Print latency/throughput stats every N seconds, 0 = at exit [%u]\n"
+                 "-o | --stats-file path  Also append stats as JSON lines to path\n"
+                 "-C | --container prefix  Write frames into prefixNNNN.frm segments with a .idx index\n"
+                 "-R | --segment N     Frames per container segment before rotating [%u]\n"
+                 "-T | --record S      Keep only the last S seconds in a mapped ring file, SIGUSR1 snapshots it\n"
+                 "-Y | --shm name      Publish frames to local readers through POSIX shm ring name, e.g. /aesd_cam\n"
+                 "-N | --net spec      Send frames with MSG_ZEROCOPY: tcp:[HOST:]PORT serves clients, udp:HOST:PORT\n"
+                 "-D | --no-disk       Only publish frames with --shm or --net, write nothing to disk\n"
+                 "-K | --cache path    Remember each device's negotiated format and rate in path, reused while unchanged\n"
+                 "-e | --encode dev    Compress yuyv frames on V4L2 encoder dev into the --container, -w 1; with -i from DMABUF\n"
+                 "-V | --codec name    Codec for --encode: h264, hevc [%s]\n"
+                 "-X | --bitrate N     Bitrate for --encode in kbit/s, 0 = driver default [%u]\n"
+                 "-h | --help          Print this message\n"
+                 "",
+                 argv[0], frame_count, req_width, req_height,
+                 format_name(req_pixelformat), yuv_output_name(output_layout), decimate, n_bands, rt_priority, motion_threshold, motion_blocks, req_fps, yuv_kernel_name(kernel),
+                 n_workers, ring_depth, ring_policy_name(ring_policy),
+                 writer_backend_name(writer_backend), writer_threads,
+                 io_names[io], req_buffers, prefetch_bytes, log_rate, recover_seconds, stats_interval, segment_frames,
+                 encode_codec == V4L2_PIX_FMT_HEVC ? "hevc" : "h264", encode_bitrate / 1000);
+}
+
+static const char short_options[] = "d:c:r:f:jgO:a:z:t:P:u:U:LM:B:F:lk:Sw:q:p:b:W:x:m:n:Hs:o:C:R:T:Y:N:DK:iGZI:vE:A:e:V:X:h";
+
+static const struct option
+long_options[] = {
+        { "device",   required_argument, NULL, 'd' },
+        { "count",    required_argument, NULL, 'c' },
+        { "resolution", required_argument, NULL, 'r' },
+        { "format",   required_argument, NULL, 'f' },
+        { "decode",   no_argument,       NULL, 'j' },
+        { "gray",     no_argument,       NULL, 'g' },
+        { "output",   required_argument, NULL, 'O' },
+        { "roi",      required_argument, NULL, 'a' },
+        { "decimate", required_argument, NULL, 'z' },
+        { "bands",    required_argument, NULL, 't' },
+        { "priority", required_argument, NULL, 'P' },
+        { "capture-cpu", required_argument, NULL, 'u' },
+        { "worker-cpus", required_argument, NULL, 'U' },
+        { "mlock",    no_argument,       NULL, 'L' },
+        { "motion",   required_argument, NULL, 'M' },
+        { "motion-blocks", required_argument, NULL, 'B' },
+        { "fps",      required_argument, NULL, 'F' },
+        { "list",     no_argument,       NULL, 'l' },
+        { "kernel",   required_argument, NULL, 'k' },
+        { "selftest", no_argument,       NULL, 'S' },
+        { "workers",  required_argument, NULL, 'w' },
+        { "queue",    required_argument, NULL, 'q' },
+        { "policy",   required_argument, NULL, 'p' },
+        { "writer",   required_argument, NULL, 'b' },
+        { "writer-threads", required_argument, NULL, 'W' },
+        { "export",   required_argument, NULL, 'x' },
+        { "io",       required_argument, NULL, 'm' },
+        { "buffers",  required_argument, NULL, 'n' },
+        { "hugepages", no_argument,      NULL, 'H' },
+        { "stats",    required_argument, NULL, 's' },
+        { "stats-file", required_argument, NULL, 'o' },
+        { "container", required_argument, NULL, 'C' },
+        { "segment",  required_argument, NULL, 'R' },
+        { "record",   required_argument, NULL, 'T' },
+        { "shm",      required_argument, NULL, 'Y' },
+        { "net",      required_argument, NULL, 'N' },
+        { "no-disk",  no_argument,       NULL, 'D' },
+        { "in-place", no_argument,       NULL, 'i' },
+        { "stream-copy", no_argument,    NULL, 'G' },
+        { "nt-stores", no_argument,      NULL, 'Z' },
+        { "prefetch", required_argument, NULL, 'I' },
+        { "verbose",  no_argument,       NULL, 'v' },
+        { "log-rate", required_argument, NULL, 'E' },
+        { "recover",  required_argument, NULL, 'A' },
+        { "cache",    required_argument, NULL, 'K' },
+        { "encode",   required_argument, NULL, 'e' },
+        { "codec",    required_argument, NULL, 'V' },
+        { "bitrate",  required_argument, NULL, 'X' },
+        { "help",     no_argument,       NULL, 'h' },
+        { 0, 0, 0, 0 }
+};
+
+/*************************************************************************
+ *                                 Main Function                         *
+ *************************************************************************/
+ 
+// Adds a camera to capture from, devices are captured in command line order
+static void add_camera(const char *name)
+{
+    struct camera *cam;
+
+    if (n_cameras == MAX_CAMERAS)
+    {
+        fprintf(stderr, "At most %d cameras\n", MAX_CAMERAS);
+        exit(EXIT_FAILURE);
+    }
+
+    cam = &cameras[n_cameras];
+    cam->dev_name = name;
+    cam->index    = n_cameras++;
+    cam->fd       = -1;
+    cam->return_fd = -1;
+}
+
+// SIGINT/SIGTERM: wake the main loop, which stops capture cleanly
+static void request_stop(int sig)
+{
+    uint64_t one = 1;
+    ssize_t r;
+
+    r = write(stop_fd, &one, sizeof(one)); // async-signal-safe
+    (void)r;
+}
+
+// SIGUSR1: have the main loop snapshot the ring recorders
+static void request_snapshot(int sig)
+{
+    uint64_t one = 1;
+    ssize_t r;
+
+    r = write(snapshot_fd, &one, sizeof(one));
+    (void)r;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa;
+    unsigned int i;
+
+    start_ns = stats_now_ns();
+
+    for (;;)
+    {
+        int idx;
+        int c;
+
+        c = getopt_long(argc, argv, short_options, long_options, &idx);
+
+        if (c == -1)
+            break;
+
+        switch (c)
+        {
+            case 0: /* getopt_long() flag */
+                break;
+
+            case 'd':
+                add_camera(optarg);
+                break;
+
+            case 'c':
+                errno = 0;
+                frame_count = strtol(optarg, NULL, 0);
+                if (errno)
+                    errno_exit(optarg);
+                break;
+
+            case 'r':
+                if (sscanf(optarg, "%ux%u", &req_width, &req_height) != 2 || req_width == 0 || req_height == 0)
+                {
+                    fprintf(stderr, "Bad resolution '%s', expected WxH\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'f':
+            {
+                unsigned int i;
+
+                for (i = 0; i < N_PIXEL_FORMATS; i++)
+                    if (strcmp(optarg, pixel_formats[i].name) == 0)
+                        break;
+                if (i == N_PIXEL_FORMATS)
+                {
+                    fprintf(stderr, "Unknown pixel format '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                req_pixelformat = pixel_formats[i].fourcc;
+                break;
+            }
+
+            case 'j':
+                decode_mjpeg = 1;
+                break;
+
+            case 'g':
+                gray_output = 1;
+                break;
+
+            case 'O':
+                if (yuv_output_parse(optarg, &output_layout) == -1)
+                {
+                    fprintf(stderr, "Unknown output layout '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'a':
+                if (sscanf(optarg, "%ux%u+%d+%d", &req_roi.width, &req_roi.height, &req_roi.left, &req_roi.top) != 4 ||
+                    !req_roi.width || !req_roi.height || req_roi.left < 0 || req_roi.top < 0)
+                {
+                    fprintf(stderr, "Bad region of interest '%s', expected WxH+X+Y\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'z':
+                decimate = strtoul(optarg, NULL, 0);
+                if (decimate != 1 && decimate != 2 && decimate != 4 && decimate != 8)
+                {
+                    fprintf(stderr, "Decimation must be 1, 2, 4 or 8\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 't':
+                n_bands = strtoul(optarg, NULL, 0);
+                if (n_bands == 0 || n_bands > 64)
+                {
+                    fprintf(stderr, "Bands must be 1 to 64\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'P':
+                rt_priority = strtol(optarg, NULL, 0);
+                if (rt_priority < 0 || rt_priority > sched_get_priority_max(SCHED_FIFO))
+                {
+                    fprintf(stderr, "SCHED_FIFO priority must be 0 to %d\n", sched_get_priority_max(SCHED_FIFO));
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'u':
+                if (parse_cpu_list(optarg, &capture_cpu, 1) != 1)
+                {
+                    fprintf(stderr, "Bad capture CPU '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'U':
+            {
+                int n = parse_cpu_list(optarg, worker_cpus, MAX_CPU_LIST);
+
+                if (n <= 0)
+                {
+                    fprintf(stderr, "Bad CPU list '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                n_worker_cpus = n;
+                break;
+            }
+
+            case 'L':
+                lock_memory = 1;
+                break;
+
+            case 'M':
+                motion_threshold = strtoul(optarg, NULL, 0);
+                if (motion_threshold > 255)
+                {
+                    fprintf(stderr, "Motion threshold is a luma difference, 0 to 255\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'B':
+                motion_blocks = strtoul(optarg, NULL, 0);
+                if (motion_blocks == 0)
+                {
+                    fprintf(stderr, "At least one changed block is needed\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'F':
+                if (strcmp(optarg, "max") == 0)
+                    req_fps = FPS_MAX;
+                else
+                    req_fps = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'l':
+                list_only = 1;
+                break;
+
+            case 'k':
+                if (yuv_kernel_parse(optarg, &kernel) == -1)
+                {
+                    fprintf(stderr, "Unknown kernel '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'S':
+                selftest = 1;
+                break;
+
+            case 'w':
+                n_workers = strtoul(optarg, NULL, 0);
+                if (n_workers < 1)
+                    n_workers = 1;
+                break;
+
+            case 'q':
+                ring_depth = strtoul(optarg, NULL, 0);
+                if (ring_depth < 1)
+                    ring_depth = 1;
+                break;
+
+            case 'p':
+                if (ring_policy_parse(optarg, &ring_policy) == -1)
+                {
+                    fprintf(stderr, "Unknown policy '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'b':
+                if (writer_backend_parse(optarg, &writer_backend) == -1)
+                {
+                    fprintf(stderr, "Unknown writer backend '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'W':
+                writer_threads = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'x':
+                export_path = optarg;
+                break;
+
+            case 'm':
+                if (strcmp(optarg, "mmap") == 0)
+                    io = IO_METHOD_MMAP;
+                else if (strcmp(optarg, "userptr") == 0)
+                    io = IO_METHOD_USERPTR;
+                else if (strcmp(optarg, "dmabuf") == 0)
+                    io = IO_METHOD_DMABUF;
+                else
+                {
+                    fprintf(stderr, "Unknown io method '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'n':
+                req_buffers = strtoul(optarg, NULL, 0);
+                if (req_buffers < 2)
+                    req_buffers = 2;
+                break;
+
+            case 'H':
+                use_hugepages = 1;
+                break;
+
+            case 's':
+                stats_interval = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'o':
+                stats_path = optarg;
+                break;
+
+            case 'C':
+                stream_prefix = optarg;
+                break;
+
+            case 'R':
+                segment_frames = strtoul(optarg, NULL, 0);
+                if (segment_frames < 1)
+                    segment_frames = 1;
+                break;
+
+            case 'T':
+                record_seconds = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'Y':
+                if (optarg[0] != '/' || strchr(optarg + 1, '/'))
+                {
+                    fprintf(stderr, "Bad shm name '%s', expected /name\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                shm_name = optarg;
+                break;
+
+            case 'N':
+                net_spec = optarg;
+                break;
+
+            case 'D':
+                no_disk = 1;
+                break;
+
+            case 'i':
+                in_place = 1;
+                break;
+
+            case 'G':
+                stream_copy = 1;
+                break;
+
+            case 'Z':
+                nt_stores = 1;
+                break;
+
+            case 'I':
+                prefetch_bytes = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'v':
+                verbose = 1;
+                break;
+
+            case 'E':
+                log_rate = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'A':
+                recover_seconds = strtoul(optarg, NULL, 0);
+                break;
+
+            case 'K':
+                cache_path = optarg;
+                break;
+
+            case 'e':
+                encode_device = optarg;
+                break;
+
+            case 'V':
+                if (strcmp(optarg, "h264") == 0)
+                    encode_codec = V4L2_PIX_FMT_H264;
+                else if (strcmp(optarg, "hevc") == 0 || strcmp(optarg, "h265") == 0)
+                    encode_codec = V4L2_PIX_FMT_HEVC;
+                else
+                {
+                    fprintf(stderr, "Unknown codec '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+            case 'X':
+                encode_bitrate = strtoul(optarg, NULL, 0) * 1000;
+                break;
+
+            case 'h':
+                usage(stdout, argc, argv);
+                exit(EXIT_SUCCESS);
+
+            default:
+                usage(stderr, argc, argv);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+	//argv[0] = name of program itself; bare device names are still accepted as before
+    while (optind < argc)
+        add_camera(argv[optind++]);
+    if (n_cameras == 0)
+        add_camera("/dev/video0");
+
+    if (export_path && io == IO_METHOD_USERPTR)
+    {
+        fprintf(stderr, "DMABUF export needs mmap or dmabuf io\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (no_disk && ((!shm_name && !net_spec) || stream_prefix))
+    {
+        fprintf(stderr, "--no-disk needs --shm or --net, and no --container\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // One worker keeps frames in order for the encoder; only the container takes access units
+    if (encode_device && (!stream_prefix || n_workers != 1 || no_disk || shm_name || net_spec || record_seconds ||
+                          decode_mjpeg || gray_output || output_layout != YUV_OUTPUT_RGB24 ||
+                          req_roi.width || decimate != 1))
+    {
+        fprintf(stderr, "--encode needs --container and -w 1, and no --no-disk, --shm, --net, --record, "
+                        "--decode, --gray, --output, --roi or --decimate\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (gray_output && output_layout != YUV_OUTPUT_RGB24)
+    {
+        fprintf(stderr, "--gray and --output are different layouts, pick one\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (stream_copy && in_place)
+    {
+        fprintf(stderr, "--stream-copy copies into the ring, --in-place has no copy\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (frame_log_start(verbose ? LOG_LEVEL_FRAME : LOG_LEVEL_INFO, log_rate) == -1)
+        errno_exit("frame_log_start");
+
+    kernel = yuv_kernel_select(kernel);
+    yuv_set_prefetch(prefetch_bytes);
+    printf("Using %s YUYV conversion kernel\n", yuv_kernel_name(kernel));
+
+    if (selftest)
+    {
+        int failures = yuv_selftest(1);
+
+        printf("Selftest %s\n", failures ? "FAILED" : "passed");
+        return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
+    // Locks what is mapped now and everything faulted in later, without populating whole thread stacks
+    if (lock_memory)
+    {
+#ifdef MCL_ONFAULT
+        if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) == -1 && errno == EINVAL)
+#endif
+            if (mlockall(MCL_CURRENT | MCL_FUTURE) == -1)
+                errno_exit("mlockall");
+    }
+
+    if (stats_path)
+    {
+        stats_file = fopen(stats_path, "a");
+        if (!stats_file)
+            errno_exit(stats_path);
+    }
+
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    snapshot_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd == -1 || snapshot_fd == -1)
+        errno_exit("eventfd");
+
+    CLEAR(sa);
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = request_snapshot;
+    sigaction(SIGUSR1, &sa, NULL);
+
+	printf("Starting camera driver...\n");
+    if (list_only)
+    {
+        for (i = 0; i < n_cameras; i++)
+        {
+            open_device(&cameras[i]);
+            printf("Camera device %s opened...\n", cameras[i].dev_name);
+            list_modes(&cameras[i]);
+            close_device(&cameras[i]);
+        }
+        return 0;
+    }
+
+    if (cache_path)
+    {
+        device_cache = device_cache_load(cache_path);
+        if (!device_cache)
+            fprintf(stderr, "Cannot read device cache '%s': %s, negotiating everything\n", cache_path, strerror(errno));
+    }
+
+    init_cameras();
+
+    if (device_cache)
+    {
+        if (device_cache_save(device_cache) == -1)
+            fprintf(stderr, "Cannot write device cache '%s': %s\n", cache_path, strerror(errno));
+        device_cache_destroy(device_cache);
+        device_cache = NULL;
+    }
+	
+    for (i = 0; i < n_cameras; i++)
+    {
+        cameras[i].startup_mark = stats_now_ns();
+        start_workers(&cameras[i]);
+        if (export_path)
+            start_export(&cameras[i]);
+        if (record_seconds)
+            start_recorder(&cameras[i]);
+        startup_phase(&cameras[i], STARTUP_WORKERS);
+        start_capturing(&cameras[i]);
+        startup_phase(&cameras[i], STARTUP_STREAMON);
+        report_startup(&cameras[i]);
+    }
+
+    start_realtime();
+    mainloop();
+    frame_log_flush();      // runtime messages ahead of the reports
+
+    for (i = 0; i < n_cameras; i++)
+    {
+        stop_capturing(&cameras[i]);
+        stop_export(&cameras[i]);
+        stop_recorder(&cameras[i]);
+        stop_workers(&cameras[i]);
+	
+        uninit_device(&cameras[i]);
+        close_device(&cameras[i]);
+    }
+    frame_log_stop();
+	printf("Uninitialized and closed devices...\n");
+    close(stop_fd);
+    close(snapshot_fd);
+    if (stats_file)
+        fclose(stats_file);
     fprintf(stderr, "\n");
 	printf("Exiting program!\n");
     return 0;
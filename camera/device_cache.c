@@ -0,0 +1,253 @@
+/*
+ * Filename   : device_cache.c
+ *
+ * Description: Negotiated capture settings remembered between runs
+ *            : 1) device_cache_load() reads every line of the file; a
+ *            :    missing file is an empty cache, a malformed line is skipped
+ *            : 2) find and put may be called from any thread, as devices
+ *            :    are initialized in parallel
+ *            : 3) device_cache_save() writes path.tmp and renames it over
+ *            :    path, so a crash never leaves half a file
+ *            : Line format: key TAB width height fourcc bytesperline
+ *            : sizeimage field numerator denominator
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <pthread.h>
+
+#include "device_cache.h"
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct device_cache
+{
+        char                       *path;
+        struct device_cache_entry  *entries;
+        unsigned int                count, capacity;
+        int                         dirty;      // put() changed something since load
+        pthread_mutex_t             lock;
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+// Index of key, or count if absent; under c->lock
+static unsigned int lookup(const struct device_cache *c, const char *key)
+{
+    unsigned int i;
+
+    for (i = 0; i < c->count; i++)
+        if (strcmp(c->entries[i].key, key) == 0)
+            break;
+
+    return i;
+}
+
+static int append(struct device_cache *c, const struct device_cache_entry *e)
+{
+    if (c->count == c->capacity)
+    {
+        unsigned int capacity = c->capacity ? 2 * c->capacity : 16;
+        struct device_cache_entry *entries = realloc(c->entries, capacity * sizeof(*entries));
+
+        if (!entries)
+            return -1;
+        c->entries  = entries;
+        c->capacity = capacity;
+    }
+
+    c->entries[c->count++] = *e;
+    return 0;
+}
+
+// Parses one line into e, 0 or -1 if it is not an entry
+static int parse_line(char *line, struct device_cache_entry *e)
+{
+    char *tab = strchr(line, '\t');
+    struct v4l2_pix_format *pix = &e->pix;
+
+    if (!tab || tab == line || (size_t)(tab - line) >= sizeof(e->key))
+        return -1;
+
+    memset(e, 0, sizeof(*e));
+    memcpy(e->key, line, tab - line);
+
+    if (sscanf(tab + 1, "%u %u %x %u %u %u %u %u",
+               &pix->width, &pix->height, &pix->pixelformat, &pix->bytesperline, &pix->sizeimage,
+               &pix->field, &e->timeperframe.numerator, &e->timeperframe.denominator) != 8)
+        return -1;
+
+    return 0;
+}
+
+/**
+ * @name   device_cache_load
+ * @brief  Reads the cache file at path
+ * @param  path - file, created by device_cache_save if missing
+ *
+ * @return cache, NULL with errno set if the file exists but can't be read
+ */
+
+struct device_cache *device_cache_load(const char *path)
+{
+    struct device_cache *c = calloc(1, sizeof(*c));
+    struct device_cache_entry e;
+    char line[DEVICE_CACHE_KEY + 128];
+    FILE *fp;
+
+    if (!c)
+        return NULL;
+    c->path = strdup(path);
+    if (!c->path)
+    {
+        free(c);
+        return NULL;
+    }
+    pthread_mutex_init(&c->lock, NULL);
+
+    fp = fopen(path, "r");
+    if (!fp)
+    {
+        if (errno == ENOENT)
+            return c;   // first run
+        device_cache_destroy(c);
+        return NULL;
+    }
+
+    while (fgets(line, sizeof(line), fp))
+        if (parse_line(line, &e) == 0 && lookup(c, e.key) == c->count && append(c, &e) == -1)
+            break;
+
+    fclose(fp);
+    return c;
+}
+
+/**
+ * @name   device_cache_save
+ * @brief  Writes the cache back if anything was put since it was loaded
+ * @param  c - cache
+ *
+ * @return 0, -1 with errno set
+ */
+
+int device_cache_save(struct device_cache *c)
+{
+    char tmp[4096];
+    unsigned int i;
+    FILE *fp;
+    int ret = 0;
+
+    pthread_mutex_lock(&c->lock);
+    if (!c->dirty)
+        goto out;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", c->path);
+    fp = fopen(tmp, "w");
+    if (!fp)
+    {
+        ret = -1;
+        goto out;
+    }
+
+    for (i = 0; i < c->count; i++)
+    {
+        const struct device_cache_entry *e = &c->entries[i];
+        const struct v4l2_pix_format *pix = &e->pix;
+
+        fprintf(fp, "%s\t%u %u %08x %u %u %u %u %u\n", e->key,
+                pix->width, pix->height, pix->pixelformat, pix->bytesperline, pix->sizeimage,
+                pix->field, e->timeperframe.numerator, e->timeperframe.denominator);
+    }
+
+    if (fclose(fp) != 0 || rename(tmp, c->path) == -1)
+    {
+        ret = -1;
+        remove(tmp);
+        goto out;
+    }
+    c->dirty = 0;
+
+out:
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+void device_cache_destroy(struct device_cache *c)
+{
+    if (!c)
+        return;
+
+    pthread_mutex_destroy(&c->lock);
+    free(c->entries);
+    free(c->path);
+    free(c);
+}
+
+// Copies the entry for key into e; 0, or -1 if there is none
+int device_cache_find(struct device_cache *c, const char *key, struct device_cache_entry *e)
+{
+    unsigned int i;
+    int ret = -1;
+
+    pthread_mutex_lock(&c->lock);
+    i = lookup(c, key);
+    if (i < c->count)
+    {
+        *e = c->entries[i];
+        ret = 0;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    return ret;
+}
+
+// Adds e or replaces the entry with its key; 0, or -1 out of memory
+int device_cache_put(struct device_cache *c, const struct device_cache_entry *in)
+{
+    struct device_cache_entry kept, *e = &kept;
+    unsigned int i;
+    int ret = 0;
+
+    // Only what the file holds, so an unchanged entry compares equal to the one loaded
+    memset(e, 0, sizeof(*e));
+    snprintf(e->key, sizeof(e->key), "%s", in->key);
+    e->pix.width        = in->pix.width;
+    e->pix.height       = in->pix.height;
+    e->pix.pixelformat  = in->pix.pixelformat;
+    e->pix.bytesperline = in->pix.bytesperline;
+    e->pix.sizeimage    = in->pix.sizeimage;
+    e->pix.field        = in->pix.field;
+    e->timeperframe     = in->timeperframe;
+
+    pthread_mutex_lock(&c->lock);
+    i = lookup(c, e->key);
+    if (i < c->count)
+    {
+        if (memcmp(&c->entries[i], e, sizeof(*e)) != 0)
+        {
+            c->entries[i] = *e;
+            c->dirty = 1;
+        }
+    }
+    else if (append(c, e) == 0)
+        c->dirty = 1;
+    else
+        ret = -1;
+    pthread_mutex_unlock(&c->lock);
+
+    return ret;
+}
@@ -0,0 +1,51 @@
+/*
+ * Filename   : device_cache.h
+ *
+ * Description: Negotiated capture settings remembered between runs
+ *            : One entry per device and request: the key names the device
+ *            : (driver, bus info and card from VIDIOC_QUERYCAP) and what was
+ *            : asked of it, the value is the format and frame interval the
+ *            : driver settled on. A later run that finds the device still
+ *            : set up that way skips renegotiating it.
+ *            : Entries are kept as text lines in one file, read at startup
+ *            : and written back whole.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef DEVICE_CACHE_H
+#define DEVICE_CACHE_H
+
+#include <linux/videodev2.h>
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define DEVICE_CACHE_KEY    256         // bytes of a key, terminator included
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct device_cache_entry
+{
+        char                    key[DEVICE_CACHE_KEY];  // no tabs or newlines
+        struct v4l2_pix_format  pix;            // what VIDIOC_S_FMT returned; size, fourcc, strides and field are kept
+        struct v4l2_fract       timeperframe;   // what VIDIOC_S_PARM returned, 0/0 if not set
+};
+
+struct device_cache;
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct device_cache *device_cache_load(const char *path);
+int device_cache_save(struct device_cache *c);
+void device_cache_destroy(struct device_cache *c);
+
+int device_cache_find(struct device_cache *c, const char *key, struct device_cache_entry *e);
+int device_cache_put(struct device_cache *c, const struct device_cache_entry *e);
+
+#endif /* DEVICE_CACHE_H */
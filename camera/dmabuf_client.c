@@ -0,0 +1,172 @@
+/*
+ * Filename   : dmabuf_client.c
+ *
+ * Description: Example consumer for the capture driver's DMABUF export
+ *            : Code Flow:
+ *            : 1) Connect to the export socket
+ *            : 2) Receive format and DMABUF fds, mmap each buffer read-only
+ *            : 3) For each announced frame, read it in place and release it
+ *            : Stands in for a GPU upload or hardware encoder import, which
+ *            : would take the same fds instead of mmap'ing them.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : https://www.kernel.org/doc/html/latest/driver-api/dma-buf.html
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <linux/dma-buf.h>
+
+#include "dmabuf_export.h"
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+static void errno_exit(const char *s)
+{
+        fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+}
+
+/**
+ * @name   receive_hello
+ * @brief  Receives the format and DMABUF fds sent on connect
+ * @param  sock  - connected socket
+ *         hello - ptr to store format
+ *         fds   - array of DMABUF_EXPORT_MAX_BUFFERS to store fds
+ *
+ * @return none, exits on failure
+ */
+
+static void receive_hello(int sock, struct dmabuf_export_hello *hello, int *fds)
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        char            buf[CMSG_SPACE(sizeof(int) * DMABUF_EXPORT_MAX_BUFFERS)];
+        struct cmsghdr  align;
+    } control;
+
+    memset(&msg, 0, sizeof(msg));
+    iov.iov_base = hello;
+    iov.iov_len  = sizeof(*hello);
+    msg.msg_iov  = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    if (recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != (ssize_t)sizeof(*hello))
+        errno_exit("recvmsg");
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (hello->magic != DMABUF_EXPORT_MAGIC || hello->n_buffers > DMABUF_EXPORT_MAX_BUFFERS ||
+        !cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(int) * hello->n_buffers))
+    {
+        fprintf(stderr, "Bad hello from exporter\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * hello->n_buffers);
+}
+
+int main(int argc, char **argv)
+{
+    struct dmabuf_export_hello hello;
+    struct sockaddr_un addr;
+    int fds[DMABUF_EXPORT_MAX_BUFFERS];
+    void *maps[DMABUF_EXPORT_MAX_BUFFERS];
+    unsigned int i, frames = 0, count;
+    int sock;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s socket [frames]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    count = argc > 2 ? strtoul(argv[2], NULL, 0) : 0;
+
+    sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1)
+        errno_exit("socket");
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        errno_exit("connect");
+
+    receive_hello(sock, &hello, fds);
+    printf("%ux%u %.4s, %u buffers\n", hello.width, hello.height, (char *)&hello.pixelformat, hello.n_buffers);
+
+    for (i = 0; i < hello.n_buffers; i++)
+    {
+        maps[i] = mmap(NULL, hello.length[i], PROT_READ, MAP_SHARED, fds[i], 0);
+        if (maps[i] == MAP_FAILED)
+            errno_exit("mmap");
+    }
+
+    while (count == 0 || frames < count)
+    {
+        struct dmabuf_export_frame frame;
+        struct dmabuf_export_release rel;
+        struct dma_buf_sync sync;
+        const unsigned char *p;
+        unsigned long long sum = 0;
+        ssize_t n;
+
+        n = recv(sock, &frame, sizeof(frame), MSG_WAITALL);
+        if (n == 0)
+            break;
+        if (n != (ssize_t)sizeof(frame))
+            errno_exit("recv");
+        if (frame.index >= hello.n_buffers)
+            continue;
+
+        // Bracket CPU access so caches are coherent with the device
+        sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+        ioctl(fds[frame.index], DMA_BUF_IOCTL_SYNC, &sync);
+
+        p = maps[frame.index];
+        for (i = 0; i < frame.bytesused; i += 2) // luma bytes of YUYV
+            sum += p[i];
+
+        sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+        ioctl(fds[frame.index], DMA_BUF_IOCTL_SYNC, &sync);
+
+        rel.index = frame.index;
+        if (send(sock, &rel, sizeof(rel), MSG_NOSIGNAL) != (ssize_t)sizeof(rel))
+            errno_exit("send");
+
+        frames++;
+        printf("frame seq %u buffer %u: %u bytes, mean luma %llu\n", frame.sequence, frame.index,
+               frame.bytesused, frame.bytesused ? sum / (frame.bytesused / 2) : 0);
+    }
+
+    for (i = 0; i < hello.n_buffers; i++)
+    {
+        munmap(maps[i], hello.length[i]);
+        close(fds[i]);
+    }
+    close(sock);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,421 @@
+/*
+ * Filename   : dmabuf_export.c
+ *
+ * Description: DMABUF export server on a Unix stream socket
+ *            : 1) Consumer connects, gets the format and every buffer's
+ *            :    DMABUF fd in one SCM_RIGHTS message
+ *            : 2) Each captured frame is announced to every consumer; the
+ *            :    buffer is held (not re-queued) while any consumer has it
+ *            : 3) Consumers send the index back when done; the last release
+ *            :    re-queues the buffer through the capture code's callback
+ *            : Sockets are non-blocking and collected in one epoll set whose
+ *            : fd the capture loop watches, so a stuck consumer can only miss
+ *            : frames, never stall capture.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : man 7 unix, man 3 cmsg, man 7 epoll
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#define _GNU_SOURCE             /* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+#include "dmabuf_export.h"
+#include "frame_log.h"
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct dmabuf_client
+{
+        int             fd;             // -1 if slot unused
+        uint32_t        held;           // bitmask of buffer indices this client owns
+        unsigned char   rx[sizeof(struct dmabuf_export_release)];
+        size_t          rx_len;         // partial release message bytes
+};
+
+struct dmabuf_export
+{
+        int                         listen_fd;
+        int                         epoll_fd;       // listen_fd and every consumer
+        char                        path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+        int                         dmabuf_fds[DMABUF_EXPORT_MAX_BUFFERS];
+        unsigned int                n_buffers;
+        unsigned int                max_held;
+        struct dmabuf_export_hello  hello;
+        struct dmabuf_client        clients[DMABUF_EXPORT_MAX_CLIENTS];
+        unsigned int                refs[DMABUF_EXPORT_MAX_BUFFERS];
+        dmabuf_requeue_fn           requeue;
+        void                       *ctx;
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+// Adds fd to the export's epoll set; c is NULL for the listening socket
+static int watch_fd(struct dmabuf_export *x, int fd, struct dmabuf_client *c)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events   = EPOLLIN;
+    ev.data.ptr = c;
+
+    return epoll_ctl(x->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/**
+ * @name   dmabuf_export_create
+ * @brief  Starts listening for DMABUF consumers
+ * @param  path       - Unix socket path, replaced if it exists
+ *         dmabuf_fds - fds from VIDIOC_EXPBUF, one per capture buffer
+ *         n_buffers  - number of capture buffers
+ *         hello      - format sent to each consumer, magic and n_buffers are filled in
+ *         requeue    - called with a buffer index once all consumers released it
+ *         ctx        - passed to requeue
+ *
+ * @descr  At most n_buffers - 2 buffers are ever held by consumers so the
+ *         driver always has buffers to fill
+ *
+ * @return export server, NULL with errno set on failure
+ */
+
+struct dmabuf_export *dmabuf_export_create(const char *path, const int *dmabuf_fds, unsigned int n_buffers,
+                                           const struct dmabuf_export_hello *hello,
+                                           dmabuf_requeue_fn requeue, void *ctx)
+{
+    struct dmabuf_export *x;
+    struct sockaddr_un addr;
+    unsigned int i;
+
+    if (n_buffers > DMABUF_EXPORT_MAX_BUFFERS || strlen(path) >= sizeof(addr.sun_path))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    x = calloc(1, sizeof(*x));
+    if (!x)
+        return NULL;
+
+    x->n_buffers = n_buffers;
+    x->max_held  = n_buffers > 2 ? n_buffers - 2 : 0;
+    x->requeue   = requeue;
+    x->ctx       = ctx;
+    x->hello     = *hello;
+    x->hello.magic     = DMABUF_EXPORT_MAGIC;
+    x->hello.n_buffers = n_buffers;
+    memcpy(x->dmabuf_fds, dmabuf_fds, n_buffers * sizeof(int));
+    strcpy(x->path, path);
+    for (i = 0; i < DMABUF_EXPORT_MAX_CLIENTS; i++)
+        x->clients[i].fd = -1;
+
+    x->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (x->epoll_fd == -1)
+    {
+        free(x);
+        return NULL;
+    }
+
+    x->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (x->listen_fd == -1)
+    {
+        close(x->epoll_fd);
+        free(x);
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if (bind(x->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(x->listen_fd, DMABUF_EXPORT_MAX_CLIENTS) == -1 ||
+        watch_fd(x, x->listen_fd, NULL) == -1)
+    {
+        int err = errno;
+
+        close(x->listen_fd);
+        close(x->epoll_fd);
+        free(x);
+        errno = err;
+        return NULL;
+    }
+
+    return x;
+}
+
+// Gives back everything a client held, then closes it
+static void drop_client(struct dmabuf_export *x, struct dmabuf_client *c)
+{
+    unsigned int i;
+
+    for (i = 0; i < x->n_buffers; i++)
+    {
+        if (c->held & (1u << i))
+        {
+            if (--x->refs[i] == 0)
+                x->requeue(x->ctx, i);
+        }
+    }
+
+    epoll_ctl(x->epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->held = 0;
+    c->rx_len = 0;
+}
+
+/**
+ * @name   accept_client
+ * @brief  Accepts a consumer and sends it the format and DMABUF fds
+ * @param  x - export server
+ *
+ * @return none
+ */
+
+static void accept_client(struct dmabuf_export *x)
+{
+    struct dmabuf_client *c = NULL;
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union
+    {
+        char            buf[CMSG_SPACE(sizeof(int) * DMABUF_EXPORT_MAX_BUFFERS)];
+        struct cmsghdr  align;
+    } control;
+    unsigned int i;
+    int fd;
+
+    fd = accept4(x->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
+        return;
+
+    for (i = 0; i < DMABUF_EXPORT_MAX_CLIENTS && !c; i++)
+        if (x->clients[i].fd == -1)
+            c = &x->clients[i];
+
+    if (!c)
+    {
+        log_warn("dmabuf export: too many consumers");
+        close(fd);
+        return;
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&control, 0, sizeof(control));
+    iov.iov_base = &x->hello;
+    iov.iov_len  = sizeof(x->hello);
+    msg.msg_iov  = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * x->n_buffers);
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int) * x->n_buffers);
+    memcpy(CMSG_DATA(cmsg), x->dmabuf_fds, sizeof(int) * x->n_buffers);
+
+    // Fresh socket buffer, the hello always fits
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(x->hello))
+    {
+        log_error("dmabuf export: hello failed %d, %s", errno, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    if (watch_fd(x, fd, c) == -1)
+    {
+        log_error("dmabuf export: epoll_ctl failed %d, %s", errno, strerror(errno));
+        close(fd);
+        return;
+    }
+
+    c->fd = fd;
+    c->held = 0;
+    c->rx_len = 0;
+    log_info("dmabuf export: consumer %u connected", (unsigned int)(c - x->clients));
+}
+
+/**
+ * @name   read_releases
+ * @brief  Reads release messages from a consumer
+ * @param  x - export server
+ *         c - readable client
+ *
+ * @descr  Releases for buffers the client doesn't hold are ignored
+ *         EOF or a socket error drops the client and its buffers
+ *
+ * @return none
+ */
+
+static void read_releases(struct dmabuf_export *x, struct dmabuf_client *c)
+{
+    unsigned char buf[64 * sizeof(struct dmabuf_export_release)];
+    ssize_t n;
+    size_t i;
+
+    n = recv(c->fd, buf, sizeof(buf), 0);
+    if (n == 0 || (n == -1 && errno != EAGAIN && errno != EINTR))
+    {
+        log_info("dmabuf export: consumer %u disconnected", (unsigned int)(c - x->clients));
+        drop_client(x, c);
+        return;
+    }
+
+    for (i = 0; n > 0 && i < (size_t)n; i++)
+    {
+        c->rx[c->rx_len++] = buf[i];
+        if (c->rx_len == sizeof(struct dmabuf_export_release))
+        {
+            struct dmabuf_export_release rel;
+
+            memcpy(&rel, c->rx, sizeof(rel));
+            c->rx_len = 0;
+
+            if (rel.index < x->n_buffers && (c->held & (1u << rel.index)))
+            {
+                c->held &= ~(1u << rel.index);
+                if (--x->refs[rel.index] == 0)
+                    x->requeue(x->ctx, rel.index);
+            }
+        }
+    }
+}
+
+/**
+ * @name   dmabuf_export_frame
+ * @brief  Announces a dequeued buffer to every consumer
+ * @param  x     - export server
+ *         frame - buffer index and metadata
+ *
+ * @descr  A consumer whose socket is full misses the frame instead of
+ *         blocking capture; the frame isn't exported at all if consumers
+ *         would be holding too many buffers
+ *
+ * @return 1 if consumers now hold the buffer (caller must not re-queue it),
+ *         0 if the caller should re-queue it as usual
+ */
+
+int dmabuf_export_frame(struct dmabuf_export *x, const struct dmabuf_export_frame *frame)
+{
+    unsigned int i, held = 0;
+
+    if (frame->index >= x->n_buffers)
+        return 0;
+
+    for (i = 0; i < x->n_buffers; i++)
+        if (x->refs[i])
+            held++;
+
+    if (held >= x->max_held)
+        return 0;
+
+    for (i = 0; i < DMABUF_EXPORT_MAX_CLIENTS; i++)
+    {
+        struct dmabuf_client *c = &x->clients[i];
+
+        if (c->fd == -1)
+            continue;
+
+        if (send(c->fd, frame, sizeof(*frame), MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t)sizeof(*frame))
+        {
+            c->held |= 1u << frame->index;
+            x->refs[frame->index]++;
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            drop_client(x, c);
+    }
+
+    return x->refs[frame->index] > 0;
+}
+
+/**
+ * @name   dmabuf_export_fd
+ * @brief  Returns an fd that is readable whenever the export has work
+ * @param  x - export server
+ *
+ * @descr  The fd is an epoll set over the listening and consumer sockets,
+ *         so the caller watches one fd however many consumers connect
+ *
+ * @return fd to poll for input, call dmabuf_export_handle when readable
+ */
+
+int dmabuf_export_fd(const struct dmabuf_export *x)
+{
+    return x->epoll_fd;
+}
+
+/**
+ * @name   dmabuf_export_handle
+ * @brief  Accepts consumers and processes releases, never blocks
+ * @param  x - export server
+ *
+ * @return none
+ */
+
+void dmabuf_export_handle(struct dmabuf_export *x)
+{
+    struct epoll_event events[DMABUF_EXPORT_MAX_CLIENTS + 1];
+    int i, n;
+
+    n = epoll_wait(x->epoll_fd, events, DMABUF_EXPORT_MAX_CLIENTS + 1, 0);
+
+    for (i = 0; i < n; i++)
+    {
+        struct dmabuf_client *c = events[i].data.ptr;
+
+        if (!c)
+            accept_client(x);
+        else if (c->fd != -1) // may have been dropped earlier in this batch
+            read_releases(x, c);
+    }
+}
+
+/**
+ * @name   dmabuf_export_destroy
+ * @brief  Disconnects consumers and removes the socket
+ * @param  x - export server
+ *
+ * @descr  Call after VIDIOC_STREAMOFF; held buffers are not re-queued
+ *         The DMABUF fds stay open, they belong to the capture buffers
+ *
+ * @return none
+ */
+
+void dmabuf_export_destroy(struct dmabuf_export *x)
+{
+    unsigned int i;
+
+    if (!x)
+        return;
+
+    for (i = 0; i < DMABUF_EXPORT_MAX_CLIENTS; i++)
+        if (x->clients[i].fd != -1)
+            close(x->clients[i].fd);
+
+    close(x->listen_fd);
+    close(x->epoll_fd);
+    unlink(x->path);
+    free(x);
+}
@@ -0,0 +1,82 @@
+/*
+ * Filename   : dmabuf_export.h
+ *
+ * Description: Zero-copy export of V4L2 capture buffers as DMABUF fds
+ *            : Consumers connect to a Unix stream socket and receive the
+ *            : format plus every buffer's DMABUF fd once (SCM_RIGHTS), then a
+ *            : small notification per frame. A buffer stays dequeued until
+ *            : every consumer it was sent to releases it.
+ *            : The wire structs below are the whole protocol.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : https://www.kernel.org/doc/html/latest/userspace-api/media/v4l/vidioc-expbuf.html
+ *            : https://www.kernel.org/doc/html/latest/driver-api/dma-buf.html
+ */
+
+#ifndef DMABUF_EXPORT_H
+#define DMABUF_EXPORT_H
+
+#include <stdint.h>
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define DMABUF_EXPORT_MAGIC       0x46424D44  // "DMBF"
+#define DMABUF_EXPORT_MAX_BUFFERS 32
+#define DMABUF_EXPORT_MAX_CLIENTS 8
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+// Server -> consumer, once on connect, carries n_buffers DMABUF fds in order
+struct dmabuf_export_hello
+{
+        uint32_t        magic;
+        uint32_t        n_buffers;
+        uint32_t        width;
+        uint32_t        height;
+        uint32_t        pixelformat;    // V4L2 fourcc
+        uint32_t        bytesperline;
+        uint32_t        sizeimage;
+        uint32_t        length[DMABUF_EXPORT_MAX_BUFFERS];
+};
+
+// Server -> consumer, per frame; the consumer owns buffer index until it releases it
+struct dmabuf_export_frame
+{
+        uint32_t        index;
+        uint32_t        sequence;
+        uint32_t        bytesused;
+        uint32_t        flags;          // v4l2_buffer flags
+        int64_t         timestamp_ns;
+};
+
+// Consumer -> server, done reading buffer index
+struct dmabuf_export_release
+{
+        uint32_t        index;
+};
+
+// Called when the last consumer releases a buffer, to give it back to the driver
+typedef void (*dmabuf_requeue_fn)(void *ctx, unsigned int index);
+
+struct dmabuf_export;
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct dmabuf_export *dmabuf_export_create(const char *path, const int *dmabuf_fds, unsigned int n_buffers,
+                                           const struct dmabuf_export_hello *hello,
+                                           dmabuf_requeue_fn requeue, void *ctx);
+void dmabuf_export_destroy(struct dmabuf_export *x);
+
+int dmabuf_export_frame(struct dmabuf_export *x, const struct dmabuf_export_frame *frame);
+
+int dmabuf_export_fd(const struct dmabuf_export *x);
+void dmabuf_export_handle(struct dmabuf_export *x);
+
+#endif /* DMABUF_EXPORT_H */
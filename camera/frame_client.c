@@ -0,0 +1,360 @@
+/*
+ * Filename   : frame_client.c
+ *
+ * Description: Example consumer for the capture driver's --shm and --net sinks
+ *            : Code Flow:
+ *            : 1) shm:/name maps the ring read-only and copies out the newest
+ *            :    frame whenever the published count moves
+ *            : 2) tcp:HOST:PORT connects and reads header + frame records
+ *            : 3) udp:PORT binds and reassembles frames from their datagrams;
+ *            :    a frame with a datagram missing is counted and dropped
+ *            : Every frame received is exactly what a per-frame file would have
+ *            : held, so -o writes the last one as a viewable .ppm/.pgm/.jpg.
+ *            : Latency is against CLOCK_MONOTONIC, meaningful on the same host.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+#include "frame_shm.h"
+#include "frame_net.h"
+
+/*************************************************************************
+ *                  Global Variables                                     *
+ *************************************************************************/
+
+static volatile sig_atomic_t stop;
+static unsigned long    frames, incomplete, missed;
+static double           latency_ms;             // sum over frames
+
+static unsigned char   *last;                   // newest complete frame, for -o
+static size_t           last_len, last_size;
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Counts a complete frame and keeps a copy of it
+static void got_frame(unsigned int tag, unsigned int sequence, uint64_t capture_ns,
+                      const unsigned char *data, size_t len)
+{
+    double ms = (double)(int64_t)(now_ns() - capture_ns) / 1e6;
+
+    printf("frame %u seq %u: %zu bytes, %.2f ms after capture\n", tag, sequence, len, ms);
+    frames++;
+    latency_ms += ms;
+
+    if (len > last_size)
+    {
+        free(last);
+        last = malloc(len);
+        last_size = last ? len : 0;
+    }
+    if (last)
+    {
+        memcpy(last, data, len);
+        last_len = len;
+    }
+}
+
+static int read_shm(const char *name, unsigned long count)
+{
+    struct shm_reader *r = shm_reader_open(name);
+    struct timespec nap = { 0, 1000000 };
+    unsigned char *buf;
+    uint64_t next = 0;
+
+    if (!r)
+    {
+        perror(name);
+        return -1;
+    }
+    buf = malloc(r->header->slot_size);
+    if (!buf)
+    {
+        shm_reader_close(r);
+        return -1;
+    }
+    printf("%s: %ux%u, %u slots\n", name, r->header->width, r->header->height, r->header->slots);
+
+    next = shm_reader_published(r);
+    while (!stop && (!count || frames < count))
+    {
+        uint64_t published = shm_reader_published(r);
+        struct shm_slot_header meta;
+        ssize_t len;
+
+        if (published <= next)
+        {
+            if (shm_reader_closed(r))
+                break;
+            nanosleep(&nap, NULL);
+            continue;
+        }
+
+        // Newest only; anything between was overwritten or is not worth catching up on
+        missed += published - 1 - next;
+        do
+            len = shm_reader_frame(r, published - 1, buf, r->header->slot_size, &meta);
+        while (len == -1 && errno == EAGAIN);
+
+        if (len == -1)
+            missed++;
+        else
+            got_frame(meta.tag, meta.sequence, meta.capture_ns, buf, len);
+        next = published;
+    }
+
+    free(buf);
+    shm_reader_close(r);
+    return 0;
+}
+
+// Reads exactly len bytes, 0 at end of stream
+static int read_all(int fd, void *buf, size_t len)
+{
+    unsigned char *p = buf;
+
+    while (len)
+    {
+        ssize_t r = read(fd, p, len);
+
+        if (r == -1 && errno == EINTR && !stop)
+            continue;
+        if (r <= 0)
+            return r;
+        p += r;
+        len -= r;
+    }
+    return 1;
+}
+
+static int open_net(const char *host, const char *port, int type)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, err;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = type;
+    hints.ai_flags    = host ? 0 : AI_PASSIVE;
+    if ((err = getaddrinfo(host, port, &hints, &res)) != 0)
+    {
+        fprintf(stderr, "%s: %s\n", port, gai_strerror(err));
+        return -1;
+    }
+    for (ai = res; ai && fd == -1; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd != -1 && (host ? connect(fd, ai->ai_addr, ai->ai_addrlen) : bind(fd, ai->ai_addr, ai->ai_addrlen)) == -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+        perror(port);
+    return fd;
+}
+
+static int read_tcp(char *spec, unsigned long count)
+{
+    char *colon = strrchr(spec, ':');
+    unsigned char *buf = NULL;
+    size_t size = 0;
+    int fd;
+
+    if (!colon)
+    {
+        fprintf(stderr, "Expected tcp:HOST:PORT\n");
+        return -1;
+    }
+    *colon = '\0';
+    fd = open_net(spec, colon + 1, SOCK_STREAM);
+    if (fd == -1)
+        return -1;
+
+    while (!stop && (!count || frames < count))
+    {
+        struct net_frame_header h;
+
+        if (read_all(fd, &h, sizeof(h)) <= 0)
+            break;
+        if (h.magic != NET_MAGIC || h.header_size != sizeof(h))
+        {
+            fprintf(stderr, "bad frame header\n");
+            break;
+        }
+        if (h.length > size)
+        {
+            free(buf);
+            size = h.length;
+            buf = malloc(size);
+            if (!buf)
+                break;
+        }
+        if (read_all(fd, buf, h.length) <= 0)
+            break;
+        got_frame(h.tag, h.sequence, h.capture_ns, buf, h.length);
+    }
+
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+static int read_udp(const char *port, unsigned long count)
+{
+    unsigned char datagram[NET_UDP_DATAGRAM];
+    unsigned char *buf = NULL;
+    size_t size = 0, received = 0;
+    unsigned int tag = 0;
+    int fd = open_net(NULL, port, SOCK_DGRAM), have = 0;
+    int rcvbuf = 8 << 20;
+
+    if (fd == -1)
+        return -1;
+    // A whole frame arrives in a burst; capped by net.core.rmem_max
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+    while (!stop && (!count || frames < count))
+    {
+        const struct net_frame_header *h = (const struct net_frame_header *)datagram;
+        ssize_t r = recv(fd, datagram, sizeof(datagram), 0);
+
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r < (ssize_t)sizeof(*h) || h->magic != NET_MAGIC ||
+            h->offset + h->chunk > h->length || sizeof(*h) + h->chunk > (size_t)r)
+            continue;
+
+        if (!have || h->tag != tag)
+        {
+            if (have && received)
+                incomplete++;
+            if (h->length > size)
+            {
+                free(buf);
+                size = h->length;
+                buf = malloc(size);
+                if (!buf)
+                    break;
+            }
+            tag = h->tag;
+            received = 0;
+            have = 1;
+        }
+
+        memcpy(buf + h->offset, datagram + sizeof(*h), h->chunk);
+        received += h->chunk;
+        if (received == h->length)
+        {
+            got_frame(h->tag, h->sequence, h->capture_ns, buf, h->length);
+            received = 0;
+            have = 0;
+        }
+    }
+
+    free(buf);
+    close(fd);
+    return 0;
+}
+
+static void request_stop(int sig)
+{
+    stop = 1;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction sa;
+    unsigned long count = 0;
+    const char *out = NULL;
+    char *source;
+    int c, ret;
+
+    while ((c = getopt(argc, argv, "c:o:h")) != -1)
+    {
+        switch (c)
+        {
+            case 'c':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            case 'o':
+                out = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c frames] [-o last_frame_file] shm:/name | tcp:HOST:PORT | udp:PORT\n", argv[0]);
+                return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-c frames] [-o last_frame_file] shm:/name | tcp:HOST:PORT | udp:PORT\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    source = argv[optind];
+
+    // No SA_RESTART: a blocking read returns so the loops can see stop
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = request_stop;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (strncmp(source, "shm:", 4) == 0)
+        ret = read_shm(source + 4, count);
+    else if (strncmp(source, "tcp:", 4) == 0)
+        ret = read_tcp(source + 4, count);
+    else if (strncmp(source, "udp:", 4) == 0)
+        ret = read_udp(source + 4, count);
+    else
+    {
+        fprintf(stderr, "Unknown source '%s'\n", source);
+        return EXIT_FAILURE;
+    }
+    if (ret == -1)
+        return EXIT_FAILURE;
+
+    printf("%lu frames received, %lu missed, %lu incomplete", frames, missed, incomplete);
+    if (frames)
+        printf(", %.2f ms mean latency", latency_ms / frames);
+    printf("\n");
+
+    if (out && last_len)
+    {
+        FILE *fp = fopen(out, "wb");
+
+        if (!fp || fwrite(last, 1, last_len, fp) != last_len)
+            perror(out);
+        if (fp)
+            fclose(fp);
+    }
+    free(last);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,948 @@
+/*
+ * Filename   : frame_encoder.c
+ *
+ * Description: H.264 / H.265 compression on a V4L2 memory-to-memory encoder
+ *            : 1) frame_encoder_create() sets the coded format on CAPTURE,
+ *            :    then YUYV at the camera's stride on OUTPUT, or NV12 if the
+ *            :    encoder will not take YUYV, then the rate controls, and
+ *            :    streams both queues on; single and multi-planar drivers
+ *            :    are both handled, with one plane per buffer
+ *            : 2) frame_encoder_submit() takes a free OUTPUT buffer and
+ *            :    queues the caller's DMABUF in it, or copies / repacks the
+ *            :    frame into its mapping; the buffer timestamp carries the
+ *            :    submit number, which the driver copies to the access unit
+ *            :    and which finds the frame's tag and driver timestamp again
+ *            : 3) The encoder thread dequeues OUTPUT buffers, handing
+ *            :    imported frames back through their done(), and CAPTURE
+ *            :    buffers, giving each access unit to the out callback
+ *            : 4) frame_encoder_stop() asks for the last access unit with
+ *            :    V4L2_ENC_CMD_STOP and waits up to ENC_DRAIN_MS for it
+ *            : One thread submits; releases may come from any thread.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : https://www.kernel.org/doc/html/latest/userspace-api/media/v4l/dev-encoder.html
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include <linux/videodev2.h>
+
+#include "frame_encoder.h"
+#include "frame_stats.h"
+#include "frame_log.h"
+#include "yuv_convert.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define ENC_META            64          // submitted frames remembered until their access unit is out
+#define ENC_IDLE_MS         5           // poll period while the driver reports nothing to wait on
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+enum enc_mode
+{
+        ENC_IMPORT,                     // capture buffers queued as DMABUF
+        ENC_COPY,                       // YUYV copied into the encoder's buffers
+        ENC_NV12,                       // repacked into them as NV12
+};
+
+static const char *enc_mode_names[] = { "DMABUF import of the capture buffers", "YUYV copy", "NV12 repack" };
+
+// An OUTPUT buffer
+struct enc_input
+{
+        unsigned char      *start;              // mapped, copy and repack only
+        size_t              length;
+        int                 busy;               // queued to the encoder, under lock
+        writer_done_fn      done;               // import only: frame owner, called on dequeue
+        void               *ctx;
+};
+
+// A CAPTURE buffer
+struct enc_coded
+{
+        unsigned char      *start;
+        size_t              length;
+};
+
+struct enc_meta
+{
+        uint64_t            n;                  // submit number, also the buffer timestamp
+        unsigned int        tag, sequence;
+        uint64_t            capture_ns;
+};
+
+struct frame_encoder
+{
+        struct frame_encoder_config cfg;
+        int                 fd;
+        int                 mplane;             // the driver has the multi-planar API only
+        enum v4l2_buf_type  out_type, cap_type;
+        enum enc_mode       mode;
+        unsigned int        in_stride;          // OUTPUT bytes per line
+        size_t              in_size;            // OUTPUT bytes per frame
+        char                card[32];
+        struct enc_input    inputs[ENC_INPUT_BUFFERS];
+        unsigned int        n_inputs;
+        struct enc_coded    coded[ENC_CODED_BUFFERS];
+        unsigned int        n_coded;
+        size_t              max_size;           // smallest CAPTURE buffer
+        encoder_out_fn      out;
+        void               *ctx;
+        int                 wake_fd;
+        pthread_t           thread;
+        int                 started;
+
+        pthread_mutex_t     lock;
+        // under lock
+        struct enc_meta     meta[ENC_META];
+        uint64_t            submitted;          // next submit number
+        int                 streaming;
+        int                 stopping;
+        int                 drain_cmd;          // V4L2_ENC_CMD_STOP was accepted
+        unsigned long       no_room;
+
+        // encoder thread
+        struct enc_meta     last;               // of the previous access unit
+        int                 drained;            // the last access unit is out
+        int                 timed_out;
+        unsigned long       units, keyframes, empty, errors;
+        uint64_t            bytes;
+};
+
+/*************************************************************************
+ *                         Buffer Functions                              *
+ *************************************************************************/
+
+static int xioctl(int fh, unsigned long request, void *arg)
+{
+    int r;
+
+    do
+    {
+        r = ioctl(fh, request, arg);
+    } while (r == -1 && errno == EINTR);
+
+    return r;
+}
+
+static void init_buf(const struct frame_encoder *e, struct v4l2_buffer *b, struct v4l2_plane *plane,
+                     enum v4l2_buf_type type, enum v4l2_memory memory, unsigned int index)
+{
+    memset(b, 0, sizeof(*b));
+    memset(plane, 0, sizeof(*plane));
+    b->type   = type;
+    b->memory = memory;
+    b->index  = index;
+    if (e->mplane)
+    {
+        b->m.planes = plane;
+        b->length   = 1;
+    }
+}
+
+// Single-planar buffers keep these in struct v4l2_buffer itself
+static __u32 *bytesused_of(const struct frame_encoder *e, struct v4l2_buffer *b)
+{
+    return e->mplane ? &b->m.planes[0].bytesused : &b->bytesused;
+}
+
+static __u32 *length_of(const struct frame_encoder *e, struct v4l2_buffer *b)
+{
+    return e->mplane ? &b->m.planes[0].length : &b->length;
+}
+
+static __u32 *offset_of(const struct frame_encoder *e, struct v4l2_buffer *b)
+{
+    return e->mplane ? &b->m.planes[0].m.mem_offset : &b->m.offset;
+}
+
+static __s32 *fd_of(const struct frame_encoder *e, struct v4l2_buffer *b)
+{
+    return e->mplane ? &b->m.planes[0].m.fd : &b->m.fd;
+}
+
+static int queue_coded(struct frame_encoder *e, unsigned int index)
+{
+    struct v4l2_buffer buf;
+    struct v4l2_plane plane;
+
+    init_buf(e, &buf, &plane, e->cap_type, V4L2_MEMORY_MMAP, index);
+    *length_of(e, &buf) = e->coded[index].length;
+
+    return xioctl(e->fd, VIDIOC_QBUF, &buf);
+}
+
+// Maps count buffers of type, the OUTPUT ones writable
+static int map_buffers(struct frame_encoder *e, enum v4l2_buf_type type, unsigned int count)
+{
+    unsigned int i;
+
+    for (i = 0; i < count; i++)
+    {
+        struct v4l2_buffer buf;
+        struct v4l2_plane plane;
+        int output = type == e->out_type;
+        void *p;
+
+        init_buf(e, &buf, &plane, type, V4L2_MEMORY_MMAP, i);
+        if (xioctl(e->fd, VIDIOC_QUERYBUF, &buf) == -1)
+            return -1;
+
+        p = mmap(NULL, *length_of(e, &buf), output ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED,
+                 e->fd, *offset_of(e, &buf));
+        if (p == MAP_FAILED)
+            return -1;
+
+        if (output)
+        {
+            e->inputs[i].start  = p;
+            e->inputs[i].length = *length_of(e, &buf);
+        }
+        else
+        {
+            e->coded[i].start  = p;
+            e->coded[i].length = *length_of(e, &buf);
+            if (!e->max_size || e->coded[i].length < e->max_size)
+                e->max_size = e->coded[i].length;
+        }
+    }
+
+    return 0;
+}
+
+// count buffers or fewer; the number granted, -1 on failure
+static int request_buffers(struct frame_encoder *e, enum v4l2_buf_type type, enum v4l2_memory memory, unsigned int count)
+{
+    struct v4l2_requestbuffers req;
+
+    memset(&req, 0, sizeof(req));
+    req.count  = count;
+    req.type   = type;
+    req.memory = memory;
+    if (xioctl(e->fd, VIDIOC_REQBUFS, &req) == -1)
+        return -1;
+    if (req.count == 0)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return req.count < count ? req.count : count;
+}
+
+/*************************************************************************
+ *                         Setup Functions                               *
+ *************************************************************************/
+
+/**
+ * @name   set_format
+ * @brief  S_FMT on one queue, single plane
+ * @param  e          - encoder
+ *         type       - its OUTPUT or CAPTURE type
+ *         fourcc     - format asked for
+ *         bpl, size  - bytes per line and per buffer asked for, 0 for the driver's choice
+ *         exact      - width and height must come back as asked
+ *         out_bpl, out_size - what the driver settled on
+ *
+ * @return 0, -1 with EINVAL if the driver wants something else
+ */
+
+static int set_format(struct frame_encoder *e, enum v4l2_buf_type type, unsigned int fourcc,
+                      unsigned int bpl, size_t size, int exact, unsigned int *out_bpl, size_t *out_size)
+{
+    struct v4l2_format fmt;
+    unsigned int width, height, pixelformat;
+
+    memset(&fmt, 0, sizeof(fmt));
+    fmt.type = type;
+    if (e->mplane)
+    {
+        fmt.fmt.pix_mp.width                     = e->cfg.width;
+        fmt.fmt.pix_mp.height                    = e->cfg.height;
+        fmt.fmt.pix_mp.pixelformat               = fourcc;
+        fmt.fmt.pix_mp.field                     = V4L2_FIELD_NONE;
+        fmt.fmt.pix_mp.num_planes                = 1;
+        fmt.fmt.pix_mp.plane_fmt[0].bytesperline = bpl;
+        fmt.fmt.pix_mp.plane_fmt[0].sizeimage    = size;
+    }
+    else
+    {
+        fmt.fmt.pix.width        = e->cfg.width;
+        fmt.fmt.pix.height       = e->cfg.height;
+        fmt.fmt.pix.pixelformat  = fourcc;
+        fmt.fmt.pix.field        = V4L2_FIELD_NONE;
+        fmt.fmt.pix.bytesperline = bpl;
+        fmt.fmt.pix.sizeimage    = size;
+    }
+
+    if (xioctl(e->fd, VIDIOC_S_FMT, &fmt) == -1)
+        return -1;
+
+    if (e->mplane)
+    {
+        width       = fmt.fmt.pix_mp.width;
+        height      = fmt.fmt.pix_mp.height;
+        pixelformat = fmt.fmt.pix_mp.pixelformat;
+        *out_bpl    = fmt.fmt.pix_mp.plane_fmt[0].bytesperline;
+        *out_size   = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+        if (fmt.fmt.pix_mp.num_planes != 1)
+            pixelformat = 0;
+    }
+    else
+    {
+        width       = fmt.fmt.pix.width;
+        height      = fmt.fmt.pix.height;
+        pixelformat = fmt.fmt.pix.pixelformat;
+        *out_bpl    = fmt.fmt.pix.bytesperline;
+        *out_size   = fmt.fmt.pix.sizeimage;
+    }
+
+    if (pixelformat != fourcc || (exact && (width != e->cfg.width || height != e->cfg.height)))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Best effort: the driver's default stays for anything it refuses
+static void set_control(struct frame_encoder *e, unsigned int id, int value, const char *name)
+{
+    struct v4l2_control ctrl;
+
+    ctrl.id    = id;
+    ctrl.value = value;
+    if (xioctl(e->fd, VIDIOC_S_CTRL, &ctrl) == -1)
+        fprintf(stderr, "%s: %s not supported, using the driver default\n", e->cfg.device, name);
+}
+
+/**
+ * @name   negotiate
+ * @brief  Checks the device is an encoder and sets both formats, the frame rate and the rate controls
+ * @param  e - encoder, device open
+ *
+ * @descr  The coded format goes first, as the encoder interface asks;
+ *         YUYV on OUTPUT is tried at the camera's stride and imported
+ *         only if the driver keeps that stride, NV12 is the fallback
+ *         Every key frame repeats the stream headers, so any of them in
+ *         the container starts a decodable sequence
+ *
+ * @return 0, -1 with errno set
+ */
+
+static int negotiate(struct frame_encoder *e)
+{
+    const struct frame_encoder_config *cfg = &e->cfg;
+    struct v4l2_capability cap;
+    struct v4l2_streamparm parm;
+    unsigned int caps, bpl;
+    size_t size;
+
+    if (xioctl(e->fd, VIDIOC_QUERYCAP, &cap) == -1)
+        return -1;
+    caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ? cap.device_caps : cap.capabilities;
+    if (!(caps & (V4L2_CAP_VIDEO_M2M | V4L2_CAP_VIDEO_M2M_MPLANE)) || !(caps & V4L2_CAP_STREAMING))
+    {
+        fprintf(stderr, "%s is not a memory-to-memory device\n", cfg->device);
+        errno = ENODEV;
+        return -1;
+    }
+    snprintf(e->card, sizeof(e->card), "%s", (const char *)cap.card);
+    e->mplane   = !(caps & V4L2_CAP_VIDEO_M2M);
+    e->out_type = e->mplane ? V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    e->cap_type = e->mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    // Room for about a byte a pixel, far more than any access unit at a sane bitrate
+    if (set_format(e, e->cap_type, cfg->codec, 0, (size_t)cfg->width * cfg->height, 0, &bpl, &size) == -1)
+    {
+        fprintf(stderr, "%s does not encode %.4s\n", cfg->device, (const char *)&cfg->codec);
+        return -1;
+    }
+
+    if (set_format(e, e->out_type, V4L2_PIX_FMT_YUYV, cfg->stride, (size_t)cfg->stride * cfg->height, 1,
+                   &e->in_stride, &e->in_size) == 0)
+        e->mode = cfg->import && e->in_stride == cfg->stride && e->in_size <= cfg->import_size ? ENC_IMPORT : ENC_COPY;
+    else if (set_format(e, e->out_type, V4L2_PIX_FMT_NV12, cfg->width, (size_t)cfg->width * cfg->height * 3 / 2, 1,
+                        &e->in_stride, &e->in_size) == 0 && !(cfg->height & 1))
+        e->mode = ENC_NV12;
+    else
+    {
+        fprintf(stderr, "%s takes neither YUYV nor NV12 at %ux%u\n", cfg->device, cfg->width, cfg->height);
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (cfg->fps_num && cfg->fps_den)
+    {
+        memset(&parm, 0, sizeof(parm));
+        parm.type = e->out_type;
+        parm.parm.output.timeperframe.numerator   = cfg->fps_num;
+        parm.parm.output.timeperframe.denominator = cfg->fps_den;
+        if (xioctl(e->fd, VIDIOC_S_PARM, &parm) == -1)
+            fprintf(stderr, "%s: frame interval not supported, rate control may be off\n", cfg->device);
+    }
+
+    if (cfg->bitrate)
+        set_control(e, V4L2_CID_MPEG_VIDEO_BITRATE, cfg->bitrate, "bitrate");
+    if (cfg->gop)
+        set_control(e, V4L2_CID_MPEG_VIDEO_GOP_SIZE, cfg->gop, "GOP size");
+    set_control(e, V4L2_CID_MPEG_VIDEO_REPEAT_SEQ_HEADER, 1, "repeated stream headers");
+    set_control(e, V4L2_CID_MPEG_VIDEO_HEADER_MODE, V4L2_MPEG_VIDEO_HEADER_MODE_JOINED_WITH_1ST_FRAME,
+                "stream headers joined with the first frame");
+
+    return 0;
+}
+
+/*************************************************************************
+ *                         Encoder Thread                                *
+ *************************************************************************/
+
+// Raw frames the encoder is done with; imported ones go back to their owner
+static void dequeue_inputs(struct frame_encoder *e)
+{
+    for (;;)
+    {
+        struct v4l2_buffer buf;
+        struct v4l2_plane plane;
+        struct enc_input *in;
+        writer_done_fn done;
+
+        init_buf(e, &buf, &plane, e->out_type, e->mode == ENC_IMPORT ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP, 0);
+        if (xioctl(e->fd, VIDIOC_DQBUF, &buf) == -1)
+        {
+            if (errno != EAGAIN && errno != EPIPE && errno != EINVAL)
+                log_warn("%s: output VIDIOC_DQBUF failed, %s", e->cfg.device, strerror(errno));
+            return;
+        }
+        if (buf.index >= e->n_inputs)
+            continue;
+
+        in   = &e->inputs[buf.index];
+        done = in->done;
+        in->done = NULL;
+        if (buf.flags & V4L2_BUF_FLAG_ERROR)
+            e->errors++;
+        if (done)
+            done(in->ctx, buf.flags & V4L2_BUF_FLAG_ERROR ? EIO : 0);
+
+        pthread_mutex_lock(&e->lock);
+        in->busy = 0;
+        pthread_mutex_unlock(&e->lock);
+    }
+}
+
+// Access units out to the callback, empty buffers straight back to the encoder
+static void dequeue_coded(struct frame_encoder *e)
+{
+    for (;;)
+    {
+        struct v4l2_buffer buf;
+        struct v4l2_plane plane;
+        struct encoded_frame f;
+        struct enc_meta m;
+        size_t offset = 0, used;
+        uint64_t n;
+
+        init_buf(e, &buf, &plane, e->cap_type, V4L2_MEMORY_MMAP, 0);
+        if (xioctl(e->fd, VIDIOC_DQBUF, &buf) == -1)
+        {
+            if (errno == EPIPE)
+                e->drained = 1;
+            else if (errno != EAGAIN && errno != EINVAL)
+                log_warn("%s: capture VIDIOC_DQBUF failed, %s", e->cfg.device, strerror(errno));
+            return;
+        }
+        if (buf.index >= e->n_coded)
+            continue;
+
+        if (buf.flags & V4L2_BUF_FLAG_LAST)
+            e->drained = 1;
+        if (e->mplane)
+            offset = plane.data_offset;
+        used = *bytesused_of(e, &buf);
+        if (used <= offset || (buf.flags & V4L2_BUF_FLAG_ERROR))
+        {
+            e->empty++;
+            if (queue_coded(e, buf.index) == -1)
+                log_warn("%s: capture VIDIOC_QBUF failed, %s", e->cfg.device, strerror(errno));
+            continue;
+        }
+
+        // Units the driver emits on their own, e.g. stream headers, go under the frame before them
+        n = (uint64_t)buf.timestamp.tv_sec * 1000000 + buf.timestamp.tv_usec;
+        pthread_mutex_lock(&e->lock);
+        m = e->meta[n % ENC_META];
+        if (m.n == n && n < e->submitted)
+            e->last = m;
+        pthread_mutex_unlock(&e->lock);
+
+        f.data       = e->coded[buf.index].start + offset;
+        f.size       = used - offset;
+        f.tag        = e->last.tag;
+        f.sequence   = e->last.sequence;
+        f.capture_ns = e->last.capture_ns;
+        f.keyframe   = !!(buf.flags & V4L2_BUF_FLAG_KEYFRAME);
+        f.index      = buf.index;
+
+        e->units++;
+        e->keyframes += f.keyframe;
+        e->bytes     += f.size;
+        e->out(e->ctx, &f);
+    }
+}
+
+// Every raw frame back from the encoder: all there is without V4L2_ENC_CMD_STOP
+static int inputs_idle(struct frame_encoder *e)
+{
+    unsigned int i;
+    int busy = 0;
+
+    pthread_mutex_lock(&e->lock);
+    for (i = 0; i < e->n_inputs; i++)
+        busy |= e->inputs[i].busy;
+    pthread_mutex_unlock(&e->lock);
+
+    return !busy;
+}
+
+/**
+ * @name   encode_thread
+ * @brief  Dequeues both queues as the driver finishes buffers, until drained after a stop
+ * @param  arg - encoder
+ *
+ * @descr  vb2 reports POLLERR while neither queue holds a buffer, which
+ *         happens between frames once every access unit is with the
+ *         writer; the encoder fd then sits out one ENC_IDLE_MS poll of
+ *         the wakeup eventfd alone, which releases also write to
+ *
+ * @return NULL
+ */
+
+static void *encode_thread(void *arg)
+{
+    struct frame_encoder *e = arg;
+    uint64_t deadline = 0;
+    int idle = 0;
+
+    for (;;)
+    {
+        struct pollfd pfd[2];
+        int stopping, drain_cmd, timeout = -1;
+        uint64_t v;
+
+        dequeue_inputs(e);
+        dequeue_coded(e);
+
+        pthread_mutex_lock(&e->lock);
+        stopping  = e->stopping;
+        drain_cmd = e->drain_cmd;
+        pthread_mutex_unlock(&e->lock);
+
+        if (stopping)
+        {
+            uint64_t now = stats_now_ns();
+
+            if (e->drained || (!drain_cmd && inputs_idle(e)))
+                break;
+            if (!deadline)
+                deadline = now + (uint64_t)ENC_DRAIN_MS * 1000000;
+            if (now >= deadline)
+            {
+                e->timed_out = 1;
+                break;
+            }
+            timeout = (deadline - now) / 1000000 + 1;
+        }
+        if (idle && (timeout == -1 || timeout > ENC_IDLE_MS))
+            timeout = ENC_IDLE_MS;
+
+        pfd[0].fd      = e->wake_fd;
+        pfd[0].events  = POLLIN;
+        pfd[1].fd      = e->fd;
+        pfd[1].events  = POLLIN | POLLOUT;
+        pfd[1].revents = 0;
+        if (poll(pfd, idle ? 1 : 2, timeout) == -1 && errno != EINTR)
+        {
+            log_error("%s: poll failed, %s", e->cfg.device, strerror(errno));
+            break;
+        }
+        if (pfd[0].revents & POLLIN)
+        {
+            ssize_t r = read(e->wake_fd, &v, sizeof(v));
+
+            (void)r;
+        }
+        idle = !idle && (pfd[1].revents & POLLERR);
+    }
+
+    return NULL;
+}
+
+/*************************************************************************
+ *                         Encoder Functions                             *
+ *************************************************************************/
+
+/**
+ * @name   frame_encoder_create
+ * @brief  Opens and sets up the encoder device and starts its thread
+ * @param  cfg - device, codec, the frames that will be submitted and rate controls
+ *         out - gets every access unit, on the encoder thread
+ *         ctx - passed to out
+ *
+ * @descr  Import is dropped for a copy if the driver refuses DMABUF on
+ *         its OUTPUT queue; frame_encoder_describe() says which it is
+ *
+ * @return encoder, NULL with errno set on failure
+ */
+
+struct frame_encoder *frame_encoder_create(const struct frame_encoder_config *cfg, encoder_out_fn out, void *ctx)
+{
+    struct frame_encoder *e = calloc(1, sizeof(*e));
+    enum v4l2_buf_type type;
+    unsigned int i;
+    int n;
+
+    if (!e)
+        return NULL;
+
+    e->cfg     = *cfg;
+    e->out     = out;
+    e->ctx     = ctx;
+    e->wake_fd = -1;
+    pthread_mutex_init(&e->lock, NULL);
+
+    e->fd = open(cfg->device, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (e->fd == -1 || negotiate(e) == -1)
+        goto fail;
+
+    n = -1;
+    if (e->mode == ENC_IMPORT)
+    {
+        n = request_buffers(e, e->out_type, V4L2_MEMORY_DMABUF, ENC_INPUT_BUFFERS);
+        if (n == -1)
+            e->mode = ENC_COPY;
+    }
+    if (e->mode != ENC_IMPORT)
+    {
+        n = request_buffers(e, e->out_type, V4L2_MEMORY_MMAP, ENC_INPUT_BUFFERS);
+        if (n == -1 || map_buffers(e, e->out_type, n) == -1)
+            goto fail;
+    }
+    e->n_inputs = n;
+
+    n = request_buffers(e, e->cap_type, V4L2_MEMORY_MMAP, ENC_CODED_BUFFERS);
+    if (n == -1)
+        goto fail;
+    e->n_coded = n;
+    if (map_buffers(e, e->cap_type, e->n_coded) == -1)
+        goto fail;
+    for (i = 0; i < e->n_coded; i++)
+        if (queue_coded(e, i) == -1)
+            goto fail;
+
+    e->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (e->wake_fd == -1)
+        goto fail;
+
+    type = e->cap_type;
+    if (xioctl(e->fd, VIDIOC_STREAMON, &type) == -1)
+        goto fail;
+    e->streaming = 1;
+    type = e->out_type;
+    if (xioctl(e->fd, VIDIOC_STREAMON, &type) == -1)
+        goto fail;
+
+    errno = pthread_create(&e->thread, NULL, encode_thread, e);
+    if (errno)
+        goto fail;
+    e->started = 1;
+
+    return e;
+
+fail:
+    {
+        int err = errno;
+
+        frame_encoder_destroy(e);
+        errno = err;
+    }
+    return NULL;
+}
+
+/**
+ * @name   frame_encoder_stop
+ * @brief  Drains the encoder, stops its thread and both queues
+ * @param  e - encoder
+ *
+ * @descr  Access units still coming out go to the out callback before
+ *         this returns; imported frames the encoder still held get their
+ *         done() with ECANCELED. Later submits are refused. Safe to call
+ *         twice.
+ *
+ * @return none
+ */
+
+void frame_encoder_stop(struct frame_encoder *e)
+{
+    struct v4l2_encoder_cmd cmd;
+    enum v4l2_buf_type type;
+    uint64_t one = 1;
+    unsigned int i;
+    int streaming;
+
+    pthread_mutex_lock(&e->lock);
+    e->stopping = 1;
+    streaming = e->streaming;
+    pthread_mutex_unlock(&e->lock);
+
+    if (e->started)
+    {
+        ssize_t r;
+
+        memset(&cmd, 0, sizeof(cmd));
+        cmd.cmd = V4L2_ENC_CMD_STOP;
+        if (xioctl(e->fd, VIDIOC_ENCODER_CMD, &cmd) == 0)
+        {
+            pthread_mutex_lock(&e->lock);
+            e->drain_cmd = 1;
+            pthread_mutex_unlock(&e->lock);
+        }
+
+        r = write(e->wake_fd, &one, sizeof(one));
+        (void)r;
+        pthread_join(e->thread, NULL);
+        e->started = 0;
+    }
+
+    // Frees every buffer the driver still holds, so the owners can have them back
+    if (streaming)
+    {
+        type = e->out_type;
+        xioctl(e->fd, VIDIOC_STREAMOFF, &type);
+        type = e->cap_type;
+        xioctl(e->fd, VIDIOC_STREAMOFF, &type);
+
+        pthread_mutex_lock(&e->lock);
+        e->streaming = 0;
+        pthread_mutex_unlock(&e->lock);
+    }
+
+    for (i = 0; i < e->n_inputs; i++)
+    {
+        struct enc_input *in = &e->inputs[i];
+
+        if (in->done)
+            in->done(in->ctx, ECANCELED);
+        in->done = NULL;
+        in->busy = 0;
+    }
+}
+
+void frame_encoder_destroy(struct frame_encoder *e)
+{
+    unsigned int i;
+
+    if (!e)
+        return;
+
+    frame_encoder_stop(e);
+
+    for (i = 0; i < e->n_inputs; i++)
+        if (e->inputs[i].start)
+            munmap(e->inputs[i].start, e->inputs[i].length);
+    for (i = 0; i < e->n_coded; i++)
+        if (e->coded[i].start)
+            munmap(e->coded[i].start, e->coded[i].length);
+    if (e->wake_fd != -1)
+        close(e->wake_fd);
+    if (e->fd != -1)
+        close(e->fd);
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+}
+
+/**
+ * @name   frame_encoder_submit
+ * @brief  Queues one YUYV frame to be encoded
+ * @param  e          - encoder
+ *         tag        - frame number
+ *         sequence   - driver sequence number
+ *         capture_ns - driver timestamp
+ *         data, size - the frame, at the configured stride
+ *         dmabuf_fd  - the same frame as a DMABUF, -1 if it is not one
+ *         done, ctx  - data is free once done() runs: before this returns
+ *                      when copied, on the encoder thread when imported
+ *
+ * @descr  Never blocks. A frame that comes with no DMABUF while the
+ *         encoder imports is refused, as is one with no free input buffer.
+ *
+ * @return 0 if taken, -1 with errno set (ESHUTDOWN, ENOBUFS, EINVAL) if
+ *         not, and done() will not be called
+ */
+
+int frame_encoder_submit(struct frame_encoder *e, unsigned int tag, unsigned int sequence, uint64_t capture_ns,
+                         const void *data, size_t size, int dmabuf_fd,
+                         writer_done_fn done, void *ctx)
+{
+    const struct frame_encoder_config *cfg = &e->cfg;
+    struct v4l2_buffer buf;
+    struct v4l2_plane plane;
+    struct enc_input *in = NULL;
+    struct enc_meta *m;
+    unsigned int i, row;
+    uint64_t n;
+
+    if ((e->mode == ENC_IMPORT && dmabuf_fd == -1) || size < (size_t)cfg->stride * cfg->height)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&e->lock);
+    if (e->stopping)
+    {
+        pthread_mutex_unlock(&e->lock);
+        errno = ESHUTDOWN;
+        return -1;
+    }
+    for (i = 0; i < e->n_inputs && !in; i++)
+        if (!e->inputs[i].busy)
+            in = &e->inputs[i];
+    if (!in)
+    {
+        e->no_room++;
+        pthread_mutex_unlock(&e->lock);
+        errno = ENOBUFS;
+        return -1;
+    }
+    in->busy = 1;
+    n = e->submitted++;
+    m = &e->meta[n % ENC_META];
+    m->n          = n;
+    m->tag        = tag;
+    m->sequence   = sequence;
+    m->capture_ns = capture_ns;
+    pthread_mutex_unlock(&e->lock);
+
+    init_buf(e, &buf, &plane, e->out_type, e->mode == ENC_IMPORT ? V4L2_MEMORY_DMABUF : V4L2_MEMORY_MMAP,
+             in - e->inputs);
+    buf.field             = V4L2_FIELD_NONE;
+    buf.timestamp.tv_sec  = n / 1000000;
+    buf.timestamp.tv_usec = n % 1000000;
+
+    switch (e->mode)
+    {
+    case ENC_IMPORT:
+        *fd_of(e, &buf)        = dmabuf_fd;
+        *length_of(e, &buf)    = cfg->import_size;
+        *bytesused_of(e, &buf) = e->in_size;
+        in->done = done;
+        in->ctx  = ctx;
+        break;
+
+    case ENC_COPY:
+        // The driver's sizeimage may pad past the frame; the check above only covers stride * height
+        if (e->in_stride == cfg->stride)
+            memcpy(in->start, data, size < e->in_size ? size : e->in_size);
+        else
+            for (row = 0; row < cfg->height; row++)
+                memcpy(in->start + (size_t)row * e->in_stride, (const unsigned char *)data + (size_t)row * cfg->stride,
+                       (size_t)cfg->width * 2);
+        *length_of(e, &buf)    = in->length;
+        *bytesused_of(e, &buf) = e->in_size;
+        break;
+
+    case ENC_NV12:
+        yuyv_to_nv12(data, cfg->stride, cfg->width, cfg->height,
+                     in->start, e->in_stride, in->start + (size_t)e->in_stride * cfg->height, e->in_stride);
+        *length_of(e, &buf)    = in->length;
+        *bytesused_of(e, &buf) = e->in_size;
+        break;
+    }
+
+    if (xioctl(e->fd, VIDIOC_QBUF, &buf) == -1)
+    {
+        int err = errno;
+
+        in->done = NULL;
+        pthread_mutex_lock(&e->lock);
+        in->busy = 0;
+        pthread_mutex_unlock(&e->lock);
+        errno = err;
+        return -1;
+    }
+
+    if (e->mode != ENC_IMPORT)
+        done(ctx, 0);
+
+    return 0;
+}
+
+// An access unit is written, its buffer goes back to the encoder
+void frame_encoder_release(struct frame_encoder *e, unsigned int index)
+{
+    uint64_t one = 1;
+    ssize_t r;
+    int streaming;
+
+    pthread_mutex_lock(&e->lock);
+    streaming = e->streaming;
+    pthread_mutex_unlock(&e->lock);
+
+    // After a stop the buffers are not queued again, destroy just unmaps them
+    if (!streaming || index >= e->n_coded)
+        return;
+
+    if (queue_coded(e, index) == -1)
+        log_warn("%s: capture VIDIOC_QBUF failed, %s", e->cfg.device, strerror(errno));
+    r = write(e->wake_fd, &one, sizeof(one));
+    (void)r;
+}
+
+// Largest access unit, every CAPTURE buffer holds this much
+size_t frame_encoder_max_size(const struct frame_encoder *e)
+{
+    return e->max_size;
+}
+
+// e.g. "encoder /dev/video11 (vicodec): H264 640x480 from YUYV copy, 4 input and 8 coded buffers of 460800 bytes"
+void frame_encoder_describe(const struct frame_encoder *e, FILE *fp)
+{
+    fprintf(fp, "encoder %s (%s): %.4s %ux%u from %s, %u input and %u coded buffers of %zu bytes\n",
+            e->cfg.device, e->card, (const char *)&e->cfg.codec, e->cfg.width, e->cfg.height,
+            enc_mode_names[e->mode], e->n_inputs, e->n_coded, e->max_size);
+}
+
+void frame_encoder_report(const struct frame_encoder *e, FILE *fp)
+{
+    double raw = (double)e->submitted * e->cfg.width * e->cfg.height * 2;
+
+    fprintf(fp, "encoder %s: %lu frames in, %lu access units out (%lu key frames), %.1f MB, %.0f:1 against YUYV; "
+            "%lu refused with no free input, %lu failed, %lu empty",
+            e->cfg.device, (unsigned long)e->submitted, e->units, e->keyframes, e->bytes / 1e6,
+            e->bytes ? raw / e->bytes : 0.0, e->no_room, e->errors, e->empty);
+    fprintf(fp, e->timed_out ? "; gave up waiting for the last access unit\n" : "\n");
+}
@@ -0,0 +1,87 @@
+/*
+ * Filename   : frame_encoder.h
+ *
+ * Description: H.264 / H.265 compression on a V4L2 memory-to-memory encoder
+ *            : Raw frames go in on the device's OUTPUT queue, the bitstream
+ *            : comes back one access unit per CAPTURE buffer. Capture
+ *            : buffers exported as DMABUF are queued to the encoder as they
+ *            : are, with no copy, when the encoder takes YUYV at the camera's
+ *            : stride; otherwise frames are copied, or repacked to NV12, into
+ *            : the encoder's own buffers. A thread dequeues both sides and
+ *            : hands each access unit to a callback, which gives the buffer
+ *            : back with frame_encoder_release() once it is written.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : https://www.kernel.org/doc/html/latest/userspace-api/media/v4l/dev-encoder.html
+ */
+
+#ifndef FRAME_ENCODER_H
+#define FRAME_ENCODER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "frame_writer.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define ENC_INPUT_BUFFERS   4           // raw frames the encoder may hold at once
+#define ENC_CODED_BUFFERS   8           // access units out with the encoder or the writer
+#define ENC_DRAIN_MS        1000        // stop waits this long for the last access unit
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct frame_encoder_config
+{
+        const char         *device;             // e.g. /dev/video11
+        unsigned int        codec;              // V4L2_PIX_FMT_H264 or V4L2_PIX_FMT_HEVC
+        unsigned int        width, height;      // of the YUYV frames submitted
+        unsigned int        stride;             // their bytes per line
+        unsigned int        fps_num, fps_den;   // frame interval, 0/0 if unknown
+        unsigned int        bitrate;            // bits per second, 0 for the driver default
+        unsigned int        gop;                // frames between key frames, 0 for the default
+        int                 import;             // frames may be submitted as DMABUF fds
+        size_t              import_size;        // length of those buffers
+};
+
+// One access unit, valid until frame_encoder_release(index)
+struct encoded_frame
+{
+        const unsigned char *data;
+        size_t              size;
+        unsigned int        tag;                // of the frame it was encoded from
+        unsigned int        sequence;
+        uint64_t            capture_ns;
+        int                 keyframe;
+        unsigned int        index;              // for frame_encoder_release()
+};
+
+// Called on the encoder thread
+typedef void (*encoder_out_fn)(void *ctx, const struct encoded_frame *f);
+
+struct frame_encoder;
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct frame_encoder *frame_encoder_create(const struct frame_encoder_config *cfg, encoder_out_fn out, void *ctx);
+void frame_encoder_stop(struct frame_encoder *e);
+void frame_encoder_destroy(struct frame_encoder *e);
+
+int frame_encoder_submit(struct frame_encoder *e, unsigned int tag, unsigned int sequence, uint64_t capture_ns,
+                         const void *data, size_t size, int dmabuf_fd,
+                         writer_done_fn done, void *ctx);
+void frame_encoder_release(struct frame_encoder *e, unsigned int index);
+
+size_t frame_encoder_max_size(const struct frame_encoder *e);
+void frame_encoder_describe(const struct frame_encoder *e, FILE *fp);
+void frame_encoder_report(const struct frame_encoder *e, FILE *fp);
+
+#endif /* FRAME_ENCODER_H */
@@ -0,0 +1,591 @@
+/*
+ * Filename   : frame_log.c
+ *
+ * Description: Asynchronous, rate-limited logger for the capture path
+ *            : 1) frame_log_write() checks the call site's rate limit, claims
+ *            :    a ring slot with one compare-and-swap and copies the format
+ *            :    pointer and the arguments' raw values into it
+ *            : 2) The log thread wakes every LOG_DRAIN_MS, formats every
+ *            :    published record, one printf conversion at a time, and
+ *            :    flushes stdout/stderr once per batch
+ *            : The ring is a bounded MPSC queue with a sequence number per
+ *            : slot, so producers never wait on each other or the consumer.
+ *            : Before frame_log_start() and after frame_log_stop() records
+ *            : are formatted and written on the caller's thread.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : https://www.1024cores.net/home/lock-free-algorithms/queues/bounded-mpmc-queue
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <errno.h>
+#include <sys/types.h>
+#include <pthread.h>
+
+#include "frame_log.h"
+#include "frame_stats.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define LOG_LINE_MAX        512
+#define LOG_SPEC_MAX        32          // one conversion, rebuilt with its '*' filled in
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+union log_arg
+{
+        long long               i;
+        unsigned long long      u;
+        double                  d;
+        const void             *p;
+};
+
+struct log_record
+{
+        _Atomic uint64_t        seq;            // == position + 1 once published
+        uint64_t                time_ns;
+        const char             *fmt;
+        unsigned char           level;
+        unsigned char           complete;       // every argument captured, else only nspecs
+        unsigned short          nspecs;         // conversions with their arguments captured
+        unsigned int            suppressed;     // by the rate limit before this one
+        union log_arg           args[LOG_MAX_ARGS];
+        char                    strings[LOG_STRING_BYTES];  // %s copies, args point here
+};
+
+enum log_length { LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z, LEN_J, LEN_T, LEN_LONG_DOUBLE };
+
+// One printf conversion as parsed out of a format
+struct log_spec
+{
+        const char             *start;          // the '%'
+        const char             *end;            // after the conversion character
+        const char             *flags, *width, *precision;  // within [start, end)
+        size_t                  flags_len, width_len, precision_len;
+        int                     star_width, star_precision;
+        enum log_length         length;
+        char                    conv;
+};
+
+static struct
+{
+        struct log_record       records[LOG_RING_RECORDS];
+        _Atomic uint64_t        head;           // next position to claim, producers
+        _Atomic uint64_t        tail;           // next position to format, log thread
+        atomic_int              level;
+        unsigned int            rate;           // records per second per call site, 0 = unlimited
+        atomic_int              running;
+        atomic_int              stop;
+        pthread_t               thread;
+        uint64_t                start_ns;
+
+        atomic_ulong            written, dropped, suppressed;
+} log_ring = { .level = LOG_LEVEL_INFO };
+
+static const char *level_tags[LOG_LEVELS] = { "error: ", "warning: ", "", "" };
+
+/*************************************************************************
+ *                        Format Functions                               *
+ *************************************************************************/
+
+// Parses the conversion at p ('%'); 0 at the end of fmt or on one we cannot defer
+static int parse_spec(const char *p, struct log_spec *s)
+{
+    memset(s, 0, sizeof(*s));
+    s->start = p++;
+
+    s->flags = p;
+    while (*p && strchr("-+ #0'", *p))
+        p++;
+    s->flags_len = p - s->flags;
+
+    s->width = p;
+    if (*p == '*')
+    {
+        s->star_width = 1;
+        p++;
+    }
+    else
+        while (*p >= '0' && *p <= '9')
+            p++;
+    s->width_len = p - s->width;
+
+    s->precision = p;
+    if (*p == '.')
+    {
+        p++;
+        if (*p == '*')
+        {
+            s->star_precision = 1;
+            p++;
+        }
+        else
+            while (*p >= '0' && *p <= '9')
+                p++;
+    }
+    s->precision_len = p - s->precision;
+
+    switch (*p)
+    {
+        case 'h': s->length = p[1] == 'h' ? LEN_HH : LEN_H; p += s->length == LEN_HH ? 2 : 1; break;
+        case 'l': s->length = p[1] == 'l' ? LEN_LL : LEN_L; p += s->length == LEN_LL ? 2 : 1; break;
+        case 'z': s->length = LEN_Z; p++; break;
+        case 'j': s->length = LEN_J; p++; break;
+        case 't': s->length = LEN_T; p++; break;
+        case 'L': s->length = LEN_LONG_DOUBLE; p++; break;
+        default: break;
+    }
+
+    s->conv = *p;
+    if (!s->conv || !strchr("diouxXcfFeEgGaAsp%", s->conv))
+        return 0;
+    s->end = p + 1;
+    return 1;
+}
+
+// Arguments a conversion takes from the va_list
+static unsigned int spec_args(const struct log_spec *s)
+{
+    return s->conv == '%' ? 0 : 1 + s->star_width + s->star_precision;
+}
+
+static void capture_args(struct log_record *r, const char *fmt, va_list ap)
+{
+    unsigned int n = 0;
+    size_t strings = 0;
+    struct log_spec s;
+    const char *p;
+
+    r->nspecs   = 0;
+    r->complete = 0;
+    for (p = strchr(fmt, '%'); p; p = strchr(s.end, '%'))
+    {
+        union log_arg *a;
+
+        if (!parse_spec(p, &s) || n + spec_args(&s) > LOG_MAX_ARGS)
+            return;     // formatted up to here
+
+        if (s.star_width)
+            r->args[n++].i = va_arg(ap, int);
+        if (s.star_precision)
+            r->args[n++].i = va_arg(ap, int);
+
+        a = &r->args[n];
+        switch (s.conv)
+        {
+            case '%':
+                break;
+
+            case 'd': case 'i':
+                n++;
+                switch (s.length)
+                {
+                    case LEN_L:  a->i = va_arg(ap, long); break;
+                    case LEN_LL: a->i = va_arg(ap, long long); break;
+                    case LEN_Z:  a->i = va_arg(ap, ssize_t); break;
+                    case LEN_J:  a->i = va_arg(ap, intmax_t); break;
+                    case LEN_T:  a->i = va_arg(ap, ptrdiff_t); break;
+                    default:     a->i = va_arg(ap, int); break;
+                }
+                if (s.length == LEN_HH)
+                    a->i = (signed char)a->i;
+                else if (s.length == LEN_H)
+                    a->i = (short)a->i;
+                break;
+
+            case 'o': case 'u': case 'x': case 'X':
+                n++;
+                switch (s.length)
+                {
+                    case LEN_L:  a->u = va_arg(ap, unsigned long); break;
+                    case LEN_LL: a->u = va_arg(ap, unsigned long long); break;
+                    case LEN_Z:  a->u = va_arg(ap, size_t); break;
+                    case LEN_J:  a->u = va_arg(ap, uintmax_t); break;
+                    case LEN_T:  a->u = va_arg(ap, ptrdiff_t); break;
+                    default:     a->u = va_arg(ap, unsigned int); break;
+                }
+                if (s.length == LEN_HH)
+                    a->u = (unsigned char)a->u;
+                else if (s.length == LEN_H)
+                    a->u = (unsigned short)a->u;
+                break;
+
+            case 'c':
+                n++;
+                a->i = va_arg(ap, int);
+                break;
+
+            case 's':
+            {
+                const char *str = va_arg(ap, const char *);
+                size_t len = str ? strlen(str) : 0;
+
+                // Copied: the caller's string may be gone by the time it is formatted
+                n++;
+                if (strings + len + 1 > sizeof(r->strings))
+                    len = strings < sizeof(r->strings) ? sizeof(r->strings) - strings - 1 : 0;
+                a->p = "";
+                if (strings < sizeof(r->strings))
+                {
+                    memcpy(r->strings + strings, str ? str : "", len);
+                    r->strings[strings + len] = '\0';
+                    a->p = r->strings + strings;
+                    strings += len + 1;
+                }
+                break;
+            }
+
+            case 'p':
+                n++;
+                a->p = va_arg(ap, void *);
+                break;
+
+            default:    // floating point
+                n++;
+                a->d = s.length == LEN_LONG_DOUBLE ? (double)va_arg(ap, long double) : va_arg(ap, double);
+                break;
+        }
+        r->nspecs++;
+    }
+    r->complete = 1;
+}
+
+// Rebuilds s with its '*' filled in and its length normalized for the stored type
+// into out, LOG_SPEC_MAX bytes; a '*' can expand to 11 characters, so returns -1
+// if the result doesn't fit
+static int build_spec(const struct log_spec *s, const union log_arg **arg, char *out)
+{
+    char width[LOG_SPEC_MAX], precision[LOG_SPEC_MAX];     // a literal cut short here can't fit out either
+    int n;
+
+    if (s->star_width)
+        snprintf(width, sizeof(width), "%d", (int)(*arg)++->i);
+    else
+        snprintf(width, sizeof(width), "%.*s", (int)s->width_len, s->width);
+    if (s->star_precision)
+    {
+        int value = (int)(*arg)++->i;
+
+        // A negative precision is taken as if it were omitted
+        if (value < 0)
+            precision[0] = '\0';
+        else
+            snprintf(precision, sizeof(precision), ".%d", value);
+    }
+    else
+        snprintf(precision, sizeof(precision), "%.*s", (int)s->precision_len, s->precision);
+
+    n = snprintf(out, LOG_SPEC_MAX, "%%%.*s%s%s%s%c", (int)s->flags_len, s->flags, width, precision,
+                 strchr("diouxX", s->conv) ? "ll" : "", s->conv);
+
+    return n < 0 || n >= LOG_SPEC_MAX ? -1 : 0;
+}
+
+static size_t append(char *line, size_t len, const char *text, size_t n)
+{
+    if (len + n >= LOG_LINE_MAX)
+        n = LOG_LINE_MAX - 1 - len;
+    memcpy(line + len, text, n);
+    return len + n;
+}
+
+// Formats one record into line, newline terminated; returns its length
+static size_t format_record(const struct log_record *r, char *line)
+{
+    const union log_arg *arg = r->args;
+    const char *p = r->fmt, *pct;
+    unsigned int specs = 0;
+    struct log_spec s;
+    size_t len;
+    int n;
+
+    n = snprintf(line, LOG_LINE_MAX, "[%10.6f] %s", (r->time_ns - log_ring.start_ns) / 1e9, level_tags[r->level]);
+    len = n > 0 ? (size_t)n : 0;
+
+    while ((pct = strchr(p, '%')) != NULL && (r->complete || specs < r->nspecs) && parse_spec(pct, &s))
+    {
+        char spec[LOG_SPEC_MAX];
+        size_t room;
+
+        len = append(line, len, p, pct - p);
+        p = s.end;
+        specs++;
+        if (s.conv == '%')
+        {
+            len = append(line, len, "%", 1);
+            continue;
+        }
+        if (build_spec(&s, &arg, spec) == -1)
+        {
+            pct = s.start;  // not worth a bigger buffer, leave the rest out
+            break;
+        }
+        room = LOG_LINE_MAX - 1 - len;
+        switch (s.conv)
+        {
+            case 'd': case 'i':                     n = snprintf(line + len, room + 1, spec, arg->i); break;
+            case 'o': case 'u': case 'x': case 'X': n = snprintf(line + len, room + 1, spec, arg->u); break;
+            case 'c':                               n = snprintf(line + len, room + 1, spec, (int)arg->i); break;
+            case 's':                               n = snprintf(line + len, room + 1, spec, (const char *)arg->p); break;
+            case 'p':                               n = snprintf(line + len, room + 1, spec, arg->p); break;
+            default:                                n = snprintf(line + len, room + 1, spec, arg->d); break;
+        }
+        arg++;
+        if (n > 0)
+            len += (size_t)n < room ? (size_t)n : room;
+    }
+    if (!pct)
+        len = append(line, len, p, strlen(p));
+
+    // Callers may or may not end with a newline; every record is one line
+    while (len && line[len - 1] == '\n')
+        len--;
+    if (r->suppressed)
+    {
+        n = snprintf(line + len, LOG_LINE_MAX - len, " (%u more suppressed)", r->suppressed);
+        if (n > 0)
+            len += (size_t)n < LOG_LINE_MAX - 1 - len ? (size_t)n : LOG_LINE_MAX - 1 - len;
+    }
+    line[len++] = '\n';
+    line[len] = '\0';
+    return len;
+}
+
+static void write_record(const struct log_record *r)
+{
+    char line[LOG_LINE_MAX + 1];
+
+    format_record(r, line);
+    fputs(line, r->level <= LOG_LEVEL_WARN ? stderr : stdout);
+    atomic_fetch_add_explicit(&log_ring.written, 1, memory_order_relaxed);
+}
+
+/*************************************************************************
+ *                          Log Thread                                   *
+ *************************************************************************/
+
+// Formats every published record; returns how many
+static unsigned int drain(void)
+{
+    uint64_t pos = atomic_load_explicit(&log_ring.tail, memory_order_relaxed);
+    unsigned int n = 0;
+
+    for (;;)
+    {
+        struct log_record *r = &log_ring.records[pos & (LOG_RING_RECORDS - 1)];
+
+        if (atomic_load_explicit(&r->seq, memory_order_acquire) != pos + 1)
+            break;
+
+        write_record(r);
+        atomic_store_explicit(&r->seq, pos + LOG_RING_RECORDS, memory_order_release);
+        atomic_store_explicit(&log_ring.tail, ++pos, memory_order_release);
+        n++;
+    }
+
+    if (n)
+    {
+        fflush(stderr);
+        fflush(stdout);
+    }
+    return n;
+}
+
+static void *log_thread(void *arg)
+{
+    struct timespec nap = { 0, LOG_DRAIN_MS * 1000000L };
+
+    while (!atomic_load(&log_ring.stop))
+        if (!drain())
+            nanosleep(&nap, NULL);
+
+    while (drain())
+        ;
+    return NULL;
+}
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+/**
+ * @name   frame_log_start
+ * @brief  Starts the log thread
+ * @param  level - most verbose level written, LOG_LEVEL_FRAME for every frame
+ *         rate  - records per second allowed per call site, 0 = unlimited
+ *
+ * @return 0, -1 with errno if the thread could not be created
+ */
+
+int frame_log_start(enum log_level level, unsigned int rate)
+{
+    unsigned int i;
+    int err;
+
+    for (i = 0; i < LOG_RING_RECORDS; i++)
+        atomic_init(&log_ring.records[i].seq, i);
+    atomic_init(&log_ring.head, 0);
+    atomic_init(&log_ring.tail, 0);
+    atomic_store(&log_ring.level, level);
+    atomic_store(&log_ring.stop, 0);
+    log_ring.rate = rate;
+    log_ring.start_ns = stats_now_ns();
+
+    err = pthread_create(&log_ring.thread, NULL, log_thread, NULL);
+    if (err)
+    {
+        errno = err;
+        return -1;
+    }
+    atomic_store(&log_ring.running, 1);
+    return 0;
+}
+
+// Returns once everything logged before the call has been written
+void frame_log_flush(void)
+{
+    uint64_t target = atomic_load(&log_ring.head);
+    struct timespec nap = { 0, 1000000 };
+
+    while (atomic_load(&log_ring.running) && atomic_load(&log_ring.tail) < target)
+        nanosleep(&nap, NULL);
+}
+
+// Writes what is left and joins the log thread; later records are written directly
+void frame_log_stop(void)
+{
+    unsigned long dropped, suppressed;
+
+    if (!atomic_load(&log_ring.running))
+        return;
+
+    atomic_store(&log_ring.stop, 1);
+    pthread_join(log_ring.thread, NULL);
+    atomic_store(&log_ring.running, 0);
+
+    dropped    = atomic_load(&log_ring.dropped);
+    suppressed = atomic_load(&log_ring.suppressed);
+    if (dropped || suppressed)
+        printf("log: %lu records written, %lu dropped with the ring full, %lu over the rate limit\n",
+               atomic_load(&log_ring.written), dropped, suppressed);
+}
+
+int frame_log_enabled(enum log_level level)
+{
+    return (int)level <= atomic_load_explicit(&log_ring.level, memory_order_relaxed);
+}
+
+// 0 if the record goes over its call site's limit; else the count suppressed before it
+static int rate_check(struct log_site *site, uint64_t now, unsigned int *suppressed)
+{
+    uint64_t window = atomic_load_explicit(&site->window_ns, memory_order_relaxed);
+
+    *suppressed = 0;
+    if (!log_ring.rate)
+        return 1;
+
+    if (now - window >= 1000000000ULL &&
+        atomic_compare_exchange_strong(&site->window_ns, &window, now))
+    {
+        atomic_store_explicit(&site->count, 0, memory_order_relaxed);
+        *suppressed = atomic_exchange_explicit(&site->suppressed, 0, memory_order_relaxed);
+    }
+
+    if (atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed) >= log_ring.rate)
+    {
+        atomic_fetch_add_explicit(&site->suppressed, *suppressed + 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&log_ring.suppressed, 1, memory_order_relaxed);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @name   frame_log_write
+ * @brief  Logs one record, use through log_error() ... log_frame()
+ * @param  site  - call site's rate limit
+ *         level - severity
+ *         fmt   - printf format, a string literal
+ *
+ * @descr  Never blocks: a record over the rate limit or finding the ring
+ *         full is counted and dropped
+ *
+ * @return none
+ */
+
+void frame_log_write(struct log_site *site, enum log_level level, const char *fmt, ...)
+{
+    uint64_t now = stats_now_ns();
+    struct log_record *r, local;
+    unsigned int suppressed;
+    uint64_t pos;
+    va_list ap;
+
+    // Per-frame records are asked for explicitly, a limit would only hide frames
+    suppressed = 0;
+    if (level != LOG_LEVEL_FRAME && !rate_check(site, now, &suppressed))
+        return;
+
+    if (!atomic_load_explicit(&log_ring.running, memory_order_acquire))
+    {
+        r = &local;
+        pos = 0;
+    }
+    else
+    {
+        pos = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+        for (;;)
+        {
+            int64_t diff;
+
+            r = &log_ring.records[pos & (LOG_RING_RECORDS - 1)];
+            diff = (int64_t)(atomic_load_explicit(&r->seq, memory_order_acquire) - pos);
+            if (diff == 0)
+            {
+                if (atomic_compare_exchange_weak_explicit(&log_ring.head, &pos, pos + 1,
+                                                          memory_order_relaxed, memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+            {
+                atomic_fetch_add_explicit(&log_ring.dropped, 1, memory_order_relaxed);
+                return;     // full, the log thread is a whole ring behind
+            }
+            else
+                pos = atomic_load_explicit(&log_ring.head, memory_order_relaxed);
+        }
+    }
+
+    r->time_ns    = now;
+    r->fmt        = fmt;
+    r->level      = level;
+    r->suppressed = suppressed;
+    va_start(ap, fmt);
+    capture_args(r, fmt, ap);
+    va_end(ap);
+
+    if (r == &local)
+    {
+        write_record(r);
+        fflush(level <= LOG_LEVEL_WARN ? stderr : stdout);
+    }
+    else
+        atomic_store_explicit(&r->seq, pos + 1, memory_order_release);
+}
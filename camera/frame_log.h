@@ -0,0 +1,83 @@
+/*
+ * Filename   : frame_log.h
+ *
+ * Description: Asynchronous, rate-limited logger for the capture path
+ *            : Callers on any thread fill a fixed-size record (format
+ *            : pointer plus the raw argument values) in a lock-free ring and
+ *            : return; nothing is formatted and no syscall is made there. A
+ *            : background thread formats the records and writes them, warnings
+ *            : and errors to stderr, the rest to stdout.
+ *            : Each call site may log at most rate records per second, the
+ *            : rest are counted and the count reported with its next record;
+ *            : per-frame records, which must be asked for, are not limited.
+ *            : A full ring drops the record rather than wait.
+ *            : Formats must be string literals; %s arguments are copied into
+ *            : the record, everything else is passed by value.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_LOG_H
+#define FRAME_LOG_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define LOG_RING_RECORDS    1024        // records in flight, a power of two
+#define LOG_MAX_ARGS        10          // arguments kept per record, '*' widths included
+#define LOG_STRING_BYTES    64          // for copies of %s arguments, per record
+#define LOG_DRAIN_MS        10          // background thread wakeup period
+
+// One rate limit per call site, format checked like printf
+#define log_at(level, ...)                                              \
+    do                                                                  \
+    {                                                                   \
+        static struct log_site log_site_;                               \
+        if (frame_log_enabled(level))                                   \
+            frame_log_write(&log_site_, level, __VA_ARGS__);            \
+    } while (0)
+
+#define log_error(...)  log_at(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)   log_at(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...)   log_at(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_frame(...)  log_at(LOG_LEVEL_FRAME, __VA_ARGS__)
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+enum log_level
+{
+        LOG_LEVEL_ERROR = 0,
+        LOG_LEVEL_WARN,
+        LOG_LEVEL_INFO,
+        LOG_LEVEL_FRAME,        // one or more per frame, off unless asked for
+        LOG_LEVELS
+};
+
+// Rate limit state of one call site, zero-initialized
+struct log_site
+{
+        _Atomic uint64_t        window_ns;      // start of the current one second window
+        atomic_uint             count;          // records in the window
+        atomic_uint             suppressed;     // over the limit since the last one written
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+int frame_log_start(enum log_level level, unsigned int rate);
+void frame_log_flush(void);
+void frame_log_stop(void);
+
+int frame_log_enabled(enum log_level level);
+void frame_log_write(struct log_site *site, enum log_level level, const char *fmt, ...)
+        __attribute__((format(printf, 3, 4)));
+
+#endif /* FRAME_LOG_H */
@@ -0,0 +1,177 @@
+/*
+ * Filename   : frame_motion.c
+ *
+ * Description: Change detection on the Y channel of YUYV frames
+ *            : 1) Each block row of the region is summed with the selected
+ *            :    yuyv_luma_sad() kernel, one call per line, into one
+ *            :    accumulator per block; a narrow last column is summed here
+ *            : 2) A block changed when its SAD exceeds threshold * pixels;
+ *            :    the scan stops as soon as min_blocks have changed
+ *            : 3) Changed frames become the new reference, so slow drift
+ *            :    adds up until it is let through once
+ *            : Call from one thread only, in capture order.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "frame_motion.h"
+#include "yuv_convert.h"
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct frame_motion
+{
+        unsigned int        width, height;      // region, pixels
+        unsigned int        threshold;          // mean |dY| per pixel for a changed block
+        unsigned int        min_blocks;         // changed blocks for a changed frame
+        unsigned int        full_blocks;        // whole 16-pixel blocks per line
+        unsigned int        rest;               // pixels in the narrow last column, 0 if none
+        unsigned char      *ref;                // region of the last changed frame, YUYV, packed lines
+        unsigned int       *acc;                // SAD per block of the current block row
+        int                 have_ref;
+        unsigned long       checked, changed;
+};
+
+/*************************************************************************
+ *                         Motion Functions                              *
+ *************************************************************************/
+
+/**
+ * @name   frame_motion_create
+ * @brief  Sets up change detection for a YUYV region
+ * @param  width, height - region size in pixels, width even
+ *         threshold     - mean absolute luma difference per pixel that
+ *                         makes a block count as changed
+ *         min_blocks    - changed blocks needed to let a frame through
+ *
+ * @return detector, NULL with errno set on failure
+ */
+
+struct frame_motion *frame_motion_create(unsigned int width, unsigned int height,
+                                         unsigned int threshold, unsigned int min_blocks)
+{
+    struct frame_motion *m = calloc(1, sizeof(*m));
+
+    if (!m)
+        return NULL;
+
+    m->width       = width;
+    m->height      = height;
+    m->threshold   = threshold;
+    m->min_blocks  = min_blocks ? min_blocks : 1;
+    m->full_blocks = width / YUYV_SAD_BLOCK;
+    m->rest        = width % YUYV_SAD_BLOCK;
+    m->ref = malloc((size_t)width * 2 * height);
+    m->acc = malloc((m->full_blocks + 1) * sizeof(*m->acc));
+    if (!m->ref || !m->acc)
+    {
+        frame_motion_destroy(m);
+        return NULL;
+    }
+
+    return m;
+}
+
+void frame_motion_destroy(struct frame_motion *m)
+{
+    if (!m)
+        return;
+
+    free(m->ref);
+    free(m->acc);
+    free(m);
+}
+
+// Keeps the region of frame as the reference for the next frames
+static void keep_reference(struct frame_motion *m, const unsigned char *frame, unsigned int bpl)
+{
+    size_t line = (size_t)m->width * 2;
+    unsigned int y;
+
+    if (bpl == line)
+        memcpy(m->ref, frame, line * m->height);
+    else
+        for (y = 0; y < m->height; y++)
+            memcpy(m->ref + y * line, frame + (size_t)y * bpl, line);
+
+    m->have_ref = 1;
+}
+
+/**
+ * @name   frame_motion_changed
+ * @brief  Decides if a frame differs enough from the last one let through
+ * @param  m     - detector
+ *         frame - first pixel of the region in the capture buffer
+ *         bpl   - bytes per line of the capture buffer
+ *
+ * @descr  The first frame always counts as changed
+ *         Only the Y bytes are read for the comparison; a changed frame
+ *         is also copied as the new reference
+ *
+ * @return 1 if the frame should be processed, 0 if it can be skipped
+ */
+
+int frame_motion_changed(struct frame_motion *m, const unsigned char *frame, unsigned int bpl)
+{
+    const size_t line = (size_t)m->width * 2;
+    unsigned int by, y, k, i, changed = 0;
+
+    m->checked++;
+
+    if (!m->have_ref)
+    {
+        keep_reference(m, frame, bpl);
+        m->changed++;
+        return 1;
+    }
+
+    for (by = 0; by < m->height && changed < m->min_blocks; by += YUYV_SAD_BLOCK)
+    {
+        unsigned int rows = m->height - by < YUYV_SAD_BLOCK ? m->height - by : YUYV_SAD_BLOCK;
+
+        memset(m->acc, 0, (m->full_blocks + 1) * sizeof(*m->acc));
+
+        for (y = by; y < by + rows; y++)
+        {
+            const unsigned char *a = frame + (size_t)y * bpl;
+            const unsigned char *b = m->ref + y * line;
+
+            yuyv_luma_sad(a, b, m->full_blocks, m->acc);
+
+            a += (size_t)m->full_blocks * YUYV_SAD_BLOCK * 2;
+            b += (size_t)m->full_blocks * YUYV_SAD_BLOCK * 2;
+            for (i = 0; i < m->rest * 2; i += 2)
+                m->acc[m->full_blocks] += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        }
+
+        for (k = 0; k < m->full_blocks; k++)
+            if (m->acc[k] > m->threshold * YUYV_SAD_BLOCK * rows)
+                changed++;
+        if (m->rest && m->acc[m->full_blocks] > m->threshold * m->rest * rows)
+            changed++;
+    }
+
+    if (changed < m->min_blocks)
+        return 0;
+
+    keep_reference(m, frame, bpl);
+    m->changed++;
+    return 1;
+}
+
+void frame_motion_report(struct frame_motion *m, FILE *fp)
+{
+    fprintf(fp, "motion: %lu of %lu frames changed, %lu unchanged skipped\n",
+            m->changed, m->checked, m->checked - m->changed);
+}
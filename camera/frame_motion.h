@@ -0,0 +1,33 @@
+/*
+ * Filename   : frame_motion.h
+ *
+ * Description: Change detection on the Y channel of YUYV frames
+ *            : The processed region is split into 16x16 blocks and the luma
+ *            : SAD of each is taken against the last frame let through.
+ *            : A frame goes on to conversion and output only when enough
+ *            : blocks changed by more than a mean per-pixel threshold, so a
+ *            : static scene costs one SAD pass per frame and nothing else.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_MOTION_H
+#define FRAME_MOTION_H
+
+#include <stdio.h>
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct frame_motion;
+
+struct frame_motion *frame_motion_create(unsigned int width, unsigned int height,
+                                         unsigned int threshold, unsigned int min_blocks);
+void frame_motion_destroy(struct frame_motion *m);
+
+int frame_motion_changed(struct frame_motion *m, const unsigned char *frame, unsigned int bpl);
+
+void frame_motion_report(struct frame_motion *m, FILE *fp);
+
+#endif /* FRAME_MOTION_H */
@@ -0,0 +1,1002 @@
+/*
+ * Filename   : frame_net.c
+ *
+ * Description: Network output of frames over TCP or UDP
+ *            : 1) frame_net_submit() fills a frame from a fixed pool with the
+ *            :    wire header and a pointer to the caller's pixels, puts it
+ *            :    on the incoming list and wakes the sender through an eventfd
+ *            : 2) The sender thread queues each incoming frame on every
+ *            :    client with room, TCP clients or the one UDP socket; a
+ *            :    client already holding NET_CLIENT_FRAMES misses the frame,
+ *            :    and one that makes no progress for NET_STALL_MS is dropped
+ *            : 3) Clients are sent to with non-blocking sendmsg(MSG_ZEROCOPY)
+ *            :    whenever poll says they are writable. TCP carries on from
+ *            :    the byte a short send stopped at; UDP sends up to
+ *            :    NET_UDP_BATCH datagrams per call with UDP_SEGMENT, fewer
+ *            :    if the kernel cannot pin that many frags in one skb
+ *            : 4) A frame fully sent waits on the client until the error
+ *            :    queue reports its last zerocopy send complete; once no
+ *            :    client holds it, done() gives the buffer back
+ *            : Sockets that refuse SO_ZEROCOPY are sent to by copy, and a
+ *            : frame is done with as soon as it is sent.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : https://www.kernel.org/doc/html/latest/networking/msg_zerocopy.html
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#define _GNU_SOURCE             /* accept4() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+
+#include <linux/errqueue.h>
+
+#include "frame_net.h"
+#include "frame_stats.h"
+#include "frame_log.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+
+#define NET_UDP_BATCH       44          // datagrams per UDP_SEGMENT send, under 64 KiB
+#define NET_DRAIN_MS        1000        // destroy waits this long for queued frames to go out
+#define NET_RETRY_MS        10          // poll timeout while a client is out of optmem
+#define NET_CLIENT_FRAMES   2           // frames one client may hold, in its queue or sent list
+#define NET_STALL_MS        2000        // a client holding frames this long without progress is dropped
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+enum net_proto
+{
+        NET_TCP,
+        NET_UDP,
+};
+
+struct net_frame
+{
+        struct net_frame_header hdr;            // TCP: sent ahead of the frame
+        struct net_frame_header *chunks;        // UDP: one per datagram
+        unsigned int        n_chunks;
+        char                image_header[WRITER_HEADER_MAX];
+        size_t              header_len;
+        const unsigned char *data;
+        size_t              size;
+        writer_done_fn      done;
+        void               *ctx;
+        unsigned int        refs;               // clients holding it, sender thread only
+        struct net_frame   *next;               // free or incoming list
+};
+
+// Sent in full, but the kernel may still be reading the pages
+struct net_sent
+{
+        struct net_frame   *f;
+        uint32_t            zc_id;              // zerocopy send that finished it
+};
+
+struct net_client
+{
+        int                 fd;
+        int                 zerocopy;           // SO_ZEROCOPY was accepted
+        int                 blocked;            // ENOBUFS, wait for completions
+        int                 head_zc;            // a zerocopy send carried part of queue[q_head]
+        struct net_frame  **queue;              // to send, depth entries
+        unsigned int        q_head, q_count;
+        size_t              offset;             // TCP: wire bytes of queue[q_head] sent; UDP: frame bytes
+        uint32_t            zc_next;            // id the kernel gives the next zerocopy send
+        struct net_sent    *sent;               // waiting for completion, depth entries
+        unsigned int        s_head, s_count;
+        uint64_t            progress_ns;        // last send or completion
+};
+
+struct frame_net
+{
+        enum net_proto      proto;
+        char                desc[80];           // for messages, e.g. "tcp port 5000"
+        struct frame_stream_info info;
+        unsigned int        depth;              // pool size, also every client queue's
+        unsigned int        client_frames;      // NET_CLIENT_FRAMES, at most depth
+        int                 listen_fd;          // TCP only
+        unsigned int        udp_batch;          // datagrams per send, 1 without UDP_SEGMENT
+        int                 wake_fd;
+        pthread_t           thread;
+        int                 started;
+
+        struct net_frame   *pool;
+        struct net_client   clients[NET_MAX_CLIENTS];  // UDP: the socket is clients[0]
+        unsigned int        n_clients;
+
+        pthread_mutex_t     lock;
+        // under lock
+        struct net_frame   *free_list;
+        struct net_frame   *incoming, **incoming_tail;
+        unsigned int        receivers;          // submit() drops frames when 0
+        int                 stopping;
+        unsigned long       no_room;
+
+        // sender thread
+        unsigned long       accepted, frames_sent, dropped;
+        unsigned long       completions, copied;
+};
+
+/*************************************************************************
+ *                         Frame Functions                               *
+ *************************************************************************/
+
+// Drops one reference, a frame no client holds goes back to its owner and the pool
+static void frame_put(struct frame_net *n, struct net_frame *f)
+{
+    if (--f->refs)
+        return;
+
+    f->done(f->ctx, 0);
+    pthread_mutex_lock(&n->lock);
+    f->next = n->free_list;
+    n->free_list = f;
+    pthread_mutex_unlock(&n->lock);
+}
+
+// iovecs for frame bytes [off, off + len), which may span header and pixels
+static int image_iov(const struct net_frame *f, size_t off, size_t len, struct iovec *iov)
+{
+    int cnt = 0;
+
+    if (off < f->header_len)
+    {
+        size_t part = f->header_len - off < len ? f->header_len - off : len;
+
+        iov[cnt].iov_base = (void *)(f->image_header + off);
+        iov[cnt].iov_len  = part;
+        cnt++;
+        off += part;
+        len -= part;
+    }
+    if (len)
+    {
+        iov[cnt].iov_base = (void *)(f->data + (off - f->header_len));
+        iov[cnt].iov_len  = len;
+        cnt++;
+    }
+
+    return cnt;
+}
+
+/*************************************************************************
+ *                         Client Functions                              *
+ *************************************************************************/
+
+static int add_client(struct frame_net *n, int fd)
+{
+    struct net_client *c = &n->clients[n->n_clients];
+    int one = 1;
+
+    memset(c, 0, sizeof(*c));
+    c->fd    = fd;
+    c->queue = calloc(n->depth, sizeof(*c->queue));
+    c->sent  = calloc(n->depth, sizeof(*c->sent));
+    if (!c->queue || !c->sent)
+    {
+        free(c->queue);
+        free(c->sent);
+        return -1;
+    }
+    c->zerocopy = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+    c->progress_ns = stats_now_ns();
+
+    n->n_clients++;
+    pthread_mutex_lock(&n->lock);
+    n->receivers = n->n_clients;
+    pthread_mutex_unlock(&n->lock);
+
+    return 0;
+}
+
+// Lets go of everything client i holds and closes it
+static void drop_client(struct frame_net *n, unsigned int i)
+{
+    struct net_client *c = &n->clients[i];
+
+    // A frame still referenced by a dying connection's skbs may be rewritten; only that peer sees it
+    while (c->q_count)
+    {
+        frame_put(n, c->queue[c->q_head]);
+        c->q_head = (c->q_head + 1) % n->depth;
+        c->q_count--;
+    }
+    while (c->s_count)
+    {
+        frame_put(n, c->sent[c->s_head].f);
+        c->s_head = (c->s_head + 1) % n->depth;
+        c->s_count--;
+    }
+    close(c->fd);
+    free(c->queue);
+    free(c->sent);
+
+    n->clients[i] = n->clients[--n->n_clients];
+    pthread_mutex_lock(&n->lock);
+    n->receivers = n->n_clients;
+    pthread_mutex_unlock(&n->lock);
+}
+
+static void accept_client(struct frame_net *n)
+{
+    int fd = accept4(n->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+    if (fd == -1)
+        return;
+
+    if (n->n_clients == NET_MAX_CLIENTS || add_client(n, fd) == -1)
+    {
+        log_warn("net %s: refusing client, %u connected", n->desc, n->n_clients);
+        close(fd);
+        return;
+    }
+    n->accepted++;
+    log_info("net %s: client %u connected%s", n->desc, n->n_clients,
+           n->clients[n->n_clients - 1].zerocopy ? "" : ", zerocopy not available");
+}
+
+// Completed zerocopy sends up to id: frames finished by them are released
+static void complete_upto(struct frame_net *n, struct net_client *c, uint32_t id)
+{
+    while (c->s_count && (int32_t)(c->sent[c->s_head].zc_id - id) <= 0)
+    {
+        frame_put(n, c->sent[c->s_head].f);
+        c->s_head = (c->s_head + 1) % n->depth;
+        c->s_count--;
+    }
+    c->blocked = 0;
+    c->progress_ns = stats_now_ns();
+}
+
+/**
+ * @name   read_completions
+ * @brief  Reaps the zerocopy notifications on a client's error queue
+ * @param  n - sender
+ *         c - client poll reported POLLERR on
+ *
+ * @descr  Each notification covers the inclusive id range
+ *         [ee_info, ee_data]; COPIED means the kernel fell back to a copy,
+ *         e.g. on loopback. Other errors (ICMP on UDP) are ignored.
+ *
+ * @return notifications read, -1 if the socket itself has failed
+ */
+
+static int read_completions(struct frame_net *n, struct net_client *c)
+{
+    int count = 0;
+
+    for (;;)
+    {
+        char control[128];
+        struct msghdr msg;
+        struct cmsghdr *cm;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+            break;
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+        {
+            struct sock_extended_err *serr;
+
+            if (!(cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR))
+                continue;
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            n->completions += serr->ee_data - serr->ee_info + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                n->copied += serr->ee_data - serr->ee_info + 1;
+            complete_upto(n, c, serr->ee_data);
+        }
+        count++;
+    }
+
+    if (count == 0)
+    {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        // POLLERR with nothing queued: a real error, which getsockopt also clears
+        if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 && err && n->proto == NET_TCP)
+            return -1;
+    }
+
+    return count;
+}
+
+/**
+ * @name   send_head
+ * @brief  Sends what it can of the frame at the head of a client's queue
+ * @param  n - sender
+ *         c - client with a frame queued
+ *
+ * @descr  TCP resumes at the wire byte the last short send stopped at;
+ *         UDP sends whole datagrams, NET_UDP_BATCH of them with UDP_SEGMENT
+ *         A finished frame moves to the client's sent list until its last
+ *         zerocopy send completes, or is released right away when copied
+ *
+ * @return 0 progress, 1 would block, -1 client failed
+ */
+
+static int send_head(struct frame_net *n, struct net_client *c)
+{
+    struct net_frame *f = c->queue[c->q_head];
+    size_t length = f->header_len + f->size;
+    struct iovec iov[3 * NET_UDP_BATCH];
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    struct msghdr msg;
+    size_t step;
+    ssize_t r;
+    int flags = MSG_DONTWAIT | MSG_NOSIGNAL | (c->zerocopy ? MSG_ZEROCOPY : 0);
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+
+    if (n->proto == NET_TCP)
+    {
+        size_t hdr = sizeof(f->hdr);
+
+        if (c->offset < hdr)
+        {
+            iov[0].iov_base = (char *)&f->hdr + c->offset;
+            iov[0].iov_len  = hdr - c->offset;
+            msg.msg_iovlen  = 1 + image_iov(f, 0, length, iov + 1);
+        }
+        else
+            msg.msg_iovlen = image_iov(f, c->offset - hdr, length - (c->offset - hdr), iov);
+    }
+    else
+    {
+        unsigned int k = c->offset / NET_UDP_CHUNK;
+        unsigned int d;
+
+        for (d = 0; d < n->udp_batch && k + d < f->n_chunks; d++)
+        {
+            struct net_frame_header *h = &f->chunks[k + d];
+
+            iov[msg.msg_iovlen].iov_base = h;
+            iov[msg.msg_iovlen].iov_len  = sizeof(*h);
+            msg.msg_iovlen++;
+            msg.msg_iovlen += image_iov(f, h->offset, h->chunk, iov + msg.msg_iovlen);
+        }
+
+        // More than one datagram: the kernel cuts the send every NET_UDP_DATAGRAM bytes
+        if (d > 1)
+        {
+            struct cmsghdr *cm;
+
+            msg.msg_control    = control;
+            msg.msg_controllen = sizeof(control);
+            cm = CMSG_FIRSTHDR(&msg);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type  = UDP_SEGMENT;
+            cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+            *(uint16_t *)CMSG_DATA(cm) = NET_UDP_DATAGRAM;
+        }
+    }
+
+    r = sendmsg(c->fd, &msg, flags);
+    if (r == -1)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return 1;
+        if (errno == EMSGSIZE && n->proto == NET_UDP && n->udp_batch > 1)
+        {
+            // Zerocopy pins each iovec as page frags, too many for one skb: send fewer at once
+            n->udp_batch /= 2;
+            return 0;
+        }
+        if (errno == ENOBUFS)
+        {
+            // Out of optmem for pinned pages: wait for completions to free some
+            c->blocked = 1;
+            return 1;
+        }
+        if (n->proto == NET_TCP)
+            return -1;
+        // UDP: an ICMP error from an earlier datagram, e.g. nobody listening; skip this batch
+        r = 0;
+    }
+    else
+    {
+        c->progress_ns = stats_now_ns();
+        if (c->zerocopy)
+        {
+            c->zc_next++;
+            c->head_zc = 1;
+        }
+    }
+
+    if (n->proto == NET_TCP)
+        step = r;
+    else
+    {
+        unsigned int k = c->offset / NET_UDP_CHUNK;
+
+        step = (size_t)(k + n->udp_batch < f->n_chunks ? n->udp_batch : f->n_chunks - k) * NET_UDP_CHUNK;
+        length = (size_t)f->n_chunks * NET_UDP_CHUNK;
+    }
+    c->offset += step;
+
+    if (c->offset < length + (n->proto == NET_TCP ? sizeof(f->hdr) : 0))
+        return 0;
+
+    // Whole frame is out
+    c->q_head = (c->q_head + 1) % n->depth;
+    c->q_count--;
+    c->offset = 0;
+    n->frames_sent++;
+
+    if (c->head_zc)
+    {
+        unsigned int s = (c->s_head + c->s_count) % n->depth;
+
+        c->sent[s].f     = f;
+        c->sent[s].zc_id = c->zc_next - 1;
+        c->s_count++;
+        c->head_zc = 0;
+    }
+    else
+        frame_put(n, f);
+
+    return 0;
+}
+
+/*************************************************************************
+ *                         Sender Thread                                 *
+ *************************************************************************/
+
+// Gives each client with room a reference to every newly submitted frame
+static void take_incoming(struct frame_net *n)
+{
+    struct net_frame *f, *next;
+    unsigned int i;
+
+    pthread_mutex_lock(&n->lock);
+    f = n->incoming;
+    n->incoming = NULL;
+    n->incoming_tail = &n->incoming;
+    pthread_mutex_unlock(&n->lock);
+
+    for (; f; f = next)
+    {
+        next = f->next;
+        f->refs = 1;    // ours, until every client has had its chance
+
+        for (i = 0; i < n->n_clients; i++)
+        {
+            struct net_client *c = &n->clients[i];
+
+            if (c->q_count + c->s_count >= n->client_frames)
+            {
+                n->dropped++;
+                continue;
+            }
+            c->queue[(c->q_head + c->q_count) % n->depth] = f;
+            c->q_count++;
+            f->refs++;
+        }
+
+        frame_put(n, f);
+    }
+}
+
+static int busy_clients(const struct frame_net *n)
+{
+    unsigned int i;
+
+    for (i = 0; i < n->n_clients; i++)
+        if (n->clients[i].q_count || n->clients[i].s_count)
+            return 1;
+    return 0;
+}
+
+/**
+ * @name   net_thread
+ * @brief  Sender thread: accepts clients, sends queued frames, reaps completions
+ * @param  arg - sender
+ *
+ * @descr  Once stopping, no more clients are accepted and the thread
+ *         leaves when nothing is queued or waiting on completions, or after
+ *         NET_DRAIN_MS
+ *
+ * @return NULL
+ */
+
+static void *net_thread(void *arg)
+{
+    struct frame_net *n = arg;
+    struct pollfd fds[2 + NET_MAX_CLIENTS];
+    uint64_t deadline = 0;
+
+    for (;;)
+    {
+        unsigned int nfds = 0, first, i;
+        int timeout = -1, stopping, ready;
+
+        pthread_mutex_lock(&n->lock);
+        stopping = n->stopping;
+        pthread_mutex_unlock(&n->lock);
+
+        take_incoming(n);
+
+        if (stopping)
+        {
+            uint64_t now = stats_now_ns();
+
+            if (!deadline)
+                deadline = now + (uint64_t)NET_DRAIN_MS * 1000000;
+            if (!busy_clients(n) || now >= deadline)
+                break;
+            timeout = (deadline - now) / 1000000 + 1;
+        }
+
+        fds[nfds].fd = n->wake_fd;
+        fds[nfds++].events = POLLIN;
+        if (n->listen_fd != -1 && !stopping)
+        {
+            fds[nfds].fd = n->listen_fd;
+            fds[nfds++].events = POLLIN;
+        }
+        first = nfds;
+        for (i = 0; i < n->n_clients; i++)
+        {
+            struct net_client *c = &n->clients[i];
+
+            fds[nfds].fd = c->fd;
+            fds[nfds].events = n->proto == NET_TCP ? POLLIN : 0;
+            if (c->q_count && !c->blocked)
+                fds[nfds].events |= POLLOUT;
+            if (c->blocked)
+                timeout = timeout == -1 || timeout > NET_RETRY_MS ? NET_RETRY_MS : timeout;
+            else if ((c->q_count || c->s_count) && (timeout == -1 || timeout > NET_STALL_MS / 4))
+                timeout = NET_STALL_MS / 4;     // to notice a stall
+            nfds++;
+        }
+
+        ready = poll(fds, nfds, timeout);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            log_error("net %s: poll failed, %s", n->desc, strerror(errno));
+            break;
+        }
+
+        if (fds[0].revents & POLLIN)
+        {
+            uint64_t count;
+            ssize_t r = read(n->wake_fd, &count, sizeof(count));
+
+            (void)r;
+        }
+        if (first > 1 && (fds[1].revents & POLLIN))
+            accept_client(n);
+
+        // Backwards, so dropping client i moves one that has been handled already
+        for (i = nfds - first; i-- > 0; )
+        {
+            struct net_client *c = &n->clients[i];
+            short revents = fds[first + i].revents;
+            int failed = 0;
+
+            if (revents & POLLERR)
+                failed = read_completions(n, c) == -1;
+
+            if (!failed && (revents & POLLIN))
+            {
+                char scratch[256];
+                ssize_t r = recv(c->fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+
+                // Clients have nothing to say; end of stream is a disconnect
+                failed = r == 0 || (r == -1 && errno != EAGAIN && errno != EWOULDBLOCK);
+            }
+
+            if (!failed && (revents & POLLHUP) && n->proto == NET_TCP)
+                failed = 1;
+
+            // A peer that stopped reading would keep its frames, and the workers' buffers, forever
+            if (!failed && n->proto == NET_TCP && (c->q_count || c->s_count) &&
+                stats_now_ns() - c->progress_ns > (uint64_t)NET_STALL_MS * 1000000)
+            {
+                log_warn("net %s: client stalled for %d ms", n->desc, NET_STALL_MS);
+                failed = 1;
+            }
+
+            // Timed out while blocked: try again even without a completion
+            if (ready == 0)
+                c->blocked = 0;
+
+            while (!failed && c->q_count && !c->blocked)
+            {
+                int r = send_head(n, c);
+
+                if (r == -1)
+                    failed = 1;
+                else if (r == 1)
+                    break;
+            }
+
+            if (failed)
+            {
+                log_info("net %s: client disconnected", n->desc);
+                drop_client(n, i);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/*************************************************************************
+ *                         Socket Setup                                  *
+ *************************************************************************/
+
+// tcp:[HOST:]PORT binds and listens, udp:HOST:PORT connects; 0 or -1
+static int open_socket(struct frame_net *n, const char *spec, unsigned int port_offset)
+{
+    char host[256] = "", service[16];
+    const char *rest, *colon;
+    struct addrinfo hints, *res, *ai;
+    unsigned long port;
+    int fd = -1, one = 1;
+
+    if (strncmp(spec, "tcp:", 4) == 0)
+        n->proto = NET_TCP;
+    else if (strncmp(spec, "udp:", 4) == 0)
+        n->proto = NET_UDP;
+    else
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    rest  = spec + 4;
+    colon = strrchr(rest, ':');
+    if (colon)
+    {
+        if ((size_t)(colon - rest) >= sizeof(host))
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        memcpy(host, rest, colon - rest);
+        host[colon - rest] = '\0';
+        rest = colon + 1;
+    }
+    port = strtoul(rest, NULL, 10) + port_offset;
+    if (port == port_offset || port > 65535 || (n->proto == NET_UDP && !host[0]))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    snprintf(service, sizeof(service), "%lu", port);
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family   = AF_UNSPEC;
+    hints.ai_socktype = n->proto == NET_TCP ? SOCK_STREAM : SOCK_DGRAM;
+    hints.ai_flags    = n->proto == NET_TCP ? AI_PASSIVE : 0;
+    if ((errno = getaddrinfo(host[0] ? host : NULL, service, &hints, &res)) != 0)
+    {
+        fprintf(stderr, "net %s: %s\n", spec, gai_strerror(errno));
+        errno = EINVAL;
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next)
+    {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (n->proto == NET_TCP)
+        {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, NET_MAX_CLIENTS) == 0)
+                break;
+        }
+        else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd == -1)
+        return -1;
+
+    if (n->proto == NET_TCP)
+    {
+        n->listen_fd = fd;
+        snprintf(n->desc, sizeof(n->desc), "tcp port %lu", port);
+        return 0;
+    }
+
+    // Probes UDP_SEGMENT; the size itself goes with each send
+    {
+        int gso = NET_UDP_DATAGRAM;
+
+        n->udp_batch = setsockopt(fd, SOL_UDP, UDP_SEGMENT, &gso, sizeof(gso)) == 0 ? NET_UDP_BATCH : 1;
+    }
+    snprintf(n->desc, sizeof(n->desc), "udp %s port %lu", host, port);
+    if (add_client(n, fd) == -1)
+    {
+        close(fd);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    return 0;
+}
+
+/*************************************************************************
+ *                         Sender Functions                              *
+ *************************************************************************/
+
+/**
+ * @name   frame_net_create
+ * @brief  Opens the socket described by spec and starts the sender thread
+ * @param  spec        - tcp:[HOST:]PORT to serve clients, udp:HOST:PORT to send to one
+ *         port_offset - added to PORT, e.g. the camera number
+ *         info        - frame size and format; max_record is the largest
+ *                       header + payload submitted, capacity the frames
+ *                       that may be in flight at once
+ *
+ * @return sender, NULL with errno set on failure
+ */
+
+struct frame_net *frame_net_create(const char *spec, unsigned int port_offset,
+                                   const struct frame_stream_info *info)
+{
+    struct frame_net *n = calloc(1, sizeof(*n));
+    unsigned int i;
+
+    if (!n)
+        return NULL;
+
+    n->info          = *info;
+    n->depth         = info->capacity ? info->capacity : 1;
+    n->client_frames = n->depth < NET_CLIENT_FRAMES ? n->depth : NET_CLIENT_FRAMES;
+    n->listen_fd     = -1;
+    n->incoming_tail = &n->incoming;
+    pthread_mutex_init(&n->lock, NULL);
+
+    n->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    n->pool = calloc(n->depth, sizeof(*n->pool));
+    if (n->wake_fd == -1 || !n->pool)
+        goto fail;
+
+    for (i = 0; i < n->depth; i++)
+    {
+        struct net_frame *f = &n->pool[i];
+
+        f->next = n->free_list;
+        n->free_list = f;
+    }
+
+    if (open_socket(n, spec, port_offset) == -1)
+        goto fail;
+
+    if (n->proto == NET_UDP)
+        for (i = 0; i < n->depth; i++)
+        {
+            struct net_frame *f = &n->pool[i];
+
+            f->chunks = calloc((info->max_record + NET_UDP_CHUNK - 1) / NET_UDP_CHUNK, sizeof(*f->chunks));
+            if (!f->chunks)
+                goto fail;
+        }
+
+    errno = pthread_create(&n->thread, NULL, net_thread, n);
+    if (errno)
+        goto fail;
+    n->started = 1;
+
+    return n;
+
+fail:
+    {
+        int err = errno;
+
+        frame_net_destroy(n);
+        errno = err;
+    }
+    return NULL;
+}
+
+/**
+ * @name   frame_net_stop
+ * @brief  Drains and stops the sender, disconnects every client
+ * @param  n - sender
+ *
+ * @descr  Every frame still held is handed back through its done() before
+ *         this returns; later submits are refused. Safe to call twice.
+ *
+ * @return none
+ */
+
+void frame_net_stop(struct frame_net *n)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&n->lock);
+    n->stopping = 1;
+    pthread_mutex_unlock(&n->lock);
+
+    if (n->started)
+    {
+        ssize_t r = write(n->wake_fd, &one, sizeof(one));
+
+        (void)r;
+        pthread_join(n->thread, NULL);
+        n->started = 0;
+    }
+
+    take_incoming(n);
+    while (n->n_clients)
+        drop_client(n, n->n_clients - 1);
+}
+
+void frame_net_destroy(struct frame_net *n)
+{
+    unsigned int i;
+
+    if (!n)
+        return;
+
+    frame_net_stop(n);
+
+    if (n->listen_fd != -1)
+        close(n->listen_fd);
+    if (n->wake_fd != -1)
+        close(n->wake_fd);
+    if (n->pool)
+        for (i = 0; i < n->depth; i++)
+            free(n->pool[i].chunks);
+    free(n->pool);
+    pthread_mutex_destroy(&n->lock);
+    free(n);
+}
+
+/**
+ * @name   frame_net_submit
+ * @brief  Queues a frame for every client
+ * @param  n          - sender
+ *         tag        - frame number
+ *         sequence   - driver sequence number
+ *         capture_ns - driver timestamp
+ *         header     - bytes sent before data, copied, at most WRITER_HEADER_MAX
+ *         data, size - payload, read in place until done() is called
+ *         done, ctx  - called on the sender thread once no client needs data
+ *
+ * @descr  Never blocks. With no client connected, or every pool frame
+ *         still in flight, the frame is not taken.
+ *
+ * @return 0 if taken, -1 with errno set (ENOTCONN, ENOBUFS) if not, and
+ *         done() will not be called
+ */
+
+int frame_net_submit(struct frame_net *n, unsigned int tag, unsigned int sequence, uint64_t capture_ns,
+                     const void *header, size_t header_len,
+                     const void *data, size_t size,
+                     writer_done_fn done, void *ctx)
+{
+    struct net_frame *f;
+    uint64_t one = 1;
+    size_t length = header_len + size;
+    ssize_t r;
+
+    if (header_len > WRITER_HEADER_MAX || length > n->info.max_record)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    pthread_mutex_lock(&n->lock);
+    if (!n->receivers || n->stopping)
+    {
+        pthread_mutex_unlock(&n->lock);
+        errno = ENOTCONN;
+        return -1;
+    }
+    f = n->free_list;
+    if (!f)
+    {
+        n->no_room++;
+        pthread_mutex_unlock(&n->lock);
+        errno = ENOBUFS;
+        return -1;
+    }
+    n->free_list = f->next;
+    pthread_mutex_unlock(&n->lock);
+
+    f->hdr.magic       = NET_MAGIC;
+    f->hdr.header_size = sizeof(f->hdr);
+    f->hdr.tag         = tag;
+    f->hdr.sequence    = sequence;
+    f->hdr.capture_ns  = capture_ns;
+    f->hdr.width       = n->info.width;
+    f->hdr.height      = n->info.height;
+    f->hdr.pixelformat = n->info.pixelformat;
+    f->hdr.length      = length;
+    f->hdr.offset      = 0;
+    f->hdr.chunk       = length;
+    memcpy(f->image_header, header, header_len);
+    f->header_len = header_len;
+    f->data       = data;
+    f->size       = size;
+    f->done       = done;
+    f->ctx        = ctx;
+
+    if (n->proto == NET_UDP)
+    {
+        unsigned int k;
+
+        f->n_chunks = (length + NET_UDP_CHUNK - 1) / NET_UDP_CHUNK;
+        for (k = 0; k < f->n_chunks; k++)
+        {
+            f->chunks[k] = f->hdr;
+            f->chunks[k].offset = k * NET_UDP_CHUNK;
+            f->chunks[k].chunk  = length - f->chunks[k].offset < NET_UDP_CHUNK ?
+                                  length - f->chunks[k].offset : NET_UDP_CHUNK;
+        }
+    }
+
+    pthread_mutex_lock(&n->lock);
+    f->next = NULL;
+    *n->incoming_tail = f;
+    n->incoming_tail = &f->next;
+    pthread_mutex_unlock(&n->lock);
+
+    r = write(n->wake_fd, &one, sizeof(one));
+    (void)r;
+
+    return 0;
+}
+
+void frame_net_report(struct frame_net *n, FILE *fp)
+{
+    fprintf(fp, "net %s: %lu frames sent, %lu missed by slow clients, %lu with no room",
+            n->desc, n->frames_sent, n->dropped, n->no_room);
+    if (n->proto == NET_TCP)
+        fprintf(fp, ", %lu clients served", n->accepted);
+    fprintf(fp, "; %lu zerocopy sends completed, %lu of them copied by the kernel\n",
+            n->completions, n->copied);
+}
@@ -0,0 +1,76 @@
+/*
+ * Filename   : frame_net.h
+ *
+ * Description: Network output of frames over TCP or UDP
+ *            : A sender thread owns the sockets. tcp:[HOST:]PORT listens and
+ *            : streams every frame to each connected client; udp:HOST:PORT
+ *            : sends every frame to one destination split into datagrams.
+ *            : Sends use MSG_ZEROCOPY where the kernel allows it, so the
+ *            : pixels go from the caller's buffer to the NIC without a copy
+ *            : and the buffer is handed back only once the kernel is done.
+ *            : A slow client misses frames rather than holding up capture.
+ *            : Each frame, or each datagram of one, starts with a
+ *            : net_frame_header followed by the bytes a per-frame file would
+ *            : have held (e.g. PPM header and pixels).
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_NET_H
+#define FRAME_NET_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "frame_writer.h"
+#include "frame_stream.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define NET_MAGIC           0x31464e41u // "ANF1" in little endian memory
+#define NET_MAX_CLIENTS     8           // more TCP connections are refused
+#define NET_UDP_DATAGRAM    1472        // header + chunk, one Ethernet MTU without fragments
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+// Before every frame on TCP, before every datagram on UDP; host byte order
+struct net_frame_header
+{
+        uint32_t        magic;          // NET_MAGIC
+        uint32_t        header_size;    // sizeof(struct net_frame_header)
+        uint32_t        tag;            // frame number
+        uint32_t        sequence;       // driver sequence number
+        uint64_t        capture_ns;     // driver timestamp, CLOCK_MONOTONIC
+        uint32_t        width, height;
+        uint32_t        pixelformat;    // V4L2 fourcc of the camera
+        uint32_t        length;         // frame bytes in total
+        uint32_t        offset;         // of the bytes that follow, within the frame
+        uint32_t        chunk;          // bytes that follow this header
+};
+
+#define NET_UDP_CHUNK       (NET_UDP_DATAGRAM - sizeof(struct net_frame_header))
+
+struct frame_net;
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct frame_net *frame_net_create(const char *spec, unsigned int port_offset,
+                                   const struct frame_stream_info *info);
+void frame_net_stop(struct frame_net *n);
+void frame_net_destroy(struct frame_net *n);
+
+int frame_net_submit(struct frame_net *n, unsigned int tag, unsigned int sequence, uint64_t capture_ns,
+                     const void *header, size_t header_len,
+                     const void *data, size_t size,
+                     writer_done_fn done, void *ctx);
+
+void frame_net_report(struct frame_net *n, FILE *fp);
+
+#endif /* FRAME_NET_H */
@@ -0,0 +1,266 @@
+/*
+ * Filename   : frame_pipeline.c
+ *
+ * Description: Stage graph between a captured frame and its sinks
+ *            : 1) Stages are added in order; each must take the format the
+ *            :    one before it makes, sinks the format of the last stage
+ *            : 2) pipeline_run() walks the stages: in-place ones work on the
+ *            :    current buffer, others write into a buffer from alloc()
+ *            :    which then becomes current, the old one being put
+ *            : 3) Every sink sees the final buffer; the pipeline's own
+ *            :    reference is put after the last, so sinks that held it
+ *            :    decide when release() runs
+ *            : One thread runs a pipeline; references may be put anywhere.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include "frame_pipeline.h"
+#include "frame_stats.h"
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct pipeline
+{
+        unsigned int        in_format;          // of source buffers
+        unsigned int        format;             // after the last stage
+        struct pipe_stage   stages[PIPE_MAX_STAGES];
+        unsigned int        n_stages;
+        struct pipe_sink    sinks[PIPE_MAX_SINKS];
+        unsigned int        n_sinks;
+        pipe_alloc_fn       alloc;
+        void               *alloc_ctx;
+
+        unsigned long       runs, dropped;
+};
+
+/*************************************************************************
+ *                         Buffer Functions                              *
+ *************************************************************************/
+
+// Sets up a buffer over storage it does not own, with no references
+void pipe_buf_init(struct pipe_buf *b, unsigned char *data, size_t capacity, void (*release)(struct pipe_buf *b))
+{
+    memset(b, 0, sizeof(*b));
+    b->data     = data;
+    b->capacity = capacity;
+    b->release  = release;
+    b->dmabuf_fd = -1;
+    atomic_init(&b->refs, 0);
+}
+
+void pipe_buf_get(struct pipe_buf *b)
+{
+    atomic_fetch_add_explicit(&b->refs, 1, memory_order_relaxed);
+}
+
+// Drops a reference, the last one hands the buffer back to its owner
+void pipe_buf_put(struct pipe_buf *b)
+{
+    if (atomic_fetch_sub_explicit(&b->refs, 1, memory_order_acq_rel) == 1)
+        b->release(b);
+}
+
+/*************************************************************************
+ *                         Pipeline Functions                            *
+ *************************************************************************/
+
+/**
+ * @name   pipeline_create
+ * @brief  Creates an empty pipeline for source buffers of one format
+ * @param  in_format - V4L2 fourcc of the buffers pipeline_run() is given
+ *         alloc     - output buffers for stages that are not in place
+ *         alloc_ctx - passed to alloc
+ *
+ * @return pipeline, NULL on allocation failure
+ */
+
+struct pipeline *pipeline_create(unsigned int in_format, pipe_alloc_fn alloc, void *alloc_ctx)
+{
+    struct pipeline *p = calloc(1, sizeof(*p));
+
+    if (!p)
+        return NULL;
+
+    p->in_format = in_format;
+    p->format    = in_format;
+    p->alloc     = alloc;
+    p->alloc_ctx = alloc_ctx;
+
+    return p;
+}
+
+void pipeline_destroy(struct pipeline *p)
+{
+    free(p);
+}
+
+// 0, or -1 with EINVAL if s does not take the current format, ENOSPC if full
+int pipeline_add_stage(struct pipeline *p, const struct pipe_stage *s)
+{
+    if (p->n_stages == PIPE_MAX_STAGES)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+    if ((s->in_format && s->in_format != p->format) || (!s->in_place && !p->alloc))
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    p->stages[p->n_stages++] = *s;
+    if (s->out_format)
+        p->format = s->out_format;
+
+    return 0;
+}
+
+int pipeline_add_sink(struct pipeline *p, const struct pipe_sink *s)
+{
+    if (p->n_sinks == PIPE_MAX_SINKS)
+    {
+        errno = ENOSPC;
+        return -1;
+    }
+    if (s->in_format && s->in_format != p->format)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    p->sinks[p->n_sinks++] = *s;
+
+    return 0;
+}
+
+// Stages that write into a new buffer; 0 means sinks get the source buffer itself
+int pipeline_copies(const struct pipeline *p)
+{
+    unsigned int i;
+    int n = 0;
+
+    for (i = 0; i < p->n_stages; i++)
+        n += !p->stages[i].in_place;
+
+    return n;
+}
+
+unsigned int pipeline_format(const struct pipeline *p)
+{
+    return p->format;
+}
+
+/**
+ * @name   pipeline_run
+ * @brief  Takes one source buffer through every stage and on to every sink
+ * @param  p   - pipeline
+ *         src - source buffer; the caller's reference passes to the pipeline
+ *
+ * @descr  A stage failing, or alloc() returning NULL, drops the frame
+ *         before any sink sees it
+ *
+ * @return 0, -1 if the frame was dropped
+ */
+
+int pipeline_run(struct pipeline *p, struct pipe_buf *src)
+{
+    struct pipe_buf *cur = src;
+    unsigned int i;
+
+    p->runs++;
+
+    for (i = 0; i < p->n_stages; i++)
+    {
+        const struct pipe_stage *s = &p->stages[i];
+        struct pipe_buf *out;
+
+        if (s->in_place)
+        {
+            if (s->run(s->ctx, cur, cur) == -1)
+                goto drop;
+            if (s->out_format)
+                cur->pixelformat = s->out_format;
+            continue;
+        }
+
+        out = p->alloc(p->alloc_ctx);
+        if (!out)
+            goto drop;
+
+        out->size        = 0;
+        out->pixelformat = s->out_format ? s->out_format : cur->pixelformat;
+        out->width       = cur->width;
+        out->height      = cur->height;
+        out->tag         = cur->tag;
+        out->sequence    = cur->sequence;
+        out->capture_ns  = cur->capture_ns;
+        out->time        = cur->time;
+        out->header_len  = 0;
+        out->dmabuf_fd   = -1;
+
+        if (s->run(s->ctx, cur, out) == -1)
+        {
+            pipe_buf_put(out);
+            goto drop;
+        }
+        pipe_buf_put(cur);
+        cur = out;
+    }
+
+    cur->sink_ns = stats_now_ns();
+    for (i = 0; i < p->n_sinks; i++)
+        p->sinks[i].consume(p->sinks[i].ctx, cur);
+
+    pipe_buf_put(cur);
+    return 0;
+
+drop:
+    pipe_buf_put(cur);
+    p->dropped++;
+    return -1;
+}
+
+// e.g. "YUYV -> yuyv-rgb24 -> RGB3 -> ppm-header (in place) -> disk, shm" on one line
+void pipeline_describe(const struct pipeline *p, FILE *fp)
+{
+    unsigned int i, format = p->in_format;
+
+    fprintf(fp, "%.4s", (const char *)&format);
+    for (i = 0; i < p->n_stages; i++)
+    {
+        const struct pipe_stage *s = &p->stages[i];
+
+        fprintf(fp, " -> %s", s->name);
+        if (s->in_place)
+            fprintf(fp, " (in place)");
+        if (s->out_format && s->out_format != format)
+        {
+            format = s->out_format;
+            fprintf(fp, " -> %.4s", (const char *)&format);
+        }
+    }
+    for (i = 0; i < p->n_sinks; i++)
+        fprintf(fp, "%s%s", i ? ", " : " -> ", p->sinks[i].name);
+    if (!pipeline_copies(p))
+        fprintf(fp, ", sinks share the source buffer");
+    fprintf(fp, "\n");
+}
+
+void pipeline_report(const struct pipeline *p, FILE *fp)
+{
+    fprintf(fp, "%lu frames through the pipeline, %lu dropped in a stage\n", p->runs, p->dropped);
+}
@@ -0,0 +1,112 @@
+/*
+ * Filename   : frame_pipeline.h
+ *
+ * Description: Stage graph between a captured frame and its sinks
+ *            : source -> stage -> stage ... -> sink, sink, ...
+ *            : Each stage declares the V4L2 format it takes and makes, and
+ *            : whether it works in place on its input. A stage that is not
+ *            : in place gets a fresh output buffer from the pipeline's
+ *            : allocator; in-place stages and sinks get the same buffer, so
+ *            : a pipeline with no copying stage hands the source buffer
+ *            : itself to every sink. Sinks that keep a buffer past their
+ *            : consume call take a reference; the buffer goes back to its
+ *            : owner through release() when the last reference is dropped.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_PIPELINE_H
+#define FRAME_PIPELINE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "frame_writer.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define PIPE_MAX_STAGES     8
+#define PIPE_MAX_SINKS      8
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+// A frame travelling through the pipeline
+struct pipe_buf
+{
+        unsigned char      *data;
+        size_t              size;               // bytes used
+        size_t              capacity;
+        unsigned int        pixelformat;        // V4L2 fourcc of data
+        unsigned int        width, height;
+        unsigned int        tag;                // frame number
+        unsigned int        sequence;           // driver sequence number
+        uint64_t            capture_ns;         // driver timestamp, CLOCK_MONOTONIC
+        struct timespec     time;               // CLOCK_REALTIME at dequeue
+        uint64_t            sink_ns;            // CLOCK_MONOTONIC when the sinks got it
+        char                header[WRITER_HEADER_MAX];  // written ahead of data, e.g. PPM
+        size_t              header_len;
+        int                 dmabuf_fd;          // data starts this DMABUF, -1 if not one
+
+        atomic_uint         refs;
+        void              (*release)(struct pipe_buf *b);  // last reference gone, any thread
+        void               *owner;              // for release() and sink callbacks
+};
+
+// Convert or filter; returns 0, or -1 to drop the frame
+typedef int (*pipe_stage_fn)(void *ctx, struct pipe_buf *in, struct pipe_buf *out);
+
+// Sink; pipe_buf_get() to hold b after returning
+typedef void (*pipe_sink_fn)(void *ctx, struct pipe_buf *b);
+
+// New output buffer holding one reference, NULL to drop the frame
+typedef struct pipe_buf *(*pipe_alloc_fn)(void *ctx);
+
+struct pipe_stage
+{
+        const char         *name;
+        unsigned int        in_format;          // fourcc taken, 0 = any
+        unsigned int        out_format;         // fourcc made, 0 = same as in
+        int                 in_place;           // run(in, in), no output buffer
+        pipe_stage_fn       run;
+        void               *ctx;
+};
+
+struct pipe_sink
+{
+        const char         *name;
+        unsigned int        in_format;          // fourcc taken, 0 = any
+        pipe_sink_fn        consume;
+        void               *ctx;
+};
+
+struct pipeline;
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+void pipe_buf_init(struct pipe_buf *b, unsigned char *data, size_t capacity, void (*release)(struct pipe_buf *b));
+void pipe_buf_get(struct pipe_buf *b);
+void pipe_buf_put(struct pipe_buf *b);
+
+struct pipeline *pipeline_create(unsigned int in_format, pipe_alloc_fn alloc, void *alloc_ctx);
+void pipeline_destroy(struct pipeline *p);
+
+int pipeline_add_stage(struct pipeline *p, const struct pipe_stage *s);
+int pipeline_add_sink(struct pipeline *p, const struct pipe_sink *s);
+
+int pipeline_copies(const struct pipeline *p);
+unsigned int pipeline_format(const struct pipeline *p);
+int pipeline_run(struct pipeline *p, struct pipe_buf *src);
+
+void pipeline_describe(const struct pipeline *p, FILE *fp);
+void pipeline_report(const struct pipeline *p, FILE *fp);
+
+#endif /* FRAME_PIPELINE_H */
@@ -0,0 +1,432 @@
+/*
+ * Filename   : frame_recorder.c
+ *
+ * Description: "Last N frames" ring recorder
+ *            : 1) name.frm / name.idx are created at full size and mapped
+ *            :    MAP_SHARED; record slots are reused oldest first
+ *            : 2) frame_recorder_put() invalidates the slot's index entry,
+ *            :    copies the frame in and marks the entry valid again
+ *            : 3) A background thread msyncs both mappings every sync_ms, so
+ *            :    after a crash the files hold the last frames written back
+ *            : 4) On a trigger the thread freezes the ring, writes
+ *            :    name_snapNNNN.frm / .idx with the index in capture order,
+ *            :    fdatasyncs them and unfreezes; frames arriving meanwhile
+ *            :    are not recorded
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : man 2 mmap, msync
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#define _GNU_SOURCE             /* fallocate() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "frame_recorder.h"
+#include "frame_stats.h"
+#include "frame_log.h"
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct frame_recorder
+{
+        int                         dirfd;
+        char                       *name;
+        struct frame_stream_info    info;
+        size_t                      record_size;
+
+        int                         fd, idx_fd;
+        unsigned char              *map;        // whole .frm, header included
+        size_t                      map_len;
+        struct stream_index_entry  *index;      // whole .idx, one entry per slot
+        size_t                      index_len;
+
+        pthread_mutex_t             lock;       // held by put() while it copies
+        pthread_cond_t              wake;
+        pthread_t                   thread;
+        unsigned int                sync_ms;
+        int                         frozen, triggered, stopping;
+
+        // under lock
+        unsigned int                next;       // slot the next frame goes to
+        unsigned long               recorded, skipped, snapshots;
+};
+
+/*************************************************************************
+ *                         Ring File Functions                           *
+ *************************************************************************/
+
+// Creates name + suffix at len bytes and maps it shared, NULL on failure
+static void *map_file(struct frame_recorder *r, const char *suffix, size_t len, int *fd)
+{
+    char path[256];
+    void *p;
+
+    snprintf(path, sizeof(path), "%s%s", r->name, suffix);
+    *fd = openat(r->dirfd, path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 00666);
+    if (*fd == -1)
+        return NULL;
+
+    // Blocks are reserved up front so a full disk can't SIGBUS the capture thread
+    if (fallocate(*fd, 0, 0, len) == -1 && (errno != EOPNOTSUPP || ftruncate(*fd, len) == -1))
+        return NULL;
+
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+// Writes all of len bytes, EIO for a short write that made no progress
+static int write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            if (n == 0)
+                errno = EIO;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+/**
+ * @name   recorder_snapshot
+ * @brief  Copies the frozen ring out as a stream segment
+ * @param  r - recorder, frozen
+ *
+ * @descr  Records keep their offsets, so the index is only reordered:
+ *         valid entries oldest first, starting at the next slot to be reused
+ *         Runs on the recorder thread; capture goes on, unrecorded
+ *
+ * @return none
+ */
+
+static void recorder_snapshot(struct frame_recorder *r)
+{
+    struct stream_file_header hdr;
+    char path[256];
+    unsigned int i, n = 0, number, cap = r->info.capacity;
+    int fd = -1, idx_fd = -1, ok = 0;
+    uint64_t start = stats_now_ns();
+
+    pthread_mutex_lock(&r->lock);
+    number = r->snapshots++;
+    pthread_mutex_unlock(&r->lock);
+
+    snprintf(path, sizeof(path), "%s_snap%04u.frm", r->name, number);
+    fd = openat(r->dirfd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00666);
+    snprintf(path, sizeof(path), "%s_snap%04u.idx", r->name, number);
+    idx_fd = openat(r->dirfd, path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00666);
+    if (fd == -1 || idx_fd == -1)
+        goto out;
+
+    memcpy(&hdr, r->map, sizeof(hdr));
+    hdr.segment = number;
+    if (write_all(fd, &hdr, sizeof(hdr)) == -1 ||
+        write_all(fd, r->map + sizeof(hdr), r->map_len - sizeof(hdr)) == -1)
+        goto out;
+
+    for (i = 0; i < cap; i++)
+    {
+        const struct stream_index_entry *e = &r->index[(r->next + i) % cap];
+
+        if (!(e->flags & STREAM_ENTRY_VALID))
+            continue;
+        if (write_all(idx_fd, e, sizeof(*e)) == -1)
+            goto out;
+        n++;
+    }
+
+    ok = fdatasync(fd) == 0 && fdatasync(idx_fd) == 0;
+
+out:
+    if (ok)
+        log_info("%s: snapshot %u, %u frames in %.1f ms", r->name, number, n, (stats_now_ns() - start) / 1e6);
+    else
+        log_error("%s: snapshot %u failed, %s", r->name, number, strerror(errno));
+    if (fd != -1)
+        close(fd);
+    if (idx_fd != -1)
+        close(idx_fd);
+}
+
+/**
+ * @name   recorder_thread
+ * @brief  Background msync and snapshot thread
+ * @param  arg - recorder
+ *
+ * @return NULL
+ */
+
+static void *recorder_thread(void *arg)
+{
+    struct frame_recorder *r = arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&r->lock);
+    while (!r->stopping)
+    {
+        if (!r->triggered)
+        {
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec  += r->sync_ms / 1000;
+            deadline.tv_nsec += (r->sync_ms % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&r->wake, &r->lock, &deadline);
+        }
+
+        if (r->triggered)
+        {
+            // put() holds the lock while copying, so no frame is half written from here on
+            r->triggered = 0;
+            r->frozen = 1;
+            pthread_mutex_unlock(&r->lock);
+            recorder_snapshot(r);
+            pthread_mutex_lock(&r->lock);
+            r->frozen = 0;
+            continue;
+        }
+
+        pthread_mutex_unlock(&r->lock);
+        msync(r->map, r->map_len, MS_SYNC);
+        msync(r->index, r->index_len, MS_SYNC);
+        pthread_mutex_lock(&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    return NULL;
+}
+
+/*************************************************************************
+ *                         Recorder API Functions                        *
+ *************************************************************************/
+
+/**
+ * @name   frame_recorder_create
+ * @brief  Creates the ring files and starts the background thread
+ * @param  dir     - directory for the ring and its snapshots
+ *         name    - ring is name.frm / name.idx
+ *         info    - geometry, largest frame and frames kept (capacity)
+ *         sync_ms - msync period
+ *
+ * @descr  Existing ring files of the same name are overwritten
+ *
+ * @return recorder, NULL with errno set on failure
+ */
+
+struct frame_recorder *frame_recorder_create(const char *dir, const char *name,
+                                             const struct frame_stream_info *info, unsigned int sync_ms)
+{
+    struct frame_recorder *r;
+    struct stream_file_header *hdr;
+    struct timespec now;
+    int err;
+
+    if (info->capacity < 1 || info->max_record == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    r = calloc(1, sizeof(*r));
+    if (!r)
+        return NULL;
+
+    r->fd = r->idx_fd = -1;
+    r->info = *info;
+    r->sync_ms = sync_ms ? sync_ms : 1000;
+    r->record_size = (info->max_record + STREAM_ALIGN - 1) / STREAM_ALIGN * STREAM_ALIGN;
+    r->map_len = STREAM_HEADER_SIZE + (size_t)info->capacity * r->record_size;
+    r->index_len = (size_t)info->capacity * sizeof(struct stream_index_entry);
+    r->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    r->name = strdup(name);
+    if (r->dirfd == -1 || !r->name)
+        goto fail;
+
+    r->map = map_file(r, ".frm", r->map_len, &r->fd);
+    if (!r->map)
+        goto fail;
+    r->index = map_file(r, ".idx", r->index_len, &r->idx_fd);
+    if (!r->index)
+        goto fail;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    hdr = (struct stream_file_header *)r->map;
+    memcpy(hdr->magic, STREAM_MAGIC, sizeof(hdr->magic));
+    hdr->version     = STREAM_VERSION;
+    hdr->header_size = STREAM_HEADER_SIZE;
+    hdr->record_size = r->record_size;
+    hdr->capacity    = info->capacity;
+    hdr->width       = info->width;
+    hdr->height      = info->height;
+    hdr->pixelformat = info->pixelformat;
+    hdr->created_ns  = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wake, NULL);
+    errno = pthread_create(&r->thread, NULL, recorder_thread, r);
+    if (errno)
+    {
+        pthread_mutex_destroy(&r->lock);
+        pthread_cond_destroy(&r->wake);
+        goto fail;
+    }
+
+    return r;
+
+fail:
+    err = errno;
+    if (r->index)
+        munmap(r->index, r->index_len);
+    if (r->map)
+        munmap(r->map, r->map_len);
+    if (r->idx_fd != -1)
+        close(r->idx_fd);
+    if (r->fd != -1)
+        close(r->fd);
+    if (r->dirfd != -1)
+        close(r->dirfd);
+    free(r->name);
+    free(r);
+    errno = err;
+    return NULL;
+}
+
+/**
+ * @name   frame_recorder_destroy
+ * @brief  Stops the thread, syncs and unmaps the ring, which stays on disk
+ * @param  r - recorder
+ *
+ * @descr  A snapshot still being written is finished first
+ *
+ * @return none
+ */
+
+void frame_recorder_destroy(struct frame_recorder *r)
+{
+    if (!r)
+        return;
+
+    pthread_mutex_lock(&r->lock);
+    r->stopping = 1;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+
+    msync(r->map, r->map_len, MS_SYNC);
+    msync(r->index, r->index_len, MS_SYNC);
+    munmap(r->map, r->map_len);
+    munmap(r->index, r->index_len);
+    close(r->fd);
+    close(r->idx_fd);
+    close(r->dirfd);
+
+    pthread_mutex_destroy(&r->lock);
+    pthread_cond_destroy(&r->wake);
+    free(r->name);
+    free(r);
+}
+
+/**
+ * @name   frame_recorder_put
+ * @brief  Copies a frame into the oldest slot of the ring
+ * @param  r          - recorder
+ *         data, size - frame, e.g. straight from the capture buffer
+ *         tag        - frame number
+ *         sequence   - driver sequence number
+ *         capture_ns - driver timestamp
+ *
+ * @descr  Capture thread only. The lock is uncontended except while a
+ *         snapshot freezes the ring
+ *
+ * @return 0 on success, -1 with errno EBUSY while frozen, EMSGSIZE if too big
+ */
+
+int frame_recorder_put(struct frame_recorder *r, const void *data, size_t size,
+                       unsigned int tag, unsigned int sequence, uint64_t capture_ns)
+{
+    struct stream_index_entry *e;
+    size_t offset;
+
+    if (size > r->record_size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    if (r->frozen)
+    {
+        r->skipped++;
+        pthread_mutex_unlock(&r->lock);
+        errno = EBUSY;
+        return -1;
+    }
+
+    e = &r->index[r->next];
+    offset = STREAM_HEADER_SIZE + (size_t)r->next * r->record_size;
+
+    // Invalid while the record is half old, half new
+    e->flags = 0;
+    memcpy(r->map + offset, data, size);
+    e->offset     = offset;
+    e->length     = size;
+    e->tag        = tag;
+    e->sequence   = sequence;
+    e->capture_ns = capture_ns;
+    e->flags      = STREAM_ENTRY_VALID;
+
+    r->next = (r->next + 1) % r->info.capacity;
+    r->recorded++;
+    pthread_mutex_unlock(&r->lock);
+
+    return 0;
+}
+
+// Asks the recorder thread for a snapshot; repeated triggers before it starts coalesce
+void frame_recorder_trigger(struct frame_recorder *r)
+{
+    pthread_mutex_lock(&r->lock);
+    r->triggered = 1;
+    pthread_cond_signal(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+}
+
+// Prints frames recorded, frames missed while frozen and snapshots taken
+void frame_recorder_report(struct frame_recorder *r, FILE *fp)
+{
+    pthread_mutex_lock(&r->lock);
+    fprintf(fp, "recorder (%s): %lu frames recorded, last %u kept, %lu skipped during %lu snapshots\n",
+            r->name, r->recorded, r->info.capacity, r->skipped, r->snapshots);
+    pthread_mutex_unlock(&r->lock);
+}
@@ -0,0 +1,40 @@
+/*
+ * Filename   : frame_recorder.h
+ *
+ * Description: "Last N frames" ring recorder
+ *            : A fixed-size file, laid out like a frame_stream segment, is
+ *            : mapped shared and overwritten in a circle straight from the
+ *            : capture buffers: one memcpy per frame, no write() calls.
+ *            : A background thread msyncs it and, on a trigger, freezes the
+ *            : ring and copies it out as a snapshot segment in capture order,
+ *            : readable with stream_tool. Disk use is bounded by the ring.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_RECORDER_H
+#define FRAME_RECORDER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "frame_stream.h"
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct frame_recorder;
+
+struct frame_recorder *frame_recorder_create(const char *dir, const char *name,
+                                             const struct frame_stream_info *info, unsigned int sync_ms);
+void frame_recorder_destroy(struct frame_recorder *r);
+
+int frame_recorder_put(struct frame_recorder *r, const void *data, size_t size,
+                       unsigned int tag, unsigned int sequence, uint64_t capture_ns);
+void frame_recorder_trigger(struct frame_recorder *r);
+
+void frame_recorder_report(struct frame_recorder *r, FILE *fp);
+
+#endif /* FRAME_RECORDER_H */
@@ -0,0 +1,343 @@
+/*
+ * Filename   : frame_ring.c
+ *
+ * Description: Lock-free single-producer frame ring
+ *            : Two index rings share one frame pool:
+ *            : 1) slots      - frames published by the capture thread
+ *            : 2) free_slots - frames released by the worker
+ *            : Indices are free running counters, masked on access.
+ *            : The worker claims a published frame with a CAS on tail so the
+ *            : producer can race it for the oldest frame under RING_DROP_OLDEST.
+ *            : Semaphores are only used to sleep when there is nothing to do;
+ *            : the uncontended path never enters the kernel.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "frame_ring.h"
+
+/*************************************************************************
+ *                  Global Variables                                     *
+ *************************************************************************/
+
+static const char *policy_names[] = { "block", "drop-oldest", "drop-newest" };
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+// Smallest power of two >= n
+static unsigned int ring_pow2(unsigned int n)
+{
+    unsigned int p = 1;
+
+    while (p < n)
+        p <<= 1;
+
+    return p;
+}
+
+// Sleep on a semaphore, ignoring signal interruptions
+static void ring_wait(sem_t *sem)
+{
+    while (sem_wait(sem) == -1 && errno == EINTR)
+        ;
+}
+
+/**
+ * @name   frame_ring_create
+ * @brief  Allocates a frame ring and its frame pool
+ * @param  depth    - frames that may wait for the consumer, >= 1
+ *         capacity - bytes of storage per frame, 0 if frames only
+ *                    refer to memory elsewhere, see frame.buffer
+ *         policy   - what the producer does when the consumer falls behind
+ *         held     - consumed frames that may still be in use elsewhere,
+ *                    e.g. by sinks reading them in place
+ *
+ * @descr  depth + 1 + held frames are allocated so the consumer can work
+ *         on one while depth more are queued; all start on the free ring
+ *
+ * @return ring, NULL on allocation failure
+ */
+
+struct frame_ring *frame_ring_create(unsigned int depth, size_t capacity, enum ring_policy policy,
+                                     unsigned int held)
+{
+    struct frame_ring *ring;
+    unsigned int i, slots;
+
+    if (depth < 1)
+        depth = 1;
+
+    ring = calloc(1, sizeof(*ring));
+    if (!ring)
+        return NULL;
+
+    ring->depth    = depth;
+    ring->n_frames = depth + 1 + held;
+    ring->capacity = capacity;
+    ring->policy   = policy;
+
+    // Both rings must hold every frame in the pool
+    slots = ring_pow2(ring->n_frames);
+    ring->mask = slots - 1;
+
+    ring->slots      = calloc(slots, sizeof(*ring->slots));
+    ring->free_slots = calloc(slots, sizeof(*ring->free_slots));
+    ring->frames     = calloc(ring->n_frames, sizeof(*ring->frames));
+    if (!ring->slots || !ring->free_slots || !ring->frames)
+    {
+        frame_ring_destroy(ring);
+        return NULL;
+    }
+
+    for (i = 0; i < ring->n_frames; i++)
+    {
+        ring->frames[i].buffer = -1;
+        ring->frames[i].data = capacity ? malloc(capacity) : NULL;
+        if (capacity && !ring->frames[i].data)
+        {
+            frame_ring_destroy(ring);
+            return NULL;
+        }
+        ring->free_slots[i] = &ring->frames[i];
+    }
+    atomic_init(&ring->free_head, ring->n_frames);
+    atomic_flag_clear(&ring->release_lock);
+
+    sem_init(&ring->ready, 0, 0);
+    sem_init(&ring->space, 0, 0);
+
+    return ring;
+}
+
+/**
+ * @name   frame_ring_destroy
+ * @brief  Frees the ring and its frame pool
+ * @param  ring - ring to free, neither side may still be using it
+ *
+ * @return none
+ */
+
+void frame_ring_destroy(struct frame_ring *ring)
+{
+    unsigned int i;
+
+    if (!ring)
+        return;
+
+    if (ring->frames)
+        for (i = 0; i < ring->n_frames; i++)
+            free(ring->frames[i].data);
+
+    sem_destroy(&ring->ready);
+    sem_destroy(&ring->space);
+
+    free(ring->frames);
+    free(ring->slots);
+    free(ring->free_slots);
+    free(ring);
+}
+
+/**
+ * @name   frame_ring_acquire
+ * @brief  Producer side: gets an empty frame to fill
+ * @param  ring - ring to take a frame from
+ *
+ * @descr  Takes a released frame if there is one, otherwise applies policy:
+ *         RING_BLOCK       - sleeps until the consumer releases a frame
+ *         RING_DROP_OLDEST - claims the oldest published frame, racing the
+ *                            consumer for it with a CAS on tail; with none
+ *                            left (the consumer or its sinks hold every
+ *                            frame) the new frame is dropped rather than
+ *                            waited for, as nothing wakes the producer here
+ *         RING_DROP_NEWEST - gives up, caller drops the new frame
+ *
+ * @return frame to fill, NULL if the new frame must be dropped or on shutdown
+ */
+
+struct frame *frame_ring_acquire(struct frame_ring *ring)
+{
+    for (;;)
+    {
+        unsigned int ft = atomic_load_explicit(&ring->free_tail, memory_order_relaxed);
+        unsigned int t;
+
+        if (atomic_load_explicit(&ring->free_head, memory_order_acquire) != ft)
+        {
+            struct frame *f = ring->free_slots[ft & ring->mask];
+
+            atomic_store_explicit(&ring->free_tail, ft + 1, memory_order_release);
+            return f;
+        }
+
+        if (atomic_load(&ring->shutdown))
+            return NULL;
+
+        switch (ring->policy)
+        {
+            case RING_DROP_NEWEST:
+                atomic_fetch_add(&ring->dropped, 1);
+                return NULL;
+
+            case RING_DROP_OLDEST:
+                // A lost CAS reloads t, try the next oldest while any is left
+                t = atomic_load_explicit(&ring->tail, memory_order_acquire);
+                while (atomic_load_explicit(&ring->head, memory_order_relaxed) != t)
+                {
+                    struct frame *f = ring->slots[t & ring->mask];
+
+                    if (atomic_compare_exchange_strong(&ring->tail, &t, t + 1))
+                    {
+                        atomic_fetch_add(&ring->dropped, 1);
+                        return f;
+                    }
+                }
+                atomic_fetch_add(&ring->dropped, 1);
+                return NULL;
+
+            case RING_BLOCK:
+            default:
+                ring_wait(&ring->space);
+                break;
+        }
+    }
+}
+
+/**
+ * @name   frame_ring_publish
+ * @brief  Producer side: hands a filled frame to the consumer
+ * @param  ring - ring the frame was acquired from
+ *         f    - filled frame
+ *
+ * @return none
+ */
+
+void frame_ring_publish(struct frame_ring *ring, struct frame *f)
+{
+    unsigned int h = atomic_load_explicit(&ring->head, memory_order_relaxed);
+
+    ring->slots[h & ring->mask] = f;
+    atomic_store_explicit(&ring->head, h + 1, memory_order_release);
+    atomic_fetch_add_explicit(&ring->published, 1, memory_order_relaxed);
+
+    sem_post(&ring->ready);
+}
+
+/**
+ * @name   frame_ring_consume
+ * @brief  Consumer side: takes the oldest published frame
+ * @param  ring - ring to consume from
+ *
+ * @descr  Sleeps while the ring is empty
+ *         After shutdown, frames already published are still drained
+ *
+ * @return frame to process, NULL once shut down and empty
+ */
+
+struct frame *frame_ring_consume(struct frame_ring *ring)
+{
+    for (;;)
+    {
+        unsigned int t = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+        if (atomic_load_explicit(&ring->head, memory_order_acquire) != t)
+        {
+            struct frame *f = ring->slots[t & ring->mask];
+
+            if (atomic_compare_exchange_weak(&ring->tail, &t, t + 1))
+                return f;
+            continue;
+        }
+
+        if (atomic_load(&ring->shutdown))
+            return NULL;
+
+        ring_wait(&ring->ready);
+    }
+}
+
+/**
+ * @name   frame_ring_release
+ * @brief  Consumer side: returns a processed frame to the pool
+ * @param  ring - ring the frame was consumed from
+ *         f    - frame to release
+ *
+ * @descr  Any thread may release, e.g. a sink done with a frame it held;
+ *         releasers take turns on a spin flag held for two stores
+ *
+ * @return none
+ */
+
+void frame_ring_release(struct frame_ring *ring, struct frame *f)
+{
+    unsigned int fh;
+
+    while (atomic_flag_test_and_set_explicit(&ring->release_lock, memory_order_acquire))
+        ;
+    fh = atomic_load_explicit(&ring->free_head, memory_order_relaxed);
+    ring->free_slots[fh & ring->mask] = f;
+    atomic_store_explicit(&ring->free_head, fh + 1, memory_order_release);
+    atomic_flag_clear_explicit(&ring->release_lock, memory_order_release);
+
+    if (ring->policy == RING_BLOCK)
+        sem_post(&ring->space);
+}
+
+/**
+ * @name   frame_ring_shutdown
+ * @brief  Wakes both sides and makes them return NULL once idle
+ * @param  ring - ring to shut down
+ *
+ * @return none
+ */
+
+void frame_ring_shutdown(struct frame_ring *ring)
+{
+    atomic_store(&ring->shutdown, 1);
+    sem_post(&ring->ready);
+    sem_post(&ring->space);
+}
+
+const char *ring_policy_name(enum ring_policy policy)
+{
+    if ((unsigned int)policy >= sizeof(policy_names) / sizeof(policy_names[0]))
+        return "unknown";
+
+    return policy_names[policy];
+}
+
+/**
+ * @name   ring_policy_parse
+ * @brief  Parses a policy name from the command line
+ * @param  name   - "block", "drop-oldest" or "drop-newest"
+ *         policy - ptr to store parsed policy
+ *
+ * @return 0 on success, -1 on unknown name
+ */
+
+int ring_policy_parse(const char *name, enum ring_policy *policy)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(policy_names) / sizeof(policy_names[0]); i++)
+    {
+        if (strcmp(name, policy_names[i]) == 0)
+        {
+            *policy = (enum ring_policy)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,92 @@
+/*
+ * Filename   : frame_ring.h
+ *
+ * Description: Lock-free single-producer frame ring between the capture
+ *            : thread and a processing worker
+ *            : The ring owns a pool of depth + 1 frames, plus any the consumer
+ *            : may pass on. The producer takes a free frame, fills it and
+ *            : publishes it; the consumer takes the oldest published frame
+ *            : and it is released back, from whichever thread is done last.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_RING_H
+#define FRAME_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+#include <time.h>
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+// What the producer does when the consumer has fallen behind
+enum ring_policy
+{
+        RING_BLOCK = 0,         // wait for the consumer to release a frame
+        RING_DROP_OLDEST,       // reuse the oldest frame still waiting in the ring
+        RING_DROP_NEWEST,       // drop the frame just captured
+};
+
+struct frame
+{
+        unsigned char   *data;  // storage owned by the ring, capacity bytes
+        size_t           size;  // bytes used
+        int              buffer;        // capture buffer holding the frame instead, -1 if data does
+        unsigned int     tag;   // frame number
+        struct timespec  time;  // time the frame was dequeued
+        unsigned int     sequence;      // driver sequence number
+        uint64_t         capture_ns;    // driver capture time, CLOCK_MONOTONIC
+        uint64_t         dequeue_ns;    // CLOCK_MONOTONIC at VIDIOC_DQBUF
+};
+
+struct frame_ring
+{
+        struct frame          **slots;      // published frames, oldest at tail
+        unsigned int            mask;       // slot capacity - 1, capacity is a power of two
+        _Atomic unsigned int    head;       // written by producer only
+        _Atomic unsigned int    tail;       // advanced by consumer, or by producer dropping oldest
+
+        struct frame          **free_slots; // released frames, consumer -> producer
+        _Atomic unsigned int    free_head;  // written by releasers, under release_lock
+        _Atomic unsigned int    free_tail;  // written by producer only
+
+        struct frame           *frames;
+        unsigned int            n_frames;
+        unsigned int            depth;
+        size_t                  capacity;
+        enum ring_policy        policy;
+
+        sem_t                   ready;      // wakes a waiting consumer
+        sem_t                   space;      // wakes a producer blocked on RING_BLOCK
+        atomic_int              shutdown;
+        atomic_flag             release_lock;
+
+        atomic_ulong            published;
+        atomic_ulong            dropped;
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct frame_ring *frame_ring_create(unsigned int depth, size_t capacity, enum ring_policy policy,
+                                     unsigned int held);
+void frame_ring_destroy(struct frame_ring *ring);
+
+struct frame *frame_ring_acquire(struct frame_ring *ring);
+void frame_ring_publish(struct frame_ring *ring, struct frame *f);
+
+struct frame *frame_ring_consume(struct frame_ring *ring);
+void frame_ring_release(struct frame_ring *ring, struct frame *f);
+
+void frame_ring_shutdown(struct frame_ring *ring);
+
+const char *ring_policy_name(enum ring_policy policy);
+int ring_policy_parse(const char *name, enum ring_policy *policy);
+
+#endif /* FRAME_RING_H */
@@ -0,0 +1,360 @@
+/*
+ * Filename   : frame_shm.c
+ *
+ * Description: Shared-memory ring of the latest frames for local consumers
+ *            : 1) The shm object is created at full size and mapped shared;
+ *            :    a stale object of the same name is unlinked first, so a
+ *            :    reader still holding it sees SHM_STATE_CLOSED only
+ *            : 2) frame_shm_publish() takes the next frame number, makes the
+ *            :    slot's seq odd, copies header and payload in and makes seq
+ *            :    even again; several workers may publish at once
+ *            : 3) If the slot is still being written by a slower publisher
+ *            :    the frame is skipped rather than waited for
+ *            : 4) A reader copies a slot out between two reads of seq and
+ *            :    retries if they differ or the slot moved on
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : man 7 shm_overview, https://lwn.net/Articles/21812/ (seqlocks)
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame_shm.h"
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct frame_shm
+{
+        char                       *name;
+        int                         fd;
+        struct shm_ring_header     *header;
+        unsigned char              *map;        // whole object, header included
+        size_t                      map_len;
+        size_t                      max_frame;  // bytes a slot holds after its header
+
+        atomic_ulong                published, busy, too_large;
+};
+
+/*************************************************************************
+ *                         Ring Functions                                *
+ *************************************************************************/
+
+static struct shm_slot_header *slot_at(unsigned char *map, const struct shm_ring_header *h, uint64_t number)
+{
+    return (struct shm_slot_header *)(map + h->header_size + (size_t)(number % h->slots) * h->slot_size);
+}
+
+/**
+ * @name   frame_shm_create
+ * @brief  Creates the shm object name and lays out its slots
+ * @param  name - shm object name, e.g. /aesd_cam
+ *         info - frame size and format; max_record is the largest
+ *                header + payload published, capacity the slot count
+ *
+ * @return ring, NULL with errno set on failure
+ */
+
+struct frame_shm *frame_shm_create(const char *name, const struct frame_stream_info *info)
+{
+    struct frame_shm *s = calloc(1, sizeof(*s));
+    struct shm_ring_header *h;
+    size_t slot_size = (SHM_SLOT_DATA + info->max_record + SHM_ALIGN - 1) / SHM_ALIGN * SHM_ALIGN;
+    unsigned int slots = info->capacity < 2 ? 2 : info->capacity;
+
+    if (!s)
+        return NULL;
+
+    s->fd = -1;
+    s->name = strdup(name);
+    if (!s->name)
+        goto fail;
+
+    s->max_frame = slot_size - SHM_SLOT_DATA;
+    s->map_len   = SHM_HEADER_SIZE + (size_t)slots * slot_size;
+
+    shm_unlink(name);
+    s->fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0644);
+    if (s->fd == -1)
+        goto fail;
+    if (ftruncate(s->fd, s->map_len) == -1)
+        goto fail;
+
+    s->map = mmap(NULL, s->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, s->fd, 0);
+    if (s->map == MAP_FAILED)
+    {
+        s->map = NULL;
+        goto fail;
+    }
+
+    // ftruncate zero-filled it: every slot starts at seq 0, never written
+    h = s->header = (struct shm_ring_header *)s->map;
+    memcpy(h->magic, SHM_MAGIC, sizeof(h->magic));
+    h->version     = SHM_VERSION;
+    h->header_size = SHM_HEADER_SIZE;
+    h->slot_size   = slot_size;
+    h->slots       = slots;
+    h->width       = info->width;
+    h->height      = info->height;
+    h->pixelformat = info->pixelformat;
+    atomic_store_explicit(&h->state, SHM_STATE_LIVE, memory_order_release);
+
+    return s;
+
+fail:
+    {
+        int err = errno;
+
+        frame_shm_destroy(s);
+        errno = err;
+    }
+    return NULL;
+}
+
+void frame_shm_destroy(struct frame_shm *s)
+{
+    if (!s)
+        return;
+
+    if (s->map)
+    {
+        atomic_store_explicit(&s->header->state, SHM_STATE_CLOSED, memory_order_release);
+        munmap(s->map, s->map_len);
+        shm_unlink(s->name);
+    }
+    if (s->fd != -1)
+        close(s->fd);
+    free(s->name);
+    free(s);
+}
+
+/**
+ * @name   frame_shm_publish
+ * @brief  Copies one frame into the next slot of the ring
+ * @param  s          - ring
+ *         tag        - frame number
+ *         sequence   - driver sequence number
+ *         capture_ns - driver timestamp
+ *         header     - bytes written before data, e.g. the PPM header
+ *         data, size - payload
+ *
+ * @descr  Never blocks: a frame that does not fit, or whose slot another
+ *         publisher has not finished, is counted and dropped
+ *         May be called from several threads
+ *
+ * @return none
+ */
+
+void frame_shm_publish(struct frame_shm *s, unsigned int tag, unsigned int sequence, uint64_t capture_ns,
+                       const void *header, size_t header_len,
+                       const void *data, size_t size)
+{
+    struct shm_ring_header *h = s->header;
+    struct shm_slot_header *slot;
+    uint64_t number, published;
+    uint32_t seq;
+
+    if (header_len + size > s->max_frame)
+    {
+        atomic_fetch_add(&s->too_large, 1);
+        return;
+    }
+
+    number = atomic_fetch_add_explicit(&h->claimed, 1, memory_order_relaxed);
+    slot = slot_at(s->map, h, number);
+
+    seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if ((seq & 1) || !atomic_compare_exchange_strong_explicit(&slot->seq, &seq, seq + 1,
+                                                              memory_order_relaxed, memory_order_relaxed))
+    {
+        atomic_fetch_add(&s->busy, 1);
+        return;
+    }
+    // Odd seq is visible before any of the stores below
+    atomic_thread_fence(memory_order_release);
+
+    slot->length     = header_len + size;
+    slot->number     = number;
+    slot->tag        = tag;
+    slot->sequence   = sequence;
+    slot->capture_ns = capture_ns;
+    memcpy((unsigned char *)slot + SHM_SLOT_DATA, header, header_len);
+    memcpy((unsigned char *)slot + SHM_SLOT_DATA + header_len, data, size);
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+
+    // Publishers can finish out of order; published only moves forward
+    published = atomic_load_explicit(&h->published, memory_order_relaxed);
+    while (published < number + 1 &&
+           !atomic_compare_exchange_weak_explicit(&h->published, &published, number + 1,
+                                                  memory_order_release, memory_order_relaxed))
+        ;
+
+    atomic_fetch_add(&s->published, 1);
+}
+
+void frame_shm_report(struct frame_shm *s, FILE *fp)
+{
+    fprintf(fp, "shm %s: %lu frames published to %u slots of %u bytes, %lu skipped while a slot was busy, %lu too large\n",
+            s->name, atomic_load(&s->published), s->header->slots, s->header->slot_size,
+            atomic_load(&s->busy), atomic_load(&s->too_large));
+}
+
+/*************************************************************************
+ *                         Reader Functions                              *
+ *************************************************************************/
+
+/**
+ * @name   shm_reader_open
+ * @brief  Maps a capture ring read-only
+ * @param  name - shm object name given to the capture side
+ *
+ * @return reader, NULL with errno set on failure
+ */
+
+struct shm_reader *shm_reader_open(const char *name)
+{
+    struct shm_reader *r = calloc(1, sizeof(*r));
+    struct shm_ring_header h;
+    struct stat st;
+    void *p;
+
+    if (!r)
+        return NULL;
+
+    r->fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (r->fd == -1)
+        goto fail;
+
+    if (fstat(r->fd, &st) == -1 || pread(r->fd, &h, sizeof(h), 0) != sizeof(h))
+        goto fail;
+    if (memcmp(h.magic, SHM_MAGIC, sizeof(h.magic)) != 0 || h.version != SHM_VERSION ||
+        (uint64_t)h.header_size + (uint64_t)h.slots * h.slot_size > (uint64_t)st.st_size ||
+        h.slot_size <= SHM_SLOT_DATA || h.slots == 0)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    r->map_len = st.st_size;
+    p = mmap(NULL, r->map_len, PROT_READ, MAP_SHARED, r->fd, 0);
+    if (p == MAP_FAILED)
+        goto fail;
+    r->map    = p;
+    r->header = p;
+
+    return r;
+
+fail:
+    {
+        int err = errno;
+
+        shm_reader_close(r);
+        errno = err;
+    }
+    return NULL;
+}
+
+void shm_reader_close(struct shm_reader *r)
+{
+    if (!r)
+        return;
+
+    if (r->map)
+        munmap((void *)r->map, r->map_len);
+    if (r->fd != -1)
+        close(r->fd);
+    free(r);
+}
+
+// Frame numbers below this have been written, the newest is one less
+uint64_t shm_reader_published(const struct shm_reader *r)
+{
+    return atomic_load_explicit(&((struct shm_ring_header *)r->header)->published, memory_order_acquire);
+}
+
+int shm_reader_closed(const struct shm_reader *r)
+{
+    return atomic_load_explicit(&((struct shm_ring_header *)r->header)->state, memory_order_acquire) == SHM_STATE_CLOSED;
+}
+
+/**
+ * @name   shm_reader_frame
+ * @brief  Copies frame number out of the ring
+ * @param  r      - reader
+ *         number - publish number, below shm_reader_published()
+ *         buf    - destination, size bytes
+ *         meta   - filled with the slot header, may be NULL
+ *
+ * @descr  EAGAIN means the slot was being written, try again; ENOENT that
+ *         it has been overwritten by a newer frame or was skipped
+ *
+ * @return frame bytes copied, -1 with errno set
+ */
+
+ssize_t shm_reader_frame(struct shm_reader *r, uint64_t number, void *buf, size_t size,
+                         struct shm_slot_header *meta)
+{
+    struct shm_slot_header *slot = slot_at((unsigned char *)r->map, r->header, number);
+    struct shm_slot_header copy;
+    uint32_t seq;
+
+    seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    if (seq & 1)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    copy.number     = slot->number;
+    copy.length     = slot->length;
+    copy.tag        = slot->tag;
+    copy.sequence   = slot->sequence;
+    copy.capture_ns = slot->capture_ns;
+    if (seq == 0 || copy.number != number)
+    {
+        errno = ENOENT;
+        return -1;
+    }
+    if (copy.length > r->header->slot_size - SHM_SLOT_DATA || copy.length > size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    memcpy(buf, (unsigned char *)slot + SHM_SLOT_DATA, copy.length);
+
+    // The copy above is complete before seq is looked at again
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    if (meta)
+    {
+        atomic_init(&meta->seq, seq);
+        meta->number     = copy.number;
+        meta->length     = copy.length;
+        meta->tag        = copy.tag;
+        meta->sequence   = copy.sequence;
+        meta->capture_ns = copy.capture_ns;
+    }
+
+    return copy.length;
+}
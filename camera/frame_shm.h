@@ -0,0 +1,100 @@
+/*
+ * Filename   : frame_shm.h
+ *
+ * Description: Shared-memory ring of the latest frames for local consumers
+ *            : A POSIX shm object holds a shm_ring_header and a fixed number
+ *            : of page-aligned slots. Each slot starts with a seqlock'd
+ *            : shm_slot_header followed by exactly the bytes a per-frame file
+ *            : would have held (e.g. PPM header and pixels). The capture side
+ *            : never waits on readers: a reader copies a slot out and retries
+ *            : if the sequence count moved underneath it.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_SHM_H
+#define FRAME_SHM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <sys/types.h>
+
+#include "frame_stream.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define SHM_MAGIC           "AESDSHM1"
+#define SHM_VERSION         1
+#define SHM_HEADER_SIZE     4096        // ring header, slot 0 starts here
+#define SHM_ALIGN           4096        // slot size is a multiple of this
+#define SHM_SLOT_DATA       64          // frame bytes start this far into a slot
+
+#define SHM_STATE_LIVE      1u          // ring header state
+#define SHM_STATE_CLOSED    2u          // the capture side has gone away
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+// Start of the shm object, host byte order
+struct shm_ring_header
+{
+        char                magic[8];       // SHM_MAGIC, no terminator
+        uint32_t            version;
+        uint32_t            header_size;    // offset of slot 0
+        uint32_t            slot_size;      // bytes between slots
+        uint32_t            slots;
+        uint32_t            width, height;
+        uint32_t            pixelformat;    // V4L2 fourcc of the camera
+        _Atomic uint32_t    state;          // SHM_STATE_*
+        _Atomic uint64_t    published;      // highest frame number written + 1
+        _Atomic uint64_t    claimed;        // frame numbers handed out to writers
+};
+
+// Start of every slot; seq is odd while the slot is being written
+struct shm_slot_header
+{
+        _Atomic uint32_t    seq;
+        uint32_t            length;         // frame bytes after SHM_SLOT_DATA
+        uint64_t            number;         // publish order, slot = number % slots
+        uint32_t            tag;            // frame number of the capture
+        uint32_t            sequence;       // driver sequence number
+        uint64_t            capture_ns;     // driver timestamp, CLOCK_MONOTONIC
+};
+
+struct frame_shm;
+
+// Read side: the whole object mapped read-only
+struct shm_reader
+{
+        int                             fd;
+        const struct shm_ring_header   *header;
+        const unsigned char            *map;
+        size_t                          map_len;
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct frame_shm *frame_shm_create(const char *name, const struct frame_stream_info *info);
+void frame_shm_destroy(struct frame_shm *s);
+
+void frame_shm_publish(struct frame_shm *s, unsigned int tag, unsigned int sequence, uint64_t capture_ns,
+                       const void *header, size_t header_len,
+                       const void *data, size_t size);
+
+void frame_shm_report(struct frame_shm *s, FILE *fp);
+
+struct shm_reader *shm_reader_open(const char *name);
+void shm_reader_close(struct shm_reader *r);
+uint64_t shm_reader_published(const struct shm_reader *r);
+int shm_reader_closed(const struct shm_reader *r);
+ssize_t shm_reader_frame(struct shm_reader *r, uint64_t number, void *buf, size_t size,
+                         struct shm_slot_header *meta);
+
+#endif /* FRAME_SHM_H */
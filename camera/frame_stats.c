@@ -0,0 +1,349 @@
+/*
+ * Filename   : frame_stats.c
+ *
+ * Description: Per-camera latency and throughput instrumentation
+ *            : 1) Log-linear histograms: values below 64 ns are exact, above
+ *            :    that each power of two is split in 32 buckets
+ *            : 2) Relaxed atomic counters, recording never blocks a stage
+ *            : 3) Reports with percentiles, as text and as one JSON object
+ *            :    per line for scripts
+ *            : 4) Driver side counters: frames dequeued, dropped, errored,
+ *            :    truncated, and sequence or timestamp anomalies
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : http://hdrhistogram.org/
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "frame_stats.h"
+
+/*************************************************************************
+ *                  Global Variables                                     *
+ *************************************************************************/
+
+static const char *stage_names[STAT_STAGES] = { "driver", "jitter", "queue", "convert", "write", "total" };
+
+static const double report_percentiles[] = { 50.0, 90.0, 99.0, 99.9 };
+#define N_PERCENTILES (sizeof(report_percentiles) / sizeof(report_percentiles[0]))
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+const char *stat_stage_name(enum stat_stage stage)
+{
+    return stage < STAT_STAGES ? stage_names[stage] : "?";
+}
+
+static unsigned int hist_index(uint64_t v)
+{
+    unsigned int msb;
+
+    if (v < 2 * HIST_SUB)
+        return v;
+
+    msb = 63 - __builtin_clzll(v);
+    return 2 * HIST_SUB + (msb - HIST_SUB_BITS - 1) * HIST_SUB + (unsigned int)(v >> (msb - HIST_SUB_BITS)) - HIST_SUB;
+}
+
+// Largest value that lands in bucket i
+static uint64_t hist_value(unsigned int i)
+{
+    unsigned int shift;
+
+    if (i < 2 * HIST_SUB)
+        return i;
+
+    shift = (i - 2 * HIST_SUB) / HIST_SUB + 1;
+    return ((uint64_t)(HIST_SUB + (i - 2 * HIST_SUB) % HIST_SUB) << shift) + ((1ULL << shift) - 1);
+}
+
+/**
+ * @name   frame_stats_create
+ * @brief  Allocates empty stats
+ * @param  name - label used in reports, not copied
+ *
+ * @return stats, NULL on allocation failure
+ */
+
+struct frame_stats *frame_stats_create(const char *name)
+{
+    struct frame_stats *s;
+    unsigned int i;
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->name = name;
+    for (i = 0; i < STAT_STAGES; i++)
+        atomic_init(&s->hist[i].min, UINT64_MAX);
+    s->start_ns = s->last_report_ns = stats_now_ns();
+
+    return s;
+}
+
+void frame_stats_destroy(struct frame_stats *s)
+{
+    free(s);
+}
+
+/**
+ * @name   frame_stats_record
+ * @brief  Records one latency sample
+ * @param  s     - stats
+ *         stage - stage the sample belongs to
+ *         ns    - latency in ns
+ *
+ * @descr  Safe from any thread; counters are relaxed, reports are a
+ *         best-effort snapshot while frames are still flowing
+ *
+ * @return none
+ */
+
+void frame_stats_record(struct frame_stats *s, enum stat_stage stage, uint64_t ns)
+{
+    struct latency_hist *h = &s->hist[stage];
+    uint64_t cur;
+
+    atomic_fetch_add_explicit(&h->counts[hist_index(ns)], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->sum, ns, memory_order_relaxed);
+
+    cur = atomic_load_explicit(&h->min, memory_order_relaxed);
+    while (ns < cur && !atomic_compare_exchange_weak_explicit(&h->min, &cur, ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+    cur = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > cur && !atomic_compare_exchange_weak_explicit(&h->max, &cur, ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+/**
+ * @name   frame_stats_sequence
+ * @brief  Tracks driver sequence numbers to count dropped frames
+ * @param  s        - stats
+ *         sequence - v4l2_buffer.sequence of a dequeued frame
+ *
+ * @descr  Call from the capture thread only, in dequeue order
+ *         A number that repeats or goes backwards is an anomaly, not a
+ *         gap; the difference is taken modulo 2^32 so a wrap isn't one
+ *
+ * @return none
+ */
+
+void frame_stats_sequence(struct frame_stats *s, unsigned int sequence)
+{
+    int step = (int)(sequence - s->last_sequence);
+
+    if (s->have_sequence && step > 1)
+        s->seq_gaps += step - 1;
+    else if (s->have_sequence && step <= 0)
+        s->anomalies++;
+
+    s->last_sequence = sequence;
+    s->have_sequence = 1;
+}
+
+/**
+ * @name   frame_stats_timestamp
+ * @brief  Checks a driver capture timestamp against the previous one
+ * @param  s          - stats
+ *         capture_ns - monotonic capture time of a dequeued frame
+ *         period_ns  - nominal frame period, 0 if unknown
+ *
+ * @descr  Call from the capture thread only, in dequeue order, for
+ *         monotonic timestamps. A timestamp at or before the last, or less
+ *         than half a period after it, can't be a new exposure; the camera
+ *         slowing down (longer exposure) or dropping frames is not counted
+ *
+ * @return none
+ */
+
+void frame_stats_timestamp(struct frame_stats *s, uint64_t capture_ns, uint64_t period_ns)
+{
+    if (s->last_capture_ns &&
+        (capture_ns <= s->last_capture_ns || capture_ns - s->last_capture_ns < period_ns / 2))
+        s->anomalies++;
+
+    s->last_capture_ns = capture_ns;
+}
+
+// The stream was restarted, its driver numbers frames from 0 again
+void frame_stats_restart(struct frame_stats *s)
+{
+    s->have_sequence   = 0;
+    s->last_capture_ns = 0;
+}
+
+// A frame reached disk, or with --no-disk its last sink
+void frame_stats_written(struct frame_stats *s, size_t bytes)
+{
+    atomic_fetch_add_explicit(&s->frames, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&s->bytes, bytes, memory_order_relaxed);
+}
+
+// A frame was dropped as unchanged before processing, capture thread only
+void frame_stats_skipped(struct frame_stats *s)
+{
+    s->skipped++;
+}
+
+// A frame missed its deadline, capture thread only
+void frame_stats_late(struct frame_stats *s)
+{
+    s->late++;
+}
+
+// The driver returned a buffer, good or not, capture thread only
+void frame_stats_dequeued(struct frame_stats *s)
+{
+    s->dequeued++;
+}
+
+// The driver flagged a buffer's data as corrupt, capture thread only
+void frame_stats_error(struct frame_stats *s)
+{
+    s->errors++;
+}
+
+// A buffer held less than a whole frame, capture thread only
+void frame_stats_truncated(struct frame_stats *s)
+{
+    s->truncated++;
+}
+
+/**
+ * @name   latency_hist_percentile
+ * @brief  Value at or below which percentile % of samples fall
+ * @param  h          - histogram
+ *         percentile - 0 to 100
+ *
+ * @return ns, within the bucket precision and never above the recorded max
+ */
+
+uint64_t latency_hist_percentile(struct latency_hist *h, double percentile)
+{
+    unsigned long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+    unsigned long target, seen = 0;
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    unsigned int i;
+
+    if (count == 0)
+        return 0;
+
+    target = (unsigned long)(percentile / 100.0 * count + 0.5);
+    if (target < 1)
+        target = 1;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+        if (seen >= target)
+            return hist_value(i) < max ? hist_value(i) : max;
+    }
+
+    return max;
+}
+
+/**
+ * @name   frame_stats_report
+ * @brief  Prints throughput since the last report and since start, latency since start
+ * @param  s       - stats
+ *         summary - human readable output, may be NULL
+ *         machine - one JSON object per call, may be NULL
+ *
+ * @descr  Call from one thread only; it owns the interval bookkeeping
+ *         Latencies are printed in us in the summary and ns in JSON
+ *
+ * @return none
+ */
+
+void frame_stats_report(struct frame_stats *s, FILE *summary, FILE *machine)
+{
+    uint64_t now = stats_now_ns();
+    unsigned long frames = atomic_load_explicit(&s->frames, memory_order_relaxed);
+    unsigned long long bytes = atomic_load_explicit(&s->bytes, memory_order_relaxed);
+    double interval = (now - s->last_report_ns) / 1e9;
+    double fps = interval > 0 ? (frames - s->last_frames) / interval : 0;
+    double bps = interval > 0 ? (bytes - s->last_bytes) / interval : 0;
+    double dqps = interval > 0 ? (s->dequeued - s->last_dequeued) / interval : 0;
+    double uptime = (now - s->start_ns) / 1e9;
+    unsigned int i, j;
+
+    if (summary)
+    {
+        fprintf(summary, "%s: %lu frames, %.1f fps (%.1f avg), %.1f MB/s, %lu dropped by driver, %lu unchanged, %lu late\n",
+                s->name, frames, fps, uptime > 0 ? frames / uptime : 0, bps / 1e6, s->seq_gaps, s->skipped, s->late);
+        fprintf(summary, "  dequeued %lu frames, %.1f fps (%.1f avg): %lu errored, %lu truncated, %lu out of order\n",
+                s->dequeued, dqps, uptime > 0 ? s->dequeued / uptime : 0, s->errors, s->truncated, s->anomalies);
+        fprintf(summary, "  %-8s %8s %9s %9s %9s %9s %9s %9s  (us)\n",
+                "stage", "count", "min", "p50", "p90", "p99", "p99.9", "max");
+        for (i = 0; i < STAT_STAGES; i++)
+        {
+            struct latency_hist *h = &s->hist[i];
+            unsigned long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+
+            if (count == 0)
+                continue;
+
+            fprintf(summary, "  %-8s %8lu %9.1f", stage_names[i], count,
+                    atomic_load_explicit(&h->min, memory_order_relaxed) / 1e3);
+            for (j = 0; j < N_PERCENTILES; j++)
+                fprintf(summary, " %9.1f", latency_hist_percentile(h, report_percentiles[j]) / 1e3);
+            fprintf(summary, " %9.1f\n", atomic_load_explicit(&h->max, memory_order_relaxed) / 1e3);
+        }
+    }
+
+    if (machine)
+    {
+        fprintf(machine, "{\"camera\":\"%s\",\"uptime_s\":%.3f,\"frames\":%lu,\"bytes\":%llu,"
+                "\"fps\":%.3f,\"avg_fps\":%.3f,\"bytes_per_s\":%.0f,\"seq_gaps\":%lu,\"skipped\":%lu,\"late\":%lu,"
+                "\"dequeued\":%lu,\"dequeued_fps\":%.3f,\"errors\":%lu,\"truncated\":%lu,\"anomalies\":%lu",
+                s->name, uptime, frames, bytes, fps, uptime > 0 ? frames / uptime : 0, bps, s->seq_gaps, s->skipped,
+                s->late, s->dequeued, dqps, s->errors, s->truncated, s->anomalies);
+        for (i = 0; i < STAT_STAGES; i++)
+        {
+            struct latency_hist *h = &s->hist[i];
+            unsigned long count = atomic_load_explicit(&h->count, memory_order_relaxed);
+
+            fprintf(machine, ",\"%s\":{\"count\":%lu", stage_names[i], count);
+            if (count)
+            {
+                fprintf(machine, ",\"min\":%llu,\"mean\":%llu",
+                        (unsigned long long)atomic_load_explicit(&h->min, memory_order_relaxed),
+                        (unsigned long long)(atomic_load_explicit(&h->sum, memory_order_relaxed) / count));
+                for (j = 0; j < N_PERCENTILES; j++)
+                    fprintf(machine, ",\"p%g\":%llu", report_percentiles[j],
+                            (unsigned long long)latency_hist_percentile(h, report_percentiles[j]));
+                fprintf(machine, ",\"max\":%llu",
+                        (unsigned long long)atomic_load_explicit(&h->max, memory_order_relaxed));
+            }
+            fprintf(machine, "}");
+        }
+        fprintf(machine, "}\n");
+        fflush(machine);
+    }
+
+    s->last_report_ns = now;
+    s->last_frames    = frames;
+    s->last_bytes     = bytes;
+    s->last_dequeued  = s->dequeued;
+}
@@ -0,0 +1,111 @@
+/*
+ * Filename   : frame_stats.h
+ *
+ * Description: Per-camera latency and throughput instrumentation
+ *            : Each pipeline stage records into a log-linear (HDR style)
+ *            : histogram with ~3% value precision from 1 ns to hours.
+ *            : Recording is lock-free, so the capture thread, workers and
+ *            : writer threads all record into the same stats directly.
+ *            : Sequence gaps from the driver count frames it dropped.
+ *            : Frames skipped as unchanged are counted separately, as are
+ *            : frames dequeued after their deadline (one frame period).
+ *            : Buffers the driver flags as errored or returns short are
+ *            : counted and never processed; sequence numbers or timestamps
+ *            : that go backwards, stand still or come too soon are counted
+ *            : as anomalies. Frames dequeued give the rate the driver delivers.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_STATS_H
+#define FRAME_STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define HIST_SUB_BITS 5                                 // 32 sub-buckets per power of two
+#define HIST_SUB      (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS  (2 * HIST_SUB + (63 - HIST_SUB_BITS) * HIST_SUB)
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+// Latencies recorded per frame, all in ns
+enum stat_stage
+{
+        STAT_DRIVER = 0,        // driver capture timestamp -> VIDIOC_DQBUF returned
+        STAT_JITTER,            // |dequeue interval - capture interval|, capture thread wakeup jitter
+        STAT_QUEUE,             // dequeue -> worker picked the frame up
+        STAT_CONVERT,           // colour conversion / copy in the worker
+        STAT_WRITE,             // submitted to the frame writer -> on disk
+        STAT_TOTAL,             // driver capture timestamp -> on disk
+        STAT_STAGES
+};
+
+struct latency_hist
+{
+        atomic_ulong            counts[HIST_BUCKETS];
+        atomic_ulong            count;
+        atomic_ullong           sum;
+        atomic_ullong           min;
+        atomic_ullong           max;
+};
+
+struct frame_stats
+{
+        const char             *name;
+        struct latency_hist     hist[STAT_STAGES];
+
+        atomic_ulong            frames;         // frames written
+        atomic_ullong           bytes;          // payload bytes written
+        unsigned long           seq_gaps;       // frames the driver dropped, capture thread only
+        unsigned long           skipped;        // frames motion detection found unchanged, capture thread only
+        unsigned long           late;           // dequeued more than a frame period after capture, capture thread only
+        unsigned long           dequeued;       // buffers the driver returned, capture thread only
+        unsigned long           errors;         // flagged V4L2_BUF_FLAG_ERROR, capture thread only
+        unsigned long           truncated;      // shorter than a whole frame, capture thread only
+        unsigned long           anomalies;      // sequence or timestamp out of order, capture thread only
+        unsigned int            last_sequence;
+        int                     have_sequence;
+        uint64_t                last_capture_ns; // driver timestamp of the last frame, 0 = none yet
+
+        uint64_t                start_ns;
+        uint64_t                last_report_ns; // interval throughput, reporting thread only
+        unsigned long           last_frames;
+        unsigned long long      last_bytes;
+        unsigned long           last_dequeued;
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+uint64_t stats_now_ns(void);
+
+struct frame_stats *frame_stats_create(const char *name);
+void frame_stats_destroy(struct frame_stats *s);
+
+void frame_stats_record(struct frame_stats *s, enum stat_stage stage, uint64_t ns);
+void frame_stats_sequence(struct frame_stats *s, unsigned int sequence);
+void frame_stats_timestamp(struct frame_stats *s, uint64_t capture_ns, uint64_t period_ns);
+void frame_stats_restart(struct frame_stats *s);
+void frame_stats_written(struct frame_stats *s, size_t bytes);
+void frame_stats_skipped(struct frame_stats *s);
+void frame_stats_late(struct frame_stats *s);
+void frame_stats_dequeued(struct frame_stats *s);
+void frame_stats_error(struct frame_stats *s);
+void frame_stats_truncated(struct frame_stats *s);
+
+uint64_t latency_hist_percentile(struct latency_hist *h, double percentile);
+
+void frame_stats_report(struct frame_stats *s, FILE *summary, FILE *machine);
+
+const char *stat_stage_name(enum stat_stage stage);
+
+#endif /* FRAME_STATS_H */
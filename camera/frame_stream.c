@@ -0,0 +1,533 @@
+/*
+ * Filename   : frame_stream.c
+ *
+ * Description: Streaming container output
+ *            : 1) Records are placed in submission order: the next free slot
+ *            :    of the current segment, at a fixed offset, so the actual
+ *            :    writes go through frame_writer with no file per frame
+ *            : 2) A full segment is rotated: a new one is created and
+ *            :    fallocate'd, the old one is closed once its last record lands
+ *            : 3) Index entries are written after their record completes, so
+ *            :    a valid entry always points at a complete record
+ *            : 4) On close a partly used segment is truncated to its records
+ *            : The reader maps the index and preads one record per frame.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : man 2 fallocate, pwrite
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#define _GNU_SOURCE             /* fallocate() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "frame_stream.h"
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct stream_segment
+{
+        int             fd;
+        int             idx_fd;
+        unsigned int    number;
+        unsigned int    used;           // slots handed out
+        unsigned int    pending;        // records submitted but not completed
+        int             retired;        // no longer current, close when pending is 0
+};
+
+// One submitted record, from frame_stream_submit to its writer callback
+struct stream_job
+{
+        struct frame_stream        *s;
+        struct stream_segment      *seg;
+        unsigned int                slot;
+        struct stream_index_entry   entry;
+        writer_done_fn              done;
+        void                       *ctx;
+};
+
+struct frame_stream
+{
+        struct frame_writer        *writer;
+        int                         dirfd;
+        char                       *prefix;
+        struct frame_stream_info    info;
+        size_t                      record_size;
+
+        pthread_mutex_t             lock;
+        pthread_cond_t              job_free;
+        struct stream_job          *jobs;
+        struct stream_job         **free_jobs;
+        unsigned int                n_free;
+        unsigned int                queue_depth;
+
+        struct stream_segment      *cur;
+        unsigned int                next_segment;
+
+        // under lock
+        unsigned long               frames, errors, segments;
+};
+
+/*************************************************************************
+ *                          Segment Functions                            *
+ *************************************************************************/
+
+static off_t record_offset(const struct frame_stream *s, unsigned int slot)
+{
+    return STREAM_HEADER_SIZE + (off_t)slot * s->record_size;
+}
+
+/**
+ * @name   segment_open
+ * @brief  Creates the next segment and its index
+ * @param  s - stream, lock held
+ *
+ * @descr  The .frm is preallocated for every record and gets its header
+ *         written here; the .idx is sized for every entry, all invalid
+ *         Filesystems without fallocate just grow the file as records land
+ *
+ * @return segment, NULL with errno set on failure
+ */
+
+static struct stream_segment *segment_open(struct frame_stream *s)
+{
+    struct stream_segment *seg;
+    struct stream_file_header *hdr;
+    struct timespec now;
+    char name[256];
+    int err;
+
+    seg = calloc(1, sizeof(*seg));
+    hdr = calloc(1, STREAM_HEADER_SIZE);
+    if (!seg || !hdr)
+    {
+        free(seg);
+        free(hdr);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    seg->number = s->next_segment;
+    seg->fd = seg->idx_fd = -1;
+
+    snprintf(name, sizeof(name), "%s%04u.frm", s->prefix, seg->number);
+    seg->fd = openat(s->dirfd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 00666);
+    snprintf(name, sizeof(name), "%s%04u.idx", s->prefix, seg->number);
+    seg->idx_fd = openat(s->dirfd, name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 00666);
+    if (seg->fd == -1 || seg->idx_fd == -1)
+        goto fail;
+
+    if (fallocate(seg->fd, 0, 0, record_offset(s, s->info.capacity)) == -1 && errno != EOPNOTSUPP)
+        goto fail;
+    if (ftruncate(seg->idx_fd, (off_t)s->info.capacity * sizeof(struct stream_index_entry)) == -1)
+        goto fail;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    memcpy(hdr->magic, STREAM_MAGIC, sizeof(hdr->magic));
+    hdr->version     = STREAM_VERSION;
+    hdr->header_size = STREAM_HEADER_SIZE;
+    hdr->record_size = s->record_size;
+    hdr->capacity    = s->info.capacity;
+    hdr->segment     = seg->number;
+    hdr->width       = s->info.width;
+    hdr->height      = s->info.height;
+    hdr->pixelformat = s->info.pixelformat;
+    hdr->created_ns  = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    if (pwrite(seg->fd, hdr, STREAM_HEADER_SIZE, 0) != STREAM_HEADER_SIZE)
+        goto fail;
+
+    free(hdr);
+    s->next_segment++;
+    s->segments++;
+    return seg;
+
+fail:
+    err = errno;
+    if (seg->fd != -1)
+        close(seg->fd);
+    if (seg->idx_fd != -1)
+        close(seg->idx_fd);
+    free(seg);
+    free(hdr);
+    errno = err;
+    return NULL;
+}
+
+// All records of a retired segment are in: trim the unused tail and close it
+static void segment_close(struct frame_stream *s, struct stream_segment *seg)
+{
+    if (seg->used < s->info.capacity)
+    {
+        if (ftruncate(seg->fd, record_offset(s, seg->used)) == -1 ||
+            ftruncate(seg->idx_fd, (off_t)seg->used * sizeof(struct stream_index_entry)) == -1)
+            perror("frame_stream ftruncate");
+    }
+
+    close(seg->fd);
+    close(seg->idx_fd);
+    free(seg);
+}
+
+/*************************************************************************
+ *                         Completion Function                           *
+ *************************************************************************/
+
+// frame_writer callback, runs on a writer thread
+static void stream_done(void *ctx, int error)
+{
+    struct stream_job *job = ctx;
+    struct frame_stream *s = job->s;
+    struct stream_segment *seg = job->seg;
+    writer_done_fn done = job->done;
+    void *done_ctx = job->ctx;
+
+    if (!error)
+    {
+        job->entry.flags = STREAM_ENTRY_VALID;
+        if (pwrite(seg->idx_fd, &job->entry, sizeof(job->entry),
+                   (off_t)job->slot * sizeof(job->entry)) != sizeof(job->entry))
+            error = errno ? errno : EIO;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    if (error)
+        s->errors++;
+    else
+        s->frames++;
+    if (--seg->pending == 0 && seg->retired)
+        segment_close(s, seg);
+    s->free_jobs[s->n_free++] = job;
+    pthread_cond_signal(&s->job_free);
+    pthread_mutex_unlock(&s->lock);
+
+    if (done)
+        done(done_ctx, error);
+}
+
+/*************************************************************************
+ *                          Stream API Functions                         *
+ *************************************************************************/
+
+/**
+ * @name   frame_stream_create
+ * @brief  Starts a session of container segments
+ * @param  writer      - writes the records, must outlive the stream
+ *         dir         - directory segments are created in
+ *         prefix      - segment names are prefixNNNN.frm / prefixNNNN.idx
+ *         info        - frame geometry, largest record and records per segment
+ *         queue_depth - records that may be in flight at once
+ *
+ * @descr  The first segment is created here, so an unwritable directory
+ *         fails at startup rather than on the first frame
+ *
+ * @return stream, NULL with errno set on failure
+ */
+
+struct frame_stream *frame_stream_create(struct frame_writer *writer, const char *dir, const char *prefix,
+                                         const struct frame_stream_info *info, unsigned int queue_depth)
+{
+    struct frame_stream *s;
+    unsigned int i;
+    int err;
+
+    if (info->capacity < 1 || info->max_record == 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (queue_depth < 1)
+        queue_depth = 1;
+
+    s = calloc(1, sizeof(*s));
+    if (!s)
+        return NULL;
+
+    s->writer = writer;
+    s->info = *info;
+    s->record_size = (info->max_record + STREAM_ALIGN - 1) / STREAM_ALIGN * STREAM_ALIGN;
+    s->queue_depth = queue_depth;
+    s->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    s->prefix = strdup(prefix);
+    s->jobs = calloc(queue_depth, sizeof(*s->jobs));
+    s->free_jobs = calloc(queue_depth, sizeof(*s->free_jobs));
+    if (s->dirfd == -1 || !s->prefix || !s->jobs || !s->free_jobs)
+        goto fail;
+
+    for (i = 0; i < queue_depth; i++)
+        s->free_jobs[s->n_free++] = &s->jobs[i];
+
+    s->cur = segment_open(s);
+    if (!s->cur)
+        goto fail;
+
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->job_free, NULL);
+    return s;
+
+fail:
+    err = errno;
+    if (s->dirfd != -1)
+        close(s->dirfd);
+    free(s->prefix); free(s->jobs); free(s->free_jobs);
+    free(s);
+    errno = err;
+    return NULL;
+}
+
+/**
+ * @name   frame_stream_destroy
+ * @brief  Waits for every record in flight, then closes the last segment
+ * @param  s - stream
+ *
+ * @return none
+ */
+
+void frame_stream_destroy(struct frame_stream *s)
+{
+    if (!s)
+        return;
+
+    pthread_mutex_lock(&s->lock);
+    while (s->n_free < s->queue_depth)
+        pthread_cond_wait(&s->job_free, &s->lock);
+    if (s->cur)
+        segment_close(s, s->cur);
+    pthread_mutex_unlock(&s->lock);
+
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->job_free);
+    close(s->dirfd);
+    free(s->prefix);
+    free(s->jobs);
+    free(s->free_jobs);
+    free(s);
+}
+
+/**
+ * @name   frame_stream_submit
+ * @brief  Appends a frame as the next record of the session
+ * @param  s          - stream
+ *         tag        - frame number
+ *         sequence   - driver sequence number, kept in the index
+ *         capture_ns - driver timestamp, kept in the index
+ *         header, data, size, done, ctx - as for frame_writer_submit
+ *
+ * @descr  Rotates to a new segment when the current one is full; that
+ *         open and fallocate is the only file creation on this path
+ *
+ * @return 0 on success, -1 with errno set on failure
+ */
+
+int frame_stream_submit(struct frame_stream *s, unsigned int tag, unsigned int sequence, uint64_t capture_ns,
+                        const void *header, size_t header_len,
+                        const void *data, size_t size,
+                        writer_done_fn done, void *ctx)
+{
+    struct stream_job *job;
+    struct stream_segment *seg;
+
+    if (header_len + size > s->record_size)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    pthread_mutex_lock(&s->lock);
+    while (s->n_free == 0)
+        pthread_cond_wait(&s->job_free, &s->lock);
+
+    if (!s->cur || s->cur->used == s->info.capacity)
+    {
+        if (s->cur)
+        {
+            s->cur->retired = 1;
+            if (s->cur->pending == 0)
+                segment_close(s, s->cur);
+        }
+        s->cur = segment_open(s);
+        if (!s->cur)
+        {
+            perror("frame_stream segment");
+            pthread_mutex_unlock(&s->lock);
+            return -1;
+        }
+    }
+
+    seg = s->cur;
+    job = s->free_jobs[--s->n_free];
+    job->s    = s;
+    job->seg  = seg;
+    job->slot = seg->used++;
+    job->done = done;
+    job->ctx  = ctx;
+    seg->pending++;
+    pthread_mutex_unlock(&s->lock);
+
+    memset(&job->entry, 0, sizeof(job->entry));
+    job->entry.offset     = record_offset(s, job->slot);
+    job->entry.length     = header_len + size;
+    job->entry.tag        = tag;
+    job->entry.sequence   = sequence;
+    job->entry.capture_ns = capture_ns;
+
+    if (frame_writer_submit_at(s->writer, tag, seg->fd, job->entry.offset,
+                               header, header_len, data, size, stream_done, job) == -1)
+    {
+        int err = errno;
+
+        // The slot stays a hole with an invalid index entry
+        pthread_mutex_lock(&s->lock);
+        s->errors++;
+        if (--seg->pending == 0 && seg->retired)
+            segment_close(s, seg);
+        s->free_jobs[s->n_free++] = job;
+        pthread_cond_signal(&s->job_free);
+        pthread_mutex_unlock(&s->lock);
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+// Prints records written, segments and errors
+void frame_stream_report(struct frame_stream *s, FILE *fp)
+{
+    pthread_mutex_lock(&s->lock);
+    fprintf(fp, "stream (%s): %lu frames in %lu segments of %u x %zu bytes, %lu errors\n",
+            s->prefix, s->frames, s->segments, s->info.capacity, s->record_size, s->errors);
+    pthread_mutex_unlock(&s->lock);
+}
+
+/*************************************************************************
+ *                          Reader Functions                             *
+ *************************************************************************/
+
+/**
+ * @name   stream_reader_open
+ * @brief  Opens a .frm segment and maps the .idx next to it
+ * @param  frm_path - path of the segment, ending in .frm
+ *
+ * @return reader, NULL with errno set on failure
+ */
+
+struct stream_reader *stream_reader_open(const char *frm_path)
+{
+    struct stream_reader *r;
+    struct stat st;
+    size_t len = strlen(frm_path);
+    char *idx_path;
+    int idx_fd = -1, err;
+
+    if (len < 4 || strcmp(frm_path + len - 4, ".frm") != 0)
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    r = calloc(1, sizeof(*r));
+    idx_path = strdup(frm_path);
+    if (!r || !idx_path)
+    {
+        free(r);
+        free(idx_path);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(idx_path + len - 4, ".idx", 4);
+
+    r->fd = open(frm_path, O_RDONLY | O_CLOEXEC);
+    if (r->fd == -1)
+        goto fail;
+    if (pread(r->fd, &r->header, sizeof(r->header), 0) != sizeof(r->header) ||
+        memcmp(r->header.magic, STREAM_MAGIC, sizeof(r->header.magic)) != 0 ||
+        r->header.version != STREAM_VERSION)
+    {
+        errno = EINVAL;
+        goto fail;
+    }
+
+    idx_fd = open(idx_path, O_RDONLY | O_CLOEXEC);
+    if (idx_fd == -1 || fstat(idx_fd, &st) == -1)
+        goto fail;
+
+    r->count = st.st_size / sizeof(struct stream_index_entry);
+    r->index_len = st.st_size;
+    if (r->count)
+    {
+        r->index = mmap(NULL, r->index_len, PROT_READ, MAP_SHARED, idx_fd, 0);
+        if (r->index == MAP_FAILED)
+            goto fail;
+    }
+
+    close(idx_fd);
+    free(idx_path);
+    return r;
+
+fail:
+    err = errno;
+    if (idx_fd != -1)
+        close(idx_fd);
+    if (r->fd != -1)
+        close(r->fd);
+    free(idx_path);
+    free(r);
+    errno = err;
+    return NULL;
+}
+
+void stream_reader_close(struct stream_reader *r)
+{
+    if (!r)
+        return;
+
+    if (r->index)
+        munmap((void *)r->index, r->index_len);
+    close(r->fd);
+    free(r);
+}
+
+/**
+ * @name   stream_reader_frame
+ * @brief  Reads record i of the segment
+ * @param  r    - reader
+ *         i    - record number within the segment
+ *         buf  - destination
+ *         size - bytes available in buf, longer records are cut short
+ *
+ * @return bytes read, -1 with errno ENOENT for a missing or incomplete record
+ */
+
+ssize_t stream_reader_frame(struct stream_reader *r, unsigned int i, void *buf, size_t size)
+{
+    const struct stream_index_entry *e;
+
+    if (i >= r->count || !(r->index[i].flags & STREAM_ENTRY_VALID))
+    {
+        errno = ENOENT;
+        return -1;
+    }
+
+    e = &r->index[i];
+    if (size > e->length)
+        size = e->length;
+
+    return pread(r->fd, buf, size, e->offset);
+}
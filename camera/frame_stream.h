@@ -0,0 +1,105 @@
+/*
+ * Filename   : frame_stream.h
+ *
+ * Description: Streaming container output, many frames per file
+ *            : A session is a series of segments, prefixNNNN.frm, each
+ *            : preallocated with fallocate for a fixed number of fixed-size,
+ *            : page-aligned records. Record i of a segment holds exactly the
+ *            : bytes a per-frame file would have held (e.g. PPM header and
+ *            : pixels). A sidecar prefixNNNN.idx holds one stream_index_entry
+ *            : per record, written once the record is on disk, so frame i is
+ *            : an index lookup plus one pread. Segments rotate when full.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_STREAM_H
+#define FRAME_STREAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "frame_writer.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define STREAM_MAGIC        "AESDFRM1"
+#define STREAM_VERSION      1
+#define STREAM_HEADER_SIZE  4096        // segment header, records start here
+#define STREAM_ALIGN        4096        // record size is a multiple of this
+
+#define STREAM_ENTRY_VALID  1u          // entry flags: record is complete
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+// Start of every .frm segment, little endian as written by the host
+struct stream_file_header
+{
+        char            magic[8];       // STREAM_MAGIC, no terminator
+        uint32_t        version;
+        uint32_t        header_size;    // offset of record 0
+        uint32_t        record_size;    // bytes between records
+        uint32_t        capacity;       // records the segment was allocated for
+        uint32_t        segment;        // number in the session, from 0
+        uint32_t        width, height;
+        uint32_t        pixelformat;    // V4L2 fourcc of the camera
+        uint64_t        created_ns;     // CLOCK_REALTIME
+};
+
+// Record i of a segment is described by entry i of its .idx file
+struct stream_index_entry
+{
+        uint64_t        offset;         // of the record in the .frm file
+        uint32_t        length;         // bytes used in the record
+        uint32_t        tag;            // frame number
+        uint32_t        sequence;       // driver sequence number
+        uint32_t        flags;          // STREAM_ENTRY_VALID once written
+        uint64_t        capture_ns;     // driver timestamp, CLOCK_MONOTONIC
+};
+
+struct frame_stream_info
+{
+        unsigned int    width, height;
+        unsigned int    pixelformat;
+        size_t          max_record;     // largest header + payload submitted
+        unsigned int    capacity;       // records per segment
+};
+
+struct frame_stream;
+
+// Read side: one segment, index mapped
+struct stream_reader
+{
+        int                             fd;
+        struct stream_file_header       header;
+        const struct stream_index_entry *index;
+        size_t                          index_len;
+        unsigned int                    count;      // entries in the index
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct frame_stream *frame_stream_create(struct frame_writer *writer, const char *dir, const char *prefix,
+                                         const struct frame_stream_info *info, unsigned int queue_depth);
+void frame_stream_destroy(struct frame_stream *s);
+
+int frame_stream_submit(struct frame_stream *s, unsigned int tag, unsigned int sequence, uint64_t capture_ns,
+                        const void *header, size_t header_len,
+                        const void *data, size_t size,
+                        writer_done_fn done, void *ctx);
+
+void frame_stream_report(struct frame_stream *s, FILE *fp);
+
+struct stream_reader *stream_reader_open(const char *frm_path);
+void stream_reader_close(struct stream_reader *r);
+ssize_t stream_reader_frame(struct stream_reader *r, unsigned int i, void *buf, size_t size);
+
+#endif /* FRAME_STREAM_H */
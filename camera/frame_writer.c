@@ -0,0 +1,1100 @@
+/*
+ * Filename   : frame_writer.c
+ *
+ * Description: Asynchronous per-frame file writer
+ *            : 1) Jobs are queued from any thread into a bounded job pool
+ *            : 2) io_uring backend: one thread drains the queue, submits every
+ *            :    pending job in one io_uring_enter(), one IORING_OP_WRITEV
+ *            :    per frame, and reaps completions
+ *            : 3) Thread backend: a pool of threads each writing one job
+ *            :    at a time with pwritev()
+ *            : Header and payload always go out in a single vectored write;
+ *            : short writes are resumed where they stopped.
+ *            : 4) Files for the next frame numbers are opened while the writer
+ *            :    is idle and handed out by tag; unused ones are unlinked
+ *            : 5) Jobs submitted with an fd and offset skip 4) and leave the
+ *            :    fd open, for callers that pack frames into one file
+ *            : io_uring is driven through the raw syscalls so no liburing is needed.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : https://kernel.dk/io_uring.pdf
+ *            : man 2 io_uring_setup, io_uring_enter, io_uring_register
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include "frame_writer.h"
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define WRITER_MAX_IOV    2     // header + payload, one writev
+#define WRITER_MAX_THREADS 16
+#define URING_POLL_NS     1000000   // completion polling period once io_uring_enter has failed
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct write_job
+{
+        unsigned int     tag;
+        int              fd;
+        off_t            offset;        // where the first segment goes
+        int              caller_fd;     // fd belongs to the caller: don't open or close it
+        struct iovec     iov[WRITER_MAX_IOV];
+        int              niov;
+        char             header[WRITER_HEADER_MAX];
+        writer_done_fn   done;
+        void            *ctx;
+        struct timespec  submitted;
+        size_t           written;       // bytes already on disk, for resuming short writes
+        int              error;
+};
+
+// File opened ahead of time for a future frame number
+struct preopened
+{
+        unsigned int     tag;
+        int              fd;
+};
+
+// Mapped io_uring submission and completion rings
+struct uring
+{
+        int                   fd;
+        unsigned int          entries;
+        unsigned int         *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned int         *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe  *sqes;
+        struct io_uring_cqe  *cqes;
+        void                 *sq_ptr, *cq_ptr;
+        size_t                sq_len, cq_len, sqes_len;
+};
+
+struct frame_writer
+{
+        enum writer_backend   backend;
+        int                   dirfd;
+        char                 *name_fmt;
+
+        pthread_mutex_t       lock;
+        pthread_cond_t        not_empty;
+        pthread_cond_t        not_full;
+        struct write_job     *jobs;         // job pool, queue_depth entries
+        struct write_job    **free_jobs;
+        unsigned int          n_free;
+        struct write_job    **queue;        // pending jobs FIFO
+        unsigned int          q_head, q_count;
+        unsigned int          queue_depth;
+        int                   stopping;
+
+        pthread_t             threads[WRITER_MAX_THREADS];
+        unsigned int          n_threads;
+
+        struct uring          ring;
+        unsigned int          inflight;     // io_uring thread only
+        int                   uring_failed; // io_uring_enter broke, writes go synchronous; io_uring thread only
+
+        pthread_mutex_t       pre_lock;
+        struct preopened     *pre;
+        unsigned int          n_pre;
+        unsigned int          next_pre_tag;
+
+        // completion statistics, under lock
+        unsigned long         frames, errors, preopen_hits;
+        unsigned long long    bytes;
+        unsigned long long    lat_sum_ns, lat_min_ns, lat_max_ns;
+};
+
+/*************************************************************************
+ *                  Global Variables                                     *
+ *************************************************************************/
+
+static const char *backend_names[] = { "auto", "uring", "threads" };
+
+/*************************************************************************
+ *                        io_uring Syscall Wrappers                      *
+ *************************************************************************/
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/**
+ * @name   uring_init
+ * @brief  Creates an io_uring instance and maps its rings
+ * @param  r       - ring to initialize
+ *         entries - submission queue entries
+ *
+ * @descr  Probes for IORING_OP_WRITEV so kernels without it (or without
+ *         the probe, before 5.6) fall back to the thread backend
+ *
+ * @return 0 on success, -1 with errno set on failure
+ */
+
+static int uring_init(struct uring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+    struct io_uring_probe *probe;
+    size_t probe_len = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+    int supported;
+
+    memset(&p, 0, sizeof(p));
+    memset(r, 0, sizeof(*r));
+
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd == -1)
+        return -1;
+
+    probe = calloc(1, probe_len);
+    if (!probe || sys_io_uring_register(r->fd, IORING_REGISTER_PROBE, probe, 256) == -1)
+    {
+        free(probe);
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+    supported = probe->last_op >= IORING_OP_WRITEV &&
+                (probe->ops[IORING_OP_WRITEV].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    if (!supported)
+    {
+        close(r->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    r->entries = p.sq_entries;
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (r->cq_len > r->sq_len)
+            r->sq_len = r->cq_len;
+        r->cq_len = r->sq_len;
+    }
+
+    r->sq_ptr = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ptr == MAP_FAILED)
+        goto fail;
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        r->cq_ptr = r->sq_ptr;
+    else
+    {
+        r->cq_ptr = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ptr == MAP_FAILED)
+            goto fail;
+    }
+
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED)
+        goto fail;
+
+    r->sq_head  = (unsigned int *)((char *)r->sq_ptr + p.sq_off.head);
+    r->sq_tail  = (unsigned int *)((char *)r->sq_ptr + p.sq_off.tail);
+    r->sq_mask  = (unsigned int *)((char *)r->sq_ptr + p.sq_off.ring_mask);
+    r->sq_array = (unsigned int *)((char *)r->sq_ptr + p.sq_off.array);
+    r->cq_head  = (unsigned int *)((char *)r->cq_ptr + p.cq_off.head);
+    r->cq_tail  = (unsigned int *)((char *)r->cq_ptr + p.cq_off.tail);
+    r->cq_mask  = (unsigned int *)((char *)r->cq_ptr + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)((char *)r->cq_ptr + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    if (r->sq_ptr && r->sq_ptr != MAP_FAILED)
+        munmap(r->sq_ptr, r->sq_len);
+    if (r->cq_ptr && r->cq_ptr != MAP_FAILED && r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    close(r->fd);
+    return -1;
+}
+
+static void uring_exit(struct uring *r)
+{
+    munmap(r->sqes, r->sqes_len);
+    if (r->cq_ptr != r->sq_ptr)
+        munmap(r->cq_ptr, r->cq_len);
+    munmap(r->sq_ptr, r->sq_len);
+    close(r->fd);
+}
+
+// Next free SQE, NULL if the submission ring is full; only the writer thread submits
+static struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    unsigned int tail = *r->sq_tail;
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    struct io_uring_sqe *sqe;
+
+    if (tail - head >= r->entries)
+        return NULL;
+
+    sqe = &r->sqes[tail & *r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[tail & *r->sq_mask] = tail & *r->sq_mask;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return sqe;
+}
+
+/*************************************************************************
+ *                       Pre-opened File Functions                       *
+ *************************************************************************/
+
+static int writer_open_name(struct frame_writer *w, unsigned int tag)
+{
+    char name[256];
+
+    snprintf(name, sizeof(name), w->name_fmt, tag);
+    return openat(w->dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 00666);
+}
+
+static void writer_unlink_name(struct frame_writer *w, unsigned int tag)
+{
+    char name[256];
+
+    snprintf(name, sizeof(name), w->name_fmt, tag);
+    unlinkat(w->dirfd, name, 0);
+}
+
+/**
+ * @name   writer_open
+ * @brief  Gets an fd for a frame's file
+ * @param  w   - writer
+ *         tag - frame number
+ *
+ * @descr  Uses the pre-opened fd if the frame was anticipated, else opens now
+ *         Either way pre-opening moves past tag, so a file that is already
+ *         being written is never opened (and truncated) a second time
+ *
+ * @return fd, -1 with errno set on failure
+ */
+
+static int writer_open(struct frame_writer *w, unsigned int tag)
+{
+    struct preopened *slot;
+    int fd = -1;
+
+    if (w->n_pre)
+    {
+        pthread_mutex_lock(&w->pre_lock);
+        slot = &w->pre[tag % w->n_pre];
+        if (slot->fd >= 0 && slot->tag == tag)
+        {
+            fd = slot->fd;
+            slot->fd = -1;
+        }
+        if (tag >= w->next_pre_tag)
+            w->next_pre_tag = tag + 1;
+        pthread_mutex_unlock(&w->pre_lock);
+    }
+
+    if (fd >= 0)
+    {
+        pthread_mutex_lock(&w->lock);
+        w->preopen_hits++;
+        pthread_mutex_unlock(&w->lock);
+        return fd;
+    }
+
+    return writer_open_name(w, tag);
+}
+
+/**
+ * @name   writer_preopen
+ * @brief  Opens files for the frames following tag
+ * @param  w   - writer
+ *         tag - most recent frame written
+ *
+ * @descr  Called by writer threads between jobs
+ *         Only tags past every frame seen so far are opened
+ *         A slot still holding an older tag belongs to a frame that was
+ *         dropped upstream, so its empty file is closed and unlinked
+ *         If that frame does turn up late, writer_open just recreates it
+ *
+ * @return none
+ */
+
+static void writer_preopen(struct frame_writer *w, unsigned int tag)
+{
+    unsigned int t;
+
+    if (!w->n_pre)
+        return;
+
+    pthread_mutex_lock(&w->pre_lock);
+
+    t = w->next_pre_tag;
+    if (t <= tag)
+        t = tag + 1;
+
+    for (; t <= tag + w->n_pre; t++)
+    {
+        struct preopened *slot = &w->pre[t % w->n_pre];
+
+        if (slot->fd >= 0)
+        {
+            if (slot->tag >= t)
+                continue;
+            close(slot->fd);
+            writer_unlink_name(w, slot->tag);
+        }
+
+        slot->tag = t;
+        slot->fd  = writer_open_name(w, t);
+    }
+    w->next_pre_tag = t;
+
+    pthread_mutex_unlock(&w->pre_lock);
+}
+
+/*************************************************************************
+ *                         Job Completion Functions                      *
+ *************************************************************************/
+
+static unsigned long long elapsed_ns(const struct timespec *from)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)(now.tv_sec - from->tv_sec) * 1000000000ULL + now.tv_nsec - from->tv_nsec;
+}
+
+/**
+ * @name   writer_complete
+ * @brief  Finishes a job: records latency, runs callback, frees the job slot
+ * @param  w   - writer
+ *         job - finished job, fd already closed
+ *
+ * @return none
+ */
+
+static void writer_complete(struct frame_writer *w, struct write_job *job)
+{
+    unsigned long long ns = elapsed_ns(&job->submitted);
+    writer_done_fn done = job->done;
+    void *ctx = job->ctx;
+    int error = job->error;
+    int i;
+
+    pthread_mutex_lock(&w->lock);
+    w->frames++;
+    if (error)
+        w->errors++;
+    else
+        for (i = 0; i < job->niov; i++)
+            w->bytes += job->iov[i].iov_len;
+    w->lat_sum_ns += ns;
+    if (ns > w->lat_max_ns)
+        w->lat_max_ns = ns;
+    if (w->lat_min_ns == 0 || ns < w->lat_min_ns)
+        w->lat_min_ns = ns;
+
+    w->free_jobs[w->n_free++] = job;
+    pthread_cond_broadcast(&w->not_full);
+    pthread_mutex_unlock(&w->lock);
+
+    if (done)
+        done(ctx, error);
+}
+
+// Total bytes of a job
+static size_t job_length(const struct write_job *job)
+{
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < job->niov; i++)
+        len += job->iov[i].iov_len;
+    return len;
+}
+
+/**
+ * @name   writer_write_sync
+ * @brief  Writes what is left of a job with pwritev(), resuming short writes
+ * @param  job - job with an open fd, job->written bytes already done
+ *
+ * @descr  Skips the job->written bytes that are already on disk, so it also
+ *         finishes a job whose io_uring write came back short
+ *
+ * @return none, sets job->error on failure
+ */
+
+static void writer_write_sync(struct write_job *job)
+{
+    struct iovec iov[WRITER_MAX_IOV];
+    size_t skip = job->written;
+    int i, n = 0;
+
+    for (i = 0; i < job->niov; i++)
+    {
+        if (skip >= job->iov[i].iov_len)
+        {
+            skip -= job->iov[i].iov_len;
+            continue;
+        }
+        iov[n].iov_base = (char *)job->iov[i].iov_base + skip;
+        iov[n].iov_len  = job->iov[i].iov_len - skip;
+        skip = 0;
+        n++;
+    }
+
+    while (n > 0)
+    {
+        ssize_t written = pwritev(job->fd, iov, n, job->offset + job->written);
+
+        if (written == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            job->error = errno;
+            return;
+        }
+        if (written == 0)
+        {
+            job->error = EIO;
+            return;
+        }
+        job->written += written;
+
+        // Drop the segments that are done, trim the one cut short
+        for (i = 0; i < n && (size_t)written >= iov[i].iov_len; i++)
+            written -= iov[i].iov_len;
+        memmove(iov, iov + i, (n - i) * sizeof(iov[0]));
+        n -= i;
+        if (n > 0)
+        {
+            iov[0].iov_base = (char *)iov[0].iov_base + written;
+            iov[0].iov_len -= written;
+        }
+    }
+}
+
+/*************************************************************************
+ *                         Thread Pool Backend                           *
+ *************************************************************************/
+
+// Pops the next pending job, waiting for one; NULL once stopping and drained
+static struct write_job *writer_next(struct frame_writer *w)
+{
+    struct write_job *job = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    while (w->q_count == 0 && !w->stopping)
+        pthread_cond_wait(&w->not_empty, &w->lock);
+
+    if (w->q_count)
+    {
+        job = w->queue[w->q_head];
+        w->q_head = (w->q_head + 1) % w->queue_depth;
+        w->q_count--;
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return job;
+}
+
+static void *writer_thread(void *arg)
+{
+    struct frame_writer *w = arg;
+    struct write_job *job;
+
+    while ((job = writer_next(w)) != NULL)
+    {
+        if (!job->caller_fd)
+            job->fd = writer_open(w, job->tag);
+        if (job->fd == -1)
+            job->error = errno;
+        else
+        {
+            writer_write_sync(job);
+            if (!job->caller_fd && close(job->fd) == -1 && !job->error)
+                job->error = errno;
+        }
+
+        writer_complete(w, job);
+        writer_preopen(w, job->tag);
+    }
+
+    return NULL;
+}
+
+/*************************************************************************
+ *                           io_uring Backend                            *
+ *************************************************************************/
+
+// Writes a job on the io_uring thread itself, when the ring can't take it
+static void uring_write_sync(struct frame_writer *w, struct write_job *job)
+{
+    writer_write_sync(job);
+    if (!job->caller_fd && close(job->fd) == -1 && !job->error)
+        job->error = errno;
+
+    writer_complete(w, job);
+    writer_preopen(w, job->tag);
+}
+
+/**
+ * @name   uring_submit
+ * @brief  Hands queued SQEs to the kernel, optionally waiting for a completion
+ * @param  w         - writer
+ *         to_submit - SQEs queued since the last submit
+ *         wait      - block until at least one write completes
+ *
+ * @descr  Retries interruptions and partial submits. On a hard error the
+ *         SQEs the kernel never consumed are taken back off the ring and
+ *         their jobs written synchronously, so inflight still drains, and
+ *         the writer stays synchronous from then on
+ *
+ * @return 0, -1 after a hard error
+ */
+
+static int uring_submit(struct frame_writer *w, unsigned int to_submit, int wait)
+{
+    struct uring *r = &w->ring;
+    unsigned int head, tail;
+    int ret;
+
+    do
+    {
+        unsigned int min = wait && to_submit == 0 ? 1 : 0;
+
+        ret = sys_io_uring_enter(r->fd, to_submit, min, min ? IORING_ENTER_GETEVENTS : 0);
+        if (ret >= 0)
+            to_submit -= (unsigned int)ret < to_submit ? (unsigned int)ret : to_submit;
+    } while ((ret == -1 && (errno == EINTR || errno == EAGAIN || errno == EBUSY)) || (ret >= 0 && to_submit));
+
+    if (ret >= 0)
+        return 0;
+
+    if (!w->uring_failed)
+        perror("io_uring_enter, writing synchronously");
+    w->uring_failed = 1;
+
+    head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    tail = *r->sq_tail;
+    __atomic_store_n(r->sq_tail, head, __ATOMIC_RELEASE);
+    for (; head != tail; head++)
+    {
+        struct io_uring_sqe *sqe = &r->sqes[r->sq_array[head & *r->sq_mask]];
+
+        w->inflight--;
+        uring_write_sync(w, (struct write_job *)(uintptr_t)sqe->user_data);
+    }
+
+    return -1;
+}
+
+/**
+ * @name   uring_queue_job
+ * @brief  Prepares one IORING_OP_WRITEV SQE covering header and payload
+ * @param  w         - writer
+ *         job       - job with an open fd
+ *         to_submit - SQEs queued and not yet submitted, updated
+ *
+ * @descr  job->iov lives in the job, so it stays valid until completion
+ *         A full submission queue is submitted first to make room; if the
+ *         ring is broken the job is written synchronously instead
+ *
+ * @return none
+ */
+
+static void uring_queue_job(struct frame_writer *w, struct write_job *job, unsigned int *to_submit)
+{
+    struct io_uring_sqe *sqe = w->uring_failed ? NULL : uring_get_sqe(&w->ring);
+
+    if (!sqe && !w->uring_failed && uring_submit(w, *to_submit, 0) == 0)
+    {
+        *to_submit = 0;
+        sqe = uring_get_sqe(&w->ring);
+    }
+    if (!sqe)
+    {
+        if (w->uring_failed)
+            *to_submit = 0;
+        uring_write_sync(w, job);
+        return;
+    }
+
+    sqe->opcode    = IORING_OP_WRITEV;
+    sqe->fd        = job->fd;
+    sqe->addr      = (unsigned long)job->iov;
+    sqe->len       = job->niov;
+    sqe->off       = job->offset;
+    sqe->user_data = (unsigned long)job;
+
+    (*to_submit)++;
+    w->inflight++;
+}
+
+// Handles every available CQE; a short write is finished synchronously
+static void uring_reap(struct frame_writer *w)
+{
+    struct uring *r = &w->ring;
+    unsigned int head = *r->cq_head;
+    unsigned int tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+
+    while (head != tail)
+    {
+        struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+        struct write_job *job = (struct write_job *)(uintptr_t)cqe->user_data;
+
+        if (cqe->res < 0)
+        {
+            if (cqe->res == -EINTR || cqe->res == -EAGAIN)
+                writer_write_sync(job);
+            else
+                job->error = -cqe->res;
+        }
+        else
+        {
+            job->written = cqe->res;
+            if (job->written < job_length(job))
+                writer_write_sync(job);
+        }
+
+        head++;
+
+        if (!job->caller_fd && close(job->fd) == -1 && !job->error)
+            job->error = errno;
+
+        w->inflight--;
+        writer_complete(w, job);
+        writer_preopen(w, job->tag);
+    }
+
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+/**
+ * @name   uring_thread
+ * @brief  io_uring backend thread: batches queued jobs and reaps completions
+ * @param  arg - writer
+ *
+ * @descr  Takes every pending job at once and submits them with a single
+ *         io_uring_enter(); when nothing new is queued it sleeps in the
+ *         kernel waiting for a completion instead
+ *
+ * @return NULL
+ */
+
+static void *uring_thread(void *arg)
+{
+    struct frame_writer *w = arg;
+    struct write_job *batch[256];
+
+    for (;;)
+    {
+        unsigned int n = 0, i, to_submit = 0;
+
+        pthread_mutex_lock(&w->lock);
+        while (w->q_count == 0 && w->inflight == 0 && !w->stopping)
+            pthread_cond_wait(&w->not_empty, &w->lock);
+
+        if (w->q_count == 0 && w->inflight == 0 && w->stopping)
+        {
+            pthread_mutex_unlock(&w->lock);
+            break;
+        }
+
+        while (w->q_count && n < sizeof(batch) / sizeof(batch[0]))
+        {
+            batch[n++] = w->queue[w->q_head];
+            w->q_head = (w->q_head + 1) % w->queue_depth;
+            w->q_count--;
+        }
+        pthread_mutex_unlock(&w->lock);
+
+        for (i = 0; i < n; i++)
+        {
+            struct write_job *job = batch[i];
+
+            if (!job->caller_fd)
+                job->fd = writer_open(w, job->tag);
+            if (job->fd == -1)
+            {
+                job->error = errno;
+                writer_complete(w, job);
+                continue;
+            }
+            uring_queue_job(w, job, &to_submit);
+        }
+
+        // Nothing new to submit: block until at least one write completes. Once the ring
+        // is broken, writes it had already taken still complete; poll for them
+        if (!w->uring_failed)
+            uring_submit(w, to_submit, w->inflight != 0);
+        else if (w->inflight)
+        {
+            const struct timespec poll = { 0, URING_POLL_NS };
+
+            nanosleep(&poll, NULL);
+        }
+
+        uring_reap(w);
+    }
+
+    return NULL;
+}
+
+/*************************************************************************
+ *                          Writer API Functions                         *
+ *************************************************************************/
+
+/**
+ * @name   frame_writer_create
+ * @brief  Creates an asynchronous frame writer
+ * @param  backend     - WRITER_AUTO, WRITER_URING or WRITER_THREADS
+ *         dir         - directory frame files are created in
+ *         name_fmt    - printf format for file names, one unsigned int (tag)
+ *         threads     - writer threads for the thread backend (io_uring uses one)
+ *         queue_depth - jobs that may be queued or in flight
+ *         preopen     - frame files to keep opened ahead, 0 to disable
+ *
+ * @descr  WRITER_URING falls back to threads if the kernel lacks io_uring
+ *
+ * @return writer, NULL on failure
+ */
+
+struct frame_writer *frame_writer_create(enum writer_backend backend, const char *dir, const char *name_fmt,
+                                         unsigned int threads, unsigned int queue_depth, unsigned int preopen)
+{
+    struct frame_writer *w;
+    unsigned int i;
+
+    if (queue_depth < 1)
+        queue_depth = 1;
+    if (threads < 1)
+        threads = 1;
+    if (threads > WRITER_MAX_THREADS)
+        threads = WRITER_MAX_THREADS;
+
+    w = calloc(1, sizeof(*w));
+    if (!w)
+        return NULL;
+
+    w->dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    w->name_fmt = strdup(name_fmt);
+    w->queue_depth = queue_depth;
+    w->jobs = calloc(queue_depth, sizeof(*w->jobs));
+    w->free_jobs = calloc(queue_depth, sizeof(*w->free_jobs));
+    w->queue = calloc(queue_depth, sizeof(*w->queue));
+    w->n_pre = preopen;
+    w->pre = calloc(preopen ? preopen : 1, sizeof(*w->pre));
+    if (w->dirfd == -1 || !w->name_fmt || !w->jobs || !w->free_jobs || !w->queue || !w->pre)
+    {
+        if (w->dirfd != -1)
+            close(w->dirfd);
+        free(w->name_fmt); free(w->jobs); free(w->free_jobs); free(w->queue); free(w->pre);
+        free(w);
+        return NULL;
+    }
+
+    for (i = 0; i < queue_depth; i++)
+        w->free_jobs[w->n_free++] = &w->jobs[i];
+    for (i = 0; i < w->n_pre; i++)
+        w->pre[i].fd = -1;
+
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_mutex_init(&w->pre_lock, NULL);
+    pthread_cond_init(&w->not_empty, NULL);
+    pthread_cond_init(&w->not_full, NULL);
+
+    if (backend != WRITER_THREADS)
+    {
+        if (uring_init(&w->ring, queue_depth) == 0)
+            backend = WRITER_URING;
+        else
+        {
+            if (backend == WRITER_URING)
+                fprintf(stderr, "io_uring unavailable (%s), using writer threads\n", strerror(errno));
+            backend = WRITER_THREADS;
+        }
+    }
+    w->backend = backend;
+
+    // Files for the first frames, frame numbers start at 1
+    writer_preopen(w, 0);
+
+    w->n_threads = (backend == WRITER_URING) ? 1 : threads;
+    for (i = 0; i < w->n_threads; i++)
+    {
+        errno = pthread_create(&w->threads[i], NULL, backend == WRITER_URING ? uring_thread : writer_thread, w);
+        if (errno)
+        {
+            perror("pthread_create");
+            w->n_threads = i;
+            frame_writer_destroy(w);
+            return NULL;
+        }
+    }
+
+    return w;
+}
+
+/**
+ * @name   frame_writer_destroy
+ * @brief  Waits for all queued frames to be written and frees the writer
+ * @param  w - writer
+ *
+ * @descr  Pre-opened files that never got a frame are unlinked
+ *
+ * @return none
+ */
+
+void frame_writer_destroy(struct frame_writer *w)
+{
+    unsigned int i;
+
+    if (!w)
+        return;
+
+    pthread_mutex_lock(&w->lock);
+    w->stopping = 1;
+    pthread_cond_broadcast(&w->not_empty);
+    pthread_mutex_unlock(&w->lock);
+
+    for (i = 0; i < w->n_threads; i++)
+        pthread_join(w->threads[i], NULL);
+
+    for (i = 0; i < w->n_pre; i++)
+    {
+        if (w->pre[i].fd >= 0)
+        {
+            close(w->pre[i].fd);
+            writer_unlink_name(w, w->pre[i].tag);
+        }
+    }
+
+    if (w->backend == WRITER_URING)
+        uring_exit(&w->ring);
+
+    pthread_mutex_destroy(&w->lock);
+    pthread_mutex_destroy(&w->pre_lock);
+    pthread_cond_destroy(&w->not_empty);
+    pthread_cond_destroy(&w->not_full);
+
+    close(w->dirfd);
+    free(w->name_fmt);
+    free(w->jobs);
+    free(w->free_jobs);
+    free(w->queue);
+    free(w->pre);
+    free(w);
+}
+
+// Fills a job from the pool and queues it, fd -1 means "open the file for tag"
+static int writer_queue(struct frame_writer *w, unsigned int tag, int fd, off_t offset,
+                        const void *header, size_t header_len,
+                        const void *data, size_t size,
+                        writer_done_fn done, void *ctx)
+{
+    struct write_job *job;
+
+    if (header_len > WRITER_HEADER_MAX)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    pthread_mutex_lock(&w->lock);
+    while (w->n_free == 0 && !w->stopping)
+        pthread_cond_wait(&w->not_full, &w->lock);
+
+    if (w->stopping)
+    {
+        pthread_mutex_unlock(&w->lock);
+        errno = ESHUTDOWN;
+        return -1;
+    }
+
+    job = w->free_jobs[--w->n_free];
+    pthread_mutex_unlock(&w->lock);
+
+    memset(job, 0, sizeof(*job));
+    job->tag  = tag;
+    job->fd   = fd;
+    job->offset    = offset;
+    job->caller_fd = fd >= 0;
+    job->done = done;
+    job->ctx  = ctx;
+    if (header_len)
+    {
+        memcpy(job->header, header, header_len);
+        job->iov[job->niov].iov_base = job->header;
+        job->iov[job->niov].iov_len  = header_len;
+        job->niov++;
+    }
+    job->iov[job->niov].iov_base = (void *)data;
+    job->iov[job->niov].iov_len  = size;
+    job->niov++;
+    clock_gettime(CLOCK_MONOTONIC, &job->submitted);
+
+    pthread_mutex_lock(&w->lock);
+    w->queue[(w->q_head + w->q_count) % w->queue_depth] = job;
+    w->q_count++;
+    pthread_cond_signal(&w->not_empty);
+    pthread_mutex_unlock(&w->lock);
+
+    return 0;
+}
+
+/**
+ * @name   frame_writer_submit
+ * @brief  Queues a frame to be written to its own file
+ * @param  w          - writer
+ *         tag        - frame number, used to name the file
+ *         header     - copied into the job, at most WRITER_HEADER_MAX bytes
+ *         data, size - payload, must stay valid until done is called
+ *         done, ctx  - completion callback, called from a writer thread
+ *
+ * @descr  Only blocks if queue_depth jobs are already queued or in flight
+ *
+ * @return 0 on success, -1 with errno set on failure
+ */
+
+int frame_writer_submit(struct frame_writer *w, unsigned int tag,
+                        const void *header, size_t header_len,
+                        const void *data, size_t size,
+                        writer_done_fn done, void *ctx)
+{
+    return writer_queue(w, tag, -1, 0, header, header_len, data, size, done, ctx);
+}
+
+/**
+ * @name   frame_writer_submit_at
+ * @brief  Queues a frame to be written at offset of an already open file
+ * @param  w          - writer
+ *         tag        - frame number, for the caller only
+ *         fd         - open for writing, must stay open until done is called
+ *         offset     - file offset of the header, payload follows it
+ *         header, data, size, done, ctx - as for frame_writer_submit
+ *
+ * @descr  Jobs for the same fd may complete in any order
+ *
+ * @return 0 on success, -1 with errno set on failure
+ */
+
+int frame_writer_submit_at(struct frame_writer *w, unsigned int tag, int fd, off_t offset,
+                           const void *header, size_t header_len,
+                           const void *data, size_t size,
+                           writer_done_fn done, void *ctx)
+{
+    if (fd < 0)
+    {
+        errno = EBADF;
+        return -1;
+    }
+
+    return writer_queue(w, tag, fd, offset, header, header_len, data, size, done, ctx);
+}
+
+/**
+ * @name   frame_writer_flush
+ * @brief  Waits until every submitted frame has completed
+ * @param  w - writer
+ *
+ * @return none
+ */
+
+void frame_writer_flush(struct frame_writer *w)
+{
+    pthread_mutex_lock(&w->lock);
+    while (w->n_free < w->queue_depth)
+        pthread_cond_wait(&w->not_full, &w->lock);
+    pthread_mutex_unlock(&w->lock);
+}
+
+enum writer_backend frame_writer_backend(const struct frame_writer *w)
+{
+    return w->backend;
+}
+
+/**
+ * @name   frame_writer_report
+ * @brief  Prints frames written, errors and submit-to-completion latency
+ * @param  w  - writer
+ *         fp - stream to print to
+ *
+ * @return none
+ */
+
+void frame_writer_report(struct frame_writer *w, FILE *fp)
+{
+    pthread_mutex_lock(&w->lock);
+    fprintf(fp, "writer (%s): %lu frames, %llu bytes, %lu errors, %lu pre-opened\n",
+            writer_backend_name(w->backend), w->frames, w->bytes, w->errors, w->preopen_hits);
+    if (w->frames)
+        fprintf(fp, "writer latency: min %llu us, avg %llu us, max %llu us\n",
+                w->lat_min_ns / 1000, w->lat_sum_ns / w->frames / 1000, w->lat_max_ns / 1000);
+    pthread_mutex_unlock(&w->lock);
+}
+
+const char *writer_backend_name(enum writer_backend backend)
+{
+    if ((unsigned int)backend >= sizeof(backend_names) / sizeof(backend_names[0]))
+        return "unknown";
+
+    return backend_names[backend];
+}
+
+/**
+ * @name   writer_backend_parse
+ * @brief  Parses a writer backend name from the command line
+ * @param  name    - "auto", "uring" or "threads"
+ *         backend - ptr to store parsed backend
+ *
+ * @return 0 on success, -1 on unknown name
+ */
+
+int writer_backend_parse(const char *name, enum writer_backend *backend)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(backend_names) / sizeof(backend_names[0]); i++)
+    {
+        if (strcmp(name, backend_names[i]) == 0)
+        {
+            *backend = (enum writer_backend)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
@@ -0,0 +1,70 @@
+/*
+ * Filename   : frame_writer.h
+ *
+ * Description: Asynchronous per-frame file writer
+ *            : Callers queue a header and payload for a frame and get a
+ *            : callback when it is on disk. Files are written either through
+ *            : io_uring (batched, linked writes) or by a pool of writer threads.
+ *            : Files for upcoming frame numbers are opened ahead of time, so
+ *            : open() is normally off the critical path as well.
+ *            : frame_writer_submit_at() instead writes at an offset of a file
+ *            : the caller keeps open, which is how frame_stream appends records.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef FRAME_WRITER_H
+#define FRAME_WRITER_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define WRITER_HEADER_MAX 128   // header bytes copied into each job
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+enum writer_backend
+{
+        WRITER_AUTO = 0,        // io_uring if the kernel has it, else threads
+        WRITER_URING,
+        WRITER_THREADS,
+};
+
+// Called from a writer thread once the frame is written (error = 0) or failed (errno value)
+typedef void (*writer_done_fn)(void *ctx, int error);
+
+struct frame_writer;
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct frame_writer *frame_writer_create(enum writer_backend backend, const char *dir, const char *name_fmt,
+                                         unsigned int threads, unsigned int queue_depth, unsigned int preopen);
+void frame_writer_destroy(struct frame_writer *w);
+
+int frame_writer_submit(struct frame_writer *w, unsigned int tag,
+                        const void *header, size_t header_len,
+                        const void *data, size_t size,
+                        writer_done_fn done, void *ctx);
+int frame_writer_submit_at(struct frame_writer *w, unsigned int tag, int fd, off_t offset,
+                           const void *header, size_t header_len,
+                           const void *data, size_t size,
+                           writer_done_fn done, void *ctx);
+void frame_writer_flush(struct frame_writer *w);
+
+enum writer_backend frame_writer_backend(const struct frame_writer *w);
+void frame_writer_report(struct frame_writer *w, FILE *fp);
+
+const char *writer_backend_name(enum writer_backend backend);
+int writer_backend_parse(const char *name, enum writer_backend *backend);
+
+#endif /* FRAME_WRITER_H */
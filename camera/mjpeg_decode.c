@@ -0,0 +1,176 @@
+/*
+ * Filename   : mjpeg_decode.c
+ *
+ * Description: MJPEG frame decoder
+ *            : 1) One jpeg_decompress_struct per decoder, created once
+ *            : 2) Decodes straight into the caller's RGB24 buffer, no
+ *            :    intermediate copy
+ *            : 3) libjpeg errors longjmp back and fail the frame instead of
+ *            :    exiting the process
+ *            : UVC cameras usually leave the Huffman tables out of MJPEG
+ *            : frames; libjpeg-turbo falls back to the standard tables.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : https://libjpeg-turbo.org/
+ *            : https://www.usb.org/document-library/video-class-v15-document-set (MJPEG payload)
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#endif
+
+#include "mjpeg_decode.h"
+
+#ifdef HAVE_LIBJPEG
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+struct mjpeg_decoder
+{
+        struct jpeg_decompress_struct   cinfo;
+        struct jpeg_error_mgr           jerr;
+        jmp_buf                         fail;
+};
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+// libjpeg error_exit: leave the frame, keep the decoder usable
+static void decoder_error_exit(j_common_ptr cinfo)
+{
+    struct mjpeg_decoder *d = (struct mjpeg_decoder *)cinfo;
+
+    longjmp(d->fail, 1);
+}
+
+// Corrupt-data warnings are per frame noise on a live stream
+static void decoder_output_message(j_common_ptr cinfo)
+{
+    (void)cinfo;
+}
+
+/**
+ * @name   mjpeg_decoder_create
+ * @brief  Sets up a libjpeg decompressor
+ * @param  none
+ *
+ * @return decoder, NULL on failure
+ */
+
+struct mjpeg_decoder *mjpeg_decoder_create(void)
+{
+    struct mjpeg_decoder *d;
+
+    d = calloc(1, sizeof(*d));
+    if (!d)
+        return NULL;
+
+    d->cinfo.err = jpeg_std_error(&d->jerr);
+    d->jerr.error_exit     = decoder_error_exit;
+    d->jerr.output_message = decoder_output_message;
+
+    if (setjmp(d->fail))
+    {
+        free(d);
+        errno = ENOMEM;
+        return NULL;
+    }
+    jpeg_create_decompress(&d->cinfo);
+
+    return d;
+}
+
+void mjpeg_decoder_destroy(struct mjpeg_decoder *d)
+{
+    if (!d)
+        return;
+
+    jpeg_destroy_decompress(&d->cinfo);
+    free(d);
+}
+
+/**
+ * @name   mjpeg_decode_rgb24
+ * @brief  Decodes one MJPEG frame into packed RGB24
+ * @param  d      - decoder
+ *         jpeg   - compressed frame, bytesused of the capture buffer
+ *         size   - bytes in jpeg
+ *         rgb    - output, width * height * 3 bytes
+ *         width  - expected frame width
+ *         height - expected frame height
+ *
+ * @descr  A frame that decodes to another size is rejected rather than
+ *         overrunning rgb
+ *
+ * @return 0 on success, -1 with errno EINVAL for a corrupt or mismatched frame
+ */
+
+int mjpeg_decode_rgb24(struct mjpeg_decoder *d, const unsigned char *jpeg, size_t size,
+                       unsigned char *rgb, unsigned int width, unsigned int height)
+{
+    struct jpeg_decompress_struct *cinfo = &d->cinfo;
+    JSAMPROW row;
+
+    if (setjmp(d->fail))
+    {
+        jpeg_abort_decompress(cinfo);
+        errno = EINVAL;
+        return -1;
+    }
+
+    jpeg_mem_src(cinfo, jpeg, size);
+    if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK)
+        longjmp(d->fail, 1);
+
+    cinfo->out_color_space = JCS_RGB;
+
+    jpeg_start_decompress(cinfo);
+    if (cinfo->output_width != width || cinfo->output_height != height || cinfo->output_components != 3)
+        longjmp(d->fail, 1);
+
+    while (cinfo->output_scanline < cinfo->output_height)
+    {
+        row = rgb + (size_t)cinfo->output_scanline * width * 3;
+        jpeg_read_scanlines(cinfo, &row, 1);
+    }
+
+    jpeg_finish_decompress(cinfo);
+    return 0;
+}
+
+#else /* !HAVE_LIBJPEG */
+
+struct mjpeg_decoder *mjpeg_decoder_create(void)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void mjpeg_decoder_destroy(struct mjpeg_decoder *d)
+{
+    (void)d;
+}
+
+int mjpeg_decode_rgb24(struct mjpeg_decoder *d, const unsigned char *jpeg, size_t size,
+                       unsigned char *rgb, unsigned int width, unsigned int height)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+#endif /* HAVE_LIBJPEG */
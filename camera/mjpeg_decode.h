@@ -0,0 +1,30 @@
+/*
+ * Filename   : mjpeg_decode.h
+ *
+ * Description: MJPEG frame decoder for consumers that need pixels
+ *            : Wraps libjpeg(-turbo), whose SIMD IDCT and colour conversion
+ *            : do the work. One decoder per thread; a decoder reuses its
+ *            : libjpeg state across frames. Built only with HAVE_LIBJPEG,
+ *            : without it mjpeg_decoder_create() fails with ENOSYS.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+#ifndef MJPEG_DECODE_H
+#define MJPEG_DECODE_H
+
+#include <stddef.h>
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+struct mjpeg_decoder;
+
+struct mjpeg_decoder *mjpeg_decoder_create(void);
+void mjpeg_decoder_destroy(struct mjpeg_decoder *d);
+
+int mjpeg_decode_rgb24(struct mjpeg_decoder *d, const unsigned char *jpeg, size_t size,
+                       unsigned char *rgb, unsigned int width, unsigned int height);
+
+#endif /* MJPEG_DECODE_H */
@@ -0,0 +1,114 @@
+/*
+ * Filename   : stream_tool.c
+ *
+ * Description: Lists and extracts frames from capture's container segments
+ *            : Code Flow:
+ *            : 1) Open the .frm segment, map its .idx
+ *            : 2) No frame number: print the header and every index entry
+ *            : 3) Frame number: one pread of that record to a file or stdout
+ *            : An extracted record is the same PPM / JPEG capture would have
+ *            : written as its own file.
+ *
+ * Author     : Swathi Venkatachalam
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <errno.h>
+
+#include "frame_stream.h"
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+static void errno_exit(const char *s)
+{
+        fprintf(stderr, "%s error %d, %s\n", s, errno, strerror(errno));
+        exit(EXIT_FAILURE);
+}
+
+// Header and index of a segment, one line per record
+static void list_segment(const struct stream_reader *r)
+{
+    const struct stream_file_header *h = &r->header;
+    unsigned int i, valid = 0;
+
+    printf("segment %u: %ux%u %.4s, %u records of %u bytes\n", h->segment, h->width, h->height,
+           (const char *)&h->pixelformat, h->capacity, h->record_size);
+
+    for (i = 0; i < r->count; i++)
+    {
+        const struct stream_index_entry *e = &r->index[i];
+
+        if (!(e->flags & STREAM_ENTRY_VALID))
+        {
+            printf("%6u  missing\n", i);
+            continue;
+        }
+        valid++;
+        printf("%6u  frame %8u  seq %8u  %10llu.%06llu s  %u bytes at %llu\n", i, e->tag, e->sequence,
+               (unsigned long long)(e->capture_ns / 1000000000ULL),
+               (unsigned long long)(e->capture_ns % 1000000000ULL / 1000),
+               e->length, (unsigned long long)e->offset);
+    }
+    printf("%u of %u records valid\n", valid, r->count);
+}
+
+int main(int argc, char **argv)
+{
+    struct stream_reader *r;
+    unsigned char *buf;
+    unsigned int i;
+    ssize_t n;
+    FILE *out = stdout;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s segment.frm [record [output]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    r = stream_reader_open(argv[1]);
+    if (!r)
+        errno_exit(argv[1]);
+
+    if (argc == 2)
+    {
+        list_segment(r);
+        stream_reader_close(r);
+        return EXIT_SUCCESS;
+    }
+
+    i = strtoul(argv[2], NULL, 0);
+    buf = malloc(r->header.record_size);
+    if (!buf)
+        errno_exit("malloc");
+
+    n = stream_reader_frame(r, i, buf, r->header.record_size);
+    if (n == -1)
+        errno_exit(argv[2]);
+
+    if (argc > 3)
+    {
+        out = fopen(argv[3], "wb");
+        if (!out)
+            errno_exit(argv[3]);
+    }
+    if (fwrite(buf, 1, n, out) != (size_t)n)
+        errno_exit("fwrite");
+    if (out != stdout)
+        fclose(out);
+
+    free(buf);
+    stream_reader_close(r);
+    return EXIT_SUCCESS;
+}
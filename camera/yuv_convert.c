@@ -0,0 +1,2222 @@
+/*
+ * Filename   : yuv_convert.c
+ *
+ * Description: YUYV to RGB24 conversion kernels with runtime CPU dispatch
+ *            : 1) Scalar reference (yuv2rgb per pixel)
+ *            : 2) SSE2 kernel, 8 macropixels per iteration
+ *            : 3) AVX2 kernel, 16 macropixels per iteration
+ *            : 4) NEON kernel, 8 macropixels per iteration
+ *            : 5) Table kernel, per-Y/U/V contribution tables and a clamp
+ *            :    table, no multiplies or compares, chroma looked up once
+ *            :    per macropixel
+ *            : Vector kernels keep all products in 32-bit lanes and clip with
+ *            : saturating packs, so every output byte matches yuv2rgb().
+ *            : Luma-only kernels mask the Y bytes and pack them down (x86) or
+ *            : deinterleave with vld2 (NEON); no arithmetic at all.
+ *            : Luma SAD kernels (motion detection) mask out chroma and use
+ *            : psadbw (x86) or vabd + pairwise adds (NEON) per 16-pixel block.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : http://en.wikipedia.org/wiki/YUV
+ *            : https://software.intel.com/sites/landingpage/IntrinsicsGuide/
+ *            : https://developer.arm.com/architectures/instruction-sets/intrinsics/
+ */
+
+
+/*************************************************************************
+ *                            Header Files                               *
+ *************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "yuv_convert.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define YUV_HAVE_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define YUV_HAVE_NEON
+#include <arm_neon.h>
+#if defined(__arm__)
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#endif
+#endif
+
+/*************************************************************************
+ *                  Global Variables                                     *
+ *************************************************************************/
+
+static enum yuv_kernel  active_kernel = YUV_KERNEL_SCALAR;
+static yuyv_convert_fn  active_fn     = yuyv_to_rgb24_scalar;
+static yuyv_luma_fn     active_luma_fn = yuyv_to_luma_scalar;
+static yuyv_sad_fn      active_sad_fn  = yuyv_luma_sad_scalar;
+static yuyv_planar_fn   active_nv12_fn;         // set with the others, scalar until then
+static size_t           prefetch_distance;      // source bytes the vector loops prefetch ahead, 0 = off
+static int              stream_loads = -1;      // SSE4.1 movntdqa usable, -1 until checked
+
+static const char *kernel_names[] = { "auto", "scalar", "sse2", "avx2", "neon", "lut" };
+static const char *output_names[] = { "rgb24", "bgr24", "rgba", "bgra", "nv12", "i420" };
+
+// yuv2rgb() split into table lookups, filled by lut_init()
+#define LUT_CLAMP_BIAS  384             // (Y + chroma) >> 8 spans -277..534
+static int              lut_y[256];     // 298 * (y - 16) + 128, rounding folded in
+static int              lut_rv[256];    // 409 * (v - 128)
+static int              lut_gu[256];    // -100 * (u - 128)
+static int              lut_gv[256];    // -208 * (v - 128)
+static int              lut_bu[256];    // 516 * (u - 128)
+static unsigned char    lut_clamp[1024];
+static int              lut_ready;
+
+/*************************************************************************
+ *                     Scalar Reference Conversion                       *
+ *************************************************************************/
+
+// This is probably the most acceptable conversion from camera YUYV to RGB
+//
+// Wikipedia has a good discussion on the details of various conversions and cites good references:
+// http://en.wikipedia.org/wiki/YUV
+//
+// Also http://www.fourcc.org/yuv.php
+//
+// What's not clear without knowing more about the camera in question is how often U & V are sampled compared
+// to Y.
+//
+// E.g. YUV444, which is equivalent to RGB, where both require 3 bytes for each pixel
+//      YUV422, which we assume here, where there are 2 bytes for each pixel, with two Y samples for one U & V,
+//              or as the name implies, 4Y and 2 UV pairs
+//      YUV420, where for every 4 Ys, there is a single UV pair, 1.5 bytes for each pixel or 36 bytes for 24 pixels
+
+/**
+ * @name   yuv2rgb
+ * @brief  Converts one YUV sample to one RGB pixel
+ * @param  y, u, v - input samples
+ *         r, g, b - ptrs to output channels
+ *
+ * @descr  Integer approximation of BT.601 studio swing conversion
+ *         This is the reference every vector kernel must match bit for bit
+ *
+ * @return none
+ */
+
+void yuv2rgb(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b)
+{
+   int r1, g1, b1;
+
+   // replaces floating point coefficients
+   int c = y-16, d = u - 128, e = v - 128;
+
+   // Conversion that avoids floating point
+   r1 = (298 * c           + 409 * e + 128) >> 8;
+   g1 = (298 * c - 100 * d - 208 * e + 128) >> 8;
+   b1 = (298 * c + 516 * d           + 128) >> 8;
+
+   // Computed values may need clipping.
+   if (r1 > 255) r1 = 255;
+   if (g1 > 255) g1 = 255;
+   if (b1 > 255) b1 = 255;
+
+   if (r1 < 0) r1 = 0;
+   if (g1 < 0) g1 = 0;
+   if (b1 < 0) b1 = 0;
+
+   *r = r1 ;
+   *g = g1 ;
+   *b = b1 ;
+}
+
+/**
+ * @name   yuyv_to_rgb24_scalar
+ * @brief  Converts a YUYV buffer to RGB24 one macropixel at a time
+ * @param  src  - YUYV input
+ *         dst  - RGB24 output, (size*6)/4 bytes
+ *         size - input bytes, trailing partial macropixel ignored
+ *
+ * @descr  Pixels are YU and YV alternating, so YUYV which is 4 bytes
+ *         We want RGB, so RGBRGB which is 6 bytes
+ *         Also used by the vector kernels to finish the tail of a frame
+ *
+ * @return none
+ */
+
+void yuyv_to_rgb24_scalar(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    size_t i, newi;
+
+    for (i = 0, newi = 0; i + 4 <= size; i = i + 4, newi = newi + 6)
+    {
+        yuv2rgb(src[i],   src[i+1], src[i+3], &dst[newi],   &dst[newi+1], &dst[newi+2]);
+        yuv2rgb(src[i+2], src[i+1], src[i+3], &dst[newi+3], &dst[newi+4], &dst[newi+5]);
+    }
+}
+
+/**
+ * @name   yuyv_to_luma_scalar
+ * @brief  Copies the Y bytes of a YUYV buffer into a grayscale plane
+ * @param  src  - YUYV input
+ *         dst  - 8-bit luma output, size/2 bytes
+ *         size - input bytes, trailing partial macropixel ignored
+ *
+ * @descr  Y is every even byte; Y0 and Y1 of a macropixel are both kept
+ *
+ * @return none
+ */
+
+void yuyv_to_luma_scalar(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    size_t i;
+
+    size &= ~(size_t)3;
+    for (i = 0; i < size; i += 2)
+        dst[i / 2] = src[i];
+}
+
+/**
+ * @name   yuyv_luma_sad_scalar
+ * @brief  Adds the luma SAD of each 16-pixel block of two YUYV rows to acc
+ * @param  a, b   - YUYV rows, blocks * 32 bytes each
+ *         blocks - number of 16-pixel blocks
+ *         acc    - one running sum per block
+ *
+ * @descr  Only Y bytes are compared, chroma is ignored
+ *
+ * @return none
+ */
+
+void yuyv_luma_sad_scalar(const unsigned char *a, const unsigned char *b, unsigned int blocks, unsigned int *acc)
+{
+    unsigned int k, i;
+
+    for (k = 0; k < blocks; k++, a += YUYV_SAD_BLOCK * 2, b += YUYV_SAD_BLOCK * 2)
+        for (i = 0; i < YUYV_SAD_BLOCK * 2; i += 2)
+            acc[k] += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+}
+
+// Macropixels to convert before dst + k * out_mp is align-byte aligned, -1 if it never is
+static inline int stream_head(const unsigned char *dst, size_t out_mp, size_t align)
+{
+    size_t k;
+
+    for (k = 0; k < align; k++)
+        if (((uintptr_t)(dst + k * out_mp) & (align - 1)) == 0)
+            return (int)k;
+
+    return -1;
+}
+
+/**
+ * @name   yuyv_to_packed_scalar
+ * @brief  Converts a YUYV buffer to any packed layout one macropixel at a time
+ * @param  src  - YUYV input
+ *         dst  - size/2 pixels of out
+ *         size - input bytes, trailing partial macropixel ignored
+ *         out  - packed layout, a constant in each caller
+ *
+ * @descr  Same yuv2rgb() as yuyv_to_rgb24_scalar(), only the byte each
+ *         channel lands in changes; also the head and tail of the vector kernels
+ *
+ * @return none
+ */
+
+static inline void yuyv_to_packed_scalar(const unsigned char *src, unsigned char *dst, size_t size,
+                                         enum yuv_output out)
+{
+    const int bgr = out == YUV_OUTPUT_BGR24 || out == YUV_OUTPUT_BGRA;
+    const size_t bytes = out == YUV_OUTPUT_RGBA || out == YUV_OUTPUT_BGRA ? 4 : 3;
+    unsigned char *r = dst + (bgr ? 2 : 0), *b = dst + (bgr ? 0 : 2);
+    size_t i, o;
+
+    for (i = 0, o = 0; i + 4 <= size; i += 4, o += 2 * bytes)
+    {
+        yuv2rgb(src[i],   src[i+1], src[i+3], &r[o],         &dst[o + 1],         &b[o]);
+        yuv2rgb(src[i+2], src[i+1], src[i+3], &r[o + bytes], &dst[o + bytes + 1], &b[o + bytes]);
+        if (bytes == 4)
+            dst[o + 3] = dst[o + 7] = 255;
+    }
+}
+
+static void yuyv_to_bgr24_scalar(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_scalar(src, dst, size, YUV_OUTPUT_BGR24);
+}
+
+static void yuyv_to_rgba_scalar(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_scalar(src, dst, size, YUV_OUTPUT_RGBA);
+}
+
+static void yuyv_to_bgra_scalar(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_scalar(src, dst, size, YUV_OUTPUT_BGRA);
+}
+
+/**
+ * @name   yuyv_to_planar_scalar
+ * @brief  Converts two YUYV lines to their Y lines and one 4:2:0 chroma line
+ * @param  a, b, ya, yb, u, v, width - as yuyv_planar_fn, width even
+ *         out - YUV_OUTPUT_NV12 or YUV_OUTPUT_I420, a constant in each caller
+ *
+ * @descr  Each chroma sample is the rounded mean of the two lines it covers,
+ *         (a + b + 1) >> 1, which is also what pavgb / vrhadd compute
+ *
+ * @return none
+ */
+
+static inline void yuyv_to_planar_scalar(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                         unsigned char *yb, unsigned char *u, unsigned char *v,
+                                         unsigned int width, enum yuv_output out)
+{
+    unsigned int m;
+
+    for (m = 0; m < width / 2; m++)
+    {
+        unsigned char cu = (a[4*m + 1] + b[4*m + 1] + 1) >> 1;
+        unsigned char cv = (a[4*m + 3] + b[4*m + 3] + 1) >> 1;
+
+        ya[2*m]     = a[4*m];
+        ya[2*m + 1] = a[4*m + 2];
+        yb[2*m]     = b[4*m];
+        yb[2*m + 1] = b[4*m + 2];
+        if (out == YUV_OUTPUT_NV12)
+        {
+            u[2*m]     = cu;
+            u[2*m + 1] = cv;
+        }
+        else
+        {
+            u[m] = cu;
+            v[m] = cv;
+        }
+    }
+}
+
+static void yuyv_to_nv12_rows_scalar(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                     unsigned char *yb, unsigned char *u, unsigned char *v, unsigned int width)
+{
+    yuyv_to_planar_scalar(a, b, ya, yb, u, v, width, YUV_OUTPUT_NV12);
+}
+
+static void yuyv_to_i420_rows_scalar(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                     unsigned char *yb, unsigned char *u, unsigned char *v, unsigned int width)
+{
+    yuyv_to_planar_scalar(a, b, ya, yb, u, v, width, YUV_OUTPUT_I420);
+}
+
+/*************************************************************************
+ *                     Table Driven Conversion Kernel                    *
+ *************************************************************************/
+
+// Builds the tables once; called by yuv_kernel_fn before the kernel is handed out
+static void lut_init(void)
+{
+    int i;
+
+    if (lut_ready)
+        return;
+
+    for (i = 0; i < 256; i++)
+    {
+        lut_y[i]  = 298 * (i - 16) + 128;
+        lut_rv[i] = 409 * (i - 128);
+        lut_gu[i] = -100 * (i - 128);
+        lut_gv[i] = -208 * (i - 128);
+        lut_bu[i] = 516 * (i - 128);
+    }
+    for (i = 0; i < 1024; i++)
+        lut_clamp[i] = i < LUT_CLAMP_BIAS ? 0 : i - LUT_CLAMP_BIAS > 255 ? 255 : i - LUT_CLAMP_BIAS;
+
+    lut_ready = 1;
+}
+
+/**
+ * @name   yuyv_to_rgb24_lut
+ * @brief  Converts a YUYV buffer to RGB24 with table lookups
+ * @param  src  - YUYV input
+ *         dst  - RGB24 output, (size*6)/4 bytes
+ *         size - input bytes, trailing partial macropixel ignored
+ *
+ * @descr  Same sums as yuv2rgb(), so bit-exact with it: each term comes
+ *         from a table and the result is clipped through lut_clamp
+ *         The three chroma terms are shared by both pixels of a macropixel
+ *         Tables are about 6 KB, so they stay in L1 on small cores
+ *
+ * @return none
+ */
+
+void yuyv_to_rgb24_lut(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    const unsigned char *clamp = lut_clamp + LUT_CLAMP_BIAS;
+    size_t i;
+
+    for (i = 0; i + 4 <= size; i += 4, dst += 6)
+    {
+        int y0 = lut_y[src[i]], y1 = lut_y[src[i+2]];
+        int rv = lut_rv[src[i+3]];
+        int guv = lut_gu[src[i+1]] + lut_gv[src[i+3]];
+        int bu = lut_bu[src[i+1]];
+
+        dst[0] = clamp[(y0 + rv) >> 8];
+        dst[1] = clamp[(y0 + guv) >> 8];
+        dst[2] = clamp[(y0 + bu) >> 8];
+        dst[3] = clamp[(y1 + rv) >> 8];
+        dst[4] = clamp[(y1 + guv) >> 8];
+        dst[5] = clamp[(y1 + bu) >> 8];
+    }
+}
+
+#if defined(YUV_HAVE_X86)
+
+/*************************************************************************
+ *                       SSE2 Conversion Kernel                          *
+ *************************************************************************/
+
+// Convert 8 pixels (4 macropixels, 16 bytes YUYV) to saturated int16 R, G, B
+__attribute__((target("sse2")))
+static inline void sse2_half(__m128i x, __m128i *r, __m128i *g, __m128i *b)
+{
+    const __m128i coef_r = _mm_set_epi16(409, 0, 409, 0, 409, 0, 409, 0);
+    const __m128i coef_g = _mm_set_epi16(-208, -100, -208, -100, -208, -100, -208, -100);
+    const __m128i coef_b = _mm_set_epi16(0, 516, 0, 516, 0, 516, 0, 516);
+    const __m128i round  = _mm_set1_epi32(128);
+    __m128i c, de, yl, yh, y_lo, y_hi, cr, cg, cb;
+
+    c  = _mm_sub_epi16(_mm_and_si128(x, _mm_set1_epi16(0x00FF)), _mm_set1_epi16(16));  // Y - 16 per pixel
+    de = _mm_sub_epi16(_mm_srli_epi16(x, 8), _mm_set1_epi16(128));                      // U - 128, V - 128 pairs
+
+    // 298 * c needs 18 bits, so widen through the 16x16 -> 32 product halves
+    yl   = _mm_mullo_epi16(c, _mm_set1_epi16(298));
+    yh   = _mm_mulhi_epi16(c, _mm_set1_epi16(298));
+    y_lo = _mm_unpacklo_epi16(yl, yh);   // pixels 0..3
+    y_hi = _mm_unpackhi_epi16(yl, yh);   // pixels 4..7
+
+    // Chroma contributions per macropixel, rounding constant folded in
+    cr = _mm_add_epi32(_mm_madd_epi16(de, coef_r), round);
+    cg = _mm_add_epi32(_mm_madd_epi16(de, coef_g), round);
+    cb = _mm_add_epi32(_mm_madd_epi16(de, coef_b), round);
+
+    // Each macropixel term is shared by two neighbouring pixels
+#define SSE2_CHANNEL(t) _mm_packs_epi32( \
+        _mm_srai_epi32(_mm_add_epi32(y_lo, _mm_shuffle_epi32(t, _MM_SHUFFLE(1, 1, 0, 0))), 8), \
+        _mm_srai_epi32(_mm_add_epi32(y_hi, _mm_shuffle_epi32(t, _MM_SHUFFLE(3, 3, 2, 2))), 8))
+
+    *r = SSE2_CHANNEL(cr);
+    *g = SSE2_CHANNEL(cg);
+    *b = SSE2_CHANNEL(cb);
+
+#undef SSE2_CHANNEL
+}
+
+// Squeeze 4 RGB0 pixels into 12 contiguous RGB bytes (upper 4 bytes zero)
+__attribute__((target("sse2")))
+static inline __m128i sse2_pack12(__m128i v)
+{
+    const __m128i keep_p0 = _mm_set_epi32(0, 0x00FFFFFF, 0, 0x00FFFFFF);
+    const __m128i keep_p1 = _mm_set_epi32(0x0000FFFF, (int)0xFF000000, 0x0000FFFF, (int)0xFF000000);
+    const __m128i keep_lo = _mm_set_epi32(0, 0, 0x0000FFFF, (int)0xFFFFFFFF);
+    const __m128i keep_hi = _mm_set_epi32(0, (int)0xFFFFFFFF, (int)0xFFFF0000, 0);
+    __m128i x;
+
+    // 6 bytes per 64-bit lane, then close the 2 byte gap between lanes
+    x = _mm_or_si128(_mm_and_si128(v, keep_p0), _mm_and_si128(_mm_srli_epi64(v, 8), keep_p1));
+    return _mm_or_si128(_mm_and_si128(x, keep_lo), _mm_and_si128(_mm_srli_si128(x, 2), keep_hi));
+}
+
+// Interleave 16 R, G, B bytes into 48 bytes of RGB24; writes 4 bytes past the end
+__attribute__((target("sse2")))
+static inline void sse2_store_rgb24(__m128i r, __m128i g, __m128i b, unsigned char *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+    __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+    __m128i b0_lo = _mm_unpacklo_epi8(b, zero);
+    __m128i b0_hi = _mm_unpackhi_epi8(b, zero);
+
+    // Stores must go in ascending order so each overrun is overwritten by the next
+    _mm_storeu_si128((__m128i *)(dst),      sse2_pack12(_mm_unpacklo_epi16(rg_lo, b0_lo)));
+    _mm_storeu_si128((__m128i *)(dst + 12), sse2_pack12(_mm_unpackhi_epi16(rg_lo, b0_lo)));
+    _mm_storeu_si128((__m128i *)(dst + 24), sse2_pack12(_mm_unpacklo_epi16(rg_hi, b0_hi)));
+    _mm_storeu_si128((__m128i *)(dst + 36), sse2_pack12(_mm_unpackhi_epi16(rg_hi, b0_hi)));
+}
+
+// Four 12-byte groups from sse2_pack12 joined into three 16-byte streaming stores, dst aligned
+__attribute__((target("sse2")))
+static inline void sse2_stream48(__m128i p0, __m128i p1, __m128i p2, __m128i p3, unsigned char *dst)
+{
+    _mm_stream_si128((__m128i *)(dst),      _mm_or_si128(p0, _mm_slli_si128(p1, 12)));
+    _mm_stream_si128((__m128i *)(dst + 16), _mm_or_si128(_mm_srli_si128(p1, 4), _mm_slli_si128(p2, 8)));
+    _mm_stream_si128((__m128i *)(dst + 32), _mm_or_si128(_mm_srli_si128(p2, 8), _mm_slli_si128(p3, 4)));
+}
+
+// As sse2_store_rgb24 but non-temporal, which can't overlap: no overrun, dst 16-byte aligned
+__attribute__((target("sse2")))
+static inline void sse2_stream_rgb24(__m128i r, __m128i g, __m128i b, unsigned char *dst)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+    __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+    __m128i b0_lo = _mm_unpacklo_epi8(b, zero);
+    __m128i b0_hi = _mm_unpackhi_epi8(b, zero);
+
+    sse2_stream48(sse2_pack12(_mm_unpacklo_epi16(rg_lo, b0_lo)), sse2_pack12(_mm_unpackhi_epi16(rg_lo, b0_lo)),
+                  sse2_pack12(_mm_unpacklo_epi16(rg_hi, b0_hi)), sse2_pack12(_mm_unpackhi_epi16(rg_hi, b0_hi)), dst);
+}
+
+// Non-temporal stores go around the cache, straight to memory; they need dst 16-byte aligned
+__attribute__((target("sse2")))
+static inline void sse2_put(unsigned char *dst, __m128i v, int nt)
+{
+    if (nt)
+        _mm_stream_si128((__m128i *)dst, v);
+    else
+        _mm_storeu_si128((__m128i *)dst, v);
+}
+
+// Interleave 16 of each channel with alpha 255 into 64 bytes; x0 lands first, so RGBA or BGRA
+__attribute__((target("sse2")))
+static inline void sse2_store_rgba(__m128i x0, __m128i x1, __m128i x2, unsigned char *dst, int nt)
+{
+    const __m128i alpha = _mm_set1_epi8((char)0xFF);
+    __m128i c01_lo = _mm_unpacklo_epi8(x0, x1);
+    __m128i c01_hi = _mm_unpackhi_epi8(x0, x1);
+    __m128i c2a_lo = _mm_unpacklo_epi8(x2, alpha);
+    __m128i c2a_hi = _mm_unpackhi_epi8(x2, alpha);
+
+    sse2_put(dst,      _mm_unpacklo_epi16(c01_lo, c2a_lo), nt);
+    sse2_put(dst + 16, _mm_unpackhi_epi16(c01_lo, c2a_lo), nt);
+    sse2_put(dst + 32, _mm_unpacklo_epi16(c01_hi, c2a_hi), nt);
+    sse2_put(dst + 48, _mm_unpackhi_epi16(c01_hi, c2a_hi), nt);
+}
+
+// Convert 8 macropixels (32 bytes YUYV) to 16 bytes each of R, G and B
+__attribute__((target("sse2")))
+static inline void sse2_rgb(const unsigned char *src, __m128i *r, __m128i *g, __m128i *b)
+{
+    __m128i ra, ga, ba, rb, gb, bb;
+
+    sse2_half(_mm_loadu_si128((const __m128i *)src), &ra, &ga, &ba);
+    sse2_half(_mm_loadu_si128((const __m128i *)(src + 16)), &rb, &gb, &bb);
+
+    *r = _mm_packus_epi16(ra, rb);
+    *g = _mm_packus_epi16(ga, gb);
+    *b = _mm_packus_epi16(ba, bb);
+}
+
+// Convert 8 macropixels (32 bytes YUYV) to 48 bytes RGB24
+__attribute__((target("sse2")))
+static inline void sse2_block(const unsigned char *src, unsigned char *dst)
+{
+    __m128i r, g, b;
+
+    sse2_rgb(src, &r, &g, &b);
+    sse2_store_rgb24(r, g, b, dst);
+}
+
+/**
+ * @name   yuyv_to_rgb24_sse2
+ * @brief  SSE2 YUYV to RGB24 conversion
+ * @param  src, dst, size - as yuyv_to_rgb24_scalar
+ *
+ * @descr  Vector loop only runs while at least one macropixel remains after
+ *         the block, so the 4 byte store overrun always lands inside dst
+ *         Remaining macropixels go through the scalar path
+ *         With yuv_set_prefetch() the source is prefetched ahead, bypassing
+ *         as much of the cache as the CPU allows since it is read only once
+ *
+ * @return none
+ */
+
+__attribute__((target("sse2")))
+static void yuyv_to_rgb24_sse2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    const size_t distance = prefetch_distance;
+    size_t i = 0, newi = 0;
+
+    size &= ~(size_t)3;
+    for (; i + 32 < size; i += 32, newi += 48)
+    {
+        if (distance)
+            _mm_prefetch((const char *)(src + i + distance), _MM_HINT_NTA);
+        sse2_block(src + i, dst + newi);
+    }
+
+    yuyv_to_rgb24_scalar(src + i, dst + newi, size - i);
+}
+
+/**
+ * @name   yuyv_to_packed_sse2
+ * @brief  SSE2 YUYV to packed layout conversion, optionally with streaming stores
+ * @param  src, dst, size, out - as yuyv_to_packed_scalar
+ *         nt                  - non-temporal stores, a constant in each caller
+ *
+ * @descr  The RGB24 arithmetic, then a store per layout: BGR24 swaps the
+ *         channels going into the 24-bit store, so it keeps its overrun
+ *         rule; the 32-bit stores are exact and run to the last block
+ *         Streaming stores skip the cache for output only a sink will read;
+ *         they start after a scalar head at the first 16-byte aligned
+ *         block, and are fenced so they are done before the frame moves on
+ *
+ * @return none
+ */
+
+__attribute__((target("sse2")))
+static inline void yuyv_to_packed_sse2(const unsigned char *src, unsigned char *dst, size_t size,
+                                       enum yuv_output out, int nt)
+{
+    const int rgb24 = out == YUV_OUTPUT_RGB24 || out == YUV_OUTPUT_BGR24;
+    const int swap = out == YUV_OUTPUT_BGR24 || out == YUV_OUTPUT_BGRA;
+    const size_t bytes = rgb24 ? 48 : 64;   // output per block
+    const size_t distance = prefetch_distance;
+    size_t i = 0, newi = 0, spare;
+    __m128i r, g, b, t;
+
+    size &= ~(size_t)3;
+    if (nt)
+    {
+        int head = stream_head(dst, bytes / 8, 16);
+
+        if (head < 0)
+            nt = 0;         // odd dst, no block ever lines up
+        else
+        {
+            i = (size_t)head * 4 < size ? (size_t)head * 4 : size;
+            newi = i / 4 * (bytes / 8);
+            yuyv_to_packed_scalar(src, dst, i, out);
+        }
+    }
+    spare = rgb24 && !nt ? 4 : 0;           // the cached 24-bit store writes 4 bytes past its block
+
+    for (; i + 32 + spare <= size; i += 32, newi += bytes)
+    {
+        if (distance)
+            _mm_prefetch((const char *)(src + i + distance), _MM_HINT_NTA);
+        sse2_rgb(src + i, &r, &g, &b);
+        if (swap)
+        {
+            t = r;
+            r = b;
+            b = t;
+        }
+
+        if (rgb24 && nt)
+            sse2_stream_rgb24(r, g, b, dst + newi);
+        else if (rgb24)
+            sse2_store_rgb24(r, g, b, dst + newi);
+        else
+            sse2_store_rgba(r, g, b, dst + newi, nt);
+    }
+    if (nt)
+        _mm_sfence();
+
+    yuyv_to_packed_scalar(src + i, dst + newi, size - i, out);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_bgr24_sse2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_sse2(src, dst, size, YUV_OUTPUT_BGR24, 0);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_rgba_sse2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_sse2(src, dst, size, YUV_OUTPUT_RGBA, 0);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_bgra_sse2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_sse2(src, dst, size, YUV_OUTPUT_BGRA, 0);
+}
+
+// Streaming store variants, see yuv_kernel_stream_fn
+__attribute__((target("sse2")))
+static void yuyv_to_rgb24_sse2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_sse2(src, dst, size, YUV_OUTPUT_RGB24, 1);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_bgr24_sse2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_sse2(src, dst, size, YUV_OUTPUT_BGR24, 1);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_rgba_sse2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_sse2(src, dst, size, YUV_OUTPUT_RGBA, 1);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_bgra_sse2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_sse2(src, dst, size, YUV_OUTPUT_BGRA, 1);
+}
+
+/**
+ * @name   yuyv_to_planar_sse2
+ * @brief  SSE2 two-line YUYV to NV12 or I420 conversion
+ * @param  a, b, ya, yb, u, v, width, out - as yuyv_to_planar_scalar
+ *
+ * @descr  Per 16 pixels: each line's Y bytes are masked and packed as in
+ *         the luma kernel; pavgb of the two lines is the rounded chroma
+ *         mean, shifted down and packed it is already NV12's UV order.
+ *         I420 splits the U / V words apart before packing them to bytes
+ *
+ * @return none
+ */
+
+__attribute__((target("sse2")))
+static inline void yuyv_to_planar_sse2(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                       unsigned char *yb, unsigned char *u, unsigned char *v,
+                                       unsigned int width, enum yuv_output out)
+{
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    const __m128i low  = _mm_set1_epi32(0xFFFF);
+    const size_t distance = prefetch_distance;
+    size_t i = 0, size = (size_t)(width & ~1u) * 2;
+
+    for (; i + 32 <= size; i += 32)
+    {
+        __m128i a0 = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i a1 = _mm_loadu_si128((const __m128i *)(a + i + 16));
+        __m128i b0 = _mm_loadu_si128((const __m128i *)(b + i));
+        __m128i b1 = _mm_loadu_si128((const __m128i *)(b + i + 16));
+        __m128i c0 = _mm_srli_epi16(_mm_avg_epu8(a0, b0), 8);
+        __m128i c1 = _mm_srli_epi16(_mm_avg_epu8(a1, b1), 8);
+
+        _mm_storeu_si128((__m128i *)(ya + i / 2), _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(a1, mask)));
+        _mm_storeu_si128((__m128i *)(yb + i / 2), _mm_packus_epi16(_mm_and_si128(b0, mask), _mm_and_si128(b1, mask)));
+
+        if (out == YUV_OUTPUT_NV12)
+            _mm_storeu_si128((__m128i *)(u + i / 2), _mm_packus_epi16(c0, c1));
+        else
+        {
+            __m128i cu = _mm_packs_epi32(_mm_and_si128(c0, low), _mm_and_si128(c1, low));
+            __m128i cv = _mm_packs_epi32(_mm_srli_epi32(c0, 16), _mm_srli_epi32(c1, 16));
+
+            _mm_storel_epi64((__m128i *)(u + i / 4), _mm_packus_epi16(cu, cu));
+            _mm_storel_epi64((__m128i *)(v + i / 4), _mm_packus_epi16(cv, cv));
+        }
+
+        if (distance)
+        {
+            _mm_prefetch((const char *)(a + i + distance), _MM_HINT_NTA);
+            _mm_prefetch((const char *)(b + i + distance), _MM_HINT_NTA);
+        }
+    }
+
+    if (out == YUV_OUTPUT_NV12)
+        yuyv_to_planar_scalar(a + i, b + i, ya + i / 2, yb + i / 2, u + i / 2, v, (size - i) / 2, out);
+    else
+        yuyv_to_planar_scalar(a + i, b + i, ya + i / 2, yb + i / 2, u + i / 4, v + i / 4, (size - i) / 2, out);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_nv12_rows_sse2(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                   unsigned char *yb, unsigned char *u, unsigned char *v, unsigned int width)
+{
+    yuyv_to_planar_sse2(a, b, ya, yb, u, v, width, YUV_OUTPUT_NV12);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_i420_rows_sse2(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                   unsigned char *yb, unsigned char *u, unsigned char *v, unsigned int width)
+{
+    yuyv_to_planar_sse2(a, b, ya, yb, u, v, width, YUV_OUTPUT_I420);
+}
+
+// 16 Y bytes per 32 input bytes: keep the low byte of every 16-bit word, pack unsigned
+// Streaming stores as in yuyv_to_packed_sse2, from the first 16-byte aligned block
+__attribute__((target("sse2")))
+static inline void yuyv_luma_sse2(const unsigned char *src, unsigned char *dst, size_t size, int nt)
+{
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    const size_t distance = prefetch_distance;
+    size_t i = 0;
+
+    size &= ~(size_t)3;
+    if (nt)
+    {
+        int head = stream_head(dst, 2, 16);
+
+        if (head < 0)
+            nt = 0;
+        else
+        {
+            i = (size_t)head * 4 < size ? (size_t)head * 4 : size;
+            yuyv_to_luma_scalar(src, dst, i);
+        }
+    }
+
+    for (; i + 32 <= size; i += 32)
+    {
+        __m128i a, b;
+
+        if (distance)
+            _mm_prefetch((const char *)(src + i + distance), _MM_HINT_NTA);
+        a = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i)), mask);
+        b = _mm_and_si128(_mm_loadu_si128((const __m128i *)(src + i + 16)), mask);
+
+        sse2_put(dst + i / 2, _mm_packus_epi16(a, b), nt);
+    }
+    if (nt)
+        _mm_sfence();
+
+    yuyv_to_luma_scalar(src + i, dst + i / 2, size - i);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_luma_sse2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_luma_sse2(src, dst, size, 0);
+}
+
+__attribute__((target("sse2")))
+static void yuyv_to_luma_sse2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_luma_sse2(src, dst, size, 1);
+}
+
+// Chroma bytes are zeroed in both rows so psadbw sums |dY| only
+__attribute__((target("sse2")))
+static void yuyv_luma_sad_sse2(const unsigned char *a, const unsigned char *b, unsigned int blocks, unsigned int *acc)
+{
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    unsigned int k;
+
+    for (k = 0; k < blocks; k++, a += 32, b += 32)
+    {
+        __m128i s0 = _mm_sad_epu8(_mm_and_si128(_mm_loadu_si128((const __m128i *)a), mask),
+                                  _mm_and_si128(_mm_loadu_si128((const __m128i *)b), mask));
+        __m128i s1 = _mm_sad_epu8(_mm_and_si128(_mm_loadu_si128((const __m128i *)(a + 16)), mask),
+                                  _mm_and_si128(_mm_loadu_si128((const __m128i *)(b + 16)), mask));
+        __m128i sum = _mm_add_epi64(s0, s1);
+
+        acc[k] += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    }
+}
+
+/*************************************************************************
+ *                       AVX2 Conversion Kernel                          *
+ *************************************************************************/
+
+// Same arithmetic as sse2_half, on two independent 128-bit lanes
+__attribute__((target("avx2")))
+static inline void avx2_half(__m256i x, __m256i *r, __m256i *g, __m256i *b)
+{
+    const __m256i coef_r = _mm256_set1_epi32(409 << 16);
+    const __m256i coef_g = _mm256_set1_epi32((int)(0xFF30FF9C));   // (-208 << 16) | (-100 & 0xFFFF)
+    const __m256i coef_b = _mm256_set1_epi32(516);
+    const __m256i round  = _mm256_set1_epi32(128);
+    __m256i c, de, yl, yh, y_lo, y_hi, cr, cg, cb;
+
+    c  = _mm256_sub_epi16(_mm256_and_si256(x, _mm256_set1_epi16(0x00FF)), _mm256_set1_epi16(16));
+    de = _mm256_sub_epi16(_mm256_srli_epi16(x, 8), _mm256_set1_epi16(128));
+
+    yl   = _mm256_mullo_epi16(c, _mm256_set1_epi16(298));
+    yh   = _mm256_mulhi_epi16(c, _mm256_set1_epi16(298));
+    y_lo = _mm256_unpacklo_epi16(yl, yh);
+    y_hi = _mm256_unpackhi_epi16(yl, yh);
+
+    cr = _mm256_add_epi32(_mm256_madd_epi16(de, coef_r), round);
+    cg = _mm256_add_epi32(_mm256_madd_epi16(de, coef_g), round);
+    cb = _mm256_add_epi32(_mm256_madd_epi16(de, coef_b), round);
+
+#define AVX2_CHANNEL(t) _mm256_packs_epi32( \
+        _mm256_srai_epi32(_mm256_add_epi32(y_lo, _mm256_shuffle_epi32(t, _MM_SHUFFLE(1, 1, 0, 0))), 8), \
+        _mm256_srai_epi32(_mm256_add_epi32(y_hi, _mm256_shuffle_epi32(t, _MM_SHUFFLE(3, 3, 2, 2))), 8))
+
+    *r = AVX2_CHANNEL(cr);
+    *g = AVX2_CHANNEL(cg);
+    *b = AVX2_CHANNEL(cb);
+
+#undef AVX2_CHANNEL
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_pack12(__m256i v)
+{
+    const __m256i keep_p0 = _mm256_set1_epi64x(0x0000000000FFFFFFLL);
+    const __m256i keep_p1 = _mm256_set1_epi64x(0x0000FFFFFF000000LL);
+    const __m256i keep_lo = _mm256_set_epi32(0, 0, 0x0000FFFF, -1, 0, 0, 0x0000FFFF, -1);
+    const __m256i keep_hi = _mm256_set_epi32(0, -1, (int)0xFFFF0000, 0, 0, -1, (int)0xFFFF0000, 0);
+    __m256i x;
+
+    x = _mm256_or_si256(_mm256_and_si256(v, keep_p0), _mm256_and_si256(_mm256_srli_epi64(v, 8), keep_p1));
+    return _mm256_or_si256(_mm256_and_si256(x, keep_lo), _mm256_and_si256(_mm256_srli_si256(x, 2), keep_hi));
+}
+
+// Convert 16 macropixels (64 bytes YUYV) to 32 bytes each of R, G and B, in the
+// lane order packus leaves: pixels {0-7, 16-23} in the low lane, {8-15, 24-31} high
+__attribute__((target("avx2")))
+static inline void avx2_rgb(const unsigned char *src, __m256i *r, __m256i *g, __m256i *b)
+{
+    __m256i ra, ga, ba, rb, gb, bb;
+
+    avx2_half(_mm256_loadu_si256((const __m256i *)src), &ra, &ga, &ba);
+    avx2_half(_mm256_loadu_si256((const __m256i *)(src + 32)), &rb, &gb, &bb);
+
+    *r = _mm256_packus_epi16(ra, rb);
+    *g = _mm256_packus_epi16(ga, gb);
+    *b = _mm256_packus_epi16(ba, bb);
+}
+
+/**
+ * @name   avx2_store_rgb24
+ * @brief  Interleaves 32 each of R, G and B, as avx2_rgb leaves them, into 96 bytes RGB24
+ * @param  r, g, b - channels
+ *         dst     - RGB24 output, 4 bytes past the block are clobbered
+ *
+ * @descr  AVX2 packs and unpacks work per 128-bit lane, so after interleaving
+ *         each register holds pixel groups {0-3, 8-11}, {4-7, 12-15},
+ *         {16-19, 24-27} and {20-23, 28-31}; stores are issued in
+ *         ascending pixel order to keep the overrun chain intact
+ *
+ * @return none
+ */
+
+__attribute__((target("avx2")))
+static inline void avx2_store_rgb24(__m256i r, __m256i g, __m256i b, unsigned char *dst)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i rg_lo, rg_hi, b0_lo, b0_hi, v0, v1, v2, v3;
+
+    rg_lo = _mm256_unpacklo_epi8(r, g);
+    rg_hi = _mm256_unpackhi_epi8(r, g);
+    b0_lo = _mm256_unpacklo_epi8(b, zero);
+    b0_hi = _mm256_unpackhi_epi8(b, zero);
+
+    v0 = avx2_pack12(_mm256_unpacklo_epi16(rg_lo, b0_lo));
+    v1 = avx2_pack12(_mm256_unpackhi_epi16(rg_lo, b0_lo));
+    v2 = avx2_pack12(_mm256_unpacklo_epi16(rg_hi, b0_hi));
+    v3 = avx2_pack12(_mm256_unpackhi_epi16(rg_hi, b0_hi));
+
+    _mm_storeu_si128((__m128i *)(dst),      _mm256_castsi256_si128(v0));
+    _mm_storeu_si128((__m128i *)(dst + 12), _mm256_castsi256_si128(v1));
+    _mm_storeu_si128((__m128i *)(dst + 24), _mm256_extracti128_si256(v0, 1));
+    _mm_storeu_si128((__m128i *)(dst + 36), _mm256_extracti128_si256(v1, 1));
+    _mm_storeu_si128((__m128i *)(dst + 48), _mm256_castsi256_si128(v2));
+    _mm_storeu_si128((__m128i *)(dst + 60), _mm256_castsi256_si128(v3));
+    _mm_storeu_si128((__m128i *)(dst + 72), _mm256_extracti128_si256(v2, 1));
+    _mm_storeu_si128((__m128i *)(dst + 84), _mm256_extracti128_si256(v3, 1));
+}
+
+// As avx2_store_rgb24 with streaming stores, dst 16-byte aligned and nothing past the block
+__attribute__((target("avx2")))
+static inline void avx2_stream_rgb24(__m256i r, __m256i g, __m256i b, unsigned char *dst)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i rg_lo, rg_hi, b0_lo, b0_hi, v0, v1, v2, v3;
+
+    rg_lo = _mm256_unpacklo_epi8(r, g);
+    rg_hi = _mm256_unpackhi_epi8(r, g);
+    b0_lo = _mm256_unpacklo_epi8(b, zero);
+    b0_hi = _mm256_unpackhi_epi8(b, zero);
+
+    v0 = avx2_pack12(_mm256_unpacklo_epi16(rg_lo, b0_lo));
+    v1 = avx2_pack12(_mm256_unpackhi_epi16(rg_lo, b0_lo));
+    v2 = avx2_pack12(_mm256_unpacklo_epi16(rg_hi, b0_hi));
+    v3 = avx2_pack12(_mm256_unpackhi_epi16(rg_hi, b0_hi));
+
+    sse2_stream48(_mm256_castsi256_si128(v0), _mm256_castsi256_si128(v1),
+                  _mm256_extracti128_si256(v0, 1), _mm256_extracti128_si256(v1, 1), dst);
+    sse2_stream48(_mm256_castsi256_si128(v2), _mm256_castsi256_si128(v3),
+                  _mm256_extracti128_si256(v2, 1), _mm256_extracti128_si256(v3, 1), dst + 48);
+}
+
+__attribute__((target("avx2")))
+static inline void avx2_put(unsigned char *dst, __m256i v, int nt)
+{
+    if (nt)
+        _mm256_stream_si256((__m256i *)dst, v);
+    else
+        _mm256_storeu_si256((__m256i *)dst, v);
+}
+
+// 32 pixels with alpha 255, x0 first; the 128-bit permutes undo the lane order
+__attribute__((target("avx2")))
+static inline void avx2_store_rgba(__m256i x0, __m256i x1, __m256i x2, unsigned char *dst, int nt)
+{
+    const __m256i alpha = _mm256_set1_epi8((char)0xFF);
+    __m256i c01_lo = _mm256_unpacklo_epi8(x0, x1);
+    __m256i c01_hi = _mm256_unpackhi_epi8(x0, x1);
+    __m256i c2a_lo = _mm256_unpacklo_epi8(x2, alpha);
+    __m256i c2a_hi = _mm256_unpackhi_epi8(x2, alpha);
+    __m256i v0 = _mm256_unpacklo_epi16(c01_lo, c2a_lo);     // pixels 0-3, 8-11
+    __m256i v1 = _mm256_unpackhi_epi16(c01_lo, c2a_lo);     // 4-7, 12-15
+    __m256i v2 = _mm256_unpacklo_epi16(c01_hi, c2a_hi);     // 16-19, 24-27
+    __m256i v3 = _mm256_unpackhi_epi16(c01_hi, c2a_hi);     // 20-23, 28-31
+
+    avx2_put(dst,      _mm256_permute2x128_si256(v0, v1, 0x20), nt);
+    avx2_put(dst + 32, _mm256_permute2x128_si256(v0, v1, 0x31), nt);
+    avx2_put(dst + 64, _mm256_permute2x128_si256(v2, v3, 0x20), nt);
+    avx2_put(dst + 96, _mm256_permute2x128_si256(v2, v3, 0x31), nt);
+}
+
+// Converts 16 macropixels (64 bytes YUYV) to 96 bytes RGB24, clobbering 4 past the end
+__attribute__((target("avx2")))
+static inline void avx2_block(const unsigned char *src, unsigned char *dst)
+{
+    __m256i r, g, b;
+
+    avx2_rgb(src, &r, &g, &b);
+    avx2_store_rgb24(r, g, b, dst);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_rgb24_avx2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    const size_t distance = prefetch_distance;
+    size_t i = 0, newi = 0;
+
+    size &= ~(size_t)3;
+    for (; i + 64 < size; i += 64, newi += 96)
+    {
+        if (distance)
+        {
+            _mm_prefetch((const char *)(src + i + distance), _MM_HINT_NTA);
+            _mm_prefetch((const char *)(src + i + distance + 32), _MM_HINT_NTA);
+        }
+        avx2_block(src + i, dst + newi);
+    }
+
+    // AVX2 implies SSE2, finish with the narrower kernel before going scalar
+    yuyv_to_rgb24_sse2(src + i, dst + newi, size - i);
+}
+
+// As yuyv_to_packed_sse2, 32 pixels a block; streaming stores start 32-byte aligned
+// and the SSE2 tail carries on streaming from there and fences
+__attribute__((target("avx2")))
+static inline void yuyv_to_packed_avx2(const unsigned char *src, unsigned char *dst, size_t size,
+                                       enum yuv_output out, int nt)
+{
+    const int rgb24 = out == YUV_OUTPUT_RGB24 || out == YUV_OUTPUT_BGR24;
+    const int swap = out == YUV_OUTPUT_BGR24 || out == YUV_OUTPUT_BGRA;
+    const size_t bytes = rgb24 ? 96 : 128;
+    const size_t distance = prefetch_distance;
+    size_t i = 0, newi = 0, spare;
+    __m256i r, g, b, t;
+
+    size &= ~(size_t)3;
+    if (nt)
+    {
+        int head = stream_head(dst, bytes / 16, 32);
+
+        if (head < 0)
+            nt = 0;
+        else
+        {
+            i = (size_t)head * 4 < size ? (size_t)head * 4 : size;
+            newi = i / 4 * (bytes / 16);
+            yuyv_to_packed_scalar(src, dst, i, out);
+        }
+    }
+    spare = rgb24 && !nt ? 4 : 0;
+
+    for (; i + 64 + spare <= size; i += 64, newi += bytes)
+    {
+        if (distance)
+        {
+            _mm_prefetch((const char *)(src + i + distance), _MM_HINT_NTA);
+            _mm_prefetch((const char *)(src + i + distance + 32), _MM_HINT_NTA);
+        }
+        avx2_rgb(src + i, &r, &g, &b);
+        if (swap)
+        {
+            t = r;
+            r = b;
+            b = t;
+        }
+
+        if (rgb24 && nt)
+            avx2_stream_rgb24(r, g, b, dst + newi);
+        else if (rgb24)
+            avx2_store_rgb24(r, g, b, dst + newi);
+        else
+            avx2_store_rgba(r, g, b, dst + newi, nt);
+    }
+
+    yuyv_to_packed_sse2(src + i, dst + newi, size - i, out, nt);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_bgr24_avx2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_avx2(src, dst, size, YUV_OUTPUT_BGR24, 0);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_rgba_avx2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_avx2(src, dst, size, YUV_OUTPUT_RGBA, 0);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_bgra_avx2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_avx2(src, dst, size, YUV_OUTPUT_BGRA, 0);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_rgb24_avx2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_avx2(src, dst, size, YUV_OUTPUT_RGB24, 1);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_bgr24_avx2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_avx2(src, dst, size, YUV_OUTPUT_BGR24, 1);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_rgba_avx2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_avx2(src, dst, size, YUV_OUTPUT_RGBA, 1);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_bgra_avx2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_avx2(src, dst, size, YUV_OUTPUT_BGRA, 1);
+}
+
+/**
+ * @name   yuyv_to_planar_avx2
+ * @brief  AVX2 two-line YUYV to NV12 or I420 conversion
+ * @param  a, b, ya, yb, u, v, width, out - as yuyv_to_planar_scalar
+ *
+ * @descr  yuyv_to_planar_sse2 on 32 pixels; every pack leaves the
+ *         quadwords of its two sources interleaved by lane, so each result
+ *         goes through the same 0xD8 permute as the luma kernel. I420's
+ *         last pack to bytes is done on the two 128-bit halves
+ *
+ * @return none
+ */
+
+__attribute__((target("avx2")))
+static inline void yuyv_to_planar_avx2(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                       unsigned char *yb, unsigned char *u, unsigned char *v,
+                                       unsigned int width, enum yuv_output out)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00FF);
+    const __m256i low  = _mm256_set1_epi32(0xFFFF);
+    const size_t distance = prefetch_distance;
+    size_t i = 0, size = (size_t)(width & ~1u) * 2;
+
+    for (; i + 64 <= size; i += 64)
+    {
+        __m256i a0 = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i a1 = _mm256_loadu_si256((const __m256i *)(a + i + 32));
+        __m256i b0 = _mm256_loadu_si256((const __m256i *)(b + i));
+        __m256i b1 = _mm256_loadu_si256((const __m256i *)(b + i + 32));
+        __m256i c0 = _mm256_srli_epi16(_mm256_avg_epu8(a0, b0), 8);
+        __m256i c1 = _mm256_srli_epi16(_mm256_avg_epu8(a1, b1), 8);
+
+        _mm256_storeu_si256((__m256i *)(ya + i / 2), _mm256_permute4x64_epi64(
+                _mm256_packus_epi16(_mm256_and_si256(a0, mask), _mm256_and_si256(a1, mask)), 0xD8));
+        _mm256_storeu_si256((__m256i *)(yb + i / 2), _mm256_permute4x64_epi64(
+                _mm256_packus_epi16(_mm256_and_si256(b0, mask), _mm256_and_si256(b1, mask)), 0xD8));
+
+        if (out == YUV_OUTPUT_NV12)
+            _mm256_storeu_si256((__m256i *)(u + i / 2), _mm256_permute4x64_epi64(_mm256_packus_epi16(c0, c1), 0xD8));
+        else
+        {
+            __m256i cu = _mm256_permute4x64_epi64(
+                    _mm256_packs_epi32(_mm256_and_si256(c0, low), _mm256_and_si256(c1, low)), 0xD8);
+            __m256i cv = _mm256_permute4x64_epi64(
+                    _mm256_packs_epi32(_mm256_srli_epi32(c0, 16), _mm256_srli_epi32(c1, 16)), 0xD8);
+
+            _mm_storeu_si128((__m128i *)(u + i / 4),
+                             _mm_packus_epi16(_mm256_castsi256_si128(cu), _mm256_extracti128_si256(cu, 1)));
+            _mm_storeu_si128((__m128i *)(v + i / 4),
+                             _mm_packus_epi16(_mm256_castsi256_si128(cv), _mm256_extracti128_si256(cv, 1)));
+        }
+
+        if (distance)
+        {
+            _mm_prefetch((const char *)(a + i + distance), _MM_HINT_NTA);
+            _mm_prefetch((const char *)(a + i + distance + 32), _MM_HINT_NTA);
+            _mm_prefetch((const char *)(b + i + distance), _MM_HINT_NTA);
+            _mm_prefetch((const char *)(b + i + distance + 32), _MM_HINT_NTA);
+        }
+    }
+
+    if (out == YUV_OUTPUT_NV12)
+        yuyv_to_planar_sse2(a + i, b + i, ya + i / 2, yb + i / 2, u + i / 2, v, (size - i) / 2, out);
+    else
+        yuyv_to_planar_sse2(a + i, b + i, ya + i / 2, yb + i / 2, u + i / 4, v + i / 4, (size - i) / 2, out);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_nv12_rows_avx2(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                   unsigned char *yb, unsigned char *u, unsigned char *v, unsigned int width)
+{
+    yuyv_to_planar_avx2(a, b, ya, yb, u, v, width, YUV_OUTPUT_NV12);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_i420_rows_avx2(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                   unsigned char *yb, unsigned char *u, unsigned char *v, unsigned int width)
+{
+    yuyv_to_planar_avx2(a, b, ya, yb, u, v, width, YUV_OUTPUT_I420);
+}
+
+// 32 Y bytes per 64 input bytes; packus works per 128-bit lane, the permute puts
+// the quadwords back in order. Streaming as yuyv_to_packed_avx2
+__attribute__((target("avx2")))
+static inline void yuyv_luma_avx2(const unsigned char *src, unsigned char *dst, size_t size, int nt)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00FF);
+    const size_t distance = prefetch_distance;
+    size_t i = 0;
+
+    size &= ~(size_t)3;
+    if (nt)
+    {
+        int head = stream_head(dst, 2, 32);
+
+        if (head < 0)
+            nt = 0;
+        else
+        {
+            i = (size_t)head * 4 < size ? (size_t)head * 4 : size;
+            yuyv_to_luma_scalar(src, dst, i);
+        }
+    }
+
+    for (; i + 64 <= size; i += 64)
+    {
+        __m256i a, b;
+
+        if (distance)
+        {
+            _mm_prefetch((const char *)(src + i + distance), _MM_HINT_NTA);
+            _mm_prefetch((const char *)(src + i + distance + 32), _MM_HINT_NTA);
+        }
+        a = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i)), mask);
+        b = _mm256_and_si256(_mm256_loadu_si256((const __m256i *)(src + i + 32)), mask);
+
+        avx2_put(dst + i / 2, _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8), nt);
+    }
+
+    yuyv_luma_sse2(src + i, dst + i / 2, size - i, nt);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_luma_avx2(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_luma_avx2(src, dst, size, 0);
+}
+
+__attribute__((target("avx2")))
+static void yuyv_to_luma_avx2_nt(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_luma_avx2(src, dst, size, 1);
+}
+
+// One 32-byte load per row and block, four 64-bit partial sums to fold
+__attribute__((target("avx2")))
+static void yuyv_luma_sad_avx2(const unsigned char *a, const unsigned char *b, unsigned int blocks, unsigned int *acc)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00FF);
+    unsigned int k;
+
+    for (k = 0; k < blocks; k++, a += 32, b += 32)
+    {
+        __m256i sad = _mm256_sad_epu8(_mm256_and_si256(_mm256_loadu_si256((const __m256i *)a), mask),
+                                      _mm256_and_si256(_mm256_loadu_si256((const __m256i *)b), mask));
+        __m128i sum = _mm_add_epi64(_mm256_castsi256_si128(sad), _mm256_extracti128_si256(sad, 1));
+
+        acc[k] += _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+    }
+}
+
+#endif /* YUV_HAVE_X86 */
+
+#if defined(YUV_HAVE_NEON)
+
+/*************************************************************************
+ *                       NEON Conversion Kernel                          *
+ *************************************************************************/
+
+// One channel for 8 pixels: (298 * c + chroma term) >> 8, clipped to 0..255
+static inline uint8x8_t neon_channel(int16x8_t c, int32x4_t t_lo, int32x4_t t_hi)
+{
+    int32x4_t lo = vaddq_s32(vmull_n_s16(vget_low_s16(c), 298), t_lo);
+    int32x4_t hi = vaddq_s32(vmull_n_s16(vget_high_s16(c), 298), t_hi);
+
+    // vqshrun: arithmetic shift then saturate to unsigned, same as the clip in yuv2rgb
+    return vqmovn_u16(vcombine_u16(vqshrun_n_s32(lo, 8), vqshrun_n_s32(hi, 8)));
+}
+
+/**
+ * @name   yuyv_to_packed_neon
+ * @brief  NEON YUYV to RGB24, BGR24, RGBA or BGRA conversion
+ * @param  src, dst, size - as yuyv_to_rgb24_scalar
+ *         out            - packed layout, a constant in each caller
+ *
+ * @descr  vld4 deinterleaves Y0, U, Y1, V for 8 macropixels, even and odd
+ *         pixels are converted separately and zipped back, then vst3 / vst4
+ *         interleave the channels in the layout's order without any overrun
+ *
+ * @return none
+ */
+
+static inline void yuyv_to_packed_neon(const unsigned char *src, unsigned char *dst, size_t size,
+                                       enum yuv_output out)
+{
+    const int bgr = out == YUV_OUTPUT_BGR24 || out == YUV_OUTPUT_BGRA;
+    const size_t bytes = out == YUV_OUTPUT_RGBA || out == YUV_OUTPUT_BGRA ? 4 : 3;
+    const size_t distance = prefetch_distance;
+    size_t i = 0, newi = 0;
+    const int32x4_t round = vdupq_n_s32(128);
+
+    size &= ~(size_t)3;
+    for (; i + 32 <= size; i += 32, newi += 16 * bytes)
+    {
+        uint8x8x4_t yuyv = vld4_u8(src + i);
+        int16x8_t c0 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(yuyv.val[0])), vdupq_n_s16(16));
+        int16x8_t d  = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(yuyv.val[1])), vdupq_n_s16(128));
+        int16x8_t c1 = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(yuyv.val[2])), vdupq_n_s16(16));
+        int16x8_t e  = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(yuyv.val[3])), vdupq_n_s16(128));
+        int32x4_t cr_lo, cr_hi, cg_lo, cg_hi, cb_lo, cb_hi;
+        uint8x8x2_t r, g, b, x0, x2;
+        int k;
+
+        if (distance)
+            __builtin_prefetch(src + i + distance, 0, 0);
+
+        cr_lo = vmlal_n_s16(round, vget_low_s16(e), 409);
+        cr_hi = vmlal_n_s16(round, vget_high_s16(e), 409);
+        cg_lo = vmlal_n_s16(vmlal_n_s16(round, vget_low_s16(d), -100), vget_low_s16(e), -208);
+        cg_hi = vmlal_n_s16(vmlal_n_s16(round, vget_high_s16(d), -100), vget_high_s16(e), -208);
+        cb_lo = vmlal_n_s16(round, vget_low_s16(d), 516);
+        cb_hi = vmlal_n_s16(round, vget_high_s16(d), 516);
+
+        r = vzip_u8(neon_channel(c0, cr_lo, cr_hi), neon_channel(c1, cr_lo, cr_hi));
+        g = vzip_u8(neon_channel(c0, cg_lo, cg_hi), neon_channel(c1, cg_lo, cg_hi));
+        b = vzip_u8(neon_channel(c0, cb_lo, cb_hi), neon_channel(c1, cb_lo, cb_hi));
+        x0 = bgr ? b : r;
+        x2 = bgr ? r : b;
+
+        for (k = 0; k < 2; k++)
+        {
+            if (bytes == 4)
+            {
+                uint8x8x4_t px;
+
+                px.val[0] = x0.val[k]; px.val[1] = g.val[k]; px.val[2] = x2.val[k]; px.val[3] = vdup_n_u8(255);
+                vst4_u8(dst + newi + k * 32, px);
+            }
+            else
+            {
+                uint8x8x3_t px;
+
+                px.val[0] = x0.val[k]; px.val[1] = g.val[k]; px.val[2] = x2.val[k];
+                vst3_u8(dst + newi + k * 24, px);
+            }
+        }
+    }
+
+    if (out == YUV_OUTPUT_RGB24)
+        yuyv_to_rgb24_scalar(src + i, dst + newi, size - i);
+    else
+        yuyv_to_packed_scalar(src + i, dst + newi, size - i, out);
+}
+
+static void yuyv_to_rgb24_neon(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_neon(src, dst, size, YUV_OUTPUT_RGB24);
+}
+
+static void yuyv_to_bgr24_neon(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_neon(src, dst, size, YUV_OUTPUT_BGR24);
+}
+
+static void yuyv_to_rgba_neon(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_neon(src, dst, size, YUV_OUTPUT_RGBA);
+}
+
+static void yuyv_to_bgra_neon(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    yuyv_to_packed_neon(src, dst, size, YUV_OUTPUT_BGRA);
+}
+
+// vld4 of each line splits 32 pixels into Y0, U, Y1, V; vrhadd is the rounded
+// chroma mean, vst2 interleaves Y back, and UV too for NV12
+static inline void yuyv_to_planar_neon(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                       unsigned char *yb, unsigned char *u, unsigned char *v,
+                                       unsigned int width, enum yuv_output out)
+{
+    const size_t distance = prefetch_distance;
+    size_t i = 0, size = (size_t)(width & ~1u) * 2;
+
+    for (; i + 64 <= size; i += 64)
+    {
+        uint8x16x4_t pa = vld4q_u8(a + i);
+        uint8x16x4_t pb = vld4q_u8(b + i);
+        uint8x16_t cu = vrhaddq_u8(pa.val[1], pb.val[1]);
+        uint8x16_t cv = vrhaddq_u8(pa.val[3], pb.val[3]);
+        uint8x16x2_t x;
+
+        x.val[0] = pa.val[0]; x.val[1] = pa.val[2];
+        vst2q_u8(ya + i / 2, x);
+        x.val[0] = pb.val[0]; x.val[1] = pb.val[2];
+        vst2q_u8(yb + i / 2, x);
+
+        if (out == YUV_OUTPUT_NV12)
+        {
+            x.val[0] = cu; x.val[1] = cv;
+            vst2q_u8(u + i / 2, x);
+        }
+        else
+        {
+            vst1q_u8(u + i / 4, cu);
+            vst1q_u8(v + i / 4, cv);
+        }
+
+        if (distance)
+        {
+            __builtin_prefetch(a + i + distance, 0, 0);
+            __builtin_prefetch(b + i + distance, 0, 0);
+        }
+    }
+
+    if (out == YUV_OUTPUT_NV12)
+        yuyv_to_planar_scalar(a + i, b + i, ya + i / 2, yb + i / 2, u + i / 2, v, (size - i) / 2, out);
+    else
+        yuyv_to_planar_scalar(a + i, b + i, ya + i / 2, yb + i / 2, u + i / 4, v + i / 4, (size - i) / 2, out);
+}
+
+static void yuyv_to_nv12_rows_neon(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                   unsigned char *yb, unsigned char *u, unsigned char *v, unsigned int width)
+{
+    yuyv_to_planar_neon(a, b, ya, yb, u, v, width, YUV_OUTPUT_NV12);
+}
+
+static void yuyv_to_i420_rows_neon(const unsigned char *a, const unsigned char *b, unsigned char *ya,
+                                   unsigned char *yb, unsigned char *u, unsigned char *v, unsigned int width)
+{
+    yuyv_to_planar_neon(a, b, ya, yb, u, v, width, YUV_OUTPUT_I420);
+}
+
+// vld2 splits 16 YUYV pixels into the Y bytes and the interleaved U/V bytes
+static void yuyv_to_luma_neon(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    const size_t distance = prefetch_distance;
+    size_t i = 0;
+
+    size &= ~(size_t)3;
+    for (; i + 32 <= size; i += 32)
+    {
+        if (distance)
+            __builtin_prefetch(src + i + distance, 0, 0);
+        vst1q_u8(dst + i / 2, vld2q_u8(src + i).val[0]);
+    }
+
+    yuyv_to_luma_scalar(src + i, dst + i / 2, size - i);
+}
+
+// |a - b| per byte, chroma masked, then widened pairwise down to two 64-bit sums
+static void yuyv_luma_sad_neon(const unsigned char *a, const unsigned char *b, unsigned int blocks, unsigned int *acc)
+{
+    const uint8x16_t mask = vreinterpretq_u8_u16(vdupq_n_u16(0x00FF));
+    unsigned int k;
+
+    for (k = 0; k < blocks; k++, a += 32, b += 32)
+    {
+        uint8x16_t d0 = vandq_u8(vabdq_u8(vld1q_u8(a), vld1q_u8(b)), mask);
+        uint8x16_t d1 = vandq_u8(vabdq_u8(vld1q_u8(a + 16), vld1q_u8(b + 16)), mask);
+        uint64x2_t sum = vpaddlq_u32(vpaddlq_u16(vaddq_u16(vpaddlq_u8(d0), vpaddlq_u8(d1))));
+
+        acc[k] += (unsigned int)(vgetq_lane_u64(sum, 0) + vgetq_lane_u64(sum, 1));
+    }
+}
+
+#endif /* YUV_HAVE_NEON */
+
+/*************************************************************************
+ *                       Runtime Kernel Dispatch                         *
+ *************************************************************************/
+
+/**
+ * @name   yuv_kernel_supported
+ * @brief  Checks if a kernel was compiled in and runs on this CPU
+ * @param  kernel - kernel to check
+ *
+ * @return 1 if usable, 0 otherwise
+ */
+
+int yuv_kernel_supported(enum yuv_kernel kernel)
+{
+    switch (kernel)
+    {
+        case YUV_KERNEL_AUTO:
+        case YUV_KERNEL_SCALAR:
+        case YUV_KERNEL_LUT:
+            return 1;
+
+#if defined(YUV_HAVE_X86)
+        case YUV_KERNEL_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+
+        case YUV_KERNEL_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+
+#if defined(YUV_HAVE_NEON)
+        case YUV_KERNEL_NEON:
+#if defined(__arm__)
+            return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#else
+            return 1; // NEON is mandatory on AArch64
+#endif
+#endif
+
+        default:
+            return 0;
+    }
+}
+
+/**
+ * @name   yuv_kernel_fn
+ * @brief  Looks up the conversion function for a kernel
+ * @param  kernel - kernel to look up, must be supported
+ *
+ * @return conversion function, scalar for anything not compiled in
+ */
+
+yuyv_convert_fn yuv_kernel_fn(enum yuv_kernel kernel)
+{
+    switch (kernel)
+    {
+#if defined(YUV_HAVE_X86)
+        case YUV_KERNEL_SSE2: return yuyv_to_rgb24_sse2;
+        case YUV_KERNEL_AVX2: return yuyv_to_rgb24_avx2;
+#endif
+#if defined(YUV_HAVE_NEON)
+        case YUV_KERNEL_NEON: return yuyv_to_rgb24_neon;
+#endif
+        case YUV_KERNEL_LUT:  lut_init();
+                              return yuyv_to_rgb24_lut;
+        default:              return yuyv_to_rgb24_scalar;
+    }
+}
+
+// Luma-only counterpart of yuv_kernel_fn
+yuyv_luma_fn yuv_kernel_luma_fn(enum yuv_kernel kernel)
+{
+    switch (kernel)
+    {
+#if defined(YUV_HAVE_X86)
+        case YUV_KERNEL_SSE2: return yuyv_to_luma_sse2;
+        case YUV_KERNEL_AVX2: return yuyv_to_luma_avx2;
+#endif
+#if defined(YUV_HAVE_NEON)
+        case YUV_KERNEL_NEON: return yuyv_to_luma_neon;
+#endif
+        default:              return yuyv_to_luma_scalar;
+    }
+}
+
+// Luma SAD counterpart of yuv_kernel_fn
+yuyv_sad_fn yuv_kernel_sad_fn(enum yuv_kernel kernel)
+{
+    switch (kernel)
+    {
+#if defined(YUV_HAVE_X86)
+        case YUV_KERNEL_SSE2: return yuyv_luma_sad_sse2;
+        case YUV_KERNEL_AVX2: return yuyv_luma_sad_avx2;
+#endif
+#if defined(YUV_HAVE_NEON)
+        case YUV_KERNEL_NEON: return yuyv_luma_sad_neon;
+#endif
+        default:              return yuyv_luma_sad_scalar;
+    }
+}
+
+/**
+ * @name   yuv_kernel_output_fn
+ * @brief  Looks up a kernel's conversion function for a packed output layout
+ * @param  kernel - kernel to look up, must be supported
+ *         out    - layout wanted
+ *
+ * @descr  The table kernel only covers RGB24, other layouts get scalar
+ *
+ * @return conversion function, NULL for the planar layouts
+ */
+
+yuyv_convert_fn yuv_kernel_output_fn(enum yuv_kernel kernel, enum yuv_output out)
+{
+    static const yuyv_convert_fn scalar[] = { NULL, yuyv_to_bgr24_scalar, yuyv_to_rgba_scalar, yuyv_to_bgra_scalar };
+#if defined(YUV_HAVE_X86)
+    static const yuyv_convert_fn sse2[] = { NULL, yuyv_to_bgr24_sse2, yuyv_to_rgba_sse2, yuyv_to_bgra_sse2 };
+    static const yuyv_convert_fn avx2[] = { NULL, yuyv_to_bgr24_avx2, yuyv_to_rgba_avx2, yuyv_to_bgra_avx2 };
+#endif
+#if defined(YUV_HAVE_NEON)
+    static const yuyv_convert_fn neon[] = { NULL, yuyv_to_bgr24_neon, yuyv_to_rgba_neon, yuyv_to_bgra_neon };
+#endif
+
+    if (out == YUV_OUTPUT_RGB24)
+        return yuv_kernel_fn(kernel);
+    if ((unsigned int)out > YUV_OUTPUT_BGRA)
+        return NULL;
+
+    switch (kernel)
+    {
+#if defined(YUV_HAVE_X86)
+        case YUV_KERNEL_SSE2: return sse2[out];
+        case YUV_KERNEL_AVX2: return avx2[out];
+#endif
+#if defined(YUV_HAVE_NEON)
+        case YUV_KERNEL_NEON: return neon[out];
+#endif
+        default:              return scalar[out];
+    }
+}
+
+// Planar counterpart of yuv_kernel_output_fn, NULL for the packed layouts
+yuyv_planar_fn yuv_kernel_planar_fn(enum yuv_kernel kernel, enum yuv_output out)
+{
+    int nv12 = out == YUV_OUTPUT_NV12;
+
+    if (out != YUV_OUTPUT_NV12 && out != YUV_OUTPUT_I420)
+        return NULL;
+
+    switch (kernel)
+    {
+#if defined(YUV_HAVE_X86)
+        case YUV_KERNEL_SSE2: return nv12 ? yuyv_to_nv12_rows_sse2 : yuyv_to_i420_rows_sse2;
+        case YUV_KERNEL_AVX2: return nv12 ? yuyv_to_nv12_rows_avx2 : yuyv_to_i420_rows_avx2;
+#endif
+#if defined(YUV_HAVE_NEON)
+        case YUV_KERNEL_NEON: return nv12 ? yuyv_to_nv12_rows_neon : yuyv_to_i420_rows_neon;
+#endif
+        default:              return nv12 ? yuyv_to_nv12_rows_scalar : yuyv_to_i420_rows_scalar;
+    }
+}
+
+/**
+ * @name   yuv_kernel_stream_fn
+ * @brief  Looks up a kernel's packed conversion with non-temporal stores
+ * @param  kernel - kernel to look up, must be supported
+ *         out    - layout wanted
+ *
+ * @descr  For output that goes straight to a sink and won't be read again
+ *         by this CPU soon, so it need not evict the source from the cache
+ *         Only the x86 kernels have streaming stores (NEON has no
+ *         non-temporal store intrinsic), the rest get their cached function
+ *
+ * @return conversion function, NULL for the planar layouts
+ */
+
+yuyv_convert_fn yuv_kernel_stream_fn(enum yuv_kernel kernel, enum yuv_output out)
+{
+#if defined(YUV_HAVE_X86)
+    static const yuyv_convert_fn sse2[] = { yuyv_to_rgb24_sse2_nt, yuyv_to_bgr24_sse2_nt,
+                                            yuyv_to_rgba_sse2_nt, yuyv_to_bgra_sse2_nt };
+    static const yuyv_convert_fn avx2[] = { yuyv_to_rgb24_avx2_nt, yuyv_to_bgr24_avx2_nt,
+                                            yuyv_to_rgba_avx2_nt, yuyv_to_bgra_avx2_nt };
+
+    if ((unsigned int)out <= YUV_OUTPUT_BGRA && kernel == YUV_KERNEL_SSE2)
+        return sse2[out];
+    if ((unsigned int)out <= YUV_OUTPUT_BGRA && kernel == YUV_KERNEL_AVX2)
+        return avx2[out];
+#endif
+
+    return yuv_kernel_output_fn(kernel, out);
+}
+
+// Luma counterpart of yuv_kernel_stream_fn
+yuyv_luma_fn yuv_kernel_luma_stream_fn(enum yuv_kernel kernel)
+{
+    switch (kernel)
+    {
+#if defined(YUV_HAVE_X86)
+        case YUV_KERNEL_SSE2: return yuyv_to_luma_sse2_nt;
+        case YUV_KERNEL_AVX2: return yuyv_to_luma_avx2_nt;
+#endif
+        default:              return yuv_kernel_luma_fn(kernel);
+    }
+}
+
+/**
+ * @name   yuv_set_prefetch
+ * @brief  Sets how far ahead of the source the vector kernels prefetch
+ * @param  distance - bytes ahead, 0 turns prefetching off
+ *
+ * @descr  The hardware prefetcher follows a linear walk on its own; an
+ *         explicit hint pays off where it doesn't keep up, e.g. a band of
+ *         rows per worker or a slow uncached source. Call at startup, with
+ *         yuv_kernel_select
+ *
+ * @return none
+ */
+
+void yuv_set_prefetch(size_t distance)
+{
+    prefetch_distance = distance;
+}
+
+#if defined(YUV_HAVE_X86)
+// movntdqa is the only load that reads write-combining memory a line at a time
+__attribute__((target("sse4.1")))
+static void stream_copy_sse41(unsigned char *dst, const unsigned char *src, size_t size)
+{
+    size_t i;
+
+    for (i = 0; i + 64 <= size; i += 64)
+    {
+        __m128i x0 = _mm_stream_load_si128((__m128i *)(src + i));
+        __m128i x1 = _mm_stream_load_si128((__m128i *)(src + i + 16));
+        __m128i x2 = _mm_stream_load_si128((__m128i *)(src + i + 32));
+        __m128i x3 = _mm_stream_load_si128((__m128i *)(src + i + 48));
+
+        _mm_storeu_si128((__m128i *)(dst + i),      x0);
+        _mm_storeu_si128((__m128i *)(dst + i + 16), x1);
+        _mm_storeu_si128((__m128i *)(dst + i + 32), x2);
+        _mm_storeu_si128((__m128i *)(dst + i + 48), x3);
+    }
+
+    memcpy(dst + i, src + i, size - i);
+}
+#endif
+
+/**
+ * @name   yuv_stream_copy
+ * @brief  Copies a frame out of a capture buffer with streaming loads
+ * @param  dst  - destination, ordinary cached memory
+ *         src  - capture buffer
+ *         size - bytes to copy
+ *
+ * @descr  Some drivers map their buffers uncached or write-combining, where
+ *         every ordinary load is a separate bus read and memcpy crawls;
+ *         SSE4.1 streaming loads fetch a whole line at once there, and
+ *         behave as normal loads on cached memory. Plain memcpy where they
+ *         aren't available
+ *
+ * @return none
+ */
+
+void yuv_stream_copy(void *dst, const void *src, size_t size)
+{
+#if defined(YUV_HAVE_X86)
+    const unsigned char *s = src;
+    unsigned char *d = dst;
+    size_t head;
+
+    if (stream_loads < 0)
+    {
+        __builtin_cpu_init();
+        stream_loads = __builtin_cpu_supports("sse4.1") != 0;
+    }
+
+    if (stream_loads)
+    {
+        // movntdqa wants a 16-byte aligned source, capture buffers are page aligned anyway
+        head = (16 - ((uintptr_t)s & 15)) & 15;
+        if (head > size)
+            head = size;
+        memcpy(d, s, head);
+        stream_copy_sse41(d + head, s + head, size - head);
+        return;
+    }
+#endif
+
+    memcpy(dst, src, size);
+}
+
+/**
+ * @name   yuv_kernel_select
+ * @brief  Selects the kernel used by yuyv_to_rgb24(), yuyv_to_luma(), yuyv_luma_sad() and yuyv_to_nv12()
+ * @param  kernel - requested kernel, YUV_KERNEL_AUTO picks the widest supported
+ *
+ * @descr  Falls back to scalar with a warning if the request can't run here
+ *         Call once at startup, before any capture thread converts frames
+ *
+ * @return kernel actually selected
+ */
+
+enum yuv_kernel yuv_kernel_select(enum yuv_kernel kernel)
+{
+    if (kernel == YUV_KERNEL_AUTO)
+    {
+        if (yuv_kernel_supported(YUV_KERNEL_AVX2))
+            kernel = YUV_KERNEL_AVX2;
+        else if (yuv_kernel_supported(YUV_KERNEL_SSE2))
+            kernel = YUV_KERNEL_SSE2;
+        else if (yuv_kernel_supported(YUV_KERNEL_NEON))
+            kernel = YUV_KERNEL_NEON;
+        else
+            kernel = YUV_KERNEL_SCALAR;
+    }
+    else if (!yuv_kernel_supported(kernel))
+    {
+        fprintf(stderr, "%s kernel not supported on this CPU, using scalar\n", yuv_kernel_name(kernel));
+        kernel = YUV_KERNEL_SCALAR;
+    }
+
+    active_kernel = kernel;
+    active_fn = yuv_kernel_fn(kernel);
+    active_luma_fn = yuv_kernel_luma_fn(kernel);
+    active_sad_fn = yuv_kernel_sad_fn(kernel);
+    active_nv12_fn = yuv_kernel_planar_fn(kernel, YUV_OUTPUT_NV12);
+
+    return kernel;
+}
+
+enum yuv_kernel yuv_kernel_active(void)
+{
+    return active_kernel;
+}
+
+const char *yuv_kernel_name(enum yuv_kernel kernel)
+{
+    if ((unsigned int)kernel >= sizeof(kernel_names) / sizeof(kernel_names[0]))
+        return "unknown";
+
+    return kernel_names[kernel];
+}
+
+/**
+ * @name   yuv_kernel_parse
+ * @brief  Parses a kernel name from the command line
+ * @param  name   - "auto", "scalar", "sse2", "avx2" or "neon"
+ *         kernel - ptr to store parsed kernel
+ *
+ * @return 0 on success, -1 on unknown name
+ */
+
+int yuv_kernel_parse(const char *name, enum yuv_kernel *kernel)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(kernel_names) / sizeof(kernel_names[0]); i++)
+    {
+        if (strcmp(name, kernel_names[i]) == 0)
+        {
+            *kernel = (enum yuv_kernel)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+const char *yuv_output_name(enum yuv_output out)
+{
+    if ((unsigned int)out >= sizeof(output_names) / sizeof(output_names[0]))
+        return "unknown";
+
+    return output_names[out];
+}
+
+/**
+ * @name   yuv_output_parse
+ * @brief  Parses an output layout name from the command line
+ * @param  name - "rgb24", "bgr24", "rgba", "bgra", "nv12" or "i420"
+ *         out  - ptr to store parsed layout
+ *
+ * @return 0 on success, -1 on unknown name
+ */
+
+int yuv_output_parse(const char *name, enum yuv_output *out)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(output_names) / sizeof(output_names[0]); i++)
+    {
+        if (strcmp(name, output_names[i]) == 0)
+        {
+            *out = (enum yuv_output)i;
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+// NV12 and I420 are converted two lines at a time, see yuyv_planar_fn
+int yuv_output_planar(enum yuv_output out)
+{
+    return out == YUV_OUTPUT_NV12 || out == YUV_OUTPUT_I420;
+}
+
+// Bytes of a width x height image in a layout; planar ones need both even
+size_t yuv_output_bytes(enum yuv_output out, unsigned int width, unsigned int height)
+{
+    size_t pixels = (size_t)width * height;
+
+    switch (out)
+    {
+        case YUV_OUTPUT_RGBA:
+        case YUV_OUTPUT_BGRA: return pixels * 4;
+        case YUV_OUTPUT_NV12:
+        case YUV_OUTPUT_I420: return pixels + pixels / 2;
+        default:              return pixels * 3;
+    }
+}
+
+/**
+ * @name   yuyv_to_rgb24
+ * @brief  Converts YUYV to RGB24 with the selected kernel
+ * @param  src, dst, size - as yuyv_to_rgb24_scalar
+ *
+ * @return none
+ */
+
+void yuyv_to_rgb24(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    active_fn(src, dst, size);
+}
+
+// Grayscale plane from YUYV with the selected kernel, as yuyv_to_luma_scalar
+void yuyv_to_luma(const unsigned char *src, unsigned char *dst, size_t size)
+{
+    active_luma_fn(src, dst, size);
+}
+
+// Block luma SAD with the selected kernel, as yuyv_luma_sad_scalar
+void yuyv_luma_sad(const unsigned char *a, const unsigned char *b, unsigned int blocks, unsigned int *acc)
+{
+    active_sad_fn(a, b, blocks, acc);
+}
+
+/**
+ * @name   yuyv_decimate_row
+ * @brief  Point-samples every step-th pixel of a YUYV row into a shorter YUYV row
+ * @param  src       - first source pixel, macropixel aligned
+ *         dst       - out_width pixels of YUYV
+ *         out_width - output pixels, even
+ *         step      - horizontal decimation, 1 or even
+ *
+ * @descr  With an even step both samples of an output macropixel are the Y0
+ *         of a source macropixel; U and V come from the first of the two
+ *         The caller converts dst while it is still in L1, so decimated
+ *         output costs a gather per output pixel and no full-width pass
+ *
+ * @return none
+ */
+
+void yuyv_decimate_row(const unsigned char *src, unsigned char *dst, unsigned int out_width, unsigned int step)
+{
+    const size_t stride = (size_t)step * 4;   // source bytes per output macropixel
+    unsigned int m;
+
+    if (step == 1)
+    {
+        memcpy(dst, src, (size_t)out_width * 2);
+        return;
+    }
+
+    for (m = 0; m < out_width / 2; m++)
+    {
+        const unsigned char *a = src + m * stride;
+        const unsigned char *b = a + (size_t)step * 2;
+
+        dst[m*4]     = a[0];
+        dst[m*4 + 1] = a[1];
+        dst[m*4 + 2] = b[0];
+        dst[m*4 + 3] = a[3];
+    }
+}
+
+/**
+ * @name   yuyv_to_nv12
+ * @brief  Repacks a YUYV frame as NV12, a Y plane and a half height interleaved UV plane
+ * @param  src, src_stride - YUYV frame and its bytes per line
+ *         width, height   - pixels, both even
+ *         y, y_stride     - luma plane out
+ *         uv, uv_stride   - CbCr plane out, height/2 lines of width bytes
+ *
+ * @descr  4:2:2 to 4:2:0: each output chroma sample is the rounded mean of
+ *         the two lines it covers. Strides let the output go straight into
+ *         an encoder's buffer, padding and all
+ *         Line pairs go through the selected kernel's NV12 rows function
+ *
+ * @return none
+ */
+
+void yuyv_to_nv12(const unsigned char *src, size_t src_stride, unsigned int width, unsigned int height,
+                  unsigned char *y, size_t y_stride, unsigned char *uv, size_t uv_stride)
+{
+    yuyv_planar_fn rows = active_nv12_fn ? active_nv12_fn : yuyv_to_nv12_rows_scalar;
+    unsigned int row;
+
+    for (row = 0; row + 1 < height; row += 2)
+        rows(src + row * src_stride, src + (row + 1) * src_stride, y + row * y_stride, y + (row + 1) * y_stride,
+             uv + (row / 2) * uv_stride, NULL, width);
+}
+
+/*************************************************************************
+ *                          Kernel Self Check                            *
+ *************************************************************************/
+
+/**
+ * @name   selftest_outputs
+ * @brief  Compares a kernel's other output layouts against scalar on one span
+ * @param  kernel   - kernel under test
+ *         a, b     - YUYV span, and the second line for the planar layouts
+ *         len      - span bytes
+ *         ref, out - scratch, 2 * len + 4 * guard bytes each
+ *
+ * @descr  Both buffers start out as guard bytes and the whole of them is
+ *         compared, so a store past any plane shows up as a mismatch
+ *
+ * @return first layout that mismatched, 0 if all bit-exact
+ */
+
+static int selftest_outputs(enum yuv_kernel kernel, const unsigned char *a, const unsigned char *b, size_t len,
+                            unsigned char *ref, unsigned char *out, size_t guard)
+{
+    const unsigned int width = (len & ~(size_t)3) / 2;
+    const size_t plane = len / 2 + guard, span = 4 * plane;
+    int o;
+
+    for (o = YUV_OUTPUT_BGR24; o < YUV_OUTPUTS; o++)
+    {
+        memset(ref, 0xA5, span);
+        memset(out, 0xA5, span);
+
+        if (yuv_output_planar(o))
+        {
+            yuv_kernel_planar_fn(YUV_KERNEL_SCALAR, o)(a, b, ref, ref + plane, ref + 2 * plane, ref + 3 * plane, width);
+            yuv_kernel_planar_fn(kernel, o)(a, b, out, out + plane, out + 2 * plane, out + 3 * plane, width);
+        }
+        else
+        {
+            yuv_kernel_output_fn(YUV_KERNEL_SCALAR, o)(a, ref, len);
+            yuv_kernel_output_fn(kernel, o)(a, out, len);
+        }
+
+        if (memcmp(ref, out, span) != 0)
+            return o;
+    }
+
+    return 0;
+}
+
+/**
+ * @name   selftest_stream
+ * @brief  Compares a kernel's streaming store variants against scalar on one span
+ * @param  kernel, a, len, ref, out, guard - as selftest_outputs
+ *
+ * @descr  The output is offset by up to 15 bytes, so the aligned streaming
+ *         body starts after heads of every length
+ *
+ * @return name of the first variant that mismatched, NULL if all bit-exact
+ */
+
+static const char *selftest_stream(enum yuv_kernel kernel, const unsigned char *a, size_t len,
+                                   unsigned char *ref, unsigned char *out, size_t guard)
+{
+    const size_t shift = (len / 4) & 15, span = 2 * len + guard;
+    int o;
+
+    for (o = YUV_OUTPUT_RGB24; o <= YUV_OUTPUT_BGRA; o++)
+    {
+        memset(ref, 0xA5, span + shift);
+        memset(out, 0xA5, span + shift);
+        yuv_kernel_output_fn(YUV_KERNEL_SCALAR, o)(a, ref + shift, len);
+        yuv_kernel_stream_fn(kernel, o)(a, out + shift, len);
+
+        if (memcmp(ref, out, span + shift) != 0)
+            return yuv_output_name(o);
+    }
+
+    memset(ref, 0xA5, span + shift);
+    memset(out, 0xA5, span + shift);
+    yuyv_to_luma_scalar(a, ref + shift, len);
+    yuv_kernel_luma_stream_fn(kernel)(a, out + shift, len);
+
+    return memcmp(ref, out, span + shift) != 0 ? "gray" : NULL;
+}
+
+/**
+ * @name   yuv_selftest
+ * @brief  Compares every supported vector and table kernel against the scalar path
+ * @param  verbose - print per kernel results
+ *
+ * @descr  For each U value, builds a frame holding every (Y, V) pair with the
+ *         second luma sample mirrored, so all 2^24 YUV combinations are seen
+ *         Short spans at unaligned starts cover the scalar tails and
+ *         unaligned loads
+ *         Output is guarded so a kernel writing past (size*6)/4 is caught
+ *         The luma and luma SAD kernels of each are checked on the same spans,
+ *         The other output layouts are checked on a pseudo-random frame with
+ *         the same spans, the planar ones against a second line further in,
+ *         and so are the streaming store variants at shifted outputs
+ *
+ * @return number of kernels that mismatched, 0 if all bit-exact
+ */
+
+int yuv_selftest(int verbose)
+{
+    const size_t size = 256 * 256 * 4, guard = 64;
+    // Full frame (len 0), then short spans around the block sizes at unaligned starts
+    static const struct { size_t start, len; } spans[] = {
+        { 0, 0 }, { 0, 4 }, { 1, 28 }, { 3, 32 }, { 4, 36 }, { 1, 60 },
+        { 0, 64 }, { 5, 68 }, { 2, 96 }, { 7, 100 }, { 1, 4092 },
+    };
+    unsigned char *src, *noise, *ref, *out;
+    uint32_t seed = 0x12345678;
+    int kernel, failures = 0;
+    size_t i, t;
+
+    src = malloc(size + 8);
+    noise = malloc(size + 8);
+    ref = malloc(size * 2 + 4 * guard);     // the widest layout, RGBA, or four guarded planes
+    out = malloc(size * 2 + 4 * guard);
+    if (!src || !noise || !ref || !out)
+    {
+        fprintf(stderr, "Out of memory\n");
+        free(src); free(noise); free(ref); free(out);
+        return -1;
+    }
+
+    // xorshift32, every byte value in every position
+    for (i = 0; i < size + 8; i++)
+    {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        noise[i] = seed >> 24;
+    }
+
+    for (kernel = YUV_KERNEL_SSE2; kernel < YUV_KERNELS; kernel++)
+    {
+        yuyv_convert_fn fn;
+        yuyv_luma_fn luma;
+        unsigned int u, bad = 0;
+
+        if (!yuv_kernel_supported(kernel))
+        {
+            if (verbose)
+                printf("selftest %-6s: not supported\n", yuv_kernel_name(kernel));
+            continue;
+        }
+        fn = yuv_kernel_fn(kernel);
+        luma = yuv_kernel_luma_fn(kernel);
+
+        for (u = 0; u < 256 && !bad; u++)
+        {
+
+            for (i = 0; i < size / 4; i++)
+            {
+                src[i*4]     = i & 0xFF;          // Y0
+                src[i*4 + 1] = u;                 // U
+                src[i*4 + 2] = 255 - (i & 0xFF);  // Y1
+                src[i*4 + 3] = (i >> 8) & 0xFF;   // V
+            }
+
+            for (t = 0; t < sizeof(spans) / sizeof(spans[0]) && !bad; t++)
+            {
+                const unsigned char *s = src + spans[t].start;
+                size_t len = spans[t].len ? spans[t].len : size;
+
+                memset(out, 0xA5, (len * 6) / 4 + guard);
+                yuyv_to_rgb24_scalar(s, ref, len);
+                fn(s, out, len);
+
+                if (memcmp(ref, out, (len * 6) / 4) != 0)
+                    bad = 1;
+                for (i = (len * 6) / 4; i < (len * 6) / 4 + guard; i++)
+                    if (out[i] != 0xA5)
+                        bad = 1;
+
+                if (bad && verbose)
+                    printf("selftest %-6s: mismatch at U=%u start=%zu len=%zu\n",
+                           yuv_kernel_name(kernel), u, spans[t].start, len);
+
+                if (u != 0 || bad)    // luma doesn't depend on U
+                    continue;
+                memset(out, 0xA5, len / 2 + guard);
+                yuyv_to_luma_scalar(s, ref, len);
+                luma(s, out, len);
+
+                if (memcmp(ref, out, (len & ~(size_t)3) / 2) != 0)
+                    bad = 1;
+                for (i = (len & ~(size_t)3) / 2; i < len / 2 + guard; i++)
+                    if (out[i] != 0xA5)
+                        bad = 1;
+
+                if (bad && verbose)
+                    printf("selftest %-6s: luma mismatch at start=%zu len=%zu\n",
+                           yuv_kernel_name(kernel), spans[t].start, len);
+
+                if (bad)
+                    continue;
+                {
+                    // Rows at different offsets, so each Y byte pair differs in sign and size
+                    unsigned int sad_ref[8], sad_out[8], blocks = len / (YUYV_SAD_BLOCK * 2);
+
+                    if (blocks > 8)
+                        blocks = 8;
+                    memset(sad_ref, 0, sizeof(sad_ref));
+                    memset(sad_out, 0, sizeof(sad_out));
+                    yuyv_luma_sad_scalar(s, src + 4096 + 52 + spans[t].start, blocks, sad_ref);
+                    yuv_kernel_sad_fn(kernel)(s, src + 4096 + 52 + spans[t].start, blocks, sad_out);
+                    if (memcmp(sad_ref, sad_out, sizeof(sad_ref)) != 0)
+                        bad = 1;
+
+                    if (bad && verbose)
+                        printf("selftest %-6s: luma SAD mismatch at start=%zu\n",
+                               yuv_kernel_name(kernel), spans[t].start);
+                }
+
+                if (bad)
+                    continue;
+                {
+                    // Chroma is constant over most blocks of src, so the layouts are checked on
+                    // noise, the second line as far from the first as the span allows
+                    int o = selftest_outputs(kernel, noise + spans[t].start, noise + size - len - spans[t].start,
+                                             len, ref, out, guard);
+
+                    if (o)
+                        bad = 1;
+                    if (bad && verbose)
+                        printf("selftest %-6s: %s mismatch at start=%zu len=%zu\n",
+                               yuv_kernel_name(kernel), yuv_output_name(o), spans[t].start, len);
+                }
+
+                if (bad)
+                    continue;
+                {
+                    const char *name = selftest_stream(kernel, noise + spans[t].start, len, ref, out, guard);
+
+                    if (name)
+                        bad = 1;
+                    if (bad && verbose)
+                        printf("selftest %-6s: %s streaming mismatch at start=%zu len=%zu\n",
+                               yuv_kernel_name(kernel), name, spans[t].start, len);
+                }
+            }
+        }
+
+        if (bad)
+            failures++;
+        else if (verbose)
+            printf("selftest %-6s: bit-exact\n", yuv_kernel_name(kernel));
+    }
+
+    free(src);
+    free(noise);
+    free(ref);
+    free(out);
+
+    return failures;
+}
@@ -0,0 +1,122 @@
+/*
+ * Filename   : yuv_convert.h
+ *
+ * Description: YUYV (YUV 4:2:2 packed) to RGB24 conversion kernels
+ *            : Scalar reference plus SSE2 / AVX2 / NEON vector kernels,
+ *            : selected at runtime from the CPU features of the host, and
+ *            : a table-driven kernel for targets without SIMD.
+ *            : All kernels are bit-exact with the integer yuv2rgb()
+ *            : (298/409/100/208/516 coefficients).
+ *            : Each kernel also has a luma-only variant that gathers the Y
+ *            : bytes into an 8-bit grayscale plane, and a luma SAD variant
+ *            : comparing two frames block by block for motion detection.
+ *            : Other output layouts (BGR24, RGBA, BGRA and the planar 4:2:0
+ *            : NV12 and I420) have their own kernels, fused so a frame is
+ *            : read once and written once in its final layout; the planar
+ *            : ones take two lines at a time and also feed hardware encoders.
+ *            : For large frames the x86 packed and luma kernels have variants
+ *            : with non-temporal stores, the vector loops can prefetch the
+ *            : source ahead, and yuv_stream_copy() reads uncached capture
+ *            : buffers with streaming loads.
+ *
+ * Author     : Swathi Venkatachalam
+ *
+ * Reference  : http://en.wikipedia.org/wiki/YUV
+ *            : http://www.fourcc.org/yuv.php
+ */
+
+#ifndef YUV_CONVERT_H
+#define YUV_CONVERT_H
+
+#include <stddef.h>
+
+/*************************************************************************
+ *                            Macros                                     *
+ *************************************************************************/
+
+#define YUYV_SAD_BLOCK  16              // pixels per block of the luma SAD kernels
+
+/*************************************************************************
+ *                        Structures                                     *
+ *************************************************************************/
+
+// Conversion kernels; auto selection prefers the widest vector kernel
+enum yuv_kernel
+{
+        YUV_KERNEL_AUTO = 0,
+        YUV_KERNEL_SCALAR,
+        YUV_KERNEL_SSE2,
+        YUV_KERNEL_AVX2,
+        YUV_KERNEL_NEON,
+        YUV_KERNEL_LUT,         // portable, table lookups instead of multiplies, explicit choice only
+        YUV_KERNELS             // count, not a kernel
+};
+
+// Layouts a YUYV frame can be converted to
+enum yuv_output
+{
+        YUV_OUTPUT_RGB24 = 0,
+        YUV_OUTPUT_BGR24,
+        YUV_OUTPUT_RGBA,        // alpha always 255
+        YUV_OUTPUT_BGRA,
+        YUV_OUTPUT_NV12,        // Y plane, then half height interleaved UV plane
+        YUV_OUTPUT_I420,        // Y plane, then quarter size U and V planes
+        YUV_OUTPUTS             // count, not a layout
+};
+
+// Converts size bytes of YUYV at src into (size*6)/4 bytes of RGB24 at dst,
+// or size/2 pixels of another packed layout
+typedef void (*yuyv_convert_fn)(const unsigned char *src, unsigned char *dst, size_t size);
+
+// Converts two YUYV lines a and b of width pixels into their Y lines ya and yb
+// and one line of chroma: interleaved at u for NV12, split over u and v for I420
+typedef void (*yuyv_planar_fn)(const unsigned char *a, const unsigned char *b, unsigned char *ya, unsigned char *yb,
+                               unsigned char *u, unsigned char *v, unsigned int width);
+
+// Extracts the size/2 Y bytes of size bytes of YUYV at src into dst
+typedef void (*yuyv_luma_fn)(const unsigned char *src, unsigned char *dst, size_t size);
+
+// Adds to acc[k] the sum of |Ya - Yb| over 16-pixel block k of YUYV rows a and b
+typedef void (*yuyv_sad_fn)(const unsigned char *a, const unsigned char *b, unsigned int blocks, unsigned int *acc);
+
+/*************************************************************************
+ *                         Functions                                     *
+ *************************************************************************/
+
+void yuv2rgb(int y, int u, int v, unsigned char *r, unsigned char *g, unsigned char *b);
+
+void yuyv_to_rgb24_scalar(const unsigned char *src, unsigned char *dst, size_t size);
+void yuyv_to_rgb24_lut(const unsigned char *src, unsigned char *dst, size_t size);
+void yuyv_to_luma_scalar(const unsigned char *src, unsigned char *dst, size_t size);
+void yuyv_luma_sad_scalar(const unsigned char *a, const unsigned char *b, unsigned int blocks, unsigned int *acc);
+
+int yuv_kernel_supported(enum yuv_kernel kernel);
+enum yuv_kernel yuv_kernel_select(enum yuv_kernel kernel);
+enum yuv_kernel yuv_kernel_active(void);
+const char *yuv_kernel_name(enum yuv_kernel kernel);
+int yuv_kernel_parse(const char *name, enum yuv_kernel *kernel);
+yuyv_convert_fn yuv_kernel_fn(enum yuv_kernel kernel);
+yuyv_luma_fn yuv_kernel_luma_fn(enum yuv_kernel kernel);
+yuyv_sad_fn yuv_kernel_sad_fn(enum yuv_kernel kernel);
+yuyv_convert_fn yuv_kernel_output_fn(enum yuv_kernel kernel, enum yuv_output out);
+yuyv_planar_fn yuv_kernel_planar_fn(enum yuv_kernel kernel, enum yuv_output out);
+yuyv_convert_fn yuv_kernel_stream_fn(enum yuv_kernel kernel, enum yuv_output out);
+yuyv_luma_fn yuv_kernel_luma_stream_fn(enum yuv_kernel kernel);
+void yuv_set_prefetch(size_t distance);
+
+const char *yuv_output_name(enum yuv_output out);
+int yuv_output_parse(const char *name, enum yuv_output *out);
+int yuv_output_planar(enum yuv_output out);
+size_t yuv_output_bytes(enum yuv_output out, unsigned int width, unsigned int height);
+
+void yuyv_to_rgb24(const unsigned char *src, unsigned char *dst, size_t size);
+void yuyv_to_luma(const unsigned char *src, unsigned char *dst, size_t size);
+void yuyv_luma_sad(const unsigned char *a, const unsigned char *b, unsigned int blocks, unsigned int *acc);
+void yuyv_decimate_row(const unsigned char *src, unsigned char *dst, unsigned int out_width, unsigned int step);
+void yuyv_to_nv12(const unsigned char *src, size_t src_stride, unsigned int width, unsigned int height,
+                  unsigned char *y, size_t y_stride, unsigned char *uv, size_t uv_stride);
+void yuv_stream_copy(void *dst, const void *src, size_t size);
+
+int yuv_selftest(int verbose);
+
+#endif /* YUV_CONVERT_H */